@@ -33,10 +33,13 @@
 #include <unistd.h>
 
 #include "client/dconf-client.h"
+#include "common/dconf-access-log.h"
 #include "common/dconf-enums.h"
+#include "common/dconf-keyfile.h"
 #include "common/dconf-paths.h"
-#include "gvdb/gvdb-builder.h"
 #include "gvdb/gvdb-reader.h"
+#include "service/dconf-gvdb-builder.h"
+#include "shm/dconf-shm.h"
 
 static gboolean dconf_help (const gchar **argv, GError **error);
 
@@ -415,20 +418,27 @@ path_compare (const void *a,
 }
 
 /**
- * add_to_keyfile:
+ * dump_dir:
  * @dir_src: a dconf source dir
  * @dir_dst: a key-file destination dir
+ * @first_group: %TRUE until the first group has been written
  *
- * Copy directory contents from dconf to key-file.
+ * Write directory contents from dconf to stdout, in key-file format.
+ *
+ * Keys are written as soon as they are read and each dir is done before
+ * moving on to the next, so only the listings of @dir_src and its
+ * parents are held in memory at any one time.  The output is the same
+ * as that of g_key_file_to_data() for the equivalent key-file.
  **/
-static void 
-add_to_keyfile (GKeyFile    *kf,
-                DConfClient *client,
-                const gchar *dir_src,
-                const gchar *dir_dst)
+static void
+dump_dir (DConfClient *client,
+          const gchar *dir_src,
+          const gchar *dir_dst,
+          gboolean    *first_group)
 {
   g_autofree gchar *group = NULL;
   g_auto(GStrv) items = NULL;
+  gboolean wrote_group = FALSE;
   gint length;
   gsize n;
 
@@ -454,7 +464,7 @@ add_to_keyfile (GKeyFile    *kf,
       if (g_str_has_suffix (*item, "/"))
         {
           g_autofree gchar *subdir = g_strconcat (dir_dst, *item, NULL);
-          add_to_keyfile (kf, client, path, subdir);
+          dump_dir (client, path, subdir, first_group);
         }
       else
         {
@@ -462,7 +472,17 @@ add_to_keyfile (GKeyFile    *kf,
           if (value != NULL)
             {
               g_autofree gchar *value_str = g_variant_print (value, TRUE);
-              g_key_file_set_value (kf, group, *item, value_str);
+
+              /* Like GKeyFile, only write out groups that have keys in
+               * them, with a blank line between groups. */
+              if (!wrote_group)
+                {
+                  g_printf ("%s[%s]\n", *first_group ? "" : "\n", group);
+                  *first_group = FALSE;
+                  wrote_group = TRUE;
+                }
+
+              g_printf ("%s=%s\n", *item, value_str);
             }
         }
     }
@@ -474,9 +494,8 @@ dconf_dump (const gchar **argv,
 {
   const gchar *dir;
   g_autoptr(GError) local_error = NULL;
-  g_autoptr(GKeyFile) kf = NULL;
   g_autoptr(DConfClient) client = NULL;
-  g_autofree gchar *data = NULL;
+  gboolean first_group = TRUE;
 
   dir = argv[0];
   if (!dconf_is_dir (dir, &local_error))
@@ -485,97 +504,104 @@ dconf_dump (const gchar **argv,
   if (argv[1] != NULL)
     return option_error_set (error, "too many arguments");
 
-  kf = g_key_file_new ();
   client = dconf_client_new ();
 
-  add_to_keyfile (kf, client, dir, "/");
-
-  data = g_key_file_to_data (kf, NULL, NULL);
-  g_printf ("%s", data);
+  dump_dir (client, dir, "/", &first_group);
 
   return TRUE;
 }
 
-static GKeyFile *
-keyfile_from_stdin (GError **error)
+static gchar *
+keyfile_from_stdin (gsize   *length,
+                    GError **error)
 {
   g_return_val_if_fail (error == NULL || *error == NULL, NULL);
 
   char buffer[1024];
   g_autoptr(GString) s = NULL;
-  g_autoptr(GKeyFile) kf = NULL;
+  gsize n;
 
   s = g_string_new (NULL);
-  while (fgets (buffer, sizeof (buffer), stdin) != NULL)
-    g_string_append (s, buffer);
+  while ((n = fread (buffer, 1, sizeof (buffer), stdin)) > 0)
+    g_string_append_len (s, buffer, n);
 
-  kf = g_key_file_new ();
-  if (!g_key_file_load_from_data (kf, s->str, s->len, G_KEY_FILE_NONE, error))
-    return FALSE;
+  if (ferror (stdin))
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "error reading from stdin: %s", g_strerror (saved_errno));
+      return NULL;
+    }
 
-  return g_steal_pointer (&kf);
+  *length = s->len;
+
+  return g_string_free (g_steal_pointer (&s), FALSE);
 }
 
 typedef void (*KeyFileForeachFunc) (const gchar *path,
                                     GVariant    *value,
                                     gpointer     user_data);
 
+typedef struct {
+  const gchar        *dir;
+  KeyFileForeachFunc  func;
+  gpointer            user_data;
+  GString            *path;
+} KeyFileForeachContext;
+
 static gboolean
-keyfile_foreach (GKeyFile           *kf,
-                 const gchar        *dir,
-                 KeyFileForeachFunc  func,
-                 gpointer            user_data,
-                 GError            **error)
+keyfile_foreach_key (const gchar  *group,
+                     const gchar  *key,
+                     const gchar  *value_str,
+                     gpointer      user_data,
+                     GError      **error)
 {
-  g_auto(GStrv) groups = NULL;
-
-  groups = g_key_file_get_groups (kf, NULL);
+  KeyFileForeachContext *ctx = user_data;
+  g_autoptr(GVariant) value = NULL;
 
-  for (gchar **group = groups; *group; ++group)
+  /* Reconstruct dconf key path from the current dir,
+   * key-file group name and key-file key. */
+  g_string_assign (ctx->path, ctx->dir);
+  if (strcmp (group, "/") != 0)
     {
-      g_auto(GStrv) keys = NULL;
-
-      keys = g_key_file_get_keys (kf, *group, NULL, NULL);
-
-      for (gchar **key = keys; *key; ++key)
-        {
-          g_autoptr(GString) s = NULL;
-          g_autofree gchar *value_str = NULL;
-          g_autoptr(GVariant) value = NULL;
+      g_string_append (ctx->path, group);
+      g_string_append_c (ctx->path, '/');
+    }
+  g_string_append (ctx->path, key);
 
-          /* Reconstruct dconf key path from the current dir,
-           * key-file group name and key-file key. */
-          s = g_string_new (dir);
-          if (strcmp (*group, "/") != 0)
-            {
-              g_string_append (s, *group);
-              g_string_append (s, "/");
-            }
-          g_string_append (s, *key);
+  if (!dconf_is_key (ctx->path->str, error))
+    {
+      g_prefix_error (error, "[%s]: %s: invalid path: ",
+                      group, key);
+      return FALSE;
+    }
 
-          if (!dconf_is_key (s->str, error))
-            {
-              g_prefix_error (error, "[%s]: %s: invalid path: ",
-                              *group, *key);
-              return FALSE;
-            }
+  value = dconf_keyfile_parse_value (value_str, error);
+  if (value == NULL)
+    {
+      g_prefix_error (error, "[%s]: %s: invalid value: %s: ",
+                      group, key, value_str);
+      return FALSE;
+    }
 
-          value_str = g_key_file_get_value (kf, *group, *key, NULL);
-          g_assert (value_str != NULL);
+  ctx->func (ctx->path->str, value, ctx->user_data);
 
-          value = g_variant_parse (NULL, value_str, NULL, NULL, error);
-          if (value == NULL)
-            {
-              g_prefix_error (error, "[%s]: %s: invalid value: %s: ",
-                              *group, *key, value_str);
-              return FALSE;
-            }
+  return TRUE;
+}
 
-          func (s->str, value, user_data);
-        }
-    }
+static gboolean
+keyfile_foreach (const gchar        *contents,
+                 gsize               length,
+                 const gchar        *dir,
+                 KeyFileForeachFunc  func,
+                 gpointer            user_data,
+                 GError            **error)
+{
+  g_autoptr(GString) path = g_string_new (NULL);
+  KeyFileForeachContext ctx = { dir, func, user_data, path };
 
-  return TRUE;
+  return dconf_keyfile_parse (contents, length, keyfile_foreach_key, &ctx, error);
 }
 
 typedef struct {
@@ -603,6 +629,183 @@ changeset_set (const gchar *path,
   dconf_changeset_set (ctx->changeset, path, value);
 }
 
+static gboolean changeset_add_missing (const gchar *path,
+                                       GVariant    *value,
+                                       gpointer     user_data);
+static GBytes *build_database_in_memory (DConfChangeset  *values,
+                                         GError         **error);
+
+static void
+changeset_set_value (const gchar *path,
+                     GVariant    *value,
+                     gpointer     user_data)
+{
+  dconf_changeset_set (user_data, path, value);
+}
+
+static gboolean
+path_is_writable (const gchar *path,
+                  GVariant    *value,
+                  gpointer     user_data)
+{
+  return dconf_client_is_writable (user_data, path);
+}
+
+/* The same test as the engine and the service use: in write-back mode,
+ * the copy in the runtime dir has the latest contents unless the file in
+ * the config dir was replaced after it was written.
+ */
+static gboolean
+live_copy_is_current (const gchar *live_filename,
+                      const gchar *filename)
+{
+  struct stat live_buf, buf;
+
+  if (stat (live_filename, &live_buf) != 0)
+    return FALSE;
+
+  if (stat (filename, &buf) != 0)
+    return TRUE;
+
+  if (live_buf.st_mtim.tv_sec != buf.st_mtim.tv_sec)
+    return live_buf.st_mtim.tv_sec > buf.st_mtim.tv_sec;
+
+  return live_buf.st_mtim.tv_nsec >= buf.st_mtim.tv_nsec;
+}
+
+/**
+ * load_offline:
+ *
+ * Write the changes straight into the user database file, merging them
+ * with its existing contents.  This is only safe while dconf-service is
+ * not running, since the service would otherwise overwrite the file on
+ * its next write.
+ *
+ * If the service left a live copy in the runtime dir (in write-back
+ * mode), that has the latest contents: merge with those instead, and
+ * remove it once the result is in the config dir.
+ **/
+static gboolean
+load_offline (DConfClient     *client,
+              DConfChangeset  *changeset,
+              GError         **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GDBusConnection) bus = NULL;
+  g_autoptr(DConfChangeset) values = NULL;
+  g_autoptr(GBytes) content = NULL;
+  g_autofree gchar *live_filename = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *dirname = NULL;
+  const gchar *old_filename;
+  GvdbTable *old;
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+
+  if (bus != NULL)
+    {
+      g_autoptr(GVariant) reply = NULL;
+      gboolean has_owner = FALSE;
+
+      reply = g_dbus_connection_call_sync (bus, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                           "org.freedesktop.DBus", "NameHasOwner",
+                                           g_variant_new ("(s)", "ca.desrt.dconf"), G_VARIANT_TYPE ("(b)"),
+                                           G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+      if (reply != NULL)
+        g_variant_get (reply, "(b)", &has_owner);
+
+      if (has_owner)
+        {
+          g_set_error_literal (error, DCONF_ERROR, DCONF_ERROR_FAILED,
+                               "dconf-service is running; load without -o instead");
+          return FALSE;
+        }
+    }
+
+  if (!dconf_changeset_all (changeset, path_is_writable, client))
+    {
+      g_set_error_literal (error, DCONF_ERROR, DCONF_ERROR_NOT_WRITABLE,
+                           "The operation attempted to modify one or more non-writable keys");
+      return FALSE;
+    }
+
+  filename = g_build_filename (g_get_user_config_dir (), "dconf", "user", NULL);
+  live_filename = g_build_filename (g_get_user_runtime_dir (), "dconf", "user.gvdb", NULL);
+
+  if (live_copy_is_current (live_filename, filename))
+    old_filename = live_filename;
+  else
+    old_filename = filename;
+
+  /* The new values go in first, since changeset_add_missing() doesn't
+   * replace anything that is already there.
+   */
+  values = dconf_changeset_new ();
+  dconf_changeset_all (changeset, changeset_add_missing, values);
+
+  old = gvdb_table_new (old_filename, FALSE, &local_error);
+  if (old != NULL)
+    {
+      g_auto(GStrv) names = NULL;
+      GvdbTable *shards;
+      gint n_names;
+
+      /* Only the service knows how to write to the shards */
+      shards = gvdb_table_get_table (old, ".shards");
+      if (shards != NULL)
+        {
+          gvdb_table_free (shards);
+          gvdb_table_free (old);
+          g_set_error_literal (error, DCONF_ERROR, DCONF_ERROR_FAILED,
+                               "The user database is sharded; load without -o instead");
+          return FALSE;
+        }
+
+      names = gvdb_table_get_names (old, &n_names);
+      for (gint i = 0; i < n_names; i++)
+        {
+          g_autoptr(GVariant) value = NULL;
+
+          if (names[i] == NULL || !dconf_is_key (names[i], NULL))
+            continue;
+
+          value = gvdb_table_get_value (old, names[i]);
+          if (value != NULL)
+            changeset_add_missing (names[i], value, values);
+        }
+
+      gvdb_table_free (old);
+    }
+  else if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  dirname = g_path_get_dirname (filename);
+  g_mkdir_with_parents (dirname, 0700);
+
+  content = build_database_in_memory (values, error);
+  if (content == NULL ||
+      !g_file_set_contents (filename, g_bytes_get_data (content, NULL), g_bytes_get_size (content), error))
+    return FALSE;
+
+  /* Clients (and the next service) would otherwise keep reading it */
+  if (g_unlink (live_filename) != 0 && errno != ENOENT)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Failed to remove '%s': %s", live_filename, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  /* Let any clients that have the old file mapped know about it */
+  dconf_shm_flag ("user");
+
+  return TRUE;
+}
+
 static gboolean
 dconf_load (const gchar **argv,
             GError      **error)
@@ -610,15 +813,21 @@ dconf_load (const gchar **argv,
   const gchar *dir;
   gint index = 0;
   gboolean force = FALSE;
+  gboolean offline = FALSE;
   g_autoptr(GError) local_error = NULL;
-  g_autoptr(GKeyFile) kf = NULL;
+  g_autofree gchar *contents = NULL;
+  gsize length;
   g_autoptr(DConfChangeset) changeset = NULL;
   g_autoptr (DConfClient) client = NULL;
 
-  if (argv[index] != NULL && strcmp (argv[index], "-f") == 0)
+  for (; argv[index] != NULL && argv[index][0] == '-'; index++)
     {
-      force = TRUE;
-      index += 1;
+      if (strcmp (argv[index], "-f") == 0)
+        force = TRUE;
+      else if (strcmp (argv[index], "-o") == 0)
+        offline = TRUE;
+      else
+        return option_error_set (error, "unknown option");
     }
 
   dir = argv[index];
@@ -630,17 +839,23 @@ dconf_load (const gchar **argv,
   if (argv[index] != NULL)
     return option_error_set (error, "too many arguments");
 
-  kf = keyfile_from_stdin (error);
-  if (kf == NULL)
+  contents = keyfile_from_stdin (&length, error);
+  if (contents == NULL)
     return FALSE;
 
   client = dconf_client_new ();
   changeset = dconf_changeset_new ();
 
   LoadContext ctx = { client, changeset, force };
-  if (!keyfile_foreach (kf, dir, changeset_set, &ctx, error))
+  if (!keyfile_foreach (contents, length, dir, changeset_set, &ctx, error))
     return FALSE;
 
+  if (offline)
+    return load_offline (client, changeset, error);
+
+  /* Big changesets are sent to the service in pieces, and committed
+   * all at once.
+   */
   return dconf_client_change_sync (client, changeset, NULL, NULL, error);
 }
 
@@ -704,7 +919,7 @@ read_locks_directory (const gchar  *dirname,
       return NULL;
     }
 
-  table = gvdb_hash_table_new (NULL, NULL);
+  table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   for (guint i = 0; i != files->len; ++i)
     {
@@ -722,62 +937,41 @@ read_locks_directory (const gchar  *dirname,
       for (gchar **line = lines; *line; ++line)
         {
           if (g_str_has_prefix (*line, "/"))
-            gvdb_hash_table_insert_string (table, *line, "");
+            g_hash_table_insert (table, g_strdup (*line), "");
         }
     }
 
   return g_steal_pointer (&table);
 }
 
-static GvdbItem *
-table_get_parent (GHashTable  *table,
-                  const gchar *name)
-{
-  GvdbItem *parent = NULL;
-  g_autofree gchar *dir = NULL;
-
-  dir = path_get_parent (name);
-  parent = g_hash_table_lookup (table, dir);
-
-  if (parent == NULL)
-    {
-      parent = gvdb_hash_table_insert (table, dir);
-      gvdb_item_set_parent (parent, table_get_parent (table, dir));
-    }
-
- return parent;
-}
-
-
-static void
-table_insert (const gchar *path,
-              GVariant    *value,
-              gpointer     user_data)
+/* See FILES-PRECEDENCE 2 */
+static gboolean
+changeset_add_missing (const gchar *path,
+                       GVariant    *value,
+                       gpointer     user_data)
 {
-  GHashTable *table = user_data;
-  GvdbItem *item;
+  DConfChangeset *values = user_data;
 
-  /* See FILES-PRECEDENCE 2 */
-  if (g_hash_table_lookup (table, path) != NULL)
-    return;
+  if (!dconf_changeset_get (values, path, NULL))
+    dconf_changeset_set (values, path, value);
 
-  item = gvdb_hash_table_insert (table, path);
-  gvdb_item_set_parent (item, table_get_parent (table, path));
-  gvdb_item_set_value (item, value);
+  return TRUE;
 }
 
-static GHashTable *
+/* Reads the keyfiles in @dir into a changeset, and the locks into a
+ * table in @locks (which is left NULL if there is no locks dir).
+ */
+static DConfChangeset *
 read_directory (const gchar  *dir,
+                GHashTable  **locks,
                 GError      **error)
 {
   g_autoptr(GError) local_error = NULL;
-  g_autoptr(GHashTable) table = NULL;
+  g_autoptr(DConfChangeset) values = NULL;
   g_autoptr(GPtrArray) files = NULL;
   g_autofree gchar *locks_dir = NULL;
-  GHashTable *locks_table = NULL;
 
-  table = gvdb_hash_table_new (NULL, NULL);
-  gvdb_hash_table_insert (table, "/");
+  values = dconf_changeset_new ();
 
   files = list_directory (dir, S_IFREG, error);
   if (files == NULL)
@@ -793,107 +987,565 @@ read_directory (const gchar  *dir,
   for (guint i = 0; i != files->len; ++i)
     {
       const gchar *filename;
-      g_autoptr(GKeyFile) kf = NULL;
+      g_autofree gchar *contents = NULL;
+      g_autoptr(DConfChangeset) file_values = NULL;
+      gsize length;
 
       filename = g_ptr_array_index (files, i);
-      kf = g_key_file_new ();
 
       g_debug ("loading key-file: %s", filename);
 
-      if (!g_key_file_load_from_file (kf, filename, G_KEY_FILE_NONE, error))
-        {
-          g_autofree gchar *display_name = g_filename_display_basename (filename);
-          g_prefix_error (error, "%s: ", display_name);
-          return FALSE;
-        }
+      /* Within a single file the last value for a key wins, as it did
+       * with GKeyFile, so collect the file before adding it.
+       */
+      file_values = dconf_changeset_new ();
 
-      if (!keyfile_foreach (kf, "/", table_insert, table, error))
+      if (!g_file_get_contents (filename, &contents, &length, error) ||
+          !keyfile_foreach (contents, length, "/", changeset_set_value, file_values, error))
         {
           g_autofree gchar *display_name = g_filename_display_basename (filename);
           g_prefix_error (error, "%s: ", display_name);
-          return FALSE;
+          return NULL;
         }
+
+      dconf_changeset_all (file_values, changeset_add_missing, values);
     }
 
   locks_dir = g_build_filename (dir, "locks", NULL);
-  locks_table = read_locks_directory (locks_dir, &local_error);
+  *locks = read_locks_directory (locks_dir, &local_error);
   if (local_error != NULL)
     {
       g_propagate_error (error, g_steal_pointer (&local_error));
-      return FALSE;
+      return NULL;
     }
 
-  if (locks_table != NULL)
+  return g_steal_pointer (&values);
+}
+
+/* The changeset describes its paths in order, which is what the
+ * builder wants.
+ */
+static void
+builder_add_changeset (DConfGvdbBuilder *builder,
+                       DConfChangeset   *values)
+{
+  g_autoptr(GString) path = NULL;
+  const gchar * const *paths;
+  GVariant * const *items;
+  const gchar *prefix;
+  guint n_items;
+
+  path = g_string_new (NULL);
+  n_items = dconf_changeset_describe (values, &prefix, &paths, &items);
+  for (guint i = 0; i < n_items; i++)
     {
-      GvdbItem *item;
+      g_string_assign (path, prefix);
+      g_string_append (path, paths[i]);
+      dconf_gvdb_builder_add_value (builder, path->str, items[i]);
+    }
+}
 
-      item = gvdb_hash_table_insert (table, ".locks");
-      gvdb_item_set_hash_table (item, locks_table);
+static GBytes *
+build_database_in_memory (DConfChangeset  *values,
+                          GError         **error)
+{
+  DConfGvdbBuilder *builder;
+
+  builder = dconf_gvdb_builder_new (-1, FALSE, NULL);
+  builder_add_changeset (builder, values);
+
+  return dconf_gvdb_builder_get_content (builder, error);
+}
+
+/* Builds the database for the keyfile dir @dir into a new file next to
+ * @filename, and returns the name of the new file.  The keys are given
+ * to the builder in order, so it can write them out as it goes.
+ *
+ * @hot_keys, if given, are placed together (see dconf-access-log.h).
+ */
+static gchar *
+build_database (const gchar  *dir,
+                const gchar  *filename,
+                gboolean      byteswap,
+                GHashTable   *hot_keys,
+                GError      **error)
+{
+  g_autoptr(DConfChangeset) values = NULL;
+  g_autoptr(GHashTable) locks = NULL;
+  g_autofree gchar *tmpname = NULL;
+  DConfGvdbBuilder *builder;
+  gboolean success;
+  gint fd;
+
+  values = read_directory (dir, &locks, error);
+  if (values == NULL)
+    return NULL;
+
+  tmpname = g_strconcat (filename, ".XXXXXX", NULL);
+  fd = g_mkstemp_full (tmpname, O_RDWR, 0666);
+  if (fd < 0)
+    {
+      gint saved_errno = errno;
+      g_autofree gchar *display_name = g_filename_display_name (tmpname);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Failed to create file '%s': %s", display_name, g_strerror (saved_errno));
+      return NULL;
     }
 
-  return g_steal_pointer (&table);
+  builder = dconf_gvdb_builder_new (fd, byteswap, hot_keys);
+
+  /* ".locks" comes before any path */
+  if (locks != NULL)
+    dconf_gvdb_builder_add_string_table (builder, ".locks", locks);
+
+  builder_add_changeset (builder, values);
+  success = dconf_gvdb_builder_finish (builder, error);
+
+  /* Like g_file_set_contents(), make sure that the data is on disk
+   * before the file gets renamed into place.
+   */
+  if (success && fsync (fd) != 0)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Failed to write database: %s", g_strerror (saved_errno));
+      success = FALSE;
+    }
+
+  close (fd);
+
+  if (!success)
+    {
+      g_unlink (tmpname);
+      return NULL;
+    }
+
+  return g_steal_pointer (&tmpname);
 }
 
+/* Returns TRUE if @filename and @other have exactly the same contents */
 static gboolean
-update_directory (const gchar *dir,
-                  GError     **error)
+files_have_same_contents (const gchar *filename,
+                          const gchar *other)
 {
-  gint fd = -1;
-  g_autofree gchar *filename = NULL;
-  g_autoptr(GHashTable) table = NULL;
-  g_autoptr(GDBusConnection) bus = NULL;
+  g_autoptr(GMappedFile) a = NULL;
+  g_autoptr(GMappedFile) b = NULL;
+  gsize length;
 
-  g_assert (g_str_has_suffix (dir, ".d"));
-  filename = strndup (dir, strlen (dir) - 2);
+  a = g_mapped_file_new (filename, FALSE, NULL);
+  b = g_mapped_file_new (other, FALSE, NULL);
+  if (a == NULL || b == NULL)
+    return FALSE;
 
-  table = read_directory (dir, error);
-  if (table == NULL)
+  length = g_mapped_file_get_length (a);
+
+  return length == g_mapped_file_get_length (b) &&
+         (length == 0 || memcmp (g_mapped_file_get_contents (a), g_mapped_file_get_contents (b), length) == 0);
+}
+
+/* "dconf update" keeps a manifest next to each database that it builds
+ * (".NAME.manifest") so that it can skip databases whose keyfiles didn't
+ * change since the last run.
+ *
+ * There is a line for each input file:
+ *
+ *   SHA256 <tab> MTIME <tab> CTIME <tab> DEV:INODE <tab> SIZE <tab> NAME
+ *
+ * where NAME is relative to the .d dir, sorted by NAME, followed by a
+ * line for the database itself with "-" in place of the checksum.  The
+ * checksum of an input is only recomputed if any of the rest differs
+ * from the last run.  The mtime and size alone are not enough: a file
+ * can be rewritten with the same size and have its mtime put back (by
+ * a package manager, for example), but that still changes the ctime,
+ * and replacing the file changes the inode.
+ */
+static gchar *
+manifest_get_filename (const gchar *filename)
+{
+  g_autofree gchar *dirname = g_path_get_dirname (filename);
+  g_autofree gchar *basename = g_path_get_basename (filename);
+  g_autofree gchar *name = g_strconcat (".", basename, ".manifest", NULL);
+
+  return g_build_filename (dirname, name, NULL);
+}
+
+static void
+manifest_append_file (GString     *manifest,
+                      const gchar *checksum,
+                      const gchar *filename,
+                      const gchar *name)
+{
+  struct stat buf;
+
+  if (stat (filename, &buf) != 0)
+    memset (&buf, 0, sizeof buf);
+
+  g_string_append_printf (manifest,
+                          "%s\t%" G_GINT64_FORMAT ".%09ld\t%" G_GINT64_FORMAT ".%09ld\t"
+                          "%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%s\n",
+                          checksum, (gint64) buf.st_mtim.tv_sec, (long) buf.st_mtim.tv_nsec,
+                          (gint64) buf.st_ctim.tv_sec, (long) buf.st_ctim.tv_nsec,
+                          (guint64) buf.st_dev, (guint64) buf.st_ino, (gint64) buf.st_size, name);
+}
+
+static gboolean
+manifest_add_inputs (GString      *manifest,
+                     GHashTable   *previous,
+                     const gchar  *dir,
+                     const gchar  *prefix,
+                     GError      **error)
+{
+  g_autoptr(GPtrArray) files = NULL;
+
+  files = list_directory (dir, S_IFREG, error);
+  if (files == NULL)
     return FALSE;
 
-  fd = open (filename, O_WRONLY);
-  if (fd < 0 && errno != ENOENT)
+  g_ptr_array_sort (files, string_compare);
+
+  for (guint i = 0; i != files->len; ++i)
     {
-      gint saved_errno = errno;
-      g_autofree gchar *display_name = g_filename_display_name (filename);
+      const gchar *filename = g_ptr_array_index (files, i);
+      g_autofree gchar *basename = g_path_get_basename (filename);
+      g_autofree gchar *name = g_strconcat (prefix, basename, NULL);
+      g_autoptr(GString) line = g_string_new (NULL);
+      g_autofree gchar *checksum = NULL;
+      const gchar *old_line;
+
+      /* If the file is unchanged as far as stat() can tell, trust the
+       * old checksum */
+      manifest_append_file (line, "", filename, name);
+      old_line = g_hash_table_lookup (previous, name);
+      if (old_line && strchr (old_line, '\t') && g_str_equal (strchr (old_line, '\t'), line->str))
+        {
+          g_string_append (manifest, old_line);
+          continue;
+        }
+
+      {
+        g_autofree gchar *contents = NULL;
+        gsize length;
 
-      g_fprintf (stderr, "warning: Failed to open '%s': for replacement: %s\n",
-                 display_name, g_strerror (saved_errno));
+        if (!g_file_get_contents (filename, &contents, &length, error))
+          return FALSE;
+
+        checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *) contents, length);
+      }
+
+      g_string_append (manifest, checksum);
+      g_string_append (manifest, line->str);
     }
 
-  if (!gvdb_table_write_contents (table, filename, FALSE, error))
+  return TRUE;
+}
+
+/* Returns the manifest for the current state of @dir, reusing the
+ * checksums in @previous (the contents of the last manifest, or NULL)
+ * where possible.
+ */
+static gchar *
+manifest_build (const gchar  *dir,
+                const gchar  *filename,
+                const gchar  *previous,
+                GError      **error)
+{
+  g_autoptr(GHashTable) old_lines = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GString) manifest = NULL;
+  g_autofree gchar *locks_dir = NULL;
+  g_auto(GStrv) lines = NULL;
+
+  old_lines = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  lines = g_strsplit (previous ? previous : "", "\n", 0);
+  for (gchar **line = lines; *line; ++line)
     {
-      if (fd >= 0)
-        close (fd);
-      return FALSE;
+      const gchar *name = strrchr (*line, '\t');
+
+      if (name != NULL)
+        g_hash_table_insert (old_lines, g_strdup (name + 1), g_strconcat (*line, "\n", NULL));
+    }
+
+  manifest = g_string_new (NULL);
+
+  if (!manifest_add_inputs (manifest, old_lines, dir, "", error))
+    return NULL;
+
+  locks_dir = g_build_filename (dir, "locks", NULL);
+  if (!manifest_add_inputs (manifest, old_lines, locks_dir, "locks/", &local_error) &&
+      !g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
     }
 
-  if (fd >= 0)
+  manifest_append_file (manifest, "-", filename, "");
+
+  return g_string_free (g_steal_pointer (&manifest), FALSE);
+}
+
+typedef struct {
+  gchar          *dir;
+  gchar          *filename;
+  gboolean        changed;
+  GError         *error;
+
+  /* What changed, if we could tell (otherwise everything did) */
+  DConfChangeset *changes;
+  DConfChangeset *lock_changes;
+} UpdateJob;
+
+static void
+update_job_free (gpointer data)
+{
+  UpdateJob *job = data;
+
+  g_free (job->dir);
+  g_free (job->filename);
+  g_clear_error (&job->error);
+  g_clear_pointer (&job->changes, dconf_changeset_unref);
+  g_clear_pointer (&job->lock_changes, dconf_changeset_unref);
+  g_slice_free (UpdateJob, job);
+}
+
+/* Adds the keys that are in @table but not in @other, or that have a
+ * different value there, to @changes.
+ */
+static void
+diff_values (GvdbTable      *table,
+             GvdbTable      *other,
+             DConfChangeset *changes)
+{
+  g_auto(GStrv) names = NULL;
+  gint n_names;
+
+  names = gvdb_table_get_names (table, &n_names);
+  for (gint i = 0; i < n_names; i++)
     {
-      /* Mark previous database as invalid. */
-      write (fd, "\0\0\0\0\0\0\0\0", 8);
-      close (fd);
+      g_autoptr(GVariant) value = NULL;
+      g_autoptr(GVariant) other_value = NULL;
+
+      if (names[i] == NULL || !dconf_is_key (names[i], NULL))
+        continue;
+
+      value = gvdb_table_get_value (table, names[i]);
+      other_value = gvdb_table_get_value (other, names[i]);
+
+      if (value == NULL || other_value == NULL || !g_variant_equal (value, other_value))
+        dconf_changeset_set (changes, names[i], NULL);
     }
+}
 
-  bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+/* Adds the paths that are locked in only one of @table and @other */
+static void
+diff_locks (GvdbTable      *table,
+            GvdbTable      *other,
+            DConfChangeset *changes)
+{
+  g_auto(GStrv) names = NULL;
+  gint n_names;
 
-  if (bus != NULL)
+  if (table == NULL)
+    return;
+
+  names = gvdb_table_get_names (table, &n_names);
+  for (gint i = 0; i < n_names; i++)
+    if (names[i] != NULL && dconf_is_path (names[i], NULL) &&
+        (other == NULL || !gvdb_table_has_value (other, names[i])))
+      dconf_changeset_set (changes, names[i], NULL);
+}
+
+/* Works out which keys and locks differ between the database that is
+ * currently in @filename and the new one in @new_filename.  If the old database can't be
+ * opened then we leave job->changes unset, which means "everything".
+ */
+static void
+update_diff (UpdateJob   *job,
+             const gchar *new_filename)
+{
+  GvdbTable *old, *new;
+  GvdbTable *old_locks, *new_locks;
+
+  old = gvdb_table_new (job->filename, FALSE, NULL);
+  if (old == NULL)
+    return;
+
+  new = gvdb_table_new (new_filename, TRUE, NULL);
+  if (new == NULL)
     {
-      g_autofree gchar *object_name = NULL;
-      g_autofree gchar *object_path = NULL;
+      gvdb_table_free (old);
+      return;
+    }
+
+  job->changes = dconf_changeset_new ();
+  diff_values (old, new, job->changes);
+  diff_values (new, old, job->changes);
+
+  old_locks = gvdb_table_get_table (old, ".locks");
+  new_locks = gvdb_table_get_table (new, ".locks");
+  job->lock_changes = dconf_changeset_new ();
+  diff_locks (old_locks, new_locks, job->lock_changes);
+  diff_locks (new_locks, old_locks, job->lock_changes);
+
+  g_clear_pointer (&old_locks, gvdb_table_free);
+  g_clear_pointer (&new_locks, gvdb_table_free);
+  gvdb_table_free (old);
+  gvdb_table_free (new);
+}
 
-      object_name = g_path_get_basename (filename);
-      object_path = g_strconcat ("/ca/desrt/dconf/Writer/", object_name, NULL);
+/* Runs in a worker thread, so it must not print anything */
+static gboolean
+update_directory (UpdateJob  *job,
+                  GError    **error)
+{
+  gint fd = -1;
+  g_autofree gchar *manifest_filename = NULL;
+  g_autofree gchar *old_manifest = NULL;
+  g_autofree gchar *manifest = NULL;
+  g_autofree gchar *new_manifest = NULL;
+  g_autofree gchar *tmpname = NULL;
+
+  manifest_filename = manifest_get_filename (job->filename);
+  g_file_get_contents (manifest_filename, &old_manifest, NULL, NULL);
+
+  manifest = manifest_build (job->dir, job->filename, old_manifest, error);
+  if (manifest == NULL)
+    return FALSE;
 
-      /* Ignore all D-Bus errors. */
+  /* Nothing changed since the last run, and nobody touched the output */
+  if (old_manifest != NULL && g_str_equal (manifest, old_manifest))
+    return TRUE;
+
+  tmpname = build_database (job->dir, job->filename, FALSE, NULL, error);
+  if (tmpname == NULL)
+    return FALSE;
+
+  /* Don't disturb the clients if the result is the same as before */
+  if (files_have_same_contents (job->filename, tmpname))
+    g_unlink (tmpname);
+  else
+    {
+      /* This has to happen before we invalidate the old file */
+      update_diff (job, tmpname);
+
+      fd = open (job->filename, O_WRONLY);
+      if (fd < 0 && errno != ENOENT)
+        {
+          gint saved_errno = errno;
+          g_autofree gchar *display_name = g_filename_display_name (job->filename);
+
+          g_set_error (&job->error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                       "warning: Failed to open '%s': for replacement: %s",
+                       display_name, g_strerror (saved_errno));
+        }
+
+      if (g_rename (tmpname, job->filename) != 0)
+        {
+          gint saved_errno = errno;
+          g_autofree gchar *display_name = g_filename_display_name (job->filename);
+
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                       "Failed to rename '%s': %s", display_name, g_strerror (saved_errno));
+          g_unlink (tmpname);
+          if (fd >= 0)
+            close (fd);
+          return FALSE;
+        }
+
+      if (fd >= 0)
+        {
+          /* Mark previous database as invalid. */
+          write (fd, "\0\0\0\0\0\0\0\0", 8);
+          close (fd);
+        }
+
+      job->changed = TRUE;
+    }
+
+  /* The output line has to describe the file as it is now */
+  new_manifest = manifest_build (job->dir, job->filename, manifest, NULL);
+
+  /* Failing to write the manifest only means more work next time */
+  if (new_manifest != NULL)
+    g_file_set_contents (manifest_filename, new_manifest, -1, NULL);
+
+  return TRUE;
+}
+
+static void
+update_worker (gpointer data,
+               gpointer user_data)
+{
+  UpdateJob *job = data;
+  GError *error = NULL;
+
+  if (!update_directory (job, &error))
+    {
+      /* Replace any warning with the actual failure */
+      g_clear_error (&job->error);
+      job->error = error;
+      job->changed = FALSE;
+    }
+}
+
+/* Beyond this many paths, a change is announced as a change to the
+ * dir that contains all of them instead.
+ */
+#define UPDATE_MAX_NOTIFY_PATHS 64
+
+static void
+update_notify (GDBusConnection *bus,
+               UpdateJob       *job)
+{
+  const gchar * const everything[] = { "", NULL };
+  g_autofree gchar *object_name = NULL;
+  g_autofree gchar *object_path = NULL;
+  const gchar * const *paths;
+  const gchar *prefix;
+  guint n;
+
+  object_name = g_path_get_basename (job->filename);
+  object_path = g_strconcat ("/ca/desrt/dconf/Writer/", object_name, NULL);
+
+  /* Ignore all D-Bus errors. */
+
+  if (job->changes == NULL)
+    {
       g_dbus_connection_emit_signal (bus, NULL, object_path,
                                      "ca.desrt.dconf.Writer",
                                      "WritabilityNotify",
                                       g_variant_new ("(s)", "/"),
                                       NULL);
-      g_dbus_connection_flush_sync (bus, NULL, NULL);
+      return;
     }
 
-  return TRUE;
+  n = dconf_changeset_describe (job->changes, &prefix, &paths, NULL);
+  if (n > UPDATE_MAX_NOTIFY_PATHS)
+    paths = everything;
+
+  if (n != 0)
+    g_dbus_connection_emit_signal (bus, NULL, object_path,
+                                   "ca.desrt.dconf.Writer",
+                                   "Notify",
+                                   g_variant_new ("(s^ass)", prefix, paths, ""),
+                                   NULL);
+
+  /* There is no multi-path form of WritabilityNotify */
+  n = dconf_changeset_describe (job->lock_changes, &prefix, &paths, NULL);
+  if (n > UPDATE_MAX_NOTIFY_PATHS)
+    paths = everything;
+
+  for (guint i = 0; n != 0 && paths[i]; i++)
+    {
+      g_autofree gchar *path = g_strconcat (prefix, paths[i], NULL);
+
+      g_dbus_connection_emit_signal (bus, NULL, object_path,
+                                     "ca.desrt.dconf.Writer",
+                                     "WritabilityNotify",
+                                      g_variant_new ("(s)", path),
+                                      NULL);
+    }
 }
 
 static gboolean
@@ -901,30 +1553,78 @@ update_all (const gchar *dirname,
             GError     **error)
 {
   gboolean failed = FALSE;
+  gboolean any_changed = FALSE;
   g_autoptr(GPtrArray) files = NULL;
+  g_autoptr(GPtrArray) jobs = NULL;
+  g_autoptr(GDBusConnection) bus = NULL;
+  GThreadPool *pool;
 
   files = list_directory (dirname, S_IFDIR, error);
   if (files == NULL)
     return FALSE;
 
+  /* The databases are independent of each other, so build them all at
+   * the same time.
+   */
+  jobs = g_ptr_array_new_with_free_func (update_job_free);
+  pool = g_thread_pool_new (update_worker, NULL, g_get_num_processors (), FALSE, NULL);
+
   for (guint i = 0; i != files->len; ++i)
     {
       const gchar *name;
-      g_autoptr(GError) local_error = NULL;
+      UpdateJob *job;
 
       name = g_ptr_array_index (files, i);
       if (!g_str_has_suffix (name, ".d"))
         continue;
 
-      if (!update_directory (name, &local_error))
+      job = g_slice_new0 (UpdateJob);
+      job->dir = g_strdup (name);
+      job->filename = g_strndup (name, strlen (name) - 2);
+      g_ptr_array_add (jobs, job);
+
+      g_thread_pool_push (pool, job, NULL);
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (guint i = 0; i != jobs->len; ++i)
+    {
+      UpdateJob *job = g_ptr_array_index (jobs, i);
+
+      if (job->changed)
         {
-          g_autofree gchar *display_name = g_filename_display_name (name);
+          /* Only a warning, the database was still written */
+          if (job->error != NULL)
+            g_fprintf (stderr, "%s\n", job->error->message);
+
+          any_changed = TRUE;
+        }
+      else if (job->error != NULL)
+        {
+          g_autofree gchar *display_name = g_filename_display_name (job->dir);
           g_fprintf (stderr, "%s: %s\n",
-                     display_name, local_error->message);
+                     display_name, job->error->message);
           failed = TRUE;
         }
     }
 
+  if (any_changed)
+    bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+
+  if (bus != NULL)
+    {
+      for (guint i = 0; i != jobs->len; ++i)
+        {
+          UpdateJob *job = g_ptr_array_index (jobs, i);
+
+          if (job->changed)
+            update_notify (bus, job);
+        }
+
+      g_dbus_connection_flush_sync (bus, NULL, NULL);
+    }
+
   if (failed)
     {
       g_set_error_literal (error, DCONF_ERROR, DCONF_ERROR_FAILED,
@@ -939,30 +1639,66 @@ static gboolean
 dconf_compile (const gchar **argv,
                GError      **error)
 {
+  g_autoptr(GHashTable) hot_keys = NULL;
+  const gchar *access_log = NULL;
   gboolean byteswap;
   const gchar *output;
   const gchar *dir;
-  g_autoptr(GHashTable) table = NULL;
+  g_autofree gchar *tmpname = NULL;
+  gint index = 0;
 
-  output = argv[0];
+  for (; argv[index] != NULL && argv[index][0] == '-'; index++)
+    {
+      if (strcmp (argv[index], "-p") == 0 && argv[index + 1] != NULL)
+        access_log = argv[++index];
+      else
+        return option_error_set (error, "unknown option");
+    }
+
+  output = argv[index];
   if (output == NULL)
     return option_error_set (error, "output file not specified");
 
-  dir = argv[1];
+  dir = argv[index + 1];
   if (dir == NULL)
     return option_error_set (error, "keyfile .d directory not specified");
 
-  if (argv[2] != NULL)
+  if (argv[index + 2] != NULL)
     return option_error_set (error, "too many arguments");
 
-  table = read_directory (dir, error);
-  if (table == NULL)
-    return FALSE;
+  if (access_log != NULL)
+    {
+      hot_keys = dconf_access_log_read_hot_keys (access_log, DCONF_ACCESS_LOG_MAX_HOT_KEYS, error);
+      if (hot_keys == NULL)
+        return FALSE;
+    }
 
   /* We always write the result of "dconf compile" as little endian so
    * that it can be installed in /usr/share */
   byteswap = (G_BYTE_ORDER == G_BIG_ENDIAN);
-  return gvdb_table_write_contents (table, output, byteswap, error);
+  tmpname = build_database (dir, output, byteswap, hot_keys, error);
+  if (tmpname == NULL)
+    return FALSE;
+
+  /* Leave the file (and its mtime) alone if nothing changed */
+  if (files_have_same_contents (output, tmpname))
+    {
+      g_unlink (tmpname);
+      return TRUE;
+    }
+
+  if (g_rename (tmpname, output) != 0)
+    {
+      gint saved_errno = errno;
+      g_autofree gchar *display_name = g_filename_display_name (output);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Failed to rename '%s': %s", display_name, g_strerror (saved_errno));
+      g_unlink (tmpname);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 static gchar *
@@ -1031,8 +1767,8 @@ static const Command commands[] = {
   },
   {
     "compile", dconf_compile,
-    "Compile a binary database from keyfiles",
-    " OUTPUT KEYFILEDIR "
+    "Compile a binary database from keyfiles.  -p puts the keys read most often in ACCESSLOG together.",
+    " [-p ACCESSLOG] OUTPUT KEYFILEDIR "
   },
   {
     "update", dconf_update,
@@ -1051,8 +1787,8 @@ static const Command commands[] = {
   },
   {
     "load", dconf_load, 
-    "Populate a subpath from stdin.  -f ignore locked keys.",
-    " [-f] DIR "
+    "Populate a subpath from stdin.  -f ignore locked keys.  -o write the database directly.",
+    " [-f] [-o] DIR "
   },
   {
     "blame", dconf_blame,
@@ -1146,6 +1882,9 @@ command_show_help (const Command *cmd,
           if (strstr (cmd->synopsis, " KEYFILEDIR ") != NULL)
             g_string_append (s, "  KEYFILEDIR  The path to the .d directory containing keyfiles\n");
 
+          if (strstr (cmd->synopsis, " ACCESSLOG] ") != NULL)
+            g_string_append (s, "  ACCESSLOG   A file written by setting DCONF_ACCESS_LOG\n");
+
           if (strstr (cmd->synopsis, " SUFFIX ") != NULL)
             g_string_append (s, "  SUFFIX      An empty string '' or '/'.\n");
 
@@ -56,6 +56,12 @@ struct _DConfClient
 
   DConfEngine  *engine;
   GMainContext *context;
+
+  /* Changes waiting for the main context, if we are coalescing them */
+  GMutex        pending_lock;
+  GQueue        pending;
+  GHashTable   *pending_by_prefix;
+  gboolean      coalesce;
 };
 
 G_DEFINE_TYPE (DConfClient, dconf_client, G_TYPE_OBJECT)
@@ -75,6 +81,8 @@ dconf_client_finalize (GObject *object)
 
   dconf_engine_unref (client->engine);
   g_main_context_unref (client->context);
+  g_mutex_clear (&client->pending_lock);
+  g_hash_table_unref (client->pending_by_prefix);
 
   G_OBJECT_CLASS (dconf_client_parent_class)
     ->finalize (object);
@@ -83,6 +91,8 @@ dconf_client_finalize (GObject *object)
 static void
 dconf_client_init (DConfClient *client)
 {
+  g_mutex_init (&client->pending_lock);
+  client->pending_by_prefix = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
 static void
@@ -152,42 +162,184 @@ dconf_client_class_init (DConfClientClass *class)
                                                                    G_TYPE_STRING | G_SIGNAL_TYPE_STATIC_SCOPE);
 }
 
+/* While a change is waiting to be coalesced with others, its paths are
+ * in the @paths set, and @changes is only filled in when it is emitted.
+ */
 typedef struct
 {
   DConfClient  *client;
   gchar        *prefix;
   gchar       **changes;
+  GHashTable   *paths;
   gchar        *tag;
   gboolean      is_writability;
 } DConfClientChange;
 
-static gboolean
-dconf_client_dispatch_change_signal (gpointer user_data)
+static void
+dconf_client_change_free (DConfClientChange *change)
 {
-  DConfClientChange *change = user_data;
+  g_free (change->prefix);
+  g_strfreev (change->changes);
+  if (change->paths)
+    g_hash_table_unref (change->paths);
+  g_free (change->tag);
+  g_slice_free (DConfClientChange, change);
+}
 
+static void
+dconf_client_emit_change (DConfClient       *client,
+                          DConfClientChange *change)
+{
   if (change->is_writability)
     {
       /* We know that the engine does it this way... */
       g_assert (change->changes[0][0] == '\0' && change->changes[1] == NULL);
 
-      g_signal_emit (change->client,
+      g_signal_emit (client,
                      dconf_client_signals[SIGNAL_WRITABILITY_CHANGED], 0,
                      change->prefix);
     }
 
-  g_signal_emit (change->client, dconf_client_signals[SIGNAL_CHANGED], 0,
+  g_signal_emit (client, dconf_client_signals[SIGNAL_CHANGED], 0,
                  change->prefix, change->changes, change->tag);
+}
+
+static gboolean
+dconf_client_dispatch_change_signal (gpointer user_data)
+{
+  DConfClientChange *change = user_data;
+
+  dconf_client_emit_change (change->client, change);
 
   g_object_unref (change->client);
-  g_free (change->prefix);
-  g_strfreev (change->changes);
-  g_free (change->tag);
-  g_slice_free (DConfClientChange, change);
+  dconf_client_change_free (change);
 
   return G_SOURCE_REMOVE;
 }
 
+static gint
+dconf_client_compare_paths (gconstpointer a,
+                            gconstpointer b,
+                            gpointer      user_data)
+{
+  return g_strcmp0 (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+/* Turns the set of paths into the list that the signal wants */
+static void
+dconf_client_change_take_paths (DConfClientChange *change)
+{
+  guint n_paths;
+
+  change->changes = (gchar **) g_hash_table_get_keys_as_array (change->paths, &n_paths);
+  g_qsort_with_data (change->changes, n_paths, sizeof (gchar *), dconf_client_compare_paths, NULL);
+
+  g_hash_table_steal_all (change->paths);
+  g_clear_pointer (&change->paths, g_hash_table_unref);
+}
+
+static gboolean
+dconf_client_dispatch_pending (gpointer user_data)
+{
+  DConfClient *client = user_data;
+  GQueue pending;
+
+  g_mutex_lock (&client->pending_lock);
+  pending = client->pending;
+  g_queue_init (&client->pending);
+  g_hash_table_remove_all (client->pending_by_prefix);
+  g_mutex_unlock (&client->pending_lock);
+
+  while (!g_queue_is_empty (&pending))
+    {
+      DConfClientChange *change = g_queue_pop_head (&pending);
+
+      if (change->paths)
+        dconf_client_change_take_paths (change);
+
+      dconf_client_emit_change (client, change);
+      dconf_client_change_free (change);
+    }
+
+  g_object_unref (client);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Adds @changes to the paths of a waiting change.  A change of the
+ * whole prefix (ie: "") swallows all of the others.
+ */
+static void
+dconf_client_change_add_paths (DConfClientChange   *change,
+                               const gchar * const *changes)
+{
+  gint i;
+
+  if (g_hash_table_contains (change->paths, ""))
+    return;
+
+  if (g_strv_contains (changes, ""))
+    {
+      g_hash_table_remove_all (change->paths);
+      g_hash_table_add (change->paths, g_strdup (""));
+      return;
+    }
+
+  for (i = 0; changes[i]; i++)
+    if (!g_hash_table_contains (change->paths, changes[i]))
+      g_hash_table_add (change->paths, g_strdup (changes[i]));
+}
+
+static void
+dconf_client_queue_change (DConfClient         *client,
+                           const gchar         *prefix,
+                           const gchar * const *changes,
+                           const gchar         *tag,
+                           gboolean             is_writability)
+{
+  DConfClientChange *change = NULL;
+  gboolean need_dispatch;
+
+  g_mutex_lock (&client->pending_lock);
+
+  need_dispatch = g_queue_is_empty (&client->pending);
+
+  /* Writability changes are never merged, so they aren't in the table */
+  if (!is_writability)
+    change = g_hash_table_lookup (client->pending_by_prefix, prefix);
+
+  if (change != NULL)
+    {
+      if (g_strcmp0 (change->tag, tag) != 0)
+        g_clear_pointer (&change->tag, g_free);
+
+      dconf_client_change_add_paths (change, changes);
+    }
+  else
+    {
+      change = g_slice_new0 (DConfClientChange);
+      change->prefix = g_strdup (prefix);
+      change->tag = g_strdup (tag);
+      change->is_writability = is_writability;
+
+      if (is_writability)
+        change->changes = g_strdupv ((gchar **) changes);
+      else
+        {
+          change->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+          dconf_client_change_add_paths (change, changes);
+          g_hash_table_insert (client->pending_by_prefix, change->prefix, change);
+        }
+
+      g_queue_push_tail (&client->pending, change);
+    }
+
+  g_mutex_unlock (&client->pending_lock);
+
+  if (need_dispatch)
+    g_main_context_invoke (client->context, dconf_client_dispatch_pending, g_object_ref (client));
+}
+
 void
 dconf_engine_change_notify (DConfEngine         *engine,
                             const gchar         *prefix,
@@ -208,10 +360,18 @@ dconf_engine_change_notify (DConfEngine         *engine,
 
   g_return_if_fail (DCONF_IS_CLIENT (client));
 
+  if (g_atomic_int_get (&client->coalesce))
+    {
+      dconf_client_queue_change (client, prefix, changes, tag, is_writability);
+      g_object_unref (client);
+      return;
+    }
+
   change = g_slice_new (DConfClientChange);
   change->client = client;
   change->prefix = g_strdup (prefix);
   change->changes = g_strdupv ((gchar **) changes);
+  change->paths = NULL;
   change->tag = g_strdup (tag);
   change->is_writability = is_writability;
 
@@ -336,6 +496,141 @@ dconf_client_read_full (DConfClient    *client,
   return dconf_engine_read (client->engine, flags, read_through, key);
 }
 
+/**
+ * dconf_client_read_boolean:
+ * @client: a #DConfClient
+ * @key: the key to read the value of
+ * @value: (out): return location for the value
+ *
+ * Reads the current value of @key, which must be a boolean.
+ *
+ * This is equivalent to calling dconf_client_read() and unpacking the
+ * result, but where possible it reads the value directly out of the
+ * database without creating a #GVariant.  The other typed getters
+ * (dconf_client_read_int32() and friends) work in the same way.
+ *
+ * If @key is unset, or is set to a value of a different type, then
+ * @value is left untouched and %FALSE is returned.
+ *
+ * Returns: %TRUE if @value was set
+ **/
+gboolean
+dconf_client_read_boolean (DConfClient *client,
+                           const gchar *key,
+                           gboolean    *value)
+{
+  g_return_val_if_fail (DCONF_IS_CLIENT (client), FALSE);
+
+  return dconf_engine_read_scalar (client->engine, DCONF_READ_FLAGS_NONE, key, "b", value);
+}
+
+/**
+ * dconf_client_read_int32:
+ * @client: a #DConfClient
+ * @key: the key to read the value of
+ * @value: (out): return location for the value
+ *
+ * Reads the current value of @key, which must be a 32-bit signed integer.  See
+ * dconf_client_read_boolean().
+ *
+ * Returns: %TRUE if @value was set
+ **/
+gboolean
+dconf_client_read_int32 (DConfClient *client,
+                         const gchar *key,
+                         gint32      *value)
+{
+  g_return_val_if_fail (DCONF_IS_CLIENT (client), FALSE);
+
+  return dconf_engine_read_scalar (client->engine, DCONF_READ_FLAGS_NONE, key, "i", value);
+}
+
+/**
+ * dconf_client_read_uint32:
+ * @client: a #DConfClient
+ * @key: the key to read the value of
+ * @value: (out): return location for the value
+ *
+ * Reads the current value of @key, which must be a 32-bit unsigned integer.  See
+ * dconf_client_read_boolean().
+ *
+ * Returns: %TRUE if @value was set
+ **/
+gboolean
+dconf_client_read_uint32 (DConfClient *client,
+                          const gchar *key,
+                          guint32     *value)
+{
+  g_return_val_if_fail (DCONF_IS_CLIENT (client), FALSE);
+
+  return dconf_engine_read_scalar (client->engine, DCONF_READ_FLAGS_NONE, key, "u", value);
+}
+
+/**
+ * dconf_client_read_int64:
+ * @client: a #DConfClient
+ * @key: the key to read the value of
+ * @value: (out): return location for the value
+ *
+ * Reads the current value of @key, which must be a 64-bit signed integer.  See
+ * dconf_client_read_boolean().
+ *
+ * Returns: %TRUE if @value was set
+ **/
+gboolean
+dconf_client_read_int64 (DConfClient *client,
+                         const gchar *key,
+                         gint64      *value)
+{
+  g_return_val_if_fail (DCONF_IS_CLIENT (client), FALSE);
+
+  return dconf_engine_read_scalar (client->engine, DCONF_READ_FLAGS_NONE, key, "x", value);
+}
+
+/**
+ * dconf_client_read_double:
+ * @client: a #DConfClient
+ * @key: the key to read the value of
+ * @value: (out): return location for the value
+ *
+ * Reads the current value of @key, which must be a double.  See
+ * dconf_client_read_boolean().
+ *
+ * Returns: %TRUE if @value was set
+ **/
+gboolean
+dconf_client_read_double (DConfClient *client,
+                          const gchar *key,
+                          gdouble     *value)
+{
+  g_return_val_if_fail (DCONF_IS_CLIENT (client), FALSE);
+
+  return dconf_engine_read_scalar (client->engine, DCONF_READ_FLAGS_NONE, key, "d", value);
+}
+
+/**
+ * dconf_client_read_string:
+ * @client: a #DConfClient
+ * @key: the key to read the value of
+ * @value: (out) (transfer full): return location for the value
+ *
+ * Reads the current value of @key, which must be a string.  See
+ * dconf_client_read_boolean().
+ *
+ * The returned string should be freed with g_free().
+ *
+ * Returns: %TRUE if @value was set
+ **/
+gboolean
+dconf_client_read_string (DConfClient  *client,
+                          const gchar  *key,
+                          gchar       **value)
+{
+  g_return_val_if_fail (DCONF_IS_CLIENT (client), FALSE);
+
+  return dconf_engine_read_scalar (client->engine, DCONF_READ_FLAGS_NONE, key, "s", value);
+}
+
 /**
  * dconf_client_list:
  * @client: a #DConfClient
@@ -695,3 +990,29 @@ dconf_client_sync (DConfClient *client)
 
   dconf_engine_sync (client->engine);
 }
+
+/**
+ * dconf_client_set_coalesce_changes:
+ * @client: a #DConfClient
+ * @coalesce: whether to coalesce change notifications
+ *
+ * Sets whether change notifications that arrive before the main
+ * context of @client gets to run should be coalesced.
+ *
+ * If @coalesce is %TRUE then all of the changes that are waiting for
+ * the main context are reported together: there is one
+ * #DConfClient::changed signal for each prefix, with each changed path
+ * listed once.  If the changes for a prefix came with different tags
+ * then the tag is %NULL.  This is useful for applications that only
+ * care about the final state after a burst of changes.
+ *
+ * The default is %FALSE, which emits one signal for each change.
+ **/
+void
+dconf_client_set_coalesce_changes (DConfClient *client,
+                                   gboolean     coalesce)
+{
+  g_return_if_fail (DCONF_IS_CLIENT (client));
+
+  g_atomic_int_set (&client->coalesce, coalesce);
+}
@@ -39,6 +39,30 @@ GVariant *              dconf_client_read_full                          (DConfCl
                                                                          DConfReadFlags        flags,
                                                                          const GQueue         *read_through);
 
+gboolean                dconf_client_read_boolean                       (DConfClient          *client,
+                                                                         const gchar          *key,
+                                                                         gboolean             *value);
+
+gboolean                dconf_client_read_int32                         (DConfClient          *client,
+                                                                         const gchar          *key,
+                                                                         gint32               *value);
+
+gboolean                dconf_client_read_uint32                        (DConfClient          *client,
+                                                                         const gchar          *key,
+                                                                         guint32              *value);
+
+gboolean                dconf_client_read_int64                         (DConfClient          *client,
+                                                                         const gchar          *key,
+                                                                         gint64               *value);
+
+gboolean                dconf_client_read_double                        (DConfClient          *client,
+                                                                         const gchar          *key,
+                                                                         gdouble              *value);
+
+gboolean                dconf_client_read_string                        (DConfClient          *client,
+                                                                         const gchar          *key,
+                                                                         gchar                **value);
+
 gchar **                dconf_client_list                               (DConfClient          *client,
                                                                          const gchar          *dir,
                                                                          gint                 *length);
@@ -82,6 +106,9 @@ void                    dconf_client_unwatch_sync                       (DConfCl
 
 void                    dconf_client_sync                               (DConfClient          *client);
 
+void                    dconf_client_set_coalesce_changes               (DConfClient          *client,
+                                                                         gboolean              coalesce);
+
 
 G_END_DECLS
 
@@ -0,0 +1,176 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "dconf-access-log.h"
+
+#include "dconf-paths.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static GMutex dconf_access_log_lock;
+static GHashTable *dconf_access_log_seen;
+static gint dconf_access_log_fd = -1;
+
+static gboolean
+dconf_access_log_open (void)
+{
+  static gsize opened;
+
+  if (g_once_init_enter (&opened))
+    {
+      const gchar *filename;
+
+      filename = g_getenv ("DCONF_ACCESS_LOG");
+
+      if (filename != NULL && filename[0] != '\0')
+        {
+          dconf_access_log_fd = open (filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+          if (dconf_access_log_fd != -1)
+            dconf_access_log_seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+          else
+            g_warning ("unable to open access log %s: %s", filename, g_strerror (errno));
+        }
+
+      g_once_init_leave (&opened, 1);
+    }
+
+  return dconf_access_log_fd != -1;
+}
+
+void
+dconf_access_log_record (const gchar *key)
+{
+  gchar *line;
+  gsize length;
+
+  if (!dconf_access_log_open ())
+    return;
+
+  g_mutex_lock (&dconf_access_log_lock);
+
+  if (g_hash_table_contains (dconf_access_log_seen, key))
+    {
+      g_mutex_unlock (&dconf_access_log_lock);
+      return;
+    }
+
+  g_hash_table_add (dconf_access_log_seen, g_strdup (key));
+
+  g_mutex_unlock (&dconf_access_log_lock);
+
+  /* One write() per line, so that lines from different processes don't
+   * get mixed up.  If it fails then the key just doesn't get counted.
+   */
+  line = g_strconcat (key, "\n", NULL);
+  length = strlen (line);
+
+  while (write (dconf_access_log_fd, line, length) < 0 && errno == EINTR)
+    ;
+
+  g_free (line);
+}
+
+typedef struct
+{
+  const gchar *key;
+  guint count;
+} DConfAccessLogEntry;
+
+static gint
+dconf_access_log_entry_compare (gconstpointer a,
+                                gconstpointer b)
+{
+  const DConfAccessLogEntry *entry_a = a;
+  const DConfAccessLogEntry *entry_b = b;
+
+  /* Most used first, and by name for the ones that are equal so that
+   * the result doesn't depend on the order of the hash table.
+   */
+  if (entry_a->count != entry_b->count)
+    return entry_a->count < entry_b->count ? 1 : -1;
+
+  return strcmp (entry_a->key, entry_b->key);
+}
+
+GHashTable *
+dconf_access_log_read_hot_keys (const gchar  *filename,
+                                guint         max_keys,
+                                GError      **error)
+{
+  GHashTable *counts;
+  GHashTableIter iter;
+  GHashTable *hot_keys;
+  GArray *entries;
+  gpointer key, value;
+  gchar *contents;
+  gchar *line;
+  gsize length;
+  guint i;
+
+  if (!g_file_get_contents (filename, &contents, &length, error))
+    return NULL;
+
+  counts = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (line = contents; line < contents + length; )
+    {
+      gchar *eol;
+
+      eol = memchr (line, '\n', contents + length - line);
+
+      /* A partial line at the end was still being written */
+      if (eol == NULL)
+        break;
+
+      *eol = '\0';
+
+      if (dconf_is_key (line, NULL))
+        {
+          guint count = GPOINTER_TO_UINT (g_hash_table_lookup (counts, line));
+
+          g_hash_table_insert (counts, line, GUINT_TO_POINTER (count + 1));
+        }
+
+      line = eol + 1;
+    }
+
+  entries = g_array_sized_new (FALSE, FALSE, sizeof (DConfAccessLogEntry), g_hash_table_size (counts));
+
+  g_hash_table_iter_init (&iter, counts);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      DConfAccessLogEntry entry = { key, GPOINTER_TO_UINT (value) };
+
+      g_array_append_val (entries, entry);
+    }
+
+  g_array_sort (entries, dconf_access_log_entry_compare);
+
+  hot_keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < entries->len && i < max_keys; i++)
+    g_hash_table_add (hot_keys, g_strdup (g_array_index (entries, DConfAccessLogEntry, i).key));
+
+  g_array_unref (entries);
+  g_hash_table_unref (counts);
+  g_free (contents);
+
+  return hot_keys;
+}
@@ -0,0 +1,47 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __dconf_access_log_h__
+#define __dconf_access_log_h__
+
+#include <glib.h>
+
+/* An opt-in record of which keys get read, for building databases with
+ * the most used keys together (see dconf_gvdb_builder_new()).
+ *
+ * If DCONF_ACCESS_LOG is set to a filename then each process appends a
+ * line to that file with the name of each key the first time that it
+ * reads it.  The more processes that read a key, the hotter it is.
+ */
+#define DCONF_ACCESS_LOG_MAX_HOT_KEYS 512
+
+/* A database with the hot keys together has a (tt) under this name,
+ * giving the start and end of the range of the file that they are in,
+ * for readers to prefetch when they open it.
+ */
+#define DCONF_ACCESS_LOG_HOT_RANGE_KEY ".hot"
+
+G_GNUC_INTERNAL
+void                    dconf_access_log_record                         (const gchar              *key);
+
+/* Returns a set of (at most) the @max_keys keys that appear most often
+ * in the log in @filename, or NULL if it can't be read.
+ */
+G_GNUC_INTERNAL
+GHashTable *            dconf_access_log_read_hot_keys                  (const gchar              *filename,
+                                                                         guint                     max_keys,
+                                                                         GError                  **error);
+
+#endif /* __dconf_access_log_h__ */
@@ -0,0 +1,366 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "dconf-keyfile.h"
+
+#include <string.h>
+
+/* The same rules as GKeyFile uses, so that we accept and reject the
+ * same files.
+ */
+static gboolean
+dconf_keyfile_is_group_name (const gchar *name)
+{
+  const gchar *p;
+
+  if (*name == '\0')
+    return FALSE;
+
+  for (p = name; *p; p = g_utf8_next_char (p))
+    {
+      gunichar c = g_utf8_get_char (p);
+
+      if (c == '[' || c == ']' || g_unichar_iscntrl (c))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+dconf_keyfile_is_key_name (const gchar *name)
+{
+  const gchar *p = name;
+
+  while (*p && *p != '[' && *p != ']')
+    p++;
+
+  if (p == name)
+    return FALSE;
+
+  /* A locale suffix, as in "key[de_DE]" */
+  if (*p == '[')
+    {
+      for (p++; *p; p = g_utf8_next_char (p))
+        if (!g_unichar_isalnum (g_utf8_get_char (p)) && !strchr ("-_.@", *p))
+          break;
+
+      if (*p != ']')
+        return FALSE;
+
+      p++;
+    }
+
+  return *p == '\0';
+}
+
+gboolean
+dconf_keyfile_parse (const gchar       *contents,
+                     gssize             length,
+                     DConfKeyfileFunc   func,
+                     gpointer           user_data,
+                     GError           **error)
+{
+  GString *group = NULL;
+  gboolean success = FALSE;
+  const gchar *end;
+  GString *line;
+
+  if (length < 0)
+    length = strlen (contents);
+
+  if (!g_utf8_validate (contents, length, NULL))
+    {
+      g_set_error_literal (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_UNKNOWN_ENCODING,
+                           "Key file contains invalid UTF-8");
+      return FALSE;
+    }
+
+  line = g_string_sized_new (256);
+  end = contents + length;
+
+  while (contents < end)
+    {
+      const gchar *eol;
+      gchar *start;
+      gchar *stop;
+      gchar *eq;
+
+      eol = memchr (contents, '\n', end - contents);
+      if (eol == NULL)
+        eol = end;
+
+      /* Each line is copied into the scratch buffer so that the pieces
+       * can be nul-terminated in place.
+       */
+      g_string_truncate (line, 0);
+      g_string_append_len (line, contents, eol - contents);
+      contents = eol < end ? eol + 1 : end;
+
+      start = line->str;
+      while (g_ascii_isspace (*start))
+        start++;
+
+      stop = line->str + line->len;
+      while (stop > start && g_ascii_isspace (stop[-1]))
+        stop--;
+      *stop = '\0';
+
+      if (*start == '\0' || *start == '#')
+        continue;
+
+      if (*start == '[' && stop[-1] == ']')
+        {
+          stop[-1] = '\0';
+
+          if (!dconf_keyfile_is_group_name (start + 1))
+            {
+              g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE,
+                           "Invalid group name: %s", start + 1);
+              goto out;
+            }
+
+          if (group == NULL)
+            group = g_string_new (start + 1);
+          else
+            g_string_assign (group, start + 1);
+
+          continue;
+        }
+
+      eq = strchr (start, '=');
+      if (eq == NULL || eq == start)
+        {
+          g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE,
+                       "Key file contains line “%s” which is not a key-value pair, group, or comment", start);
+          goto out;
+        }
+
+      if (group == NULL)
+        {
+          g_set_error_literal (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND,
+                               "Key file does not start with a group");
+          goto out;
+        }
+
+      *eq = '\0';
+      while (eq > start && g_ascii_isspace (eq[-1]))
+        *--eq = '\0';
+
+      if (!dconf_keyfile_is_key_name (start))
+        {
+          g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE,
+                       "Invalid key name: %s", start);
+          goto out;
+        }
+
+      eq += strlen (eq) + 1;
+      while (g_ascii_isspace (*eq))
+        eq++;
+
+      if (!func (group->str, start, eq, user_data, error))
+        goto out;
+    }
+
+  success = TRUE;
+
+ out:
+  if (group != NULL)
+    g_string_free (group, TRUE);
+  g_string_free (line, TRUE);
+
+  return success;
+}
+
+static gboolean
+dconf_keyfile_parse_int32 (const gchar *p,
+                           const gchar *end,
+                           gint32      *result)
+{
+  gboolean negative = FALSE;
+  guint64 value = 0;
+
+  if (*p == '-')
+    {
+      negative = TRUE;
+      p++;
+    }
+
+  /* Leave anything that g_variant_parse() would read as octal or hex
+   * (or that can't possibly fit) to g_variant_parse().
+   */
+  if (p == end || end - p > 10 || (*p == '0' && end - p > 1))
+    return FALSE;
+
+  for (; p < end; p++)
+    {
+      if (!g_ascii_isdigit (*p))
+        return FALSE;
+
+      value = value * 10 + (*p - '0');
+    }
+
+  if (value > (negative ? (guint64) G_MAXINT32 + 1 : (guint64) G_MAXINT32))
+    return FALSE;
+
+  *result = negative ? (gint32) -(gint64) value : (gint32) value;
+
+  return TRUE;
+}
+
+/* Reads a quoted string with no escapes in it, starting at 'p'.
+ * Returns a pointer to just past the closing quote, or NULL.
+ */
+static const gchar *
+dconf_keyfile_parse_string (const gchar  *p,
+                            const gchar  *end,
+                            GVariant    **result)
+{
+  const gchar *start = p + 1;
+  gchar quote = *p;
+
+  for (p = start; p < end; p++)
+    {
+      if (*p == '\\')
+        return NULL;
+
+      if (*p == quote)
+        break;
+    }
+
+  if (p == end || !g_utf8_validate (start, p - start, NULL))
+    return NULL;
+
+  *result = g_variant_new_take_string (g_strndup (start, p - start));
+
+  return p + 1;
+}
+
+static GVariant *
+dconf_keyfile_parse_string_array (const gchar *p,
+                                  const gchar *end)
+{
+  GPtrArray *children;
+  GVariant *result;
+
+  children = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+
+  /* p points at the opening '[' */
+  for (p++; p < end && g_ascii_isspace (*p); p++);
+
+  /* The empty array needs a type annotation: let g_variant_parse() deal */
+  while (p < end && (*p == '\'' || *p == '"'))
+    {
+      GVariant *child;
+
+      p = dconf_keyfile_parse_string (p, end, &child);
+      if (p == NULL)
+        break;
+
+      g_ptr_array_add (children, child);
+
+      for (; p < end && g_ascii_isspace (*p); p++);
+
+      if (p < end && *p == ']')
+        {
+          for (p++; p < end && g_ascii_isspace (*p); p++);
+
+          if (p != end)
+            break;
+
+          result = g_variant_new_array (G_VARIANT_TYPE_STRING,
+                                        (GVariant **) children->pdata, children->len);
+          g_ptr_array_set_free_func (children, NULL);
+          g_ptr_array_free (children, TRUE);
+
+          return result;
+        }
+
+      if (p == end || *p != ',')
+        break;
+
+      for (p++; p < end && g_ascii_isspace (*p); p++);
+    }
+
+  g_ptr_array_free (children, TRUE);
+
+  return NULL;
+}
+
+/* The hand-written fast paths for the types of values that make up
+ * almost all of the site defaults out there.  Returns NULL (without
+ * an error) for anything else.
+ */
+static GVariant *
+dconf_keyfile_parse_literal (const gchar *text)
+{
+  const gchar *end;
+  GVariant *value;
+  gint32 number;
+
+  while (g_ascii_isspace (*text))
+    text++;
+
+  end = text + strlen (text);
+  while (end > text && g_ascii_isspace (end[-1]))
+    end--;
+
+  switch (*text)
+    {
+    case 't':
+      if (end - text == 4 && memcmp (text, "true", 4) == 0)
+        return g_variant_new_boolean (TRUE);
+      break;
+
+    case 'f':
+      if (end - text == 5 && memcmp (text, "false", 5) == 0)
+        return g_variant_new_boolean (FALSE);
+      break;
+
+    case '\'':
+    case '"':
+      value = NULL;
+      if (dconf_keyfile_parse_string (text, end, &value) == end)
+        return value;
+      else if (value != NULL)
+        g_variant_unref (value);
+      break;
+
+    case '[':
+      return dconf_keyfile_parse_string_array (text, end);
+
+    default:
+      if (dconf_keyfile_parse_int32 (text, end, &number))
+        return g_variant_new_int32 (number);
+      break;
+    }
+
+  return NULL;
+}
+
+GVariant *
+dconf_keyfile_parse_value (const gchar  *text,
+                           GError      **error)
+{
+  GVariant *value;
+
+  value = dconf_keyfile_parse_literal (text);
+  if (value != NULL)
+    return g_variant_ref_sink (value);
+
+  return g_variant_parse (NULL, text, NULL, NULL, error);
+}
@@ -0,0 +1,52 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __dconf_keyfile_h__
+#define __dconf_keyfile_h__
+
+#include <glib.h>
+
+/* A streaming reader for the keyfiles that dconf reads its settings
+ * from.  It accepts the same files as GKeyFile but hands each key to
+ * the caller as it is found instead of building up a copy of the file.
+ * Values are passed on as they appear in the file, like
+ * g_key_file_get_value() does.
+ *
+ * The strings passed to the callback are only valid during the call.
+ */
+typedef gboolean     (* DConfKeyfileFunc)                               (const gchar              *group,
+                                                                         const gchar              *key,
+                                                                         const gchar              *value,
+                                                                         gpointer                  user_data,
+                                                                         GError                  **error);
+
+G_GNUC_INTERNAL
+gboolean                dconf_keyfile_parse                             (const gchar              *contents,
+                                                                         gssize                    length,
+                                                                         DConfKeyfileFunc          func,
+                                                                         gpointer                  user_data,
+                                                                         GError                  **error);
+
+/* Parses a value in GVariant text format.  Simple literals (booleans,
+ * integers, strings and arrays of strings) are handled directly and
+ * anything else is given to g_variant_parse().
+ *
+ * Returns a non-floating reference.
+ */
+G_GNUC_INTERNAL
+GVariant *              dconf_keyfile_parse_value                       (const gchar              *text,
+                                                                         GError                  **error);
+
+#endif /* __dconf_keyfile_h__ */
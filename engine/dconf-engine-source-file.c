@@ -37,7 +37,7 @@ dconf_engine_source_file_init (DConfEngineSource *source)
 static gboolean
 dconf_engine_source_file_needs_reopen (DConfEngineSource *source)
 {
-  return !source->values;
+  return !source->values && dconf_engine_source_retry_due (source);
 }
 
 static GvdbTable *
@@ -46,7 +46,7 @@ dconf_engine_source_file_reopen (DConfEngineSource *source)
   GError *error = NULL;
   GvdbTable *table;
 
-  table = gvdb_table_new (source->name, FALSE, &error);
+  table = dconf_engine_source_open_gvdb (source->name, &error);
 
   if (table == NULL)
     {
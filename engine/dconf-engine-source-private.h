@@ -28,4 +28,8 @@ G_GNUC_INTERNAL extern const DConfEngineSourceVTable dconf_engine_source_user_vt
 G_GNUC_INTERNAL extern const DConfEngineSourceVTable dconf_engine_source_service_vtable;
 G_GNUC_INTERNAL extern const DConfEngineSourceVTable dconf_engine_source_system_vtable;
 
+G_GNUC_INTERNAL
+GvdbTable *             dconf_engine_source_open_gvdb                   (const gchar        *filename,
+                                                                         GError            **error);
+
 #endif /* __dconf_engine_source_private_h__ */
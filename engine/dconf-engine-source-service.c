@@ -22,12 +22,22 @@
 
 #include "dconf-engine-source-private.h"
 
+#include "../shm/dconf-shm-db.h"
 #include "dconf-engine.h"
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 
+typedef struct
+{
+  DConfEngineSource source;
+
+  DConfShmDb *db;
+  guint64 generation;
+  gboolean did_init;
+} DConfEngineSourceService;
+
 static void
 dconf_engine_source_service_init (DConfEngineSource *source)
 {
@@ -40,39 +50,92 @@ dconf_engine_source_service_init (DConfEngineSource *source)
 static gboolean
 dconf_engine_source_service_needs_reopen (DConfEngineSource *source)
 {
-  return !source->values || !gvdb_table_is_valid (source->values);
+  DConfEngineSourceService *service_source = (DConfEngineSourceService *) source;
+
+  /* Don't ask the service to create it on every read */
+  if (!source->values)
+    return dconf_engine_source_retry_due (source);
+
+  if (service_source->db)
+    return dconf_shm_db_get_generation (service_source->db) != service_source->generation;
+
+  return !gvdb_table_is_valid (source->values);
+}
+
+static GvdbTable *
+dconf_engine_source_service_open (DConfEngineSourceService  *service_source,
+                                  const gchar               *filename,
+                                  GError                   **error)
+{
+  /* If the service is keeping the database in a buffered file then we
+   * use the current slot in place: the service won't reuse it while our
+   * table (or a value from it) holds on to it.
+   */
+  if (service_source->db == NULL)
+    {
+      gchar *db_filename;
+
+      db_filename = g_strconcat (filename, ".shared", NULL);
+      service_source->db = dconf_shm_db_open (db_filename, FALSE);
+      g_free (db_filename);
+    }
+
+  if (service_source->db)
+    {
+      GvdbTable *table;
+      GBytes *bytes;
+
+      bytes = dconf_shm_db_read (service_source->db, &service_source->generation);
+      if (bytes != NULL)
+        {
+          table = gvdb_table_new_from_bytes (bytes, FALSE, error);
+          g_bytes_unref (bytes);
+
+          return table;
+        }
+
+      /* Either the service hasn't written anything to it yet, or it
+       * removed the file because it stopped using it.  Both ways, the
+       * plain file is the one to read.  We look for the other one again
+       * when the service invalidates that.
+       */
+      g_clear_pointer (&service_source->db, dconf_shm_db_close);
+    }
+
+  return dconf_engine_source_open_gvdb (filename, error);
 }
 
 static GvdbTable *
 dconf_engine_source_service_reopen (DConfEngineSource *source)
 {
+  DConfEngineSourceService *service_source = (DConfEngineSourceService *) source;
   GError *error = NULL;
   GvdbTable *table;
   gchar *filename;
 
   filename = g_build_filename (g_get_user_runtime_dir (), "dconf-service", source->name, NULL);
 
-  table = gvdb_table_new (filename, FALSE, NULL);
+  table = dconf_engine_source_service_open (service_source, filename, &error);
 
   if (table == NULL)
     {
-      /* If the file does not exist, kick the service to have it created. */
-      dconf_engine_dbus_call_sync_func (source->bus_type, source->bus_name, source->object_path,
-                                        "ca.desrt.dconf.Writer", "Init", g_variant_new ("()"), NULL, NULL);
-
-      /* try again */
-      table = gvdb_table_new (filename, FALSE, &error);
-
-      if (table == NULL)
+      /* If the file does not exist, have the engine kick the service
+       * to create it.  That happens asynchronously, so we will be back
+       * here when it's done.
+       */
+      if (!service_source->did_init)
         {
-          if (!source->did_warn)
-            {
-              g_warning ("unable to open file '%s': %s; expect degraded performance", filename, error->message);
-              source->did_warn = TRUE;
-            }
+          source->needs_init = TRUE;
+          service_source->did_init = TRUE;
+        }
 
-          g_error_free (error);
+      else if (!source->did_warn)
+        {
+          g_warning ("unable to open file '%s': %s; expect degraded performance", filename, error->message);
+          source->did_warn = TRUE;
         }
+
+      g_error_free (error);
     }
 
   g_free (filename);
@@ -83,11 +146,15 @@ dconf_engine_source_service_reopen (DConfEngineSource *source)
 static void
 dconf_engine_source_service_finalize (DConfEngineSource *source)
 {
+  DConfEngineSourceService *service_source = (DConfEngineSourceService *) source;
+
+  if (service_source->db)
+    dconf_shm_db_close (service_source->db);
 }
 
 G_GNUC_INTERNAL
 const DConfEngineSourceVTable dconf_engine_source_service_vtable = {
-  .instance_size    = sizeof (DConfEngineSource),
+  .instance_size    = sizeof (DConfEngineSourceService),
   .init             = dconf_engine_source_service_init,
   .finalize         = dconf_engine_source_service_finalize,
   .needs_reopen     = dconf_engine_source_service_needs_reopen,
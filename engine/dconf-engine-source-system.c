@@ -37,7 +37,10 @@ dconf_engine_source_system_init (DConfEngineSource *source)
 static gboolean
 dconf_engine_source_system_needs_reopen (DConfEngineSource *source)
 {
-  return !source->values || !gvdb_table_is_valid (source->values);
+  if (!source->values)
+    return dconf_engine_source_retry_due (source);
+
+  return !gvdb_table_is_valid (source->values);
 }
 
 static GvdbTable *
@@ -48,7 +51,7 @@ dconf_engine_source_system_reopen (DConfEngineSource *source)
   gchar *filename;
 
   filename = g_build_filename (SYSCONFDIR "/dconf/db", source->name, NULL);
-  table = gvdb_table_new (filename, FALSE, &error);
+  table = dconf_engine_source_open_gvdb (filename, &error);
 
   if (table == NULL)
     {
@@ -23,7 +23,10 @@
 #include "dconf-engine-source-private.h"
 
 #include "../shm/dconf-shm.h"
+#include "../shm/dconf-journal.h"
+#include "dconf-engine.h"
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -31,25 +34,196 @@ typedef struct
 {
   DConfEngineSource source;
 
-  guint8 *shm;
+  const guint64 *shm;
+  guint64 generation;
 } DConfEngineSourceUser;
 
+/* The live copy is only worth reading if the file in the config dir
+ * hasn't been replaced since it was written (by "dconf load" while the
+ * service wasn't running, say).  The service removes stale ones.
+ */
+static gboolean
+dconf_engine_source_user_is_current (const gchar *live_filename,
+                                     const gchar *filename)
+{
+  struct stat live_buf, buf;
+
+  if (stat (live_filename, &live_buf) != 0)
+    return FALSE;
+
+  if (stat (filename, &buf) != 0)
+    return TRUE;
+
+  if (live_buf.st_mtim.tv_sec != buf.st_mtim.tv_sec)
+    return live_buf.st_mtim.tv_sec > buf.st_mtim.tv_sec;
+
+  return live_buf.st_mtim.tv_nsec >= buf.st_mtim.tv_nsec;
+}
+
 static GvdbTable *
 dconf_engine_source_user_open_gvdb (const gchar *name)
 {
-  GvdbTable *table;
+  GvdbTable *table = NULL;
+  gchar *live_filename;
+  gchar *live_name;
   gchar *filename;
 
   /* This can fail in the normal case of the user not having any
    * settings.  That's OK and it shouldn't be considered as an error.
    */
   filename = g_build_filename (g_get_user_config_dir (), "dconf", name, NULL);
-  table = gvdb_table_new (filename, FALSE, NULL);
+
+  /* If the service is running the database in "write-back" mode then
+   * the live copy is in the runtime dir and the one in the config dir
+   * may be out of date.
+   */
+  live_name = g_strconcat (name, ".gvdb", NULL);
+  live_filename = g_build_filename (g_get_user_runtime_dir (), "dconf", live_name, NULL);
+  g_free (live_name);
+
+  if (dconf_engine_source_user_is_current (live_filename, filename))
+    table = dconf_engine_source_open_gvdb (live_filename, NULL);
+
+  if (table == NULL)
+    table = dconf_engine_source_open_gvdb (filename, NULL);
+
+  g_free (live_filename);
   g_free (filename);
 
   return table;
 }
 
+/* One thread per database reads the journal for the whole process and
+ * passes the records on to the engines.  It is started when something
+ * is first watched, and runs for as long as the service keeps writing
+ * the journal (or until the engine sees the service lose its name).
+ * After that, the sources that were using it go over to D-Bus for good.
+ */
+static GHashTable *dconf_engine_source_user_journals;
+static GMutex      dconf_engine_source_user_journals_lock;
+
+typedef struct
+{
+  gchar        *name;
+  DConfJournal *journal;
+} DConfJournalReader;
+
+static gpointer
+dconf_engine_source_user_journal_thread (gpointer user_data)
+{
+  DConfJournalReader *reader = user_data;
+  guint64 position;
+
+  position = dconf_journal_get_position (reader->journal);
+
+  while (TRUE)
+    {
+      gboolean lagged = FALSE;
+      GVariant *record;
+
+      record = dconf_journal_read (reader->journal, &position, &lagged);
+
+      if (lagged)
+        {
+          const gchar * const everything[] = { "", NULL };
+
+          /* We missed some changes, so anything could have changed */
+          dconf_engine_handle_journal_record (reader->name, "/", everything, NULL);
+        }
+      else if (record)
+        {
+          const gchar *prefix;
+          const gchar **changes;
+          const gchar *tag;
+
+          g_variant_get (record, "(t&s^a&s&s)", NULL, &prefix, &changes, &tag);
+          dconf_engine_handle_journal_record (reader->name, prefix, changes, tag);
+          g_variant_unref (record);
+          g_free (changes);
+        }
+      else if (!dconf_journal_wait (reader->journal, position))
+        break;
+    }
+
+  /* Sources created from now on won't find us, and will use D-Bus
+   * unless a new service has started its own journal by then.
+   */
+  g_mutex_lock (&dconf_engine_source_user_journals_lock);
+  g_hash_table_remove (dconf_engine_source_user_journals, reader->name);
+  g_mutex_unlock (&dconf_engine_source_user_journals_lock);
+
+  dconf_engine_handle_journal_closed (reader->name);
+
+  dconf_journal_close (reader->journal);
+  g_free (reader->name);
+  g_slice_free (DConfJournalReader, reader);
+
+  return NULL;
+}
+
+static gboolean
+dconf_engine_source_user_start_journal (DConfEngineSource *source)
+{
+  const gchar *name = source->name;
+  gboolean have_reader;
+
+  /* Only if the service was asked to keep it, too */
+  if (g_getenv ("DCONF_JOURNAL") == NULL)
+    return FALSE;
+
+  g_mutex_lock (&dconf_engine_source_user_journals_lock);
+
+  if G_UNLIKELY (dconf_engine_source_user_journals == NULL)
+    dconf_engine_source_user_journals = g_hash_table_new (g_str_hash, g_str_equal);
+
+  have_reader = g_hash_table_contains (dconf_engine_source_user_journals, name);
+
+  if (!have_reader)
+    {
+      DConfJournal *journal;
+
+      /* NULL unless the service is keeping the journal */
+      journal = dconf_journal_open (name, FALSE);
+
+      if (journal != NULL)
+        {
+          DConfJournalReader *reader;
+
+          reader = g_slice_new (DConfJournalReader);
+          reader->name = g_strdup (name);
+          reader->journal = journal;
+
+          g_hash_table_insert (dconf_engine_source_user_journals, reader->name, reader);
+          g_thread_unref (g_thread_new ("dconf journal", dconf_engine_source_user_journal_thread, reader));
+          have_reader = TRUE;
+        }
+    }
+
+  g_mutex_unlock (&dconf_engine_source_user_journals_lock);
+
+  return have_reader;
+}
+
+/* The thread sees that the journal was cancelled, and goes through
+ * dconf_engine_handle_journal_closed() as if the service had closed it.
+ */
+static void
+dconf_engine_source_user_stop_journal (DConfEngineSource *source,
+                                       gboolean           check)
+{
+  DConfJournalReader *reader = NULL;
+
+  g_mutex_lock (&dconf_engine_source_user_journals_lock);
+
+  if (dconf_engine_source_user_journals != NULL)
+    reader = g_hash_table_lookup (dconf_engine_source_user_journals, source->name);
+
+  if (reader != NULL && (!check || !dconf_journal_check (reader->journal)))
+    dconf_journal_cancel (reader->journal);
+
+  g_mutex_unlock (&dconf_engine_source_user_journals_lock);
+}
+
 static void
 dconf_engine_source_user_init (DConfEngineSource *source)
 {
@@ -59,23 +233,170 @@ dconf_engine_source_user_init (DConfEngineSource *source)
   source->writable = TRUE;
 }
 
+static void
+dconf_engine_source_user_shard_free (gpointer data)
+{
+  DConfEngineShard *shard = data;
+
+  /* Taken over by the new list */
+  if (shard == NULL)
+    return;
+
+  if (shard->table)
+    gvdb_table_free (shard->table);
+
+  dconf_shm_close (shard->shm);
+  g_free (shard->dir);
+  g_free (shard->name);
+
+  g_slice_free (DConfEngineShard, shard);
+}
+
+static void
+dconf_engine_source_user_open_shard (DConfEngineShard *shard)
+{
+  gchar *filename;
+
+  /* As for the main table: read the generation first */
+  if (shard->shm != NULL)
+    shard->generation = dconf_shm_get_generation (shard->shm);
+
+  g_clear_pointer (&shard->table, gvdb_table_free);
+
+  filename = g_build_filename (g_get_user_config_dir (), "dconf", shard->name, NULL);
+  shard->table = dconf_engine_source_open_gvdb (filename, NULL);
+  g_free (filename);
+}
+
+/* Finds the shards that the (newly opened) main table lists.  The ones
+ * that we already had open are kept if they haven't changed, so that a
+ * change to the main table doesn't mean reopening all of them.
+ */
+static void
+dconf_engine_source_user_load_shards (DConfEngineSource *source,
+                                      GvdbTable         *table)
+{
+  GPtrArray *old_shards;
+  GvdbTable *index = NULL;
+  gchar **dirs;
+  gsize n_dirs;
+  gsize i;
+
+  old_shards = source->shards;
+  source->shards = NULL;
+
+  if (table != NULL)
+    index = gvdb_table_get_table (table, ".shards");
+
+  if (index == NULL)
+    {
+      if (old_shards)
+        g_ptr_array_unref (old_shards);
+
+      return;
+    }
+
+  source->shards = g_ptr_array_new_with_free_func (dconf_engine_source_user_shard_free);
+
+  dirs = gvdb_table_get_names (index, &n_dirs);
+  for (i = 0; i < n_dirs; i++)
+    {
+      DConfEngineShard *shard = NULL;
+      const gchar *name;
+      GVariant *value;
+      guint j;
+
+      value = gvdb_table_get_value (index, dirs[i]);
+      if (value == NULL || !g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+        {
+          g_clear_pointer (&value, g_variant_unref);
+          continue;
+        }
+
+      name = g_variant_get_string (value, NULL);
+
+      for (j = 0; old_shards && j < old_shards->len; j++)
+        {
+          DConfEngineShard *old = g_ptr_array_index (old_shards, j);
+
+          if (g_str_equal (old->name, name) && g_str_equal (old->dir, dirs[i]))
+            {
+              shard = old;
+              old_shards->pdata[j] = NULL;
+              break;
+            }
+        }
+
+      if (shard == NULL)
+        {
+          shard = g_slice_new0 (DConfEngineShard);
+          shard->dir = g_strdup (dirs[i]);
+          shard->name = g_strdup (name);
+          shard->shm = dconf_shm_open (shard->name);
+          dconf_engine_source_user_open_shard (shard);
+        }
+      else if (dconf_shm_is_flagged (shard->shm, shard->generation))
+        dconf_engine_source_user_open_shard (shard);
+
+      g_ptr_array_add (source->shards, shard);
+      g_variant_unref (value);
+    }
+
+  g_strfreev (dirs);
+  gvdb_table_free (index);
+
+  if (old_shards)
+    g_ptr_array_unref (old_shards);
+}
+
+static gboolean
+dconf_engine_source_user_refresh_shards (DConfEngineSource *source)
+{
+  gboolean reopened = FALSE;
+  guint i;
+
+  for (i = 0; i < source->shards->len; i++)
+    {
+      DConfEngineShard *shard = g_ptr_array_index (source->shards, i);
+
+      if (dconf_shm_is_flagged (shard->shm, shard->generation))
+        {
+          dconf_engine_source_user_open_shard (shard);
+          reopened = TRUE;
+        }
+    }
+
+  return reopened;
+}
+
 static gboolean
 dconf_engine_source_user_needs_reopen (DConfEngineSource *source)
 {
   DConfEngineSourceUser *user_source = (DConfEngineSourceUser *) source;
 
-  return dconf_shm_is_flagged (user_source->shm);
+  return dconf_shm_is_flagged (user_source->shm, user_source->generation);
 }
 
 static GvdbTable *
 dconf_engine_source_user_reopen (DConfEngineSource *source)
 {
   DConfEngineSourceUser *user_source = (DConfEngineSourceUser *) source;
+  GvdbTable *table;
 
-  dconf_shm_close (user_source->shm);
-  user_source->shm = dconf_shm_open (source->name);
+  /* The page stays mapped once we have it */
+  if (user_source->shm == NULL)
+    user_source->shm = dconf_shm_open (source->name);
+
+  /* Read the generation before opening the file, so that a change that
+   * happens in between will cause us to reopen again next time.
+   */
+  if (user_source->shm != NULL)
+    user_source->generation = dconf_shm_get_generation (user_source->shm);
+
+  table = dconf_engine_source_user_open_gvdb (source->name);
+  dconf_engine_source_user_load_shards (source, table);
 
-  return dconf_engine_source_user_open_gvdb (source->name);
+  return table;
 }
 
 static void
@@ -92,5 +413,8 @@ const DConfEngineSourceVTable dconf_engine_source_user_vtable = {
   .init             = dconf_engine_source_user_init,
   .finalize         = dconf_engine_source_user_finalize,
   .needs_reopen     = dconf_engine_source_user_needs_reopen,
-  .reopen           = dconf_engine_source_user_reopen
+  .reopen           = dconf_engine_source_user_reopen,
+  .refresh_shards   = dconf_engine_source_user_refresh_shards,
+  .start_journal    = dconf_engine_source_user_start_journal,
+  .stop_journal     = dconf_engine_source_user_stop_journal
 };
@@ -22,7 +22,17 @@
 
 #include "dconf-engine-source-private.h"
 
+#include "../common/dconf-access-log.h"
+
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+
+/* How long to wait before looking again for a database that we failed
+ * to open.  The interval doubles after each failure, up to the maximum.
+ */
+#define DCONF_ENGINE_SOURCE_MIN_RETRY_INTERVAL  (G_TIME_SPAN_SECOND / 10)
+#define DCONF_ENGINE_SOURCE_MAX_RETRY_INTERVAL  (60 * G_TIME_SPAN_SECOND)
 
 void
 dconf_engine_source_free (DConfEngineSource *source)
@@ -33,6 +43,9 @@ dconf_engine_source_free (DConfEngineSource *source)
   if (source->locks)
     gvdb_table_free (source->locks);
 
+  if (source->shards)
+    g_ptr_array_unref (source->shards);
+
   source->vtable->finalize (source);
   g_free (source->bus_name);
   g_free (source->object_path);
@@ -61,6 +74,17 @@ dconf_engine_source_refresh (DConfEngineSource *source)
       /* Check if we ended up with a gvdb. */
       is_open = source->values != NULL;
 
+      if (is_open)
+        source->retry_interval = 0;
+      else
+        {
+          /* The monotonic clock doesn't need a syscall to read */
+          source->retry_interval = CLAMP (source->retry_interval * 2,
+                                          DCONF_ENGINE_SOURCE_MIN_RETRY_INTERVAL,
+                                          DCONF_ENGINE_SOURCE_MAX_RETRY_INTERVAL);
+          source->retry_time = g_get_monotonic_time () + source->retry_interval;
+        }
+
       /* Only return TRUE in the case that we either had a database
        * before or ended up with one after.  In the case that we just go
        * from NULL to NULL, return FALSE.
@@ -68,9 +92,138 @@ dconf_engine_source_refresh (DConfEngineSource *source)
       return was_open || is_open;
     }
 
+  if (source->shards && source->vtable->refresh_shards)
+    return source->vtable->refresh_shards (source);
+
   return FALSE;
 }
 
+/* Opens the database in @filename, and asks the kernel to start reading
+ * in the range of it with the hot keys, if it has one (see
+ * dconf-access-log.h).
+ */
+GvdbTable *
+dconf_engine_source_open_gvdb (const gchar  *filename,
+                               GError      **error)
+{
+  GvdbTable *table;
+  GVariant *range;
+
+  table = gvdb_table_new (filename, FALSE, error);
+  if (table == NULL)
+    return NULL;
+
+  range = gvdb_table_get_value (table, DCONF_ACCESS_LOG_HOT_RANGE_KEY);
+  if (range == NULL)
+    return table;
+
+#ifdef POSIX_FADV_WILLNEED
+  if (g_variant_is_of_type (range, G_VARIANT_TYPE ("(tt)")))
+    {
+      guint64 start, end;
+      gint fd;
+
+      g_variant_get (range, "(tt)", &start, &end);
+
+      /* If the file was replaced since we mapped it then this reads in
+       * part of the new one instead, which does no harm.
+       */
+      fd = open (filename, O_RDONLY | O_CLOEXEC);
+      if (fd != -1)
+        {
+          if (start < end)
+            posix_fadvise (fd, start, end - start, POSIX_FADV_WILLNEED);
+
+          close (fd);
+        }
+    }
+#endif
+
+  g_variant_unref (range);
+
+  return table;
+}
+
+/* The table that @key is in: the shard with the longest dir that @key
+ * is in, or the main table.
+ */
+GvdbTable *
+dconf_engine_source_get_table (DConfEngineSource *source,
+                               const gchar       *key)
+{
+  DConfEngineShard *result = NULL;
+  guint i;
+
+  if (source->shards == NULL)
+    return source->values;
+
+  for (i = 0; i < source->shards->len; i++)
+    {
+      DConfEngineShard *shard = g_ptr_array_index (source->shards, i);
+
+      if (g_str_has_prefix (key, shard->dir) &&
+          (result == NULL || strlen (shard->dir) > strlen (result->dir)))
+        result = shard;
+    }
+
+  return result ? result->table : source->values;
+}
+
+/* Adds what the shards have in @dir to @results, as gvdb_table_list()
+ * would list it.
+ */
+void
+dconf_engine_source_list_shards (DConfEngineSource *source,
+                                 const gchar       *dir,
+                                 GHashTable        *results)
+{
+  guint i;
+
+  if (source->shards == NULL)
+    return;
+
+  for (i = 0; i < source->shards->len; i++)
+    {
+      DConfEngineShard *shard = g_ptr_array_index (source->shards, i);
+      gchar **list;
+      gint j;
+
+      if (shard->table == NULL ||
+          !(g_str_has_prefix (shard->dir, dir) || g_str_has_prefix (dir, shard->dir)))
+        continue;
+
+      /* The shard has its keys under their full paths, dirs and all */
+      list = gvdb_table_list (shard->table, dir);
+
+      if (list != NULL)
+        {
+          for (j = 0; list[j]; j++)
+            g_hash_table_add (results, list[j]);
+
+          g_free (list);
+        }
+    }
+}
+
+/* For the needs_reopen() of sources that can't otherwise find out when
+ * a missing database appears: should we look for it again yet?
+ */
+gboolean
+dconf_engine_source_retry_due (DConfEngineSource *source)
+{
+  return g_get_monotonic_time () >= source->retry_time;
+}
+
+/* Called when something (like a signal from the service) suggests that
+ * a missing database might exist now.
+ */
+void
+dconf_engine_source_retry (DConfEngineSource *source)
+{
+  source->retry_time = 0;
+  source->retry_interval = 0;
+}
+
 DConfEngineSource *
 dconf_engine_source_new (const gchar *description)
 {
@@ -35,17 +35,45 @@ struct _DConfEngineSourceVTable
   void          (* finalize)         (DConfEngineSource *source);
   gboolean      (* needs_reopen)     (DConfEngineSource *source);
   GvdbTable *   (* reopen)           (DConfEngineSource *source);
+
+  /* Optional: reopens the shards that changed, if the database has any.
+   * Returns TRUE if any were reopened.
+   */
+  gboolean      (* refresh_shards)   (DConfEngineSource *source);
+
+  /* Optional: start reading the journal, returning TRUE if the service
+   * keeps one, and stop again (if @check, only if the service is gone).
+   */
+  gboolean      (* start_journal)    (DConfEngineSource *source);
+  void          (* stop_journal)     (DConfEngineSource *source,
+                                      gboolean           check);
 };
 
+/* A dir of a sharded database, which is in a file of its own */
+typedef struct
+{
+  gchar         *dir;
+  gchar         *name;
+  GvdbTable     *table;
+  const guint64 *shm;
+  guint64        generation;
+} DConfEngineShard;
+
 struct _DConfEngineSource
 {
   const DConfEngineSourceVTable *vtable;
 
   GvdbTable *values;
   GvdbTable *locks;
+  GPtrArray *shards;            /* DConfEngineShard, or NULL if the database is in one piece */
   GBusType   bus_type;
   gboolean   writable;
   gboolean   did_warn;
+  gboolean   journal;   /* change notifies come from the journal, not D-Bus */
+  gboolean   journal_tried;
+  gint64     retry_time;      /* when to look again for a missing database */
+  gint64     retry_interval;
+  gboolean   needs_init;      /* the service should be asked to create the database */
   gchar     *bus_name;
   gchar     *object_path;
   gchar     *name;
@@ -57,6 +85,21 @@ void                    dconf_engine_source_free                        (DConfEn
 G_GNUC_INTERNAL
 gboolean                dconf_engine_source_refresh                     (DConfEngineSource  *source);
 
+G_GNUC_INTERNAL
+gboolean                dconf_engine_source_retry_due                   (DConfEngineSource  *source);
+
+G_GNUC_INTERNAL
+GvdbTable *             dconf_engine_source_get_table                   (DConfEngineSource  *source,
+                                                                         const gchar        *key);
+
+G_GNUC_INTERNAL
+void                    dconf_engine_source_list_shards                 (DConfEngineSource  *source,
+                                                                         const gchar        *dir,
+                                                                         GHashTable         *results);
+
+G_GNUC_INTERNAL
+void                    dconf_engine_source_retry                       (DConfEngineSource  *source);
+
 G_GNUC_INTERNAL
 DConfEngineSource *     dconf_engine_source_new                         (const gchar        *name);
 
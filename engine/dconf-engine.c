@@ -22,6 +22,7 @@
 #define _XOPEN_SOURCE 600
 #include "dconf-engine.h"
 
+#include "../common/dconf-access-log.h"
 #include "../common/dconf-enums.h"
 #include "../common/dconf-paths.h"
 #include "../gvdb/gvdb-reader.h"
@@ -148,12 +149,13 @@ struct _DConfEngine
   DConfEngineSource **sources;       /* Array never changes, but each source changes internally. */
   gint                n_sources;
 
-  GMutex              queue_lock;    /* This lock is for pending, in_flight, queue_cond */
+  GMutex              queue_lock;    /* This lock is for pending, in_flight, queue_cond, own_tags, held */
   GCond               queue_cond;    /* Signalled when there are neither in-flight nor pending changes. */
   DConfChangeset     *pending;       /* Yet to be sent on the wire. */
   DConfChangeset     *in_flight;     /* Already sent but awaiting response. */
 
-  gchar              *last_handled;  /* reply tag from last item in in_flight */
+  GQueue              own_tags;      /* reply tags of our changes that have not been notified yet */
+  GQueue              held;          /* change notifies that came while a change was in flight */
 
   /**
    * establishing and active, are hash tables storing the number
@@ -165,6 +167,11 @@ struct _DConfEngine
   GHashTable         *establishing;
   /* active on the client side, and with a D-Bus match rule established */
   GHashTable         *active;
+
+  /* The bus that we watch the service's name on, if any source uses the
+   * journal.  Protected by sources_lock.
+   */
+  GBusType            name_owner_bus;
 };
 
 /* When taking the sources lock we check if any of the databases have
@@ -188,6 +195,9 @@ struct _DConfEngine
  *
  * If it does, we can revisit this...
  */
+static void dconf_engine_init_source (DConfEngine *engine,
+                                      gint         index);
+
 static void
 dconf_engine_acquire_sources (DConfEngine *engine)
 {
@@ -196,8 +206,13 @@ dconf_engine_acquire_sources (DConfEngine *engine)
   g_mutex_lock (&engine->sources_lock);
 
   for (i = 0; i < engine->n_sources; i++)
-    if (dconf_engine_source_refresh (engine->sources[i]))
-      engine->state++;
+    {
+      if (dconf_engine_source_refresh (engine->sources[i]))
+        engine->state++;
+
+      if (engine->sources[i]->needs_init)
+        dconf_engine_init_source (engine, i);
+    }
 }
 
 static void
@@ -309,6 +324,41 @@ dconf_engine_unlock_subscription_counts (DConfEngine *engine)
   g_mutex_unlock (&engine->subscription_count_lock);
 }
 
+/* We only need to remember the tags until the notifies for them come in,
+ * which is almost immediately, but some changes (setting a key to the
+ * value that it already has) never get a notify at all.
+ */
+#define DCONF_ENGINE_MAX_OWN_TAGS 16
+
+typedef struct
+{
+  gchar  *prefix;
+  gchar **changes;
+  gchar  *tag;
+} DConfEngineHeldNotify;
+
+static void
+dconf_engine_held_notify_free (gpointer data)
+{
+  DConfEngineHeldNotify *notify = data;
+
+  g_free (notify->prefix);
+  g_strfreev (notify->changes);
+  g_free (notify->tag);
+  g_slice_free (DConfEngineHeldNotify, notify);
+}
+
+/* returns floating */
+static GVariant *
+dconf_engine_make_name_owner_rule (void)
+{
+  return g_variant_new ("(s)", "type='signal',"
+                               "sender='org.freedesktop.DBus',"
+                               "interface='org.freedesktop.DBus',"
+                               "member='NameOwnerChanged',"
+                               "arg0='ca.desrt.dconf'");
+}
+
 DConfEngine *
 dconf_engine_new (const gchar    *profile,
                   gpointer        user_data,
@@ -374,11 +424,19 @@ dconf_engine_unref (DConfEngine *engine)
       dconf_engine_global_list = g_slist_remove (dconf_engine_global_list, engine);
       g_mutex_unlock (&dconf_engine_global_lock);
 
+      if (engine->name_owner_bus != G_BUS_TYPE_NONE)
+        dconf_engine_dbus_call_async_func (engine->name_owner_bus, "org.freedesktop.DBus",
+                                           "/org/freedesktop/DBus", "org.freedesktop.DBus", "RemoveMatch",
+                                           dconf_engine_make_name_owner_rule (), NULL, NULL);
+
       g_mutex_clear (&engine->sources_lock);
       g_mutex_clear (&engine->queue_lock);
       g_cond_clear (&engine->queue_cond);
 
-      g_free (engine->last_handled);
+      g_queue_foreach (&engine->own_tags, (GFunc) g_free, NULL);
+      g_queue_clear (&engine->own_tags);
+      g_queue_foreach (&engine->held, (GFunc) dconf_engine_held_notify_free, NULL);
+      g_queue_clear (&engine->held);
 
       g_clear_pointer (&engine->pending, dconf_changeset_unref);
       g_clear_pointer (&engine->in_flight, dconf_changeset_unref);
@@ -548,16 +606,46 @@ dconf_engine_find_key_in_queue (const GQueue  *queue,
   return FALSE;
 }
 
-GVariant *
-dconf_engine_read (DConfEngine    *engine,
-                   DConfReadFlags  flags,
-                   const GQueue   *read_through,
-                   const gchar    *key)
+/* Looks for a value for 'key' in 'table', or takes 'value' (which was
+ * found in one of the queues) if 'table' is NULL.  Returns TRUE if the
+ * search should stop there.
+ */
+typedef gboolean (* DConfEngineLookupFunc) (GvdbTable   *table,
+                                            GVariant    *value,
+                                            const gchar *key,
+                                            gpointer     user_data);
+
+/* The shard that @key belongs in may be missing even if the source's
+ * main table is there.
+ */
+static gboolean
+dconf_engine_lookup_in_source (DConfEngineSource     *source,
+                               const gchar           *key,
+                               DConfEngineLookupFunc  lookup,
+                               gpointer               user_data)
+{
+  GvdbTable *table;
+
+  table = dconf_engine_source_get_table (source, key);
+
+  return table != NULL && lookup (table, NULL, key, user_data);
+}
+
+static void
+dconf_engine_lookup (DConfEngine           *engine,
+                     DConfReadFlags         flags,
+                     const GQueue          *read_through,
+                     const gchar           *key,
+                     DConfEngineLookupFunc  lookup,
+                     gpointer               user_data)
 {
   GVariant *value = NULL;
+  gboolean found = FALSE;
   gint lock_level = 0;
   gint i;
 
+  dconf_access_log_record (key);
+
   dconf_engine_acquire_sources (engine);
 
   /* There are a number of situations that this function has to deal
@@ -667,6 +755,9 @@ dconf_engine_read (DConfEngine    *engine,
    *     We do this until we have value != NULL.  Even if found_key was
    *     TRUE, the reset that was requested will not have affected the
    *     lower-level databases.
+   *
+   * 'lookup' does the actual work of getting the value out of a source
+   * (or a queue) and tells us when we have found it.
    */
 
   /* Step 1.  Check for locks.
@@ -719,9 +810,15 @@ dconf_engine_read (DConfEngine    *engine,
           dconf_engine_unlock_queue (engine);
         }
 
+      if (value != NULL)
+        {
+          found = lookup (NULL, value, key, user_data);
+          g_variant_unref (value);
+        }
+
       /* Step 4.  Check the first source. */
       if (!found_key && engine->sources[0]->values)
-        value = gvdb_table_get_value (engine->sources[0]->values, key);
+        found = dconf_engine_lookup_in_source (engine->sources[0], key, lookup, user_data);
 
       /* We already checked source #0 (or ignored it, as appropriate).
        *
@@ -730,22 +827,98 @@ dconf_engine_read (DConfEngine    *engine,
       lock_level = 1;
     }
 
-  /* Step 5.  Check the remaining sources, until value != NULL. */
+  /* Step 5.  Check the remaining sources, until we find it. */
   if (~flags & DCONF_READ_USER_VALUE)
-    for (i = lock_level; value == NULL && i < engine->n_sources; i++)
+    for (i = lock_level; !found && i < engine->n_sources; i++)
       {
         if (engine->sources[i]->values == NULL)
           continue;
 
-        if ((value = gvdb_table_get_value (engine->sources[i]->values, key)))
-          break;
+        found = dconf_engine_lookup_in_source (engine->sources[i], key, lookup, user_data);
       }
 
   dconf_engine_release_sources (engine);
+}
+
+static gboolean
+dconf_engine_lookup_value (GvdbTable   *table,
+                           GVariant    *value,
+                           const gchar *key,
+                           gpointer     user_data)
+{
+  GVariant **result = user_data;
+
+  if (table)
+    *result = gvdb_table_get_value (table, key);
+  else
+    *result = g_variant_ref (value);
+
+  return *result != NULL;
+}
+
+GVariant *
+dconf_engine_read (DConfEngine    *engine,
+                   DConfReadFlags  flags,
+                   const GQueue   *read_through,
+                   const gchar    *key)
+{
+  GVariant *value = NULL;
+
+  dconf_engine_lookup (engine, flags, read_through, key, dconf_engine_lookup_value, &value);
 
   return value;
 }
 
+typedef struct
+{
+  const gchar *type_string;
+  gpointer     result;
+  gboolean     matched;
+} DConfEngineScalarRead;
+
+static gboolean
+dconf_engine_lookup_scalar (GvdbTable   *table,
+                            GVariant    *value,
+                            const gchar *key,
+                            gpointer     user_data)
+{
+  DConfEngineScalarRead *read = user_data;
+
+  if (table)
+    {
+      value = gvdb_table_get_value (table, key);
+      if (value == NULL)
+        return FALSE;
+    }
+  else
+    g_variant_ref (value);
+
+  if (value && g_variant_is_of_type (value, G_VARIANT_TYPE (read->type_string)))
+    {
+      g_variant_get (value, read->type_string, read->result);
+      read->matched = TRUE;
+    }
+
+  if (value)
+    g_variant_unref (value);
+
+  return TRUE;
+}
+
+gboolean
+dconf_engine_read_scalar (DConfEngine    *engine,
+                          DConfReadFlags  flags,
+                          const gchar    *key,
+                          const gchar    *type_string,
+                          gpointer        result)
+{
+  DConfEngineScalarRead read = { type_string, result, FALSE };
+
+  dconf_engine_lookup (engine, flags, NULL, key, dconf_engine_lookup_scalar, &read);
+
+  return read.matched;
+}
+
 gchar **
 dconf_engine_list (DConfEngine *engine,
                    const gchar *dir,
@@ -797,6 +970,8 @@ dconf_engine_list (DConfEngine *engine,
           /* Free only the list. */
           g_free (partial_list);
         }
+
+      dconf_engine_source_list_shards (engine->sources[i], dir, results);
     }
 
   dconf_engine_release_sources (engine);
@@ -881,6 +1056,153 @@ dconf_engine_call_handle_free (DConfEngineCallHandle *handle)
   g_free (handle);
 }
 
+typedef struct
+{
+  DConfEngineCallHandle handle;
+
+  gint index;
+} OutstandingInit;
+
+static void
+dconf_engine_source_initialised (DConfEngine  *engine,
+                                 gpointer      handle,
+                                 GVariant     *reply,
+                                 const GError *error)
+{
+  OutstandingInit *oi = handle;
+  DConfEngineSource *source;
+  gboolean reopened;
+
+  /* If there was an error then this will fail again and warn */
+  g_mutex_lock (&engine->sources_lock);
+  source = engine->sources[oi->index];
+  dconf_engine_source_retry (source);
+  reopened = dconf_engine_source_refresh (source);
+  if (reopened)
+    engine->state++;
+  g_mutex_unlock (&engine->sources_lock);
+
+  /* Reads up to now didn't see anything from this database */
+  if (reopened)
+    {
+      const gchar * const changes[] = { "", NULL };
+
+      dconf_engine_change_notify (engine, "/", changes, NULL, FALSE, NULL, engine->user_data);
+    }
+
+  dconf_engine_call_handle_free (handle);
+}
+
+/* Asks the service to create the database for a source, without
+ * blocking the read (or whatever) that found it to be missing.  Reads
+ * see the values from the other sources in the meantime.
+ *
+ * Called with sources_lock held.
+ */
+static void
+dconf_engine_init_source (DConfEngine *engine,
+                          gint         index)
+{
+  DConfEngineSource *source = engine->sources[index];
+  OutstandingInit *oi;
+
+  source->needs_init = FALSE;
+
+  oi = dconf_engine_call_handle_new (engine, dconf_engine_source_initialised,
+                                     G_VARIANT_TYPE_UNIT, sizeof (OutstandingInit));
+  oi->index = index;
+
+  if (!dconf_engine_dbus_call_async_func (source->bus_type, source->bus_name, source->object_path,
+                                          "ca.desrt.dconf.Writer", "Init", g_variant_new ("()"),
+                                          &oi->handle, NULL))
+    {
+      /* The next refresh will warn about it */
+      dconf_engine_source_retry (source);
+      dconf_engine_call_handle_free (&oi->handle);
+    }
+  else
+    /* Don't look again until the service has replied */
+    source->retry_time = G_MAXINT64;
+}
+
+/* Sources that get their change notifies from the journal don't need
+ * match rules on the bus.
+ */
+static gboolean
+dconf_engine_source_needs_match_rule (DConfEngineSource *source)
+{
+  return source->bus_type && !g_atomic_int_get (&source->journal);
+}
+
+/* Stops the journals of the sources that have one.  If @check is set,
+ * only the ones whose service is gone.
+ */
+static void
+dconf_engine_stop_journals (DConfEngine *engine,
+                            GBusType     bus_type,
+                            gboolean     check)
+{
+  gint i;
+
+  for (i = 0; i < engine->n_sources; i++)
+    {
+      DConfEngineSource *source = engine->sources[i];
+
+      if (source->bus_type == bus_type && g_atomic_int_get (&source->journal))
+        source->vtable->stop_journal (source, check);
+    }
+}
+
+static void
+dconf_engine_name_owner_watched (DConfEngine  *engine,
+                                 gpointer      handle,
+                                 GVariant     *reply,
+                                 const GError *error)
+{
+  /* The service may have died before the match rule went in */
+  dconf_engine_stop_journals (engine, engine->name_owner_bus, TRUE);
+  dconf_engine_call_handle_free (handle);
+}
+
+/* Starts reading the journals of the sources that have one, the first
+ * time that anything is watched.  Returns the bus to add the
+ * NameOwnerChanged match rule on, or G_BUS_TYPE_NONE if that's not
+ * needed (or has been done already).
+ */
+static GBusType
+dconf_engine_start_journals (DConfEngine *engine)
+{
+  GBusType bus_type = G_BUS_TYPE_NONE;
+  gint i;
+
+  g_mutex_lock (&engine->sources_lock);
+
+  for (i = 0; i < engine->n_sources; i++)
+    {
+      DConfEngineSource *source = engine->sources[i];
+
+      if (source->vtable->start_journal == NULL || source->journal_tried)
+        continue;
+
+      source->journal_tried = TRUE;
+
+      if (source->vtable->start_journal (source))
+        {
+          g_atomic_int_set (&source->journal, TRUE);
+          bus_type = source->bus_type;
+        }
+    }
+
+  if (bus_type != G_BUS_TYPE_NONE && engine->name_owner_bus == G_BUS_TYPE_NONE)
+    engine->name_owner_bus = bus_type;
+  else
+    bus_type = G_BUS_TYPE_NONE;
+
+  g_mutex_unlock (&engine->sources_lock);
+
+  return bus_type;
+}
+
 /* returns floating */
 static GVariant *
 dconf_engine_make_match_rule (DConfEngineSource *source,
@@ -976,11 +1298,38 @@ dconf_engine_watch_fast (DConfEngine *engine,
     return;
 
   OutstandingWatch *ow;
+  GBusType name_owner_bus;
+  gint n_match_rules = 0;
   gint i;
 
   if (engine->n_sources == 0)
     return;
 
+  name_owner_bus = dconf_engine_start_journals (engine);
+  if (name_owner_bus != G_BUS_TYPE_NONE)
+    {
+      DConfEngineCallHandle *handle;
+
+      handle = dconf_engine_call_handle_new (engine, dconf_engine_name_owner_watched,
+                                             G_VARIANT_TYPE_UNIT, sizeof (DConfEngineCallHandle));
+      dconf_engine_dbus_call_async_func (name_owner_bus, "org.freedesktop.DBus",
+                                         "/org/freedesktop/DBus", "org.freedesktop.DBus", "AddMatch",
+                                         dconf_engine_make_name_owner_rule (), handle, NULL);
+    }
+
+  for (i = 0; i < engine->n_sources; i++)
+    if (dconf_engine_source_needs_match_rule (engine->sources[i]))
+      n_match_rules++;
+
+  /* With only the journal, there is nothing to wait for */
+  if (n_match_rules == 0)
+    {
+      dconf_engine_lock_subscription_counts (engine);
+      dconf_engine_move_subscriptions (engine->establishing, engine->active, path);
+      dconf_engine_unlock_subscription_counts (engine);
+      return;
+    }
+
   /* It's possible (although rare) that the dconf database could change
    * while our match rule is on the wire.
    *
@@ -998,12 +1347,10 @@ dconf_engine_watch_fast (DConfEngine *engine,
   /* We start getting async calls returned as soon as we start dispatching them,
    * so we must not touch the 'ow' struct after we send the first one.
    */
-  for (i = 0; i < engine->n_sources; i++)
-    if (engine->sources[i]->bus_type)
-      ow->pending++;
+  ow->pending = n_match_rules;
 
   for (i = 0; i < engine->n_sources; i++)
-    if (engine->sources[i]->bus_type)
+    if (dconf_engine_source_needs_match_rule (engine->sources[i]))
       dconf_engine_dbus_call_async_func (engine->sources[i]->bus_type, "org.freedesktop.DBus",
                                          "/org/freedesktop/DBus", "org.freedesktop.DBus", "AddMatch",
                                          dconf_engine_make_match_rule (engine->sources[i], path),
@@ -1034,7 +1381,7 @@ dconf_engine_unwatch_fast (DConfEngine *engine,
     return;
 
   for (i = 0; i < engine->n_sources; i++)
-    if (engine->sources[i]->bus_type)
+    if (dconf_engine_source_needs_match_rule (engine->sources[i]))
       dconf_engine_dbus_call_async_func (engine->sources[i]->bus_type, "org.freedesktop.DBus",
                                          "/org/freedesktop/DBus", "org.freedesktop.DBus", "RemoveMatch",
                                          dconf_engine_make_match_rule (engine->sources[i], path), NULL, NULL);
@@ -1058,7 +1405,7 @@ dconf_engine_handle_match_rule_sync (DConfEngine *engine,
     {
       GVariant *result;
 
-      if (!engine->sources[i]->bus_type)
+      if (!dconf_engine_source_needs_match_rule (engine->sources[i]))
         continue;
 
       result = dconf_engine_dbus_call_sync_func (engine->sources[i]->bus_type, "org.freedesktop.DBus",
@@ -1080,7 +1427,26 @@ dconf_engine_watch_sync (DConfEngine *engine,
   dconf_engine_unlock_subscription_counts (engine);
   g_debug ("watch_sync: \"%s\" (active: %d)", path, num_active - 1);
   if (num_active == 1)
-    dconf_engine_handle_match_rule_sync (engine, "AddMatch", path);
+    {
+      GBusType name_owner_bus;
+
+      name_owner_bus = dconf_engine_start_journals (engine);
+      if (name_owner_bus != G_BUS_TYPE_NONE)
+        {
+          GVariant *result;
+
+          result = dconf_engine_dbus_call_sync_func (name_owner_bus, "org.freedesktop.DBus",
+                                                     "/org/freedesktop/DBus", "org.freedesktop.DBus", "AddMatch",
+                                                     dconf_engine_make_name_owner_rule (),
+                                                     G_VARIANT_TYPE_UNIT, NULL);
+          if (result)
+            g_variant_unref (result);
+
+          dconf_engine_stop_journals (engine, name_owner_bus, TRUE);
+        }
+
+      dconf_engine_handle_match_rule_sync (engine, "AddMatch", path);
+    }
 }
 
 void
@@ -1141,6 +1507,69 @@ dconf_engine_emit_changes (DConfEngine    *engine,
     dconf_engine_change_notify (engine, prefix, changes, NULL, FALSE, origin_tag, engine->user_data);
 }
 
+/* Called with the queue lock held.  Returns %TRUE if @tag is the tag of
+ * one of our own changes: we already told the client about those when
+ * we queued them.
+ */
+static gboolean
+dconf_engine_is_own_tag (DConfEngine *engine,
+                         const gchar *tag)
+{
+  GList *node;
+
+  if (tag == NULL)
+    return FALSE;
+
+  for (node = engine->own_tags.head; node; node = node->next)
+    if (g_str_equal (node->data, tag))
+      {
+        /* The service sends the notifies in order, so the changes
+         * before this one are never going to get one.
+         */
+        while (engine->own_tags.head != node)
+          g_free (g_queue_pop_head (&engine->own_tags));
+
+        g_free (g_queue_pop_head (&engine->own_tags));
+
+        return TRUE;
+      }
+
+  return FALSE;
+}
+
+/* Called with the queue lock held.  Returns %TRUE if the notify should
+ * be delivered now.  Otherwise it is either one of ours, or it might be
+ * one of ours and is held until the reply for the change in flight
+ * tells us its tag.  Only notifies from the writer that we send our
+ * changes to (the first source) can be ours.
+ */
+static gboolean
+dconf_engine_filter_notify (DConfEngine         *engine,
+                            DConfEngineSource   *source,
+                            const gchar         *prefix,
+                            const gchar * const *changes,
+                            const gchar         *tag)
+{
+  DConfEngineHeldNotify *notify;
+
+  if (source != engine->sources[0])
+    return TRUE;
+
+  if (dconf_engine_is_own_tag (engine, tag))
+    return FALSE;
+
+  if (engine->in_flight == NULL || tag == NULL)
+    return TRUE;
+
+  notify = g_slice_new (DConfEngineHeldNotify);
+  notify->prefix = g_strdup (prefix);
+  notify->changes = g_strdupv ((gchar **) changes);
+  notify->tag = g_strdup (tag);
+  g_queue_push_tail (&engine->held, notify);
+
+  return FALSE;
+}
+
 static void
 dconf_engine_change_completed (DConfEngine  *engine,
                                gpointer      handle,
@@ -1149,16 +1578,14 @@ dconf_engine_change_completed (DConfEngine  *engine,
 {
   OutstandingChange *oc = handle;
   DConfChangeset *expected;
+  GQueue release = G_QUEUE_INIT;
+  GQueue held;
 
   dconf_engine_lock_queue (engine);
 
   expected = g_steal_pointer (&engine->in_flight);
   g_assert (expected && oc->change == expected);
 
-  /* Another request could be sent now. Check for pending changes. */
-  dconf_engine_manage_queue (engine);
-  dconf_engine_unlock_queue (engine);
-
   /* Deal with the reply we got. */
   if (reply)
     {
@@ -1167,16 +1594,45 @@ dconf_engine_change_completed (DConfEngine  *engine,
        * We already sent a change notification for this item when we
        * added it to the pending queue and we don't want to send another
        * one again.  At the same time, it's very likely that we're just
-       * about to receive a change signal from the service.
+       * about to receive a change notify from the service (or that we
+       * already did, and are holding it).
        *
        * The tag sent as part of the reply to the Change call will be
-       * the same tag as on the change notification signal.  Record that
-       * tag so that we can ignore the signal when it comes.
-       *
-       * last_handled is only ever touched from the worker thread
+       * the same tag as on the change notify.  Record that tag so that
+       * we can ignore the notify when it comes.
        */
-      g_free (engine->last_handled);
-      g_variant_get (reply, "(s)", &engine->last_handled);
+      g_queue_push_tail (&engine->own_tags, NULL);
+      g_variant_get (reply, "(s)", &engine->own_tags.tail->data);
+
+      if (engine->own_tags.length > DCONF_ENGINE_MAX_OWN_TAGS)
+        g_free (g_queue_pop_head (&engine->own_tags));
+    }
+
+  /* Now we can tell which of the notifies that we held were ours */
+  held = engine->held;
+  g_queue_init (&engine->held);
+
+  while (!g_queue_is_empty (&held))
+    {
+      DConfEngineHeldNotify *notify = g_queue_pop_head (&held);
+
+      if (dconf_engine_is_own_tag (engine, notify->tag))
+        dconf_engine_held_notify_free (notify);
+      else
+        g_queue_push_tail (&release, notify);
+    }
+
+  /* Another request could be sent now. Check for pending changes. */
+  dconf_engine_manage_queue (engine);
+  dconf_engine_unlock_queue (engine);
+
+  while (!g_queue_is_empty (&release))
+    {
+      DConfEngineHeldNotify *notify = g_queue_pop_head (&release);
+
+      dconf_engine_change_notify (engine, notify->prefix, (const gchar * const *) notify->changes,
+                                  notify->tag, FALSE, NULL, engine->user_data);
+      dconf_engine_held_notify_free (notify);
     }
 
   if (error)
@@ -1302,6 +1758,96 @@ dconf_engine_change_fast (DConfEngine     *engine,
   return TRUE;
 }
 
+/* Changesets with more than this many paths are sent to the service in
+ * pieces, using a transaction, instead of in a single Change call.
+ */
+#define DCONF_ENGINE_CHANGE_CHUNK_SIZE  1024
+
+static GVariant *
+dconf_engine_call_writer_sync (DConfEngine         *engine,
+                               const gchar         *method_name,
+                               GVariant            *parameters,
+                               const GVariantType  *expected_type,
+                               GError             **error)
+{
+  return dconf_engine_dbus_call_sync_func (engine->sources[0]->bus_type,
+                                           engine->sources[0]->bus_name,
+                                           engine->sources[0]->object_path,
+                                           "ca.desrt.dconf.Writer", method_name,
+                                           parameters, expected_type, error);
+}
+
+/* Sends the paths in order so that resets of dirs are applied before any
+ * writes below them, just as dconf_changeset_change() does.
+ */
+static GVariant *
+dconf_engine_change_sync_chunked (DConfEngine     *engine,
+                                  DConfChangeset  *changeset,
+                                  GError         **error)
+{
+  const gchar * const *paths;
+  GVariant * const *values;
+  const gchar *prefix;
+  guint transaction;
+  GVariant *reply;
+  guint n_items;
+  guint i;
+
+  n_items = dconf_changeset_describe (changeset, &prefix, &paths, &values);
+
+  reply = dconf_engine_call_writer_sync (engine, "BeginTransaction", g_variant_new ("()"),
+                                         G_VARIANT_TYPE ("(u)"), error);
+  if (reply == NULL)
+    return NULL;
+
+  g_variant_get (reply, "(u)", &transaction);
+  g_variant_unref (reply);
+
+  for (i = 0; i < n_items; i += DCONF_ENGINE_CHANGE_CHUNK_SIZE)
+    {
+      DConfChangeset *chunk;
+      GVariant *serialised;
+      guint j;
+
+      chunk = dconf_changeset_new ();
+      for (j = i; j < n_items && j < i + DCONF_ENGINE_CHANGE_CHUNK_SIZE; j++)
+        {
+          gchar *path = g_strconcat (prefix, paths[j], NULL);
+          dconf_changeset_set (chunk, path, values[j]);
+          g_free (path);
+        }
+
+      serialised = g_variant_ref_sink (dconf_changeset_serialise (chunk));
+      dconf_changeset_unref (chunk);
+
+      reply = dconf_engine_call_writer_sync (engine, "Append",
+                                             g_variant_new ("(u@ay)", transaction,
+                                                            g_variant_new_from_data (G_VARIANT_TYPE_BYTESTRING,
+                                                                                     g_variant_get_data (serialised),
+                                                                                     g_variant_get_size (serialised), TRUE,
+                                                                                     (GDestroyNotify) g_variant_unref,
+                                                                                     g_variant_ref (serialised))),
+                                             G_VARIANT_TYPE_UNIT, error);
+      g_variant_unref (serialised);
+
+      if (reply == NULL)
+        {
+          /* Don't leave the partial change hanging around in the service */
+          reply = dconf_engine_call_writer_sync (engine, "Abort", g_variant_new ("(u)", transaction),
+                                                 G_VARIANT_TYPE_UNIT, NULL);
+          if (reply)
+            g_variant_unref (reply);
+
+          return NULL;
+        }
+
+      g_variant_unref (reply);
+    }
+
+  return dconf_engine_call_writer_sync (engine, "Commit", g_variant_new ("(u)", transaction),
+                                        G_VARIANT_TYPE ("(s)"), error);
+}
+
 gboolean
 dconf_engine_change_sync (DConfEngine     *engine,
                           DConfChangeset  *changeset,
@@ -1325,12 +1871,12 @@ dconf_engine_change_sync (DConfEngine     *engine,
   dconf_changeset_seal (changeset);
 
   /* we know that we have at least one source because we checked writability */
-  reply = dconf_engine_dbus_call_sync_func (engine->sources[0]->bus_type,
-                                            engine->sources[0]->bus_name,
-                                            engine->sources[0]->object_path,
-                                            "ca.desrt.dconf.Writer", "Change",
-                                            dconf_engine_prepare_change (engine, changeset),
-                                            G_VARIANT_TYPE ("(s)"), error);
+  if (dconf_changeset_describe (changeset, NULL, NULL, NULL) > DCONF_ENGINE_CHANGE_CHUNK_SIZE)
+    reply = dconf_engine_change_sync_chunked (engine, changeset, error);
+  else
+    reply = dconf_engine_call_writer_sync (engine, "Change",
+                                           dconf_engine_prepare_change (engine, changeset),
+                                           G_VARIANT_TYPE ("(s)"), error);
 
   if (reply == NULL)
     return FALSE;
@@ -1342,6 +1888,24 @@ dconf_engine_change_sync (DConfEngine     *engine,
   return TRUE;
 }
 
+static DConfEngineSource *
+dconf_engine_find_signal_source (DConfEngine *engine,
+                                 GBusType     bus_type,
+                                 const gchar *path)
+{
+  gint i;
+
+  for (i = 0; i < engine->n_sources; i++)
+    {
+      DConfEngineSource *source = engine->sources[i];
+
+      if (source->bus_type == bus_type && g_str_equal (source->object_path, path))
+        return source;
+    }
+
+  return NULL;
+}
+
 static gboolean
 dconf_engine_is_interested_in_signal (DConfEngine *engine,
                                       GBusType     bus_type,
@@ -1354,6 +1918,10 @@ dconf_engine_is_interested_in_signal (DConfEngine *engine,
     {
       DConfEngineSource *source = engine->sources[i];
 
+      /* Don't deliver the same change twice */
+      if (g_atomic_int_get (&source->journal))
+        continue;
+
       if (source->bus_type == bus_type && g_str_equal (source->object_path, path))
         return TRUE;
     }
@@ -1361,6 +1929,66 @@ dconf_engine_is_interested_in_signal (DConfEngine *engine,
   return FALSE;
 }
 
+/* A signal from the service (or from "dconf update") may mean that a
+ * database that we failed to open exists now, so look for it again
+ * straight away instead of waiting out the backoff.
+ */
+static void
+dconf_engine_retry_sources (DConfEngine *engine,
+                            GBusType     bus_type,
+                            const gchar *path)
+{
+  gint i;
+
+  g_mutex_lock (&engine->sources_lock);
+
+  for (i = 0; i < engine->n_sources; i++)
+    {
+      DConfEngineSource *source = engine->sources[i];
+
+      if (source->bus_type == bus_type && g_str_equal (source->object_path, path))
+        dconf_engine_source_retry (source);
+    }
+
+  g_mutex_unlock (&engine->sources_lock);
+}
+
+static gboolean
+dconf_engine_is_valid_change (const gchar         *prefix,
+                              const gchar * const *changes)
+{
+  if (changes[0] == NULL)
+    /* No changes?  Do nothing. */
+    return FALSE;
+
+  if (dconf_is_key (prefix, NULL))
+    {
+      /* If the prefix is a key then the changes must be ['']. */
+      if (changes[0][0] || changes[1])
+        return FALSE;
+    }
+  else if (dconf_is_dir (prefix, NULL))
+    {
+      /* If the prefix is a dir then we can have changes within that
+       * dir, but they must be rel paths.
+       *
+       *   ie:
+       *
+       *  ('/a/', ['b', 'c/']) == ['/a/b', '/a/c/']
+       */
+      gint i;
+
+      for (i = 0; changes[i]; i++)
+        if (!dconf_is_rel_path (changes[i], NULL))
+          return FALSE;
+    }
+  else
+    /* Not a key or a dir? */
+    return FALSE;
+
+  return TRUE;
+}
+
 void
 dconf_engine_handle_dbus_signal (GBusType     type,
                                  const gchar *sender,
@@ -1381,33 +2009,7 @@ dconf_engine_handle_dbus_signal (GBusType     type,
       g_variant_get (body, "(&s^a&s&s)", &prefix, &changes, &tag);
 
       /* Reject junk */
-      if (changes[0] == NULL)
-        /* No changes?  Do nothing. */
-        goto junk;
-
-      if (dconf_is_key (prefix, NULL))
-        {
-          /* If the prefix is a key then the changes must be ['']. */
-          if (changes[0][0] || changes[1])
-            goto junk;
-        }
-      else if (dconf_is_dir (prefix, NULL))
-        {
-          /* If the prefix is a dir then we can have changes within that
-           * dir, but they must be rel paths.
-           *
-           *   ie:
-           *
-           *  ('/a/', ['b', 'c/']) == ['/a/b', '/a/c/']
-           */
-          gint i;
-
-          for (i = 0; changes[i]; i++)
-            if (!dconf_is_rel_path (changes[i], NULL))
-              goto junk;
-        }
-      else
-        /* Not a key or a dir? */
+      if (!dconf_engine_is_valid_change (prefix, changes))
         goto junk;
 
       g_mutex_lock (&dconf_engine_global_lock);
@@ -1418,15 +2020,28 @@ dconf_engine_handle_dbus_signal (GBusType     type,
         {
           DConfEngine *engine = engines->data;
 
-          /* It's possible that this incoming change notify is for a
-           * change that we already announced to the client when we
-           * placed it in the queue.
-           *
-           * Check last_handled to determine if we should ignore it.
-           */
-          if (!engine->last_handled || !g_str_equal (engine->last_handled, tag))
-            if (dconf_engine_is_interested_in_signal (engine, type, sender, object_path))
-              dconf_engine_change_notify (engine, prefix, changes, tag, FALSE, NULL, engine->user_data);
+          if (dconf_engine_is_interested_in_signal (engine, type, sender, object_path))
+            {
+              gboolean deliver;
+
+              /* It's possible that this incoming change notify is for a
+               * change that we already announced to the client when we
+               * placed it in the queue.
+               *
+               * The reply to the Change call may come over the peer
+               * socket, so there is nothing to say that it gets here
+               * before the signal does.
+               */
+              dconf_engine_lock_queue (engine);
+              deliver = dconf_engine_filter_notify (engine, dconf_engine_find_signal_source (engine, type, object_path),
+                                                    prefix, changes, tag);
+              dconf_engine_unlock_queue (engine);
+
+              dconf_engine_retry_sources (engine, type, object_path);
+
+              if (deliver)
+                dconf_engine_change_notify (engine, prefix, changes, tag, FALSE, NULL, engine->user_data);
+            }
 
           engines = g_slist_delete_link (engines, engines);
 
@@ -1461,7 +2076,45 @@ junk:
           DConfEngine *engine = engines->data;
 
           if (dconf_engine_is_interested_in_signal (engine, type, sender, object_path))
-            dconf_engine_change_notify (engine, path, empty_str_list, "", TRUE, NULL, engine->user_data);
+            {
+              dconf_engine_retry_sources (engine, type, object_path);
+              dconf_engine_change_notify (engine, path, empty_str_list, "", TRUE, NULL, engine->user_data);
+            }
+
+          engines = g_slist_delete_link (engines, engines);
+
+          dconf_engine_unref (engine);
+        }
+    }
+
+  else if (g_str_equal (member, "NameOwnerChanged"))
+    {
+      const gchar *name;
+      const gchar *old_owner;
+      GSList *engines;
+
+      if (!g_variant_is_of_type (body, G_VARIANT_TYPE ("(sss)")))
+        return;
+
+      g_variant_get (body, "(&s&s&s)", &name, &old_owner, NULL);
+
+      /* Only the bus itself gets to say that the service has gone */
+      if (g_strcmp0 (sender, "org.freedesktop.DBus") != 0 ||
+          !g_str_equal (name, "ca.desrt.dconf") || old_owner[0] == '\0')
+        return;
+
+      g_mutex_lock (&dconf_engine_global_lock);
+      engines = g_slist_copy_deep (dconf_engine_global_list, (GCopyFunc) dconf_engine_ref, NULL);
+      g_mutex_unlock (&dconf_engine_global_lock);
+
+      while (engines)
+        {
+          DConfEngine *engine = engines->data;
+
+          /* A service that exits normally closes the journal itself, so
+           * this is for one that crashed.
+           */
+          dconf_engine_stop_journals (engine, type, FALSE);
 
           engines = g_slist_delete_link (engines, engines);
 
@@ -1470,6 +2123,179 @@ junk:
     }
 }
 
+/* The same test as the arg0path match rule that we would otherwise have
+ * added on the bus.
+ */
+static gboolean
+dconf_engine_is_watching (DConfEngine *engine,
+                          const gchar *prefix)
+{
+  GHashTable *tables[] = { engine->active, engine->establishing };
+  gboolean watching = FALSE;
+  guint i;
+
+  dconf_engine_lock_subscription_counts (engine);
+
+  for (i = 0; i < G_N_ELEMENTS (tables) && !watching; i++)
+    {
+      GHashTableIter iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&iter, tables[i]);
+      while (!watching && g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          const gchar *path = key;
+
+          watching = g_str_equal (path, prefix) ||
+                     (g_str_has_suffix (path, "/") && g_str_has_prefix (prefix, path)) ||
+                     (g_str_has_suffix (prefix, "/") && g_str_has_prefix (path, prefix));
+        }
+    }
+
+  dconf_engine_unlock_subscription_counts (engine);
+
+  return watching;
+}
+
+void
+dconf_engine_handle_journal_record (const gchar         *name,
+                                    const gchar         *prefix,
+                                    const gchar * const *changes,
+                                    const gchar         *tag)
+{
+  GSList *engines;
+
+  if (!dconf_engine_is_valid_change (prefix, changes))
+    return;
+
+  g_mutex_lock (&dconf_engine_global_lock);
+  engines = g_slist_copy_deep (dconf_engine_global_list, (GCopyFunc) dconf_engine_ref, NULL);
+  g_mutex_unlock (&dconf_engine_global_lock);
+
+  while (engines)
+    {
+      DConfEngine *engine = engines->data;
+      gint i;
+
+      for (i = 0; i < engine->n_sources; i++)
+        {
+          DConfEngineSource *source = engine->sources[i];
+          gboolean deliver;
+
+          if (!g_atomic_int_get (&source->journal) || !g_str_equal (source->name, name))
+            continue;
+
+          if (!dconf_engine_is_watching (engine, prefix))
+            break;
+
+          /* The record is written before the reply to the Change call
+           * is sent, so it can easily beat the reply here (just like the
+           * Notify signal).
+           */
+          dconf_engine_lock_queue (engine);
+          deliver = dconf_engine_filter_notify (engine, source, prefix, changes, tag);
+          dconf_engine_unlock_queue (engine);
+
+          if (deliver)
+            dconf_engine_change_notify (engine, prefix, changes, tag, FALSE, NULL, engine->user_data);
+
+          break;
+        }
+
+      engines = g_slist_delete_link (engines, engines);
+
+      dconf_engine_unref (engine);
+    }
+}
+
+static void
+dconf_engine_journal_fallback_established (DConfEngine  *engine,
+                                           gpointer      handle,
+                                           GVariant     *reply,
+                                           const GError *error)
+{
+  const gchar * const everything[] = { "", NULL };
+  OutstandingWatch *ow = handle;
+
+  /* ignore errors */
+
+  if (--ow->pending)
+    return;
+
+  /* We don't know what we missed between the journal going away and
+   * the match rules going in, so anything could have changed.
+   */
+  dconf_engine_change_notify (engine, "/", everything, NULL, FALSE, NULL, engine->user_data);
+  dconf_engine_call_handle_free (handle);
+}
+
+void
+dconf_engine_handle_journal_closed (const gchar *name)
+{
+  GSList *engines;
+
+  g_mutex_lock (&dconf_engine_global_lock);
+  engines = g_slist_copy_deep (dconf_engine_global_list, (GCopyFunc) dconf_engine_ref, NULL);
+  g_mutex_unlock (&dconf_engine_global_lock);
+
+  while (engines)
+    {
+      DConfEngine *engine = engines->data;
+      gint i;
+
+      for (i = 0; i < engine->n_sources; i++)
+        {
+          DConfEngineSource *source = engine->sources[i];
+          GHashTable *tables[] = { engine->active, engine->establishing };
+          OutstandingWatch *ow;
+          GPtrArray *paths;
+          guint j;
+
+          if (!g_atomic_int_get (&source->journal) || !g_str_equal (source->name, name))
+            continue;
+
+          /* From here on, new watches add match rules for this source
+           * themselves, and the Notify signal gets through to us.
+           */
+          g_atomic_int_set (&source->journal, FALSE);
+
+          paths = g_ptr_array_new_with_free_func (g_free);
+
+          dconf_engine_lock_subscription_counts (engine);
+          for (j = 0; j < G_N_ELEMENTS (tables); j++)
+            {
+              GHashTableIter iter;
+              gpointer key;
+
+              g_hash_table_iter_init (&iter, tables[j]);
+              while (g_hash_table_iter_next (&iter, &key, NULL))
+                g_ptr_array_add (paths, g_strdup (key));
+            }
+          dconf_engine_unlock_subscription_counts (engine);
+
+          if (paths->len > 0)
+            {
+              ow = dconf_engine_call_handle_new (engine, dconf_engine_journal_fallback_established,
+                                                 G_VARIANT_TYPE_UNIT, sizeof (OutstandingWatch));
+              ow->pending = paths->len;
+
+              /* As in dconf_engine_watch_fast(), don't touch 'ow' after this */
+              for (j = 0; j < paths->len; j++)
+                dconf_engine_dbus_call_async_func (source->bus_type, "org.freedesktop.DBus",
+                                                   "/org/freedesktop/DBus", "org.freedesktop.DBus", "AddMatch",
+                                                   dconf_engine_make_match_rule (source, paths->pdata[j]),
+                                                   &ow->handle, NULL);
+            }
+
+          g_ptr_array_unref (paths);
+        }
+
+      engines = g_slist_delete_link (engines, engines);
+
+      dconf_engine_unref (engine);
+    }
+}
+
 gboolean
 dconf_engine_has_outstanding (DConfEngine *engine)
 {
@@ -78,6 +78,16 @@ void                    dconf_engine_dbus_handle_connection_closed      (GDBusCo
                                                                          GCallback                bus_closed_callback,
                                                                          gpointer                 bus_closed_callback_user_data);
 
+/* Helper function used by the client library to talk to dconf-service
+ * directly, over its private socket, instead of through the bus.
+ *
+ * Returns a new reference to the connection, or NULL if the call should
+ * go over the bus as normal.
+ */
+G_GNUC_INTERNAL
+GDBusConnection *       dconf_engine_dbus_get_peer_connection           (GBusType                 bus_type,
+                                                                         const gchar             *bus_name);
+
 /* Notifies that a change occured.
  *
  * The engine lock is never held when calling this function so it is
@@ -107,6 +117,17 @@ void                    dconf_engine_handle_dbus_signal                 (GBusTyp
                                                                          const gchar             *signal_name,
                                                                          GVariant                *parameters);
 
+/* Called by the user source for each record read from the journal */
+G_GNUC_INTERNAL
+void                    dconf_engine_handle_journal_record              (const gchar             *name,
+                                                                         const gchar             *prefix,
+                                                                         const gchar * const     *changes,
+                                                                         const gchar             *tag);
+
+/* Called by the user source when the service stops writing the journal */
+G_GNUC_INTERNAL
+void                    dconf_engine_handle_journal_closed              (const gchar             *name);
+
 G_GNUC_INTERNAL
 DConfEngine *           dconf_engine_new                                (const gchar             *profile,
                                                                          gpointer                 user_data,
@@ -134,6 +155,17 @@ GVariant *              dconf_engine_read                               (DConfEn
                                                                          const GQueue            *read_through,
                                                                          const gchar             *key);
 
+/* Reads a value of a basic type ("b", "i", "u", "x", "d" or "s")
+ * straight into 'result', without creating a GVariant where possible.
+ * Returns FALSE if the key is unset or has a different type.
+ */
+G_GNUC_INTERNAL
+gboolean                dconf_engine_read_scalar                        (DConfEngine             *engine,
+                                                                         DConfReadFlags           flags,
+                                                                         const gchar             *key,
+                                                                         const gchar             *type_string,
+                                                                         gpointer                 result);
+
 G_GNUC_INTERNAL
 gchar **                dconf_engine_list                               (DConfEngine             *engine,
                                                                          const gchar             *dir,
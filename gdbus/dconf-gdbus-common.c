@@ -40,3 +40,65 @@ dconf_engine_dbus_handle_connection_closed (GDBusConnection *connection,
 
   g_mutex_unlock (bus_lock);
 }
+
+static GMutex           dconf_gdbus_peer_lock;
+static GDBusConnection *dconf_gdbus_peer;
+
+GDBusConnection *
+dconf_engine_dbus_get_peer_connection (GBusType     bus_type,
+                                       const gchar *bus_name)
+{
+  GDBusConnection *connection = NULL;
+
+  if (bus_type != G_BUS_TYPE_SESSION || !g_str_equal (bus_name, "ca.desrt.dconf"))
+    return NULL;
+
+  g_mutex_lock (&dconf_gdbus_peer_lock);
+
+  /* We don't rely on the "closed" signal here, since it is delivered to
+   * whatever thread happened to create the connection.
+   */
+  if (dconf_gdbus_peer && g_dbus_connection_is_closed (dconf_gdbus_peer))
+    g_clear_object (&dconf_gdbus_peer);
+
+  if (dconf_gdbus_peer == NULL)
+    {
+      gchar *path;
+
+      path = g_build_filename (g_get_user_runtime_dir (), "dconf-service", "socket", NULL);
+
+      /* If the service isn't listening then just use the bus (which
+       * will also start the service, if needed).
+       */
+      if (g_file_test (path, G_FILE_TEST_EXISTS))
+        {
+          GError *error = NULL;
+          gchar *escaped;
+          gchar *address;
+
+          escaped = g_dbus_address_escape_value (path);
+          address = g_strconcat ("unix:path=", escaped, NULL);
+          dconf_gdbus_peer = g_dbus_connection_new_for_address_sync (address,
+                                                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                                                     NULL, NULL, &error);
+
+          if (dconf_gdbus_peer == NULL)
+            {
+              g_debug ("Unable to connect to dconf-service directly: %s", error->message);
+              g_error_free (error);
+            }
+
+          g_free (address);
+          g_free (escaped);
+        }
+
+      g_free (path);
+    }
+
+  if (dconf_gdbus_peer)
+    connection = g_object_ref (dconf_gdbus_peer);
+
+  g_mutex_unlock (&dconf_gdbus_peer_lock);
+
+  return connection;
+}
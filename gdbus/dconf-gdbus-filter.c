@@ -123,13 +123,17 @@ dconf_gdbus_filter_function (GDBusConnection *connection,
         case G_DBUS_MESSAGE_TYPE_SIGNAL:
           {
             const gchar *interface;
+            const gchar *member;
 
             interface = g_dbus_message_get_interface (message);
-            if (interface && g_str_equal (interface, "ca.desrt.dconf.Writer"))
+            member = g_dbus_message_get_member (message);
+            if (interface && (g_str_equal (interface, "ca.desrt.dconf.Writer") ||
+                              (g_str_equal (interface, "org.freedesktop.DBus") &&
+                               g_strcmp0 (member, "NameOwnerChanged") == 0)))
               dconf_engine_handle_dbus_signal (connection_state_get_bus_type (state),
                                                g_dbus_message_get_sender (message),
                                                g_dbus_message_get_path (message),
-                                               g_dbus_message_get_member (message),
+                                               member,
                                                g_dbus_message_get_body (message));
 
             /* Others could theoretically be interested in this... */
@@ -229,6 +229,11 @@ dconf_gdbus_get_bus_in_worker (GBusType   bus_type,
           g_dbus_connection_signal_subscribe (connection, NULL, "ca.desrt.dconf.Writer",
                                               NULL, NULL, NULL, G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE,
                                               dconf_gdbus_signal_handler, GINT_TO_POINTER (bus_type), NULL);
+          /* For the journal: the engine adds the match rule itself */
+          g_dbus_connection_signal_subscribe (connection, "org.freedesktop.DBus", "org.freedesktop.DBus",
+                                              "NameOwnerChanged", "/org/freedesktop/DBus", "ca.desrt.dconf",
+                                              G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE,
+                                              dconf_gdbus_signal_handler, GINT_TO_POINTER (bus_type), NULL);
           dconf_gdbus_get_bus_is_error[bus_type] = FALSE;
           result = connection;
         }
@@ -281,11 +286,19 @@ dconf_gdbus_method_call (gpointer user_data)
   DConfGDBusCall *call = user_data;
   g_autoptr(GDBusConnection) connection = NULL;
   g_autoptr(GError) error = NULL;
+  const gchar *bus_name = NULL;
 
-  connection = dconf_gdbus_get_bus_in_worker (call->bus_type, &error);
+  /* Peer connections have no bus names */
+  connection = dconf_engine_dbus_get_peer_connection (call->bus_type, call->bus_name);
+
+  if (connection == NULL)
+    {
+      connection = dconf_gdbus_get_bus_in_worker (call->bus_type, &error);
+      bus_name = call->bus_name;
+    }
 
   if (connection)
-    g_dbus_connection_call (connection, call->bus_name, call->object_path, call->interface_name,
+    g_dbus_connection_call (connection, bus_name, call->object_path, call->interface_name,
                             call->method_name, call->parameters, call->expected_type, G_DBUS_CALL_FLAGS_NONE,
                             -1, NULL, dconf_gdbus_method_call_done, call->handle);
 
@@ -383,7 +396,12 @@ dconf_engine_dbus_call_sync_func (GBusType             bus_type,
 {
   g_autoptr(GDBusConnection) connection = NULL;
 
-  connection = dconf_gdbus_get_bus_for_sync (bus_type, error);
+  connection = dconf_engine_dbus_get_peer_connection (bus_type, bus_name);
+
+  if (connection != NULL)
+    bus_name = NULL;
+  else
+    connection = dconf_gdbus_get_bus_for_sync (bus_type, error);
 
   if (connection == NULL)
     {
@@ -59,7 +59,9 @@ dconf_blame_record (GDBusMethodInvocation *invocation)
 
   info = blame->blame_info;
 
-  g_string_append_printf (info, "Sender: %s\n", g_dbus_method_invocation_get_sender (invocation));
+  /* Calls from peers have no sender */
+  g_string_append_printf (info, "Sender: %s\n", g_dbus_method_invocation_get_sender (invocation) ?
+                          g_dbus_method_invocation_get_sender (invocation) : "(peer)");
   g_string_append_printf (info, "Object path: %s\n", g_dbus_method_invocation_get_object_path (invocation));
   g_string_append_printf (info, "Method: %s\n", g_dbus_method_invocation_get_method_name (invocation));
 
@@ -72,24 +74,37 @@ dconf_blame_record (GDBusMethodInvocation *invocation)
       g_free (tmp);
     }
 
-  reply = g_dbus_connection_call_sync (g_dbus_method_invocation_get_connection (invocation),
-                                       "org.freedesktop.DBus", "/", "org.freedesktop.DBus",
-                                       "GetConnectionUnixProcessID",
-                                       g_variant_new ("(s)", g_dbus_method_invocation_get_sender (invocation)),
-                                       G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
-
-  if (reply != NULL)
+  if (g_dbus_method_invocation_get_sender (invocation) == NULL)
     {
-      guint pid;
+      GCredentials *credentials;
 
-      g_variant_get (reply, "(u)", &pid);
-      g_string_append_printf (info, "PID: %u\n", pid);
-      g_variant_unref (reply);
+      credentials = g_dbus_connection_get_peer_credentials (g_dbus_method_invocation_get_connection (invocation));
+      if (credentials != NULL && g_credentials_get_unix_pid (credentials, NULL) != -1)
+        g_string_append_printf (info, "PID: %d\n", (gint) g_credentials_get_unix_pid (credentials, NULL));
+      else
+        g_string_append (info, "Unable to acquire PID\n");
     }
   else
     {
-      g_string_append_printf (info, "Unable to acquire PID: %s\n", error->message);
-      g_error_free (error);
+      reply = g_dbus_connection_call_sync (g_dbus_method_invocation_get_connection (invocation),
+                                           "org.freedesktop.DBus", "/", "org.freedesktop.DBus",
+                                           "GetConnectionUnixProcessID",
+                                           g_variant_new ("(s)", g_dbus_method_invocation_get_sender (invocation)),
+                                           G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+
+      if (reply != NULL)
+        {
+          guint pid;
+
+          g_variant_get (reply, "(u)", &pid);
+          g_string_append_printf (info, "PID: %u\n", pid);
+          g_variant_unref (reply);
+        }
+      else
+        {
+          g_string_append_printf (info, "Unable to acquire PID: %s\n", error->message);
+          g_error_free (error);
+        }
     }
 
   {
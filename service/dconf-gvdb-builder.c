@@ -0,0 +1,949 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "dconf-gvdb-builder.h"
+
+#include "../common/dconf-access-log.h"
+#include "../gvdb/gvdb-format.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Everything except the hash table itself is written out as soon as we
+ * see it: all that we keep for each item is a small fixed-size record.
+ * The parent of each key is found from the '/' separators in it, and
+ * because keys with a common prefix arrive one after another the dirs
+ * that are currently open form a stack.
+ *
+ * The hash table and the child lists of the dirs go at the end of the
+ * file, once we know the index of every item, and the header is filled
+ * in last of all.  The key strings and values of the hot keys are held
+ * back until then too, so that they end up next to the hash table, and
+ * they are never interned so that the hot range has all of them.  The
+ * dirs that they are in have been written by the time that we see a
+ * hot key, so their names are written again in the hot range.
+ */
+#define DCONF_GVDB_BUILDER_BUFFER_SIZE (64 * 1024)
+
+/* Lots of keys share the same value ('true', '0', '@as []') or the same
+ * name ('enabled', 'position'), so we remember where each value and key
+ * string was written and point the later items at the same bytes
+ * instead of writing them again.  Only small blobs are remembered: big
+ * ones are rarely the same and would make the table grow with the size
+ * of the file.  For the same reason only the first
+ * DCONF_GVDB_BUILDER_INTERN_MAX_ENTRIES different ones are: the common
+ * values turn up early on, and a file with millions of unique values
+ * would otherwise have a copy of all of them in memory while it is
+ * built.
+ */
+#define DCONF_GVDB_BUILDER_INTERN_MAX_SIZE    256
+#define DCONF_GVDB_BUILDER_INTERN_MAX_ENTRIES 16384
+
+typedef struct
+{
+  guint32 hash_value;
+  guint32 parent;
+  guint32 first_child;
+  guint32 last_child;
+  guint32 sibling;
+  guint32 assigned_index;
+  guint64 key_start;
+  guint32 key_size;
+  gchar type;
+  guint64 value_start;
+  guint64 value_end;
+} DConfGvdbBuilderItem;
+
+/* @value is NULL for the dirs that hot keys are in */
+typedef struct
+{
+  guint32 index;
+  gchar *basename;
+  GBytes *value;
+} DConfGvdbBuilderHotItem;
+
+struct _DConfGvdbBuilder
+{
+  gint fd;
+  GByteArray *content;
+  gboolean byteswap;
+  gint saved_errno;
+  GError *error;
+
+  guchar *buffer;
+  gsize buffer_size;
+  gsize buffer_fill;
+  guint64 offset;
+
+  GArray *items;
+  GArray *dirs;
+  GString *dir_path;
+  gchar *last_key;
+
+  GHashTable *values;
+  GHashTable *strings;
+
+  GHashTable *hot_keys;
+  GArray *hot_items;
+};
+
+/* The same hash function as gvdb uses */
+static guint32
+dconf_gvdb_builder_hash (const gchar *key)
+{
+  guint32 hash_value = 5381;
+
+  while (*key)
+    hash_value = hash_value * 33 + *(signed char *)key++;
+
+  return hash_value;
+}
+
+static GHashTable *
+dconf_gvdb_builder_intern_table_new (void)
+{
+  return g_hash_table_new_full (g_bytes_hash, g_bytes_equal, (GDestroyNotify) g_bytes_unref, g_free);
+}
+
+static gboolean
+dconf_gvdb_builder_intern_lookup (GHashTable    *table,
+                                  gconstpointer  data,
+                                  gsize          size,
+                                  guint64       *start)
+{
+  const guint64 *offset;
+  GBytes *bytes;
+
+  if (size == 0 || size > DCONF_GVDB_BUILDER_INTERN_MAX_SIZE)
+    return FALSE;
+
+  bytes = g_bytes_new_static (data, size);
+  offset = g_hash_table_lookup (table, bytes);
+  g_bytes_unref (bytes);
+
+  if (offset == NULL)
+    return FALSE;
+
+  *start = *offset;
+
+  return TRUE;
+}
+
+static void
+dconf_gvdb_builder_intern_insert (GHashTable    *table,
+                                  gconstpointer  data,
+                                  gsize          size,
+                                  guint64        start)
+{
+  guint64 *offset;
+
+  if (size == 0 || size > DCONF_GVDB_BUILDER_INTERN_MAX_SIZE)
+    return;
+
+  if (g_hash_table_size (table) >= DCONF_GVDB_BUILDER_INTERN_MAX_ENTRIES)
+    return;
+
+  offset = g_new (guint64, 1);
+  *offset = start;
+  g_hash_table_insert (table, g_bytes_new (data, size), offset);
+}
+
+static void
+dconf_gvdb_builder_flush (DConfGvdbBuilder *builder)
+{
+  const guchar *data = builder->buffer;
+  gsize size = builder->buffer_fill;
+
+  builder->buffer_fill = 0;
+
+  if (builder->content != NULL)
+    {
+      g_byte_array_append (builder->content, data, size);
+      size = 0;
+    }
+
+  while (size && builder->saved_errno == 0)
+    {
+      gssize s;
+
+      s = write (builder->fd, data, size);
+
+      if (s < 0)
+        {
+          if (errno != EINTR)
+            builder->saved_errno = errno;
+
+          continue;
+        }
+
+      data += s;
+      size -= s;
+    }
+
+  /* Don't keep a huge buffer around after it was needed */
+  if (builder->buffer_size > DCONF_GVDB_BUILDER_BUFFER_SIZE)
+    {
+      g_free (builder->buffer);
+      builder->buffer_size = DCONF_GVDB_BUILDER_BUFFER_SIZE;
+      builder->buffer = g_malloc (builder->buffer_size);
+    }
+}
+
+/* Returns space for @size bytes at the current end of the file, which
+ * stays valid until the next call.  The space (and the padding before
+ * it) is all in the buffer, so it can be given back with
+ * dconf_gvdb_builder_unreserve().
+ */
+static gpointer
+dconf_gvdb_builder_reserve (DConfGvdbBuilder *builder,
+                            guint             alignment,
+                            gsize             size,
+                            guint64          *start)
+{
+  gsize padding;
+
+  padding = (-builder->offset) & (alignment - 1);
+
+  if (builder->buffer_fill + padding + size > builder->buffer_size)
+    {
+      dconf_gvdb_builder_flush (builder);
+
+      /* Only the value of a huge key can be bigger than the buffer */
+      if (padding + size > builder->buffer_size)
+        {
+          g_free (builder->buffer);
+          builder->buffer_size = padding + size;
+          builder->buffer = g_malloc (builder->buffer_size);
+        }
+    }
+
+  memset (builder->buffer + builder->buffer_fill, 0, padding);
+  builder->buffer_fill += padding;
+  builder->offset += padding;
+
+  if (start != NULL)
+    *start = builder->offset;
+
+  builder->buffer_fill += size;
+  builder->offset += size;
+
+  return builder->buffer + builder->buffer_fill - size;
+}
+
+/* Goes back to @offset, from before the last reserve */
+static void
+dconf_gvdb_builder_unreserve (DConfGvdbBuilder *builder,
+                              guint64           offset)
+{
+  builder->buffer_fill -= builder->offset - offset;
+  builder->offset = offset;
+}
+
+static void
+dconf_gvdb_builder_append (DConfGvdbBuilder *builder,
+                           guint             alignment,
+                           gconstpointer     data,
+                           gsize             size,
+                           guint64          *start)
+{
+  gpointer dest;
+
+  dest = dconf_gvdb_builder_reserve (builder, alignment, size, start);
+  if (size != 0)
+    memcpy (dest, data, size);
+}
+
+static void
+dconf_gvdb_builder_append_interned (DConfGvdbBuilder *builder,
+                                    GHashTable       *table,
+                                    guint             alignment,
+                                    gconstpointer     data,
+                                    gsize             size,
+                                    guint64          *start)
+{
+  if (dconf_gvdb_builder_intern_lookup (table, data, size, start))
+    return;
+
+  dconf_gvdb_builder_append (builder, alignment, data, size, start);
+  dconf_gvdb_builder_intern_insert (table, data, size, *start);
+}
+
+/* Writes @value, wrapped in a variant as gvdb stores it, straight into
+ * the buffer.  Values that come from a table that we built ourselves
+ * are trusted, so they are copied as they are without being parsed.
+ *
+ * If @hot is set then the serialised value is returned instead, for
+ * writing later.
+ */
+static GBytes *
+dconf_gvdb_builder_append_value (DConfGvdbBuilder *builder,
+                                 GVariant         *value,
+                                 gboolean          hot,
+                                 guint64          *start,
+                                 guint64          *end)
+{
+  const gchar *type_string;
+  GBytes *serialised = NULL;
+  GVariant *normal;
+  gsize type_length;
+  gsize data_size;
+  guint64 before;
+  guchar *dest;
+  gsize size;
+
+  g_variant_ref_sink (value);
+
+  /* Both give the normal form, which is all that we may write */
+  if (builder->byteswap)
+    normal = g_variant_byteswap (value);
+  else
+    normal = g_variant_get_normal_form (value);
+
+  g_variant_unref (value);
+
+  type_string = g_variant_get_type_string (normal);
+  type_length = strlen (type_string);
+  data_size = g_variant_get_size (normal);
+  size = data_size + 1 + type_length;
+
+  before = builder->offset;
+  dest = dconf_gvdb_builder_reserve (builder, 8, size, start);
+  g_variant_store (normal, dest);
+  dest[data_size] = '\0';
+  memcpy (dest + data_size + 1, type_string, type_length);
+  g_variant_unref (normal);
+
+  if (hot)
+    serialised = g_bytes_new (dest, size);
+
+  if (hot || dconf_gvdb_builder_intern_lookup (builder->values, dest, size, start))
+    dconf_gvdb_builder_unreserve (builder, before);
+  else
+    dconf_gvdb_builder_intern_insert (builder->values, dest, size, *start);
+
+  *end = *start + size;
+
+  return serialised;
+}
+
+/* The default gvdb format only has 16 bits for the size of a name.  If
+ * @size is too big then the item gets an empty name, but the error
+ * comes out at the end.
+ */
+static guint32
+dconf_gvdb_builder_check_name_size (DConfGvdbBuilder *builder,
+                                    gsize             size)
+{
+  if (size <= G_MAXUINT16)
+    return size;
+
+  if (builder->error == NULL)
+    g_set_error (&builder->error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "Failed to write database: a name of %" G_GSIZE_FORMAT " bytes is too long", size);
+
+  return 0;
+}
+
+static void
+dconf_gvdb_builder_hot_item_clear (gpointer data)
+{
+  DConfGvdbBuilderHotItem *hot = data;
+
+  g_free (hot->basename);
+  if (hot->value != NULL)
+    g_bytes_unref (hot->value);
+}
+
+DConfGvdbBuilder *
+dconf_gvdb_builder_new (gint        fd,
+                        gboolean    byteswap,
+                        GHashTable *hot_keys)
+{
+  DConfGvdbBuilder *builder;
+
+  builder = g_slice_new0 (DConfGvdbBuilder);
+  builder->fd = fd;
+  if (fd == -1)
+    builder->content = g_byte_array_new ();
+  builder->byteswap = byteswap;
+  builder->buffer_size = DCONF_GVDB_BUILDER_BUFFER_SIZE;
+  builder->buffer = g_malloc (builder->buffer_size);
+  builder->items = g_array_new (FALSE, TRUE, sizeof (DConfGvdbBuilderItem));
+  builder->dirs = g_array_new (FALSE, FALSE, sizeof (guint32));
+  builder->dir_path = g_string_new (NULL);
+  builder->values = dconf_gvdb_builder_intern_table_new ();
+  builder->strings = dconf_gvdb_builder_intern_table_new ();
+
+  if (hot_keys != NULL)
+    {
+      builder->hot_keys = g_hash_table_ref (hot_keys);
+      builder->hot_items = g_array_new (FALSE, TRUE, sizeof (DConfGvdbBuilderHotItem));
+      g_array_set_clear_func (builder->hot_items, dconf_gvdb_builder_hot_item_clear);
+    }
+
+  /* The header is filled in last, when we know where the root table is */
+  memset (dconf_gvdb_builder_reserve (builder, 1, sizeof (struct gvdb_header), NULL),
+          0, sizeof (struct gvdb_header));
+
+  return builder;
+}
+
+/* If @hot is set then the key string is held back for later */
+static DConfGvdbBuilderItem *
+dconf_gvdb_builder_add_item (DConfGvdbBuilder *builder,
+                             const gchar      *key,
+                             gsize             key_length,
+                             guint32           parent,
+                             gsize             parent_length,
+                             gboolean          hot)
+{
+  DConfGvdbBuilderItem *item;
+  guint32 index;
+
+  index = builder->items->len;
+  g_array_set_size (builder->items, index + 1);
+  item = &g_array_index (builder->items, DConfGvdbBuilderItem, index);
+
+  item->hash_value = dconf_gvdb_builder_hash (key);
+  item->parent = parent;
+  item->first_child = -1u;
+  item->last_child = -1u;
+  item->sibling = -1u;
+  item->key_size = dconf_gvdb_builder_check_name_size (builder, key_length - parent_length);
+
+  if (hot)
+    {
+      DConfGvdbBuilderHotItem hot_item = { index, g_strdup (key + parent_length), NULL };
+
+      g_array_append_val (builder->hot_items, hot_item);
+    }
+  else
+    dconf_gvdb_builder_append_interned (builder, builder->strings, 1,
+                                        key + parent_length, item->key_size, &item->key_start);
+
+  /* Children always arrive in order, so they just go on the end */
+  if (parent != -1u)
+    {
+      DConfGvdbBuilderItem *parent_item = &g_array_index (builder->items, DConfGvdbBuilderItem, parent);
+
+      if (parent_item->last_child != -1u)
+        g_array_index (builder->items, DConfGvdbBuilderItem, parent_item->last_child).sibling = index;
+      else
+        parent_item->first_child = index;
+
+      parent_item->last_child = index;
+    }
+
+  return item;
+}
+
+/* Closes the dirs that @key is not in and opens the ones that it is
+ * in, and returns the record index of its parent (or -1).
+ */
+static guint32
+dconf_gvdb_builder_enter_dir (DConfGvdbBuilder *builder,
+                              const gchar      *key)
+{
+  const gchar *slash;
+
+  if (key[0] != '/')
+    return -1u;
+
+  while (builder->dirs->len > 0 &&
+         strncmp (key, builder->dir_path->str, builder->dir_path->len) != 0)
+    {
+      g_array_set_size (builder->dirs, builder->dirs->len - 1);
+
+      /* Each dir is one component longer than the one it is in */
+      g_string_truncate (builder->dir_path, builder->dir_path->len - 1);
+      while (builder->dir_path->len > 0 && builder->dir_path->str[builder->dir_path->len - 1] != '/')
+        g_string_truncate (builder->dir_path, builder->dir_path->len - 1);
+    }
+
+  while ((slash = strchr (key + builder->dir_path->len, '/')) != NULL)
+    {
+      guint32 parent = -1u;
+      gsize parent_length;
+      guint32 index;
+
+      if (builder->dirs->len > 0)
+        parent = g_array_index (builder->dirs, guint32, builder->dirs->len - 1);
+
+      parent_length = builder->dir_path->len;
+      g_string_append_len (builder->dir_path, key + parent_length, slash + 1 - (key + parent_length));
+
+      index = builder->items->len;
+      dconf_gvdb_builder_add_item (builder, builder->dir_path->str, builder->dir_path->len,
+                                   parent, parent_length, FALSE)->type = 'L';
+      g_array_append_val (builder->dirs, index);
+    }
+
+  return builder->dirs->len > 0 ? g_array_index (builder->dirs, guint32, builder->dirs->len - 1) : -1u;
+}
+
+/* Holds back copies of the names of the dirs that are open, for a hot
+ * key.  The key_start of a dir is set to -1 once that is done.
+ */
+static void
+dconf_gvdb_builder_hold_dirs (DConfGvdbBuilder *builder)
+{
+  gsize end = builder->dir_path->len;
+  guint i;
+
+  for (i = builder->dirs->len; i > 0; i--)
+    {
+      guint32 index = g_array_index (builder->dirs, guint32, i - 1);
+      DConfGvdbBuilderItem *item = &g_array_index (builder->items, DConfGvdbBuilderItem, index);
+      DConfGvdbBuilderHotItem hot_item = { index, NULL, NULL };
+
+      /* ...in which case the ones that it is in were held with it */
+      if (item->key_start == G_MAXUINT64)
+        break;
+
+      end -= item->key_size;
+      hot_item.basename = g_strndup (builder->dir_path->str + end, item->key_size);
+      g_array_append_val (builder->hot_items, hot_item);
+      item->key_start = G_MAXUINT64;
+    }
+}
+
+static DConfGvdbBuilderItem *
+dconf_gvdb_builder_add_key (DConfGvdbBuilder *builder,
+                            const gchar      *key,
+                            gboolean          hot)
+{
+  guint32 parent;
+
+  if (builder->last_key != NULL && strcmp (builder->last_key, key) >= 0)
+    {
+      g_critical ("dconf_gvdb_builder: key '%s' is not after '%s'", key, builder->last_key);
+      return NULL;
+    }
+
+  g_free (builder->last_key);
+  builder->last_key = g_strdup (key);
+
+  parent = dconf_gvdb_builder_enter_dir (builder, key);
+
+  /* Before the key itself, which has to be the last hot item */
+  if (hot)
+    dconf_gvdb_builder_hold_dirs (builder);
+
+  return dconf_gvdb_builder_add_item (builder, key, strlen (key), parent,
+                                      parent != -1u ? builder->dir_path->len : 0, hot);
+}
+
+/* Keys must be added in strcmp() order, and must not end with '/':
+ * those are the dirs that the builder creates itself.
+ */
+void
+dconf_gvdb_builder_add_value (DConfGvdbBuilder *builder,
+                              const gchar      *key,
+                              GVariant         *value)
+{
+  DConfGvdbBuilderItem *item;
+  gboolean hot;
+  GBytes *serialised;
+
+  g_return_if_fail (!g_str_has_suffix (key, "/"));
+
+  hot = builder->hot_keys != NULL && g_hash_table_contains (builder->hot_keys, key);
+  item = dconf_gvdb_builder_add_key (builder, key, hot);
+  if (item == NULL)
+    {
+      g_variant_unref (g_variant_ref_sink (value));
+      return;
+    }
+
+  item->type = 'v';
+  serialised = dconf_gvdb_builder_append_value (builder, value, hot, &item->value_start, &item->value_end);
+
+  /* The key that was just added is the last hot item */
+  if (hot)
+    g_array_index (builder->hot_items, DConfGvdbBuilderHotItem, builder->hot_items->len - 1).value = serialised;
+}
+
+/* Sorts @items into the buckets of a hash table, setting their
+ * assigned_index.  Returns the index that each bucket starts at, and
+ * sets @order to the items in the order that they go in the table.
+ */
+static guint32 *
+dconf_gvdb_builder_assign_buckets (GArray   *items,
+                                   guint32 **order)
+{
+  guint32 n_items, n_buckets;
+  guint32 *bucket_start;
+  guint32 i;
+
+  n_items = items->len;
+  n_buckets = n_items;
+
+  /* A counting sort */
+  bucket_start = g_new0 (guint32, n_buckets + 1);
+  *order = g_new (guint32, n_items);
+
+  for (i = 0; i < n_items; i++)
+    bucket_start[g_array_index (items, DConfGvdbBuilderItem, i).hash_value % n_buckets + 1]++;
+
+  for (i = 0; i < n_buckets; i++)
+    bucket_start[i + 1] += bucket_start[i];
+
+  for (i = 0; i < n_items; i++)
+    {
+      DConfGvdbBuilderItem *item = &g_array_index (items, DConfGvdbBuilderItem, i);
+      guint32 *next = &bucket_start[item->hash_value % n_buckets];
+
+      item->assigned_index = (*next)++;
+      (*order)[item->assigned_index] = i;
+    }
+
+  /* Now bucket_start[b] is where bucket b + 1 starts */
+  memmove (bucket_start + 1, bucket_start, n_buckets * sizeof (guint32));
+  bucket_start[0] = 0;
+
+  return bucket_start;
+}
+
+/* Writes the hash table for @items, which must all be written out
+ * already, with no bloom filter.  Frees @bucket_start and @order.
+ */
+static void
+dconf_gvdb_builder_append_hash (DConfGvdbBuilder *builder,
+                                GArray           *items,
+                                guint32          *bucket_start,
+                                guint32          *order,
+                                guint64          *start,
+                                guint64          *end)
+{
+  guint32_le hdr;
+  guint32 i;
+
+  hdr = guint32_to_le (5 << 27 | 0);
+  dconf_gvdb_builder_append (builder, 4, &hdr, sizeof hdr, start);
+  hdr = guint32_to_le (items->len);
+  dconf_gvdb_builder_append (builder, 4, &hdr, sizeof hdr, NULL);
+
+  for (i = 0; i < items->len; i++)
+    {
+      guint32_le le = guint32_to_le (bucket_start[i]);
+
+      dconf_gvdb_builder_append (builder, 4, &le, sizeof le, NULL);
+    }
+
+  for (i = 0; i < items->len; i++)
+    {
+      DConfGvdbBuilderItem *item = &g_array_index (items, DConfGvdbBuilderItem, order[i]);
+      struct gvdb_hash_item entry = { { 0, }, };
+      guint32 parent = -1u;
+
+      if (item->parent != -1u)
+        parent = g_array_index (items, DConfGvdbBuilderItem, item->parent).assigned_index;
+
+      entry.hash_value = guint32_to_le (item->hash_value);
+      entry.parent = guint32_to_le (parent);
+      entry.key_start = guint32_to_le (item->key_start);
+      entry.key_size = guint16_to_le (item->key_size);
+      entry.type = item->type;
+      entry.value.pointer.start = guint32_to_le (item->value_start);
+      entry.value.pointer.end = guint32_to_le (item->value_end);
+
+      dconf_gvdb_builder_append (builder, 1, &entry, sizeof entry, NULL);
+    }
+
+  *end = builder->offset;
+
+  g_free (bucket_start);
+  g_free (order);
+}
+
+/* Adds a nested table with no dirs in it, mapping each key of @table to
+ * the string that it has as its value (such as ".locks", where the
+ * strings are empty).
+ */
+void
+dconf_gvdb_builder_add_string_table (DConfGvdbBuilder *builder,
+                                     const gchar      *key,
+                                     GHashTable       *table)
+{
+  DConfGvdbBuilderItem *item;
+  guint32 *bucket_start;
+  GHashTableIter iter;
+  gpointer name, string;
+  guint32 *order;
+  GArray *nested;
+  guint64 start, end;
+
+  g_return_if_fail (!g_str_has_suffix (key, "/"));
+
+  item = dconf_gvdb_builder_add_key (builder, key, FALSE);
+  if (item == NULL)
+    return;
+
+  nested = g_array_new (FALSE, TRUE, sizeof (DConfGvdbBuilderItem));
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, &name, &string))
+    {
+      DConfGvdbBuilderItem entry = { 0, };
+
+      entry.hash_value = dconf_gvdb_builder_hash (name);
+      entry.parent = -1u;
+      entry.type = 'v';
+      entry.key_size = dconf_gvdb_builder_check_name_size (builder, strlen (name));
+      dconf_gvdb_builder_append_interned (builder, builder->strings, 1, name, entry.key_size, &entry.key_start);
+      dconf_gvdb_builder_append_value (builder, g_variant_new_string (string), FALSE,
+                                       &entry.value_start, &entry.value_end);
+      g_array_append_val (nested, entry);
+    }
+
+  bucket_start = dconf_gvdb_builder_assign_buckets (nested, &order);
+  dconf_gvdb_builder_append_hash (builder, nested, bucket_start, order, &start, &end);
+  g_array_unref (nested);
+
+  /* The array may have grown since we got @item */
+  item = &g_array_index (builder->items, DConfGvdbBuilderItem, builder->items->len - 1);
+  item->type = 'H';
+  item->value_start = start;
+  item->value_end = end;
+}
+
+static void
+dconf_gvdb_builder_free (DConfGvdbBuilder *builder)
+{
+  g_free (builder->buffer);
+  if (builder->content != NULL)
+    g_byte_array_unref (builder->content);
+  g_array_unref (builder->items);
+  g_array_unref (builder->dirs);
+  g_string_free (builder->dir_path, TRUE);
+  g_free (builder->last_key);
+  g_hash_table_unref (builder->values);
+  g_hash_table_unref (builder->strings);
+  g_clear_error (&builder->error);
+  if (builder->hot_keys != NULL)
+    {
+      g_hash_table_unref (builder->hot_keys);
+      g_array_unref (builder->hot_items);
+    }
+
+  g_slice_free (DConfGvdbBuilder, builder);
+}
+
+/* Overwrites part of what has been flushed already */
+static void
+dconf_gvdb_builder_pwrite (DConfGvdbBuilder *builder,
+                           gconstpointer     data,
+                           gsize             size,
+                           goffset           offset)
+{
+  if (builder->content != NULL)
+    {
+      memcpy (builder->content->data + offset, data, size);
+      return;
+    }
+
+  while (builder->saved_errno == 0 && pwrite (builder->fd, data, size, offset) != (gssize) size)
+    if (errno != EINTR)
+      builder->saved_errno = errno;
+}
+
+/* Writes the held back hot keys, followed by the entry that says where
+ * they are.  Returns where that entry's value is, to be filled in once
+ * the end of the file is known.
+ */
+static guint64
+dconf_gvdb_builder_append_hot_items (DConfGvdbBuilder *builder,
+                                     guint64          *hot_start)
+{
+  DConfGvdbBuilderItem *item;
+  guint64 start, end;
+  GBytes *placeholder;
+  gconstpointer data;
+  gsize size;
+  guint i;
+
+  *hot_start = builder->offset;
+
+  for (i = 0; i < builder->hot_items->len; i++)
+    {
+      DConfGvdbBuilderHotItem *hot = &g_array_index (builder->hot_items, DConfGvdbBuilderHotItem, i);
+
+      item = &g_array_index (builder->items, DConfGvdbBuilderItem, hot->index);
+      dconf_gvdb_builder_append (builder, 1, hot->basename, item->key_size, &item->key_start);
+
+      if (hot->value == NULL)
+        continue;
+
+      data = g_bytes_get_data (hot->value, &size);
+      dconf_gvdb_builder_append (builder, 8, data, size, &item->value_start);
+      item->value_end = item->value_start + size;
+    }
+
+  /* Written with a placeholder, which has the same size */
+  item = dconf_gvdb_builder_add_item (builder, DCONF_ACCESS_LOG_HOT_RANGE_KEY,
+                                      strlen (DCONF_ACCESS_LOG_HOT_RANGE_KEY), -1u, 0, FALSE);
+  item->type = 'v';
+  placeholder = dconf_gvdb_builder_append_value (builder, g_variant_new ("(tt)", G_GUINT64_CONSTANT (0),
+                                                                         G_GUINT64_CONSTANT (0)),
+                                                 TRUE, &start, &end);
+  data = g_bytes_get_data (placeholder, &size);
+  dconf_gvdb_builder_append (builder, 8, data, size, &item->value_start);
+  item->value_end = item->value_start + size;
+  g_bytes_unref (placeholder);
+
+  return item->value_start;
+}
+
+/* Fills in the value of the hot range entry at @start */
+static void
+dconf_gvdb_builder_write_hot_range (DConfGvdbBuilder *builder,
+                                    guint64           start,
+                                    guint64           hot_start)
+{
+  DConfGvdbBuilderItem *item;
+  guint64 value_start, value_end;
+  GBytes *serialised;
+
+  serialised = dconf_gvdb_builder_append_value (builder, g_variant_new ("(tt)", hot_start, builder->offset),
+                                                TRUE, &value_start, &value_end);
+
+  item = &g_array_index (builder->items, DConfGvdbBuilderItem, builder->items->len - 1);
+  g_assert (g_bytes_get_size (serialised) == item->value_end - item->value_start);
+  dconf_gvdb_builder_pwrite (builder, g_bytes_get_data (serialised, NULL), g_bytes_get_size (serialised), start);
+  g_bytes_unref (serialised);
+}
+
+/* Writes out the hash table and the header */
+static gboolean
+dconf_gvdb_builder_complete (DConfGvdbBuilder  *builder,
+                             GError           **error)
+{
+  struct gvdb_header header = { { 0, }, };
+  guint64 hot_value = 0, hot_start = 0;
+  guint64 root_start, root_end;
+  guint32 *bucket_start;
+  guint32 *order;
+  guint32 i;
+
+  if (builder->hot_items != NULL)
+    hot_value = dconf_gvdb_builder_append_hot_items (builder, &hot_start);
+
+  if (builder->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&builder->error));
+      return FALSE;
+    }
+
+  bucket_start = dconf_gvdb_builder_assign_buckets (builder->items, &order);
+
+  /* The child lists of the dirs */
+  for (i = 0; i < builder->items->len; i++)
+    {
+      DConfGvdbBuilderItem *item = &g_array_index (builder->items, DConfGvdbBuilderItem, i);
+      guint32 child;
+
+      if (item->type != 'L')
+        continue;
+
+      for (child = item->first_child; child != -1u; )
+        {
+          DConfGvdbBuilderItem *child_item = &g_array_index (builder->items, DConfGvdbBuilderItem, child);
+          guint32_le index = guint32_to_le (child_item->assigned_index);
+
+          dconf_gvdb_builder_append (builder, 4, &index, sizeof index,
+                                     child == item->first_child ? &item->value_start : NULL);
+          child = child_item->sibling;
+        }
+
+      item->value_end = builder->offset;
+    }
+
+  dconf_gvdb_builder_append_hash (builder, builder->items, bucket_start, order, &root_start, &root_end);
+  dconf_gvdb_builder_flush (builder);
+
+  /* gvdb can't point past 4GiB */
+  if (builder->saved_errno == 0 && builder->offset > G_MAXUINT32)
+    {
+      g_set_error_literal (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                           "Failed to write database: it is bigger than 4GiB");
+      return FALSE;
+    }
+
+  if (builder->hot_items != NULL)
+    dconf_gvdb_builder_write_hot_range (builder, hot_value, hot_start);
+
+  if (builder->byteswap)
+    {
+      header.signature[0] = GVDB_SWAPPED_SIGNATURE0;
+      header.signature[1] = GVDB_SWAPPED_SIGNATURE1;
+    }
+  else
+    {
+      header.signature[0] = GVDB_SIGNATURE0;
+      header.signature[1] = GVDB_SIGNATURE1;
+    }
+
+  header.root.start = guint32_to_le (root_start);
+  header.root.end = guint32_to_le (root_end);
+  dconf_gvdb_builder_pwrite (builder, &header, sizeof header, 0);
+
+  if (builder->saved_errno != 0)
+    {
+      gint saved_errno = builder->saved_errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Failed to write database: %s", g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Completes the file and frees @builder.  The file descriptor is left
+ * open.
+ */
+gboolean
+dconf_gvdb_builder_finish (DConfGvdbBuilder  *builder,
+                           GError           **error)
+{
+  gboolean success;
+
+  g_return_val_if_fail (builder->content == NULL, FALSE);
+
+  success = dconf_gvdb_builder_complete (builder, error);
+  dconf_gvdb_builder_free (builder);
+
+  return success;
+}
+
+/* Completes the file, returns it and frees @builder */
+GBytes *
+dconf_gvdb_builder_get_content (DConfGvdbBuilder  *builder,
+                                GError           **error)
+{
+  GBytes *content = NULL;
+
+  g_return_val_if_fail (builder->content != NULL, NULL);
+
+  if (dconf_gvdb_builder_complete (builder, error))
+    content = g_byte_array_free_to_bytes (g_steal_pointer (&builder->content));
+
+  dconf_gvdb_builder_free (builder);
+
+  return content;
+}
@@ -0,0 +1,58 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __dconf_gvdb_builder_h__
+#define __dconf_gvdb_builder_h__
+
+#include <glib.h>
+
+/* Builds dconf databases from keys that are given in sorted order.
+ *
+ * The files are ordinary gvdb files.  This lives here rather than in
+ * gvdb/, which is a copy of the gvdb module (see HACKING), because it
+ * knows how dconf arranges its paths: the dirs that the keys are in
+ * are created automatically, and the key strings and values are
+ * written out as they arrive, so the keys of each dir end up together.
+ * Identical small values and names are only written once.
+ *
+ * If @fd is -1 then the file is built in memory and
+ * dconf_gvdb_builder_get_content() returns it.  Otherwise it is
+ * written to @fd (which must be a new, empty file) as it goes, and
+ * dconf_gvdb_builder_finish() completes it.  Either way, each name in
+ * a key can be at most 64KiB and the file at most 4GiB: the error for
+ * that comes out at the end.
+ *
+ * If @hot_keys is given then the names and values of the keys in it
+ * are put together with the hash table, and the range of the file that
+ * they are in is stored under DCONF_ACCESS_LOG_HOT_RANGE_KEY (see
+ * dconf-access-log.h).
+ */
+typedef struct _DConfGvdbBuilder DConfGvdbBuilder;
+
+DConfGvdbBuilder *      dconf_gvdb_builder_new                          (gint               fd,
+                                                                         gboolean           byteswap,
+                                                                         GHashTable        *hot_keys);
+void                    dconf_gvdb_builder_add_value                    (DConfGvdbBuilder  *builder,
+                                                                         const gchar       *key,
+                                                                         GVariant          *value);
+void                    dconf_gvdb_builder_add_string_table             (DConfGvdbBuilder  *builder,
+                                                                         const gchar       *key,
+                                                                         GHashTable        *table);
+gboolean                dconf_gvdb_builder_finish                       (DConfGvdbBuilder  *builder,
+                                                                         GError           **error);
+GBytes *                dconf_gvdb_builder_get_content                  (DConfGvdbBuilder  *builder,
+                                                                         GError           **error);
+
+#endif /* __dconf_gvdb_builder_h__ */
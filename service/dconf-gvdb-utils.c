@@ -22,32 +22,79 @@
 
 #include "dconf-gvdb-utils.h"
 
+#include "dconf-gvdb-builder.h"
+#include "../common/dconf-access-log.h"
 #include "../common/dconf-paths.h"
-#include "../gvdb/gvdb-builder.h"
 #include "../gvdb/gvdb-reader.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-DConfChangeset *
-dconf_gvdb_utils_read_and_back_up_file (const gchar  *filename,
-                                        gboolean     *file_missing,
+/* Asks the kernel to start reading in the range of @bytes that has the
+ * hot keys of @table in it, if there is one (see dconf-access-log.h).
+ */
+static void
+dconf_gvdb_utils_prefetch (GvdbTable *table,
+                           GBytes    *bytes)
+{
+#ifdef MADV_WILLNEED
+  guint64 start = 0, end = 0;
+  const guchar *data;
+  GVariant *range;
+  guintptr address;
+  gsize page_size;
+  gsize size;
+
+  range = gvdb_table_get_value (table, DCONF_ACCESS_LOG_HOT_RANGE_KEY);
+  if (range == NULL)
+    return;
+
+  if (g_variant_is_of_type (range, G_VARIANT_TYPE ("(tt)")))
+    g_variant_get (range, "(tt)", &start, &end);
+  g_variant_unref (range);
+
+  data = g_bytes_get_data (bytes, &size);
+  if (start >= end || end > size)
+    return;
+
+  /* The range doesn't have to start on a page boundary */
+  page_size = sysconf (_SC_PAGESIZE);
+  address = (guintptr) (data + start);
+  address -= address % page_size;
+
+  madvise ((gpointer) address, (guintptr) (data + end) - address, MADV_WILLNEED);
+#endif
+}
+
+gboolean
+dconf_gvdb_utils_open_and_back_up_file (const gchar  *filename,
+                                        GvdbTable   **table,
                                         GError      **error)
 {
-  DConfChangeset *database;
   GError *my_error = NULL;
-  GvdbTable *table = NULL;
-  gchar *contents;
-  gsize size;
+  GMappedFile *mapped;
 
-  if (g_file_get_contents (filename, &contents, &size, &my_error))
+  *table = NULL;
+
+  /* Map the file rather than reading it: the caller only looks at the
+   * parts of it that it needs.  We write our files by replacing them,
+   * so the contents can not change under us.
+   */
+  mapped = g_mapped_file_new (filename, FALSE, &my_error);
+  if (mapped)
     {
       GBytes *bytes;
 
-      bytes = g_bytes_new_take (contents, size);
-      table = gvdb_table_new_from_bytes (bytes, FALSE, &my_error);
+      bytes = g_mapped_file_get_bytes (mapped);
+      *table = gvdb_table_new_from_bytes (bytes, FALSE, &my_error);
+      if (*table != NULL)
+        dconf_gvdb_utils_prefetch (*table, bytes);
+      g_mapped_file_unref (mapped);
       g_bytes_unref (bytes);
     }
 
@@ -92,111 +139,252 @@ dconf_gvdb_utils_read_and_back_up_file (const gchar  *filename,
   else if (my_error)
     {
       g_propagate_prefixed_error (error, my_error, "Cannot open dconf database: ");
-      return NULL;
+      return FALSE;
     }
 
-  /* Only allocate once we know we are in a non-error situation */
-  database = dconf_changeset_new_database (NULL);
+  return TRUE;
+}
+
+/* The keys to put together at the front of the databases that we write,
+ * from the access log that the clients are writing to (if any).  It is
+ * read once: the hot keys don't change much from one write to the next.
+ */
+static GHashTable *
+dconf_gvdb_utils_get_hot_keys (void)
+{
+  static GHashTable *hot_keys;
+  static gsize initialised;
 
-  /* Fill the table up with the initial state */
-  if (table != NULL)
+  if (g_once_init_enter (&initialised))
     {
-      gchar **names;
+      const gchar *filename;
+
+      filename = g_getenv ("DCONF_ACCESS_LOG");
+
+      if (filename != NULL && filename[0] != '\0')
+        hot_keys = dconf_access_log_read_hot_keys (filename, DCONF_ACCESS_LOG_MAX_HOT_KEYS, NULL);
+
+      g_once_init_leave (&initialised, 1);
+    }
+
+  return hot_keys;
+}
+
+/* Whether @key belongs in one of the shards rather than in the main table */
+static gboolean
+dconf_gvdb_utils_is_in_shard (GHashTable  *shards,
+                              const gchar *key)
+{
+  GHashTableIter iter;
+  gpointer dir;
+
+  if (shards == NULL)
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, shards);
+  while (g_hash_table_iter_next (&iter, &dir, NULL))
+    if (g_str_has_prefix (key, dir))
+      return TRUE;
+
+  return FALSE;
+}
+
+static gint
+dconf_gvdb_utils_compare_names (gconstpointer a,
+                                gconstpointer b)
+{
+  return strcmp (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+static gboolean
+dconf_gvdb_utils_add_name (const gchar *path,
+                           GVariant    *value,
+                           gpointer     user_data)
+{
+  GPtrArray *names = user_data;
+
+  /* Skip resets: they only matter for what is in the base table */
+  if (value != NULL)
+    g_ptr_array_add (names, g_strdup (path));
+
+  return TRUE;
+}
+
+/* If @shards (a map from dirs to the names of the shards that hold
+ * them) is given then this is the main table of a sharded database:
+ * keys of @base in those dirs are left out, and the map is written to
+ * the ".shards" table for the clients to find.
+ *
+ * Values that the overlay does not touch are copied out of @base.  If
+ * @base is a table that we built ourselves (and so trusted) then that
+ * is a plain copy of the bytes, without them being parsed.
+ */
+GBytes *
+dconf_gvdb_utils_serialise (GvdbTable       *base,
+                            DConfChangeset  *overlay,
+                            GHashTable      *shards,
+                            GError         **error)
+{
+  DConfGvdbBuilder *builder;
+  GPtrArray *names;
+  guint i;
+
+  names = g_ptr_array_new_with_free_func (g_free);
+
+  if (base != NULL)
+    {
+      gchar **base_names;
       gsize n_names;
-      gsize i;
+      gsize j;
 
-      names = gvdb_table_get_names (table, &n_names);
-      for (i = 0; i < n_names; i++)
+      base_names = gvdb_table_get_names (base, &n_names);
+      for (j = 0; j < n_names; j++)
         {
-          if (dconf_is_key (names[i], NULL))
-            {
-              GVariant *value;
+          if (dconf_is_key (base_names[j], NULL) &&
+              !dconf_gvdb_utils_is_in_shard (shards, base_names[j]) &&
+              (overlay == NULL || !dconf_changeset_get (overlay, base_names[j], NULL)))
+            g_ptr_array_add (names, base_names[j]);
+          else
+            g_free (base_names[j]);
+        }
+      g_free (base_names);
+    }
+
+  if (overlay != NULL)
+    dconf_changeset_all (overlay, dconf_gvdb_utils_add_name, names);
 
-              value = gvdb_table_get_value (table, names[i]);
+  /* The builder takes the keys in order, and so keeps the keys of each
+   * dir together: apps read them all at once.
+   */
+  g_ptr_array_sort (names, dconf_gvdb_utils_compare_names);
 
-              if (value != NULL)
-                {
-                  dconf_changeset_set (database, names[i], value);
-                  g_variant_unref (value);
-                }
-            }
+  builder = dconf_gvdb_builder_new (-1, FALSE, dconf_gvdb_utils_get_hot_keys ());
 
-          g_free (names[i]);
-        }
+  if (shards != NULL && g_hash_table_size (shards) > 0)
+    dconf_gvdb_builder_add_string_table (builder, ".shards", shards);
+
+  for (i = 0; i < names->len; i++)
+    {
+      const gchar *name = g_ptr_array_index (names, i);
+      GVariant *value = NULL;
 
-      gvdb_table_free (table);
-      g_free (names);
+      if (overlay == NULL || !dconf_changeset_get (overlay, name, &value))
+        value = gvdb_table_get_value (base, name);
+
+      if (value != NULL)
+        {
+          dconf_gvdb_builder_add_value (builder, name, value);
+          g_variant_unref (value);
+        }
     }
 
-  if (file_missing)
-    *file_missing = (table == NULL);
+  g_ptr_array_unref (names);
 
-  return database;
+  return dconf_gvdb_builder_get_content (builder, error);
 }
 
-static GvdbItem *
-dconf_gvdb_utils_get_parent (GHashTable  *table,
-                             const gchar *key)
+/* Writes @content to a new temporary file next to @filename, and
+ * returns its name.  The fsync() is only done if @durable is set.
+ */
+static gchar *
+dconf_gvdb_utils_write_temp_once (const gchar  *filename,
+                                  GBytes       *content,
+                                  gboolean      durable,
+                                  GError      **error)
 {
-  GvdbItem *grandparent, *parent;
-  gchar *parent_name;
-  gint len;
+  const gchar *data;
+  gchar *tmpname;
+  gsize size;
+  gint saved_errno;
+  gint fd;
 
-  if (g_str_equal (key, "/"))
-    return NULL;
+  tmpname = g_strdup_printf ("%s.XXXXXX", filename);
+  fd = g_mkstemp_full (tmpname, O_RDWR, 0666);
 
-  len = strlen (key);
-  if (key[len - 1] == '/')
-    len--;
+  if (fd == -1)
+    {
+      saved_errno = errno;
+      goto fail;
+    }
 
-  while (key[len - 1] != '/')
-    len--;
+  data = g_bytes_get_data (content, &size);
+  while (size)
+    {
+      gssize s;
 
-  parent_name = g_strndup (key, len);
-  parent = g_hash_table_lookup (table, parent_name);
+      s = write (fd, data, size);
 
-  if (parent == NULL)
-    {
-      parent = gvdb_hash_table_insert (table, parent_name);
+      if (s < 0)
+        {
+          if (errno == EINTR)
+            continue;
 
-      grandparent = dconf_gvdb_utils_get_parent (table, parent_name);
+          saved_errno = errno;
+          close (fd);
+          g_unlink (tmpname);
+          goto fail;
+        }
 
-      if (grandparent != NULL)
-        gvdb_item_set_parent (parent, grandparent);
+      data += s;
+      size -= s;
     }
 
-  g_free (parent_name);
+  if ((durable && fsync (fd) != 0) || close (fd) != 0)
+    {
+      saved_errno = errno;
+      g_unlink (tmpname);
+      goto fail;
+    }
+
+  return tmpname;
+
+fail:
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+               "Failed to write '%s': %s", filename, g_strerror (saved_errno));
+  g_free (tmpname);
 
-  return parent;
+  return NULL;
 }
 
+/* Like g_file_set_contents(), but without the fsync().  The rename
+ * still gives readers an atomic switch to the new contents, but they
+ * may not survive a crash until dconf_gvdb_utils_sync_file() is called.
+ */
 static gboolean
-dconf_gvdb_utils_add_key (const gchar *path,
-                          GVariant    *value,
-                          gpointer     user_data)
+dconf_gvdb_utils_replace_contents (const gchar  *filename,
+                                   GBytes       *content,
+                                   GError      **error)
 {
-  GHashTable *gvdb = user_data;
-  GvdbItem *item;
+  gchar *tmpname;
 
-  g_assert (g_hash_table_lookup (gvdb, path) == NULL);
-  item = gvdb_hash_table_insert (gvdb, path);
-  gvdb_item_set_parent (item, dconf_gvdb_utils_get_parent (gvdb, path));
-  gvdb_item_set_value (item, value);
+  tmpname = dconf_gvdb_utils_write_temp_once (filename, content, FALSE, error);
+  if (tmpname == NULL)
+    return FALSE;
 
-  return TRUE;
+  return dconf_gvdb_utils_rename_temp (tmpname, filename, error);
+}
+
+static gboolean
+dconf_gvdb_utils_write_contents_once (const gchar  *filename,
+                                      GBytes       *content,
+                                      gboolean      durable,
+                                      GError      **error)
+{
+  if (durable)
+    return g_file_set_contents (filename, g_bytes_get_data (content, NULL), g_bytes_get_size (content), error);
+  else
+    return dconf_gvdb_utils_replace_contents (filename, content, error);
 }
 
 gboolean
-dconf_gvdb_utils_write_file (const gchar     *filename,
-                             DConfChangeset  *database,
-                             GError         **error)
+dconf_gvdb_utils_write_contents (const gchar  *filename,
+                                 GBytes       *content,
+                                 gboolean      durable,
+                                 GError      **error)
 {
-  GHashTable *gvdb;
   gboolean success;
 
-  gvdb = gvdb_hash_table_new (NULL, NULL);
-  dconf_changeset_all (database, dconf_gvdb_utils_add_key, gvdb);
-  success = gvdb_table_write_contents (gvdb, filename, FALSE, error);
+  success = dconf_gvdb_utils_write_contents_once (filename, content, durable, error);
 
   if (!success)
     {
@@ -210,10 +398,91 @@ dconf_gvdb_utils_write_file (const gchar     *filename,
       g_free (dirname);
 
       g_clear_error (error);
-      success = gvdb_table_write_contents (gvdb, filename, FALSE, error);
+      success = dconf_gvdb_utils_write_contents_once (filename, content, durable, error);
     }
 
-  g_hash_table_unref (gvdb);
-
   return success;
 }
+
+/* The first half of dconf_gvdb_utils_write_contents(), for writing
+ * several files that should all be replaced or none of them: the new
+ * contents go to a temporary file, the name of which is returned.
+ */
+gchar *
+dconf_gvdb_utils_write_temp (const gchar  *filename,
+                             GBytes       *content,
+                             gboolean      durable,
+                             GError      **error)
+{
+  gchar *tmpname;
+
+  tmpname = dconf_gvdb_utils_write_temp_once (filename, content, durable, error);
+
+  if (tmpname == NULL)
+    {
+      gchar *dirname;
+
+      /* As in dconf_gvdb_utils_write_contents() */
+      dirname = g_path_get_dirname (filename);
+      g_mkdir_with_parents (dirname, 0700);
+      g_free (dirname);
+
+      g_clear_error (error);
+      tmpname = dconf_gvdb_utils_write_temp_once (filename, content, durable, error);
+    }
+
+  return tmpname;
+}
+
+/* The second half: moves @tmpname into place as @filename, and frees
+ * it.  The temporary file is removed if that fails.
+ */
+gboolean
+dconf_gvdb_utils_rename_temp (gchar        *tmpname,
+                              const gchar  *filename,
+                              GError      **error)
+{
+  if (g_rename (tmpname, filename) != 0)
+    {
+      gint saved_errno = errno;
+
+      g_unlink (tmpname);
+      g_free (tmpname);
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "Failed to write '%s': %s", filename, g_strerror (saved_errno));
+
+      return FALSE;
+    }
+
+  g_free (tmpname);
+
+  return TRUE;
+}
+
+void
+dconf_gvdb_utils_sync_file (const gchar *filename)
+{
+  gchar *dirname;
+  gint fd;
+
+  /* Flush the file contents and then the directory entry that the
+   * rename() gave it.  Errors are not interesting here: the worst that
+   * can happen is that we lose the same data we would have lost anyway.
+   */
+  fd = open (filename, O_RDONLY);
+  if (fd != -1)
+    {
+      fsync (fd);
+      close (fd);
+    }
+
+  dirname = g_path_get_dirname (filename);
+  fd = open (dirname, O_RDONLY);
+  if (fd != -1)
+    {
+      fsync (fd);
+      close (fd);
+    }
+  g_free (dirname);
+}
@@ -22,12 +22,26 @@
 #define __dconf_gvdb_utils_h__
 
 #include "../common/dconf-changeset.h"
+#include "../gvdb/gvdb-reader.h"
 
-DConfChangeset *                dconf_gvdb_utils_read_and_back_up_file  (const gchar     *filename,
-                                                                         gboolean        *file_missing,
+gboolean                        dconf_gvdb_utils_open_and_back_up_file  (const gchar     *filename,
+                                                                         GvdbTable      **table,
                                                                          GError         **error);
-gboolean                        dconf_gvdb_utils_write_file             (const gchar     *filename,
-                                                                         DConfChangeset  *database,
+GBytes *                        dconf_gvdb_utils_serialise              (GvdbTable       *base,
+                                                                         DConfChangeset  *overlay,
+                                                                         GHashTable      *shards,
                                                                          GError         **error);
+gboolean                        dconf_gvdb_utils_write_contents         (const gchar     *filename,
+                                                                         GBytes          *content,
+                                                                         gboolean         durable,
+                                                                         GError         **error);
+gchar *                         dconf_gvdb_utils_write_temp             (const gchar     *filename,
+                                                                         GBytes          *content,
+                                                                         gboolean         durable,
+                                                                         GError         **error);
+gboolean                        dconf_gvdb_utils_rename_temp            (gchar           *tmpname,
+                                                                         const gchar     *filename,
+                                                                         GError         **error);
+void                            dconf_gvdb_utils_sync_file              (const gchar     *filename);
 
 #endif /* __dconf_gvdb_utils_h__ */
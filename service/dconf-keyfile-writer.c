@@ -22,6 +22,8 @@
 
 #include "dconf-writer.h"
 
+#include "../common/dconf-keyfile.h"
+
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -43,23 +45,31 @@ typedef struct
 
 G_DEFINE_TYPE (DConfKeyfileWriter, dconf_keyfile_writer, DCONF_TYPE_WRITER)
 
-static DConfChangeset *
-dconf_keyfile_to_changeset (GKeyFile    *keyfile,
-                            const gchar *filename_fyi)
+typedef struct
 {
   DConfChangeset *changeset;
-  gchar **groups;
-  gint i;
+  const gchar    *filename_fyi;
+  GString        *group;
+  GString        *path;
+  gsize           prefix_len;
+  gboolean        group_is_valid;
+} KeyfileParseContext;
 
-  changeset = dconf_changeset_new_database (NULL);
+static gboolean
+dconf_keyfile_add_key (const gchar  *group,
+                       const gchar  *key,
+                       const gchar  *value_str,
+                       gpointer      user_data,
+                       GError      **unused)
+{
+  KeyfileParseContext *ctx = user_data;
+  GError *error = NULL;
+  GVariant *value;
 
-  groups = g_key_file_get_groups (keyfile, NULL);
-  for (i = 0; groups[i]; i++)
+  /* Keys arrive group by group, so only check the group when it changes */
+  if (ctx->group->len == 0 || !g_str_equal (ctx->group->str, group))
     {
-      const gchar *group = groups[i];
-      gchar *key_prefix;
-      gchar **keys;
-      gint j;
+      g_string_assign (ctx->group, group);
 
       /* Special case the [/] group to be able to contain keys at the
        * root (/a, /b, etc.).  All others must not start or end with a
@@ -67,61 +77,92 @@ dconf_keyfile_to_changeset (GKeyFile    *keyfile,
        */
       if (!g_str_equal (group, "/"))
         {
-          if (g_str_has_prefix (group, "/") || g_str_has_suffix (group, "/") || strstr (group, "//"))
-            {
-              g_warning ("%s: ignoring invalid group name: %s\n", filename_fyi, group);
-              continue;
-            }
+          ctx->group_is_valid = !g_str_has_prefix (group, "/") && !g_str_has_suffix (group, "/") && !strstr (group, "//");
+
+          if (!ctx->group_is_valid)
+            g_warning ("%s: ignoring invalid group name: %s\n", ctx->filename_fyi, group);
 
-          key_prefix = g_strconcat ("/", group, "/", NULL);
+          g_string_printf (ctx->path, "/%s/", group);
         }
       else
-        key_prefix = g_strdup ("/");
+        {
+          ctx->group_is_valid = TRUE;
+          g_string_assign (ctx->path, "/");
+        }
 
-      keys = g_key_file_get_keys (keyfile, group, NULL, NULL);
-      g_assert (keys != NULL);
+      ctx->prefix_len = ctx->path->len;
+    }
 
-      for (j = 0; keys[j]; j++)
-        {
-          const gchar *key = keys[j];
-          GError *error = NULL;
-          gchar *value_str;
-          GVariant *value;
-          gchar *path;
+  if (!ctx->group_is_valid)
+    return TRUE;
 
-          if (strchr (key, '/'))
-            {
-              g_warning ("%s: [%s]: ignoring invalid key name: %s\n", filename_fyi, group, key);
-              continue;
-            }
+  if (strchr (key, '/'))
+    {
+      g_warning ("%s: [%s]: ignoring invalid key name: %s\n", ctx->filename_fyi, group, key);
+      return TRUE;
+    }
 
-          value_str = g_key_file_get_value (keyfile, group, key, NULL);
-          g_assert (value_str != NULL);
+  value = dconf_keyfile_parse_value (value_str, &error);
 
-          value = g_variant_parse (NULL, value_str, NULL, NULL, &error);
-          g_free (value_str);
+  if (value == NULL)
+    {
+      g_warning ("%s: [%s]: %s: skipping invalid value: %s (%s)\n",
+                 ctx->filename_fyi, group, key, value_str, error->message);
+      g_error_free (error);
+      return TRUE;
+    }
 
-          if (value == NULL)
-            {
-              g_warning ("%s: [%s]: %s: skipping invalid value: %s (%s)\n",
-                         filename_fyi, group, key, value_str, error->message);
-              g_error_free (error);
-              continue;
-            }
+  g_string_truncate (ctx->path, ctx->prefix_len);
+  g_string_append (ctx->path, key);
+  dconf_changeset_set (ctx->changeset, ctx->path->str, value);
+  g_variant_unref (value);
 
-          path = g_strconcat (key_prefix, key, NULL);
-          dconf_changeset_set (changeset, path, value);
-          g_variant_unref (value);
-          g_free (path);
-        }
+  return TRUE;
+}
 
-      g_free (key_prefix);
-      g_strfreev (keys);
-    }
+static DConfChangeset *
+dconf_keyfile_to_changeset (const gchar  *contents,
+                            const gchar  *filename_fyi,
+                            GError      **error)
+{
+  KeyfileParseContext ctx = { 0, };
+
+  ctx.changeset = dconf_changeset_new_database (NULL);
+  ctx.filename_fyi = filename_fyi;
+  ctx.group = g_string_new (NULL);
+  ctx.path = g_string_new (NULL);
+
+  if (contents && !dconf_keyfile_parse (contents, -1, dconf_keyfile_add_key, &ctx, error))
+    g_clear_pointer (&ctx.changeset, dconf_changeset_unref);
+
+  g_string_free (ctx.group, TRUE);
+  g_string_free (ctx.path, TRUE);
+
+  return ctx.changeset;
+}
+
+/* The GKeyFile is only needed for writing changes back to the file
+ * (keeping any comments in it), so it is loaded the first time that
+ * happens rather than on every begin().
+ */
+static GKeyFile *
+dconf_keyfile_writer_get_keyfile (DConfKeyfileWriter *kfw)
+{
+  if (kfw->keyfile == NULL)
+    {
+      GError *error = NULL;
+
+      kfw->keyfile = g_key_file_new ();
 
-  g_strfreev (groups);
+      /* This can't really fail: begin() already parsed the contents */
+      if (kfw->contents && !g_key_file_load_from_data (kfw->keyfile, kfw->contents, -1, G_KEY_FILE_KEEP_COMMENTS, &error))
+        {
+          g_warning ("%s: %s", kfw->filename, error->message);
+          g_error_free (error);
+        }
+    }
 
-  return changeset;
+  return kfw->keyfile;
 }
 
 static void
@@ -258,22 +299,17 @@ dconf_keyfile_writer_begin (DConfWriter  *writer,
       g_clear_error (&local_error);
     }
 
-  kfw->keyfile = g_key_file_new ();
-
-  if (kfw->contents)
+  contents = dconf_keyfile_to_changeset (kfw->contents, kfw->filename, &local_error);
+  if (contents == NULL)
     {
-      if (!g_key_file_load_from_data (kfw->keyfile, kfw->contents, -1, G_KEY_FILE_KEEP_COMMENTS, &local_error))
-        {
-          g_clear_pointer (&kfw->keyfile, g_key_file_free);
-          g_clear_pointer (&kfw->contents, g_free);
-          g_propagate_error (error, local_error);
-          return FALSE;
-        }
+      g_clear_pointer (&kfw->contents, g_free);
+      g_propagate_error (error, local_error);
+      return FALSE;
     }
 
   if (!DCONF_WRITER_CLASS (dconf_keyfile_writer_parent_class)->begin (writer, error))
     {
-      g_clear_pointer (&kfw->keyfile, g_key_file_free);
+      dconf_changeset_unref (contents);
       return FALSE;
     }
 
@@ -284,7 +320,6 @@ dconf_keyfile_writer_begin (DConfWriter  *writer,
    * making changes to the file and also the case of starting for the
    * first time.
    */
-  contents = dconf_keyfile_to_changeset (kfw->keyfile, kfw->filename);
   changes = dconf_writer_diff (writer, contents);
 
   if (changes)
@@ -326,7 +361,7 @@ dconf_keyfile_writer_change (DConfWriter    *writer,
            *
            * Easiest way to do this:
            */
-          g_key_file_free (kfw->keyfile);
+          g_clear_pointer (&kfw->keyfile, g_key_file_free);
           kfw->keyfile = g_key_file_new ();
         }
       else if (g_str_has_suffix (path, "/"))
@@ -346,7 +381,7 @@ dconf_keyfile_writer_change (DConfWriter    *writer,
            * with the group name in the middle.
            */
           group_to_remove = g_strndup (path + 1, strlen (path) - 2);
-          g_key_file_remove_group (kfw->keyfile, group_to_remove, NULL);
+          g_key_file_remove_group (dconf_keyfile_writer_get_keyfile (kfw), group_to_remove, NULL);
           g_free (group_to_remove);
 
           /* Now the rest...
@@ -391,11 +426,11 @@ dconf_keyfile_writer_change (DConfWriter    *writer,
               gchar *printed;
 
               printed = g_variant_print (value, TRUE);
-              g_key_file_set_value (kfw->keyfile, group, key, printed);
+              g_key_file_set_value (dconf_keyfile_writer_get_keyfile (kfw), group, key, printed);
               g_free (printed);
             }
           else
-            g_key_file_remove_key (kfw->keyfile, group, key, NULL);
+            g_key_file_remove_key (dconf_keyfile_writer_get_keyfile (kfw), group, key, NULL);
 
           g_free (group);
           g_free (key);
@@ -411,39 +446,43 @@ dconf_keyfile_writer_commit (DConfWriter  *writer,
 {
   DConfKeyfileWriter *kfw = (DConfKeyfileWriter *) writer;
 
-  /* Pretty simple.  Write the keyfile. */
-  {
-    gchar *data;
-    gsize size;
-
-    /* docs say: "Note that this function never reports an error" */
-    data = g_key_file_to_data (kfw->keyfile, &size, NULL);
-
-    /* don't write it again if nothing changed */
-    if (!kfw->contents || !g_str_equal (kfw->contents, data))
-      {
-        if (!g_file_set_contents (kfw->filename, data, size, error))
-          {
-            gchar *dirname;
-
-            /* Maybe it failed because the directory doesn't exist.  Try
-             * again, after mkdir().
-             */
-            dirname = g_path_get_dirname (kfw->filename);
-            g_mkdir_with_parents (dirname, 0777);
-            g_free (dirname);
-
-            g_clear_error (error);
-            if (!g_file_set_contents (kfw->filename, data, size, error))
-              {
-                g_free (data);
-                return FALSE;
-              }
-          }
-      }
-
-    g_free (data);
-  }
+  /* Pretty simple.  Write the keyfile.
+   *
+   * If it was never loaded then none of the changes touched it.
+   */
+  if (kfw->keyfile != NULL)
+    {
+      gchar *data;
+      gsize size;
+
+      /* docs say: "Note that this function never reports an error" */
+      data = g_key_file_to_data (kfw->keyfile, &size, NULL);
+
+      /* don't write it again if nothing changed */
+      if (!kfw->contents || !g_str_equal (kfw->contents, data))
+        {
+          if (!g_file_set_contents (kfw->filename, data, size, error))
+            {
+              gchar *dirname;
+
+              /* Maybe it failed because the directory doesn't exist.  Try
+               * again, after mkdir().
+               */
+              dirname = g_path_get_dirname (kfw->filename);
+              g_mkdir_with_parents (dirname, 0777);
+              g_free (dirname);
+
+              g_clear_error (error);
+              if (!g_file_set_contents (kfw->filename, data, size, error))
+                {
+                  g_free (data);
+                  return FALSE;
+                }
+            }
+        }
+
+      g_free (data);
+    }
 
   /* Failing to update the shm file after writing the keyfile is
    * unlikely to occur.  It can only happen if the runtime dir hits
@@ -480,11 +519,10 @@ dconf_keyfile_update (gpointer user_data)
 {
   DConfKeyfileWriter *kfw = user_data;
 
-  if (dconf_keyfile_writer_begin (DCONF_WRITER (kfw), NULL))
-    {
-      dconf_keyfile_writer_commit (DCONF_WRITER (kfw), NULL);
-      dconf_keyfile_writer_end (DCONF_WRITER (kfw));
-    }
+  /* Goes through the writer's queue, since a commit may be in progress
+   * in the thread pool.
+   */
+  dconf_writer_refresh (DCONF_WRITER (kfw));
 
   kfw->scheduled_update = 0;
 
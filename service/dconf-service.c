@@ -25,9 +25,12 @@
 #include "dconf-writer.h"
 #include "dconf-blame.h"
 
+#include <glib/gstdio.h>
 #include <glib-unix.h>
 #include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 typedef GApplicationClass DConfServiceClass;
 typedef struct
@@ -40,6 +43,12 @@ typedef struct
   GHashTable  *writers;
   GArray      *subtree_ids;
 
+  /* Clients can also talk to us directly, over a private socket */
+  GDBusConnection *connection;
+  GDBusServer     *server;
+  gchar           *socket_path;
+  GHashTable      *peers;
+
   gboolean     released;
 } DConfService;
 
@@ -190,7 +199,11 @@ dconf_service_get_writer (DConfService    *service,
       writer = dconf_writer_new (writer_type, name);
       g_hash_table_insert (writers, g_strdup (name), writer);
       object_path = g_strjoin ("/", base_path, name, NULL);
-      g_dbus_interface_skeleton_export (writer, connection, object_path, &error);
+
+      /* Signals always go out on the bus, even if the writer was
+       * created for a call from a peer.
+       */
+      g_dbus_interface_skeleton_export (writer, service->connection, object_path, &error);
       g_assert_no_error (error);
       g_free (object_path);
     }
@@ -217,22 +230,166 @@ dconf_service_subtree_dispatch (GDBusConnection *connection,
   return g_dbus_interface_skeleton_get_vtable (*out_user_data);
 }
 
-static gboolean
-dconf_service_dbus_register (GApplication     *application,
-                             GDBusConnection  *connection,
-                             const gchar      *object_path,
-                             GError          **error)
+static void
+dconf_service_register_subtrees (DConfService    *service,
+                                 GDBusConnection *connection,
+                                 GArray          *subtree_ids)
 {
   const GDBusSubtreeVTable subtree_vtable = {
     dconf_service_subtree_enumerate,
     dconf_service_subtree_introspect,
     dconf_service_subtree_dispatch
   };
-  DConfService *service = DCONF_SERVICE (application);
   GError *local_error = NULL;
   GList *node;
   guint id;
 
+  for (node = g_io_extension_point_get_extensions (service->extension_point); node; node = node->next)
+    {
+      gchar *path;
+
+      path = g_strconcat ("/ca/desrt/dconf/", g_io_extension_get_name (node->data), NULL);
+      id = g_dbus_connection_register_subtree (connection, path, &subtree_vtable,
+                                               G_DBUS_SUBTREE_FLAGS_DISPATCH_TO_UNENUMERATED_NODES,
+                                               g_object_ref (service), g_object_unref, &local_error);
+      g_assert_no_error (local_error);
+      g_array_append_vals (subtree_ids, &id, 1);
+      g_free (path);
+    }
+}
+
+static void
+dconf_service_peer_closed (GDBusConnection *connection,
+                           gboolean         remote_peer_vanished,
+                           GError          *error,
+                           gpointer         user_data)
+{
+  DConfService *service = user_data;
+  GArray *subtree_ids;
+  guint i;
+
+  subtree_ids = g_hash_table_lookup (service->peers, connection);
+  g_assert (subtree_ids != NULL);
+
+  for (i = 0; i < subtree_ids->len; i++)
+    g_dbus_connection_unregister_subtree (connection, g_array_index (subtree_ids, guint, i));
+
+  g_signal_handlers_disconnect_by_func (connection, dconf_service_peer_closed, service);
+  g_hash_table_remove (service->peers, connection);
+}
+
+static gboolean
+dconf_service_new_connection (GDBusServer     *server,
+                              GDBusConnection *connection,
+                              gpointer         user_data)
+{
+  DConfService *service = user_data;
+  GArray *subtree_ids;
+
+  /* Peers get the same objects as the bus.  The writers only emit their
+   * signals on the bus, though.
+   */
+  subtree_ids = g_array_new (FALSE, TRUE, sizeof (guint));
+  dconf_service_register_subtrees (service, connection, subtree_ids);
+  g_hash_table_insert (service->peers, g_object_ref (connection), subtree_ids);
+  g_signal_connect (connection, "closed", G_CALLBACK (dconf_service_peer_closed), service);
+
+  return TRUE;
+}
+
+static gboolean
+dconf_service_authorize_peer (GDBusAuthObserver *observer,
+                              GIOStream         *stream,
+                              GCredentials      *credentials,
+                              gpointer           user_data)
+{
+  /* The socket is in a private directory anyway, but make sure */
+  return credentials != NULL && g_credentials_get_unix_user (credentials, NULL) == getuid ();
+}
+
+static void
+dconf_service_start_server (DConfService *service)
+{
+  GDBusAuthObserver *observer;
+  GError *error = NULL;
+  gchar *dirname;
+  gchar *escaped;
+  gchar *address;
+  gchar *guid;
+
+  dirname = g_build_filename (g_get_user_runtime_dir (), "dconf-service", NULL);
+  service->socket_path = g_build_filename (dirname, "socket", NULL);
+
+  if (g_mkdir_with_parents (dirname, 0700) != 0)
+    {
+      g_warning ("Unable to create directory '%s': %s", dirname, g_strerror (errno));
+      g_free (dirname);
+      return;
+    }
+  g_free (dirname);
+
+  /* We own the bus name, so any existing socket is stale */
+  g_unlink (service->socket_path);
+
+  escaped = g_dbus_address_escape_value (service->socket_path);
+  address = g_strconcat ("unix:path=", escaped, NULL);
+  g_free (escaped);
+
+  observer = g_dbus_auth_observer_new ();
+  g_signal_connect (observer, "authorize-authenticated-peer", G_CALLBACK (dconf_service_authorize_peer), NULL);
+
+  guid = g_dbus_generate_guid ();
+  service->server = g_dbus_server_new_sync (address, G_DBUS_SERVER_FLAGS_NONE, guid, observer, NULL, &error);
+  g_object_unref (observer);
+  g_free (address);
+  g_free (guid);
+
+  if (service->server == NULL)
+    {
+      /* Clients will just use the bus */
+      g_warning ("Unable to listen on '%s': %s", service->socket_path, error->message);
+      g_error_free (error);
+      return;
+    }
+
+  g_signal_connect (service->server, "new-connection", G_CALLBACK (dconf_service_new_connection), service);
+  g_dbus_server_start (service->server);
+}
+
+static void
+dconf_service_stop_server (DConfService *service)
+{
+  GHashTableIter iter;
+  gpointer connection;
+
+  if (service->server)
+    {
+      g_dbus_server_stop (service->server);
+      g_clear_object (&service->server);
+      g_unlink (service->socket_path);
+    }
+
+  /* Peers will fall back to the bus */
+  g_hash_table_iter_init (&iter, service->peers);
+  while (g_hash_table_iter_next (&iter, &connection, NULL))
+    {
+      g_object_ref (connection);
+      dconf_service_peer_closed (connection, FALSE, NULL, service);
+      g_dbus_connection_close (connection, NULL, NULL, NULL);
+      g_object_unref (connection);
+      g_hash_table_iter_init (&iter, service->peers);
+    }
+}
+
+static gboolean
+dconf_service_dbus_register (GApplication     *application,
+                             GDBusConnection  *connection,
+                             const gchar      *object_path,
+                             GError          **error)
+{
+  DConfService *service = DCONF_SERVICE (application);
+  GError *local_error = NULL;
+
   service->extension_point = g_io_extension_point_register ("dconf-backend");
   g_io_extension_point_set_required_type (service->extension_point, DCONF_TYPE_WRITER);
   g_io_extension_point_implement ("dconf-backend", DCONF_TYPE_WRITER, "Writer", 0);
@@ -247,18 +404,8 @@ dconf_service_dbus_register (GApplication     *application,
       g_assert_no_error (local_error);
     }
 
-  for (node = g_io_extension_point_get_extensions (service->extension_point); node; node = node->next)
-    {
-      gchar *path;
-
-      path = g_strconcat ("/ca/desrt/dconf/", g_io_extension_get_name (node->data), NULL);
-      id = g_dbus_connection_register_subtree (connection, path, &subtree_vtable,
-                                               G_DBUS_SUBTREE_FLAGS_DISPATCH_TO_UNENUMERATED_NODES,
-                                               g_object_ref (service), g_object_unref, &local_error);
-      g_assert_no_error (local_error);
-      g_array_append_vals (service->subtree_ids, &id, 1);
-      g_free (path);
-    }
+  service->connection = connection;
+  dconf_service_register_subtrees (service, connection, service->subtree_ids);
 
   return TRUE;
 }
@@ -281,6 +428,7 @@ dconf_service_dbus_unregister (GApplication    *application,
   for (i = 0; i < service->subtree_ids->len; i++)
     g_dbus_connection_unregister_subtree (connection, g_array_index (service->subtree_ids, guint, i));
   g_array_set_size (service->subtree_ids, 0);
+  service->connection = NULL;
 }
 
 static void
@@ -296,11 +444,40 @@ dconf_service_startup (GApplication *application)
   g_unix_signal_add (SIGHUP, dconf_service_signalled, service);
 
   g_application_hold (application);
+
+  dconf_service_start_server (service);
 }
 
 static void
 dconf_service_shutdown (GApplication *application)
 {
+  DConfService *service = DCONF_SERVICE (application);
+  GHashTableIter iter;
+  gpointer table;
+
+  dconf_service_stop_server (service);
+
+  /* Don't lose any changes that are still waiting to be committed */
+  g_hash_table_iter_init (&iter, service->writers);
+  while (g_hash_table_iter_next (&iter, NULL, &table))
+    {
+      GHashTableIter writer_iter;
+      gpointer writer;
+
+      g_hash_table_iter_init (&writer_iter, table);
+      while (g_hash_table_iter_next (&writer_iter, NULL, &writer))
+        {
+          dconf_writer_flush (writer);
+          g_dbus_interface_skeleton_unexport (writer);
+        }
+    }
+
+  /* Finalizing the writers invalidates their journals, so clients go
+   * back to D-Bus (and start the next service) instead of waiting on a
+   * journal that nobody is writing.
+   */
+  g_hash_table_remove_all (service->writers);
+
   G_APPLICATION_CLASS (dconf_service_parent_class)
     ->shutdown (application);
 }
@@ -310,6 +487,7 @@ dconf_service_init (DConfService *service)
 {
   service->writers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
   service->subtree_ids = g_array_new (FALSE, TRUE, sizeof (guint));
+  service->peers = g_hash_table_new_full (NULL, NULL, g_object_unref, (GDestroyNotify) g_array_unref);
 }
 
 static void
@@ -319,6 +497,8 @@ dconf_service_finalize (GObject *object)
 
   g_assert_cmpint (service->subtree_ids->len, ==, 0);
   g_array_free (service->subtree_ids, TRUE);
+  g_hash_table_unref (service->peers);
+  g_free (service->socket_path);
 
   G_OBJECT_CLASS (dconf_service_parent_class)->finalize (object);
 }
@@ -23,10 +23,14 @@
 #include "dconf-writer.h"
 
 #include "../shm/dconf-shm.h"
+#include "../shm/dconf-journal.h"
+#include "../shm/dconf-shm-db.h"
+#include "../common/dconf-paths.h"
 #include "dconf-gvdb-utils.h"
 #include "dconf-generated.h"
 #include "dconf-blame.h"
 
+#include <glib/gstdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -34,6 +38,25 @@
 #include <errno.h>
 #include <stdio.h>
 
+typedef enum
+{
+  DCONF_WRITER_DURABILITY_STRICT,
+  DCONF_WRITER_DURABILITY_BATCHED,
+  DCONF_WRITER_DURABILITY_WRITE_BACK
+} DConfWriterDurability;
+
+/* How long (in seconds) to wait before syncing the database to disk in
+ * the "batched" mode, and before copying the live database back to the
+ * config directory in the "write-back" mode.
+ */
+#define DCONF_WRITER_BATCHED_SYNC_INTERVAL      1
+#define DCONF_WRITER_WRITE_BACK_SYNC_INTERVAL   30
+
+/* How long (in seconds) after the last commit to keep the database we
+ * built in memory before switching over to a mapping of the file.
+ */
+#define DCONF_WRITER_IDLE_TIMEOUT               60
+
 struct _DConfWriterPrivate
 {
   gchar *filename;
@@ -43,11 +66,68 @@ struct _DConfWriterPrivate
   guint64 tag;
   gboolean need_write;
 
+  /* The database is the commited table with the uncommited changes
+   * on top of it.  The table is either the contents that we built at
+   * the last commit (trusted, and kept in commited_content) or a
+   * mapping of the file on disk.
+   */
+  gboolean loaded;
+  GvdbTable *commited_table;
+  GBytes *commited_content;
   DConfChangeset *uncommited_values;
-  DConfChangeset *commited_values;
+  guint idle_source;
 
   GQueue uncommited_changes;
   GQueue commited_changes;
+
+  /* Everything is done in the main context except for the writing of
+   * the database (and syncing it), which is done in the thread pool.
+   * While 'job' is set, the fields above belong to the pool thread.
+   * The lock and the condition are for the job's 'done' flag.
+   */
+  GMainContext *context;
+  GMutex lock;
+  GCond cond;
+  struct _DConfWriterJob *job;
+  gboolean flushing;
+  GQueue pending_changes;
+  guint flush_source;
+  gboolean sync_requested;
+  gboolean idle_requested;
+
+  DConfWriterDurability durability;
+  gchar *live_filename;
+  gboolean have_live_copy;
+  guint sync_source;
+
+  /* Clients that use the journal don't need the Notify signal */
+  DConfJournal *journal;
+  guint64 generation;
+
+  /* Non-native databases can be kept in a buffered file instead
+   * of being replaced on each commit.  'stale_file' is set while the
+   * old (plain) file still needs to be removed.  The buffered
+   * file is written back to the plain one and removed when we are done
+   * with it, so that clients never read one that nobody updates.
+   */
+  DConfShmDb *shm_db;
+  gboolean stale_file;
+
+  /* If the database is sharded then the dirs listed in DCONF_SHARDS
+   * each have their own file (and shm flag), so that a change to one
+   * of them doesn't rewrite the rest.  'shards' is the layout that is
+   * on disk, and 'resplit' is set when that is not the configured one.
+   * The first two are NULL for the non-native databases.
+   */
+  GHashTable *shard_config;
+  GPtrArray *shards;
+  gboolean resplit;
+
+  /* Bulk changes that are being sent to us in pieces.  Only touched
+   * from the main thread.
+   */
+  GHashTable *transactions;
+  guint next_transaction;
 };
 
 typedef struct
@@ -56,6 +136,68 @@ typedef struct
   gchar          *tag;
 } TaggedChange;
 
+typedef struct
+{
+  gchar          *dir;
+  gchar          *name;
+  gchar          *filename;
+  GvdbTable      *table;
+  GBytes         *content;
+  DConfChangeset *changes;
+} DConfWriterShard;
+
+typedef struct
+{
+  GDBusMethodInvocation *invocation;
+  DConfChangeset        *changeset;
+  gchar                 *tag;
+  gboolean               written;
+} PendingChange;
+
+typedef struct _DConfWriterJob
+{
+  GQueue    batch;
+  gboolean  begun;
+  gboolean  write;
+  gboolean  sync;
+  gboolean  idle;
+  gboolean  done;
+  GError   *error;
+} DConfWriterJob;
+
+typedef struct
+{
+  DConfWriter     *writer;
+  guint            id;
+  GDBusConnection *connection;
+  gchar           *sender;
+  guint            watch_id;
+  gulong           closed_id;
+  GQueue           changesets;
+  guint            n_pieces;
+  gsize            size;
+} Transaction;
+
+/* Nothing that a client sends us in pieces is kept for longer than the
+ * transaction, but it is all in memory until then.
+ */
+#define DCONF_WRITER_MAX_TRANSACTION_SIZE       (64 * 1024 * 1024)
+#define DCONF_WRITER_MAX_TRANSACTION_PIECES     4096
+
+/* How long (in milliseconds) to wait for further Change calls before
+ * committing the ones that we have already received.  Zero means that
+ * we commit as soon as the mainloop is idle, which still merges any
+ * calls that were queued up behind a commit that was in progress.
+ */
+static guint dconf_writer_commit_delay;
+
+/* Databases are written by a small pool of threads, so that a slow
+ * write to one database doesn't hold up any of the others (or the main
+ * loop).  Each writer only ever uses one of them at a time.
+ */
+#define DCONF_WRITER_MAX_THREADS 4
+static GThreadPool *dconf_writer_pool;
+
 static void dconf_writer_iface_init (DConfDBusWriterIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (DConfWriter, dconf_writer, DCONF_DBUS_TYPE_WRITER_SKELETON,
@@ -88,294 +230,2010 @@ static gchar *
 dconf_writer_get_tag (DConfWriter *writer)
 {
   GDBusConnection *connection;
+  const gchar *unique_name;
 
   connection = g_dbus_interface_skeleton_get_connection (G_DBUS_INTERFACE_SKELETON (writer));
 
+  /* Peer-to-peer connections have no unique name */
+  unique_name = g_dbus_connection_get_unique_name (connection);
+  if (unique_name == NULL)
+    unique_name = "";
+
   return g_strdup_printf ("%s:%s:%" G_GUINT64_FORMAT,
-                          g_dbus_connection_get_unique_name (connection),
-                          writer->priv->name, writer->priv->tag++);
+                          unique_name, writer->priv->name, writer->priv->tag++);
 }
 
-static gboolean
-dconf_writer_real_begin (DConfWriter  *writer,
-                         GError      **error)
+static DConfWriterShard *
+dconf_writer_shard_new (DConfWriter *writer,
+                        const gchar *dir,
+                        const gchar *name)
 {
-  /* If this is the first time, populate the value table with the
-   * existing values.
-   */
-  if (writer->priv->commited_values == NULL)
-    {
-      gboolean missing;
+  DConfWriterShard *shard;
 
-      writer->priv->commited_values = dconf_gvdb_utils_read_and_back_up_file (writer->priv->filename, &missing, error);
+  shard = g_slice_new0 (DConfWriterShard);
+  shard->dir = g_strdup (dir);
+  shard->name = g_strdup (name);
+  shard->filename = g_build_filename (writer->priv->basepath, name, NULL);
 
-      if (!writer->priv->commited_values)
-        return FALSE;
+  return shard;
+}
 
-      /* If this is a non-native writer and the file doesn't exist, we
-       * will need to write it on commit so that the client can open it.
-       */
-      if (missing && !writer->priv->native)
-        writer->priv->need_write = TRUE;
-    }
+static void
+dconf_writer_shard_free (gpointer data)
+{
+  DConfWriterShard *shard = data;
 
-  writer->priv->uncommited_values = dconf_changeset_new_database (writer->priv->commited_values);
+  g_clear_pointer (&shard->table, gvdb_table_free);
+  g_clear_pointer (&shard->content, g_bytes_unref);
+  g_clear_pointer (&shard->changes, dconf_changeset_unref);
+  g_free (shard->dir);
+  g_free (shard->name);
+  g_free (shard->filename);
 
-  return TRUE;
+  g_slice_free (DConfWriterShard, shard);
 }
 
-static void
-dconf_writer_real_change (DConfWriter    *writer,
-                          DConfChangeset *changeset,
-                          const gchar    *tag)
+/* The shard that holds @path, if it is a key or a dir that is in one */
+static DConfWriterShard *
+dconf_writer_find_shard (DConfWriter *writer,
+                         const gchar *path)
 {
-  g_return_if_fail (writer->priv->uncommited_values != NULL);
-  DConfChangeset *effective_changeset = dconf_changeset_filter_changes (writer->priv->uncommited_values,
-                                                                        changeset);
+  DConfWriterShard *result = NULL;
+  guint i;
 
-  if (effective_changeset)
+  if (writer->priv->shards == NULL)
+    return NULL;
+
+  /* The longest match wins, the same as in the engine */
+  for (i = 0; i < writer->priv->shards->len; i++)
     {
-      dconf_changeset_change (writer->priv->uncommited_values, effective_changeset);
-      if (tag)
-        {
-          TaggedChange *change;
+      DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
 
-          change = g_slice_new (TaggedChange);
-          change->changeset = dconf_changeset_ref (effective_changeset);
-          change->tag = g_strdup (tag);
+      if (g_str_has_prefix (path, shard->dir) &&
+          (result == NULL || strlen (shard->dir) > strlen (result->dir)))
+        result = shard;
+    }
 
-          g_queue_push_tail (&writer->priv->uncommited_changes, change);
-        }
+  return result;
+}
 
-      writer->priv->need_write = TRUE;
-    }
+static GVariant *
+dconf_writer_lookup (DConfWriter *writer,
+                     const gchar *key)
+{
+  DConfWriterShard *shard;
+  GVariant *value;
+
+  if (writer->priv->uncommited_values && dconf_changeset_get (writer->priv->uncommited_values, key, &value))
+    return value;
+
+  shard = dconf_writer_find_shard (writer, key);
+  if (shard != NULL)
+    return shard->table ? gvdb_table_get_value (shard->table, key) : NULL;
+
+  if (writer->priv->commited_table)
+    return gvdb_table_get_value (writer->priv->commited_table, key);
+
+  return NULL;
 }
 
 static gboolean
-dconf_writer_real_commit (DConfWriter  *writer,
-                          GError      **error)
+dconf_writer_is_not_below (const gchar *path,
+                           GVariant    *value,
+                           gpointer     user_data)
 {
-  gint invalidate_fd = -1;
+  const gchar *dir = user_data;
 
-  if (!writer->priv->need_write)
-    {
-      g_assert (g_queue_is_empty (&writer->priv->uncommited_changes));
-      g_assert (g_queue_is_empty (&writer->priv->commited_changes));
-      dconf_changeset_unref (writer->priv->uncommited_values);
-      writer->priv->uncommited_values = NULL;
-
-      return TRUE;
-    }
+  return value == NULL || !g_str_has_prefix (path, dir);
+}
 
-  if (!writer->priv->native)
-    /* If it fails, it doesn't matter... */
-    invalidate_fd = open (writer->priv->filename, O_WRONLY);
+static gboolean
+dconf_writer_table_has_keys_below (DConfWriter *writer,
+                                   GvdbTable   *table,
+                                   const gchar *dir)
+{
+  gboolean found = FALSE;
+  gchar **children;
+  gint i;
 
-  if (!dconf_gvdb_utils_write_file (writer->priv->filename, writer->priv->uncommited_values, error))
+  children = gvdb_table_list (table, dir);
+  if (children == NULL)
     return FALSE;
 
-  if (writer->priv->native)
-    dconf_shm_flag (writer->priv->name);
-
-  if (invalidate_fd != -1)
+  for (i = 0; !found && children[i]; i++)
     {
-      write (invalidate_fd, "\0\0\0\0\0\0\0\0", 8);
-      close (invalidate_fd);
-    }
+      gchar *path = g_strconcat (dir, children[i], NULL);
 
-  writer->priv->need_write = FALSE;
-
-  if (writer->priv->commited_values)
-    dconf_changeset_unref (writer->priv->commited_values);
-  writer->priv->commited_values = writer->priv->uncommited_values;
-  writer->priv->uncommited_values = NULL;
+      if (g_str_has_suffix (path, "/"))
+        found = dconf_writer_table_has_keys_below (writer, table, path);
+      else
+        found = !writer->priv->uncommited_values ||
+                !dconf_changeset_get (writer->priv->uncommited_values, path, NULL);
 
-  {
-    GQueue empty_queue = G_QUEUE_INIT;
+      g_free (path);
+    }
 
-    g_assert (g_queue_is_empty (&writer->priv->commited_changes));
-    writer->priv->commited_changes = writer->priv->uncommited_changes;
-    writer->priv->uncommited_changes = empty_queue;
-  }
+  g_strfreev (children);
 
-  return TRUE;
+  return found;
 }
 
-static void
-dconf_writer_real_end (DConfWriter *writer)
+static gboolean
+dconf_writer_has_keys_below (DConfWriter *writer,
+                             const gchar *dir)
 {
-  while (!g_queue_is_empty (&writer->priv->uncommited_changes))
-    {
-      TaggedChange *change = g_queue_pop_head (&writer->priv->uncommited_changes);
-      dconf_changeset_unref (change->changeset);
-      g_free (change->tag);
-      g_slice_free (TaggedChange, change);
-    }
+  if (writer->priv->uncommited_values &&
+      !dconf_changeset_all (writer->priv->uncommited_values, dconf_writer_is_not_below, (gpointer) dir))
+    return TRUE;
 
-  while (!g_queue_is_empty (&writer->priv->commited_changes))
+  if (writer->priv->commited_table && dconf_writer_table_has_keys_below (writer, writer->priv->commited_table, dir))
+    return TRUE;
+
+  if (writer->priv->shards != NULL)
     {
-      TaggedChange *change = g_queue_pop_head (&writer->priv->commited_changes);
-      const gchar *prefix;
-      const gchar * const *paths;
-      guint n;
+      guint i;
 
-      n = dconf_changeset_describe (change->changeset, &prefix, &paths, NULL);
-      g_assert (n != 0);
-      dconf_dbus_writer_emit_notify_signal (DCONF_DBUS_WRITER (writer), prefix, paths, change->tag);
-      dconf_changeset_unref (change->changeset);
-      g_free (change->tag);
-      g_slice_free (TaggedChange, change);
+      for (i = 0; i < writer->priv->shards->len; i++)
+        {
+          DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+          if (shard->table != NULL &&
+              (g_str_has_prefix (shard->dir, dir) || g_str_has_prefix (dir, shard->dir)) &&
+              dconf_writer_table_has_keys_below (writer, shard->table, dir))
+            return TRUE;
+        }
     }
 
-  g_clear_pointer (&writer->priv->uncommited_values, dconf_changeset_unref);
+  return FALSE;
 }
 
-static gboolean
-dconf_writer_begin (DConfWriter  *writer,
-                    GError      **error)
+/* Like dconf_changeset_filter_changes(), but against the table plus
+ * the uncommited changes, without having to load the whole table.
+ */
+static DConfChangeset *
+dconf_writer_filter_changes (DConfWriter    *writer,
+                             DConfChangeset *changes)
 {
-  return DCONF_WRITER_GET_CLASS (writer)->begin (writer, error);
-}
+  DConfChangeset *result = NULL;
+  const gchar * const *paths;
+  GVariant * const *values;
+  const gchar *prefix;
+  guint n, i;
 
-static void
-dconf_writer_change (DConfWriter    *writer,
-                     DConfChangeset *changeset,
-                     const gchar    *tag)
-{
-  DCONF_WRITER_GET_CLASS (writer)->change (writer, changeset, tag);
+  n = dconf_changeset_describe (changes, &prefix, &paths, &values);
+
+  for (i = 0; i < n; i++)
+    {
+      gboolean effective;
+      gchar *path;
+
+      path = g_strconcat (prefix, paths[i], NULL);
+
+      if (g_str_has_suffix (path, "/"))
+        effective = dconf_writer_has_keys_below (writer, path);
+      else
+        {
+          GVariant *current;
+
+          current = dconf_writer_lookup (writer, path);
+
+          if (current != NULL)
+            {
+              effective = values[i] == NULL || !g_variant_equal (values[i], current);
+              g_variant_unref (current);
+            }
+          else
+            effective = values[i] != NULL;
+        }
+
+      if (effective)
+        {
+          if (!result)
+            result = dconf_changeset_new ();
+
+          dconf_changeset_set (result, path, values[i]);
+        }
+
+      g_free (path);
+    }
+
+  return result;
 }
 
 static gboolean
-dconf_writer_commit (DConfWriter  *writer,
-                     GError      **error)
+dconf_writer_add_value (const gchar *path,
+                        GVariant    *value,
+                        gpointer     user_data)
 {
-  return DCONF_WRITER_GET_CLASS (writer)->commit (writer, error);
-}
+  DConfChangeset *database = user_data;
 
-static void
-dconf_writer_end (DConfWriter *writer)
-{
-  return DCONF_WRITER_GET_CLASS (writer)->end (writer);
+  if (value != NULL)
+    dconf_changeset_set (database, path, value);
+
+  return TRUE;
 }
 
 static void
-dconf_writer_complete_invocation (DConfDBusWriter       *dbus_writer,
-                                  GDBusMethodInvocation *invocation,
-                                  GVariant              *result,
-                                  GError                *error)
+dconf_writer_add_table_values (DConfWriter    *writer,
+                               DConfChangeset *database,
+                               GvdbTable      *table)
 {
-  if (error)
+  gchar **names;
+  gsize n_names;
+  gsize i;
+
+  names = gvdb_table_get_names (table, &n_names);
+  for (i = 0; i < n_names; i++)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      g_error_free (error);
+      if (dconf_is_key (names[i], NULL) &&
+          (!writer->priv->uncommited_values ||
+           !dconf_changeset_get (writer->priv->uncommited_values, names[i], NULL)))
+        {
+          GVariant *value;
+
+          value = gvdb_table_get_value (table, names[i]);
+
+          if (value != NULL)
+            {
+              dconf_changeset_set (database, names[i], value);
+              g_variant_unref (value);
+            }
+        }
+
+      g_free (names[i]);
     }
-  else
-    g_dbus_method_invocation_return_value (invocation, result);
+  g_free (names);
 }
 
-static gboolean
-dconf_writer_handle_init (DConfDBusWriter       *dbus_writer,
-                          GDBusMethodInvocation *invocation)
+/* Only for when we really need all of it at once */
+static DConfChangeset *
+dconf_writer_get_values (DConfWriter *writer)
 {
-  DConfWriter *writer = DCONF_WRITER (dbus_writer);
-  GError *error = NULL;
+  DConfChangeset *database;
 
-  dconf_blame_record (invocation);
+  database = dconf_changeset_new_database (NULL);
 
-  if (dconf_writer_begin (writer, &error))
-    dconf_writer_commit (writer, &error);
+  if (writer->priv->commited_table)
+    dconf_writer_add_table_values (writer, database, writer->priv->commited_table);
 
-  dconf_writer_complete_invocation (dbus_writer, invocation, NULL, error);
-  dconf_writer_end (writer);
+  if (writer->priv->shards != NULL)
+    {
+      guint i;
 
-  return TRUE;
+      for (i = 0; i < writer->priv->shards->len; i++)
+        {
+          DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+          if (shard->table != NULL)
+            dconf_writer_add_table_values (writer, database, shard->table);
+        }
+    }
+
+  if (writer->priv->uncommited_values)
+    dconf_changeset_all (writer->priv->uncommited_values, dconf_writer_add_value, database);
+
+  return database;
 }
 
+/* Opens the shards that the main table says it has */
 static gboolean
-dconf_writer_handle_change (DConfDBusWriter       *dbus_writer,
-                            GDBusMethodInvocation *invocation,
-                            GVariant              *blob)
+dconf_writer_load_shards (DConfWriter  *writer,
+                          GError      **error)
 {
-  DConfWriter *writer = DCONF_WRITER (dbus_writer);
-  DConfChangeset *changeset;
-  GError *error = NULL;
-  GVariant *tmp, *args, *result = NULL;
-  gchar *tag;
-
-  dconf_blame_record (invocation);
-
-  tmp = g_variant_new_from_data (G_VARIANT_TYPE ("a{smv}"),
-                                 g_variant_get_data (blob), g_variant_get_size (blob), FALSE,
-                                 (GDestroyNotify) g_variant_unref, g_variant_ref (blob));
-  g_variant_ref_sink (tmp);
-  args = g_variant_get_normal_form (tmp);
-  g_variant_unref (tmp);
+  GvdbTable *index = NULL;
+  guint n_shards = 0;
 
-  changeset = dconf_changeset_deserialise (args);
-  g_variant_unref (args);
+  writer->priv->shards = g_ptr_array_new_with_free_func (dconf_writer_shard_free);
 
-  tag = dconf_writer_get_tag (writer);
+  if (writer->priv->commited_table)
+    index = gvdb_table_get_table (writer->priv->commited_table, ".shards");
 
-  /* Don't bother with empty changesets... */
-  if (dconf_changeset_describe (changeset, NULL, NULL, NULL))
+  if (index != NULL)
     {
-      if (!dconf_writer_begin (writer, &error))
-        goto out;
+      gchar **dirs;
+      gsize n_dirs;
+      gsize i;
 
-      dconf_writer_change (writer, changeset, tag);
+      dirs = gvdb_table_get_names (index, &n_dirs);
+      for (i = 0; i < n_dirs; i++)
+        {
+          DConfWriterShard *shard;
+          const gchar *configured;
+          GVariant *name;
+
+          name = gvdb_table_get_value (index, dirs[i]);
+          if (name == NULL || !g_variant_is_of_type (name, G_VARIANT_TYPE_STRING) ||
+              !dconf_is_dir (dirs[i], NULL))
+            {
+              g_clear_pointer (&name, g_variant_unref);
+              continue;
+            }
+
+          shard = dconf_writer_shard_new (writer, dirs[i], g_variant_get_string (name, NULL));
+          g_ptr_array_add (writer->priv->shards, shard);
+          g_variant_unref (name);
+
+          configured = g_hash_table_lookup (writer->priv->shard_config, shard->dir);
+          if (g_strcmp0 (configured, shard->name) == 0)
+            n_shards++;
+
+          if (!dconf_gvdb_utils_open_and_back_up_file (shard->filename, &shard->table, error))
+            {
+              g_strfreev (dirs);
+              gvdb_table_free (index);
+              return FALSE;
+            }
+        }
 
-      if (!dconf_writer_commit (writer, &error))
-        goto out;
+      g_strfreev (dirs);
+      gvdb_table_free (index);
     }
 
-out:
-  if (!error)
-    result = g_variant_new ("(s)", tag);
-
-  dconf_changeset_unref (changeset);
-  g_free (tag);
-
-  dconf_writer_complete_invocation (dbus_writer, invocation, result, error);
-  dconf_writer_end (writer);
+  /* Move the keys around if the shards were configured differently */
+  if (n_shards != writer->priv->shards->len ||
+      n_shards != g_hash_table_size (writer->priv->shard_config))
+    {
+      writer->priv->resplit = TRUE;
+      writer->priv->need_write = TRUE;
+    }
 
   return TRUE;
 }
 
-static void
-dconf_writer_iface_init (DConfDBusWriterIface *iface)
-{
-  iface->handle_init = dconf_writer_handle_init;
-  iface->handle_change = dconf_writer_handle_change;
-}
-
-static void
-dconf_writer_init (DConfWriter *writer)
+/* Whether the live copy is at least as new as the file in the config
+ * dir.  Clients make the same check before reading it.
+ */
+static gboolean
+dconf_writer_live_copy_is_current (DConfWriter *writer)
 {
-  writer->priv = dconf_writer_get_instance_private (writer);
-  writer->priv->basepath = g_build_filename (g_get_user_config_dir (), "dconf", NULL);
-  writer->priv->native = TRUE;
-}
+  GStatBuf live_buf, buf;
 
-static void
-dconf_writer_set_property (GObject *object, guint prop_id,
-                           const GValue *value, GParamSpec *pspec)
-{
-  DConfWriter *writer = DCONF_WRITER (object);
+  if (g_stat (writer->priv->live_filename, &live_buf) != 0)
+    return FALSE;
 
-  g_assert_cmpint (prop_id, ==, 1);
+  if (g_stat (writer->priv->filename, &buf) != 0)
+    return TRUE;
 
-  g_assert (!writer->priv->name);
-  writer->priv->name = g_value_dup_string (value);
+  if (live_buf.st_mtim.tv_sec != buf.st_mtim.tv_sec)
+    return live_buf.st_mtim.tv_sec > buf.st_mtim.tv_sec;
 
-  writer->priv->filename = g_build_filename (writer->priv->basepath, writer->priv->name, NULL);
+  return live_buf.st_mtim.tv_nsec >= buf.st_mtim.tv_nsec;
 }
 
-static void
-dconf_writer_class_init (DConfWriterClass *class)
+static gboolean
+dconf_writer_real_begin (DConfWriter  *writer,
+                         GError      **error)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (class);
+  /* If this is the first time, open the existing database.  We only
+   * look into it as needed.
+   */
+  if (!writer->priv->loaded)
+    {
+      const gchar *filename = writer->priv->filename;
 
-  object_class->set_property = dconf_writer_set_property;
+      /* A live copy in the runtime dir (left by the "write-back" mode)
+       * is newer than the one in the config dir, unless the config dir
+       * one was replaced behind our back: then the live copy is stale.
+       */
+      if (writer->priv->live_filename && g_file_test (writer->priv->live_filename, G_FILE_TEST_EXISTS))
+        {
+          if (dconf_writer_live_copy_is_current (writer))
+            {
+              filename = writer->priv->live_filename;
+              writer->priv->have_live_copy = TRUE;
+            }
+          else
+            g_unlink (writer->priv->live_filename);
+        }
+
+      if (writer->priv->shm_db)
+        {
+          GBytes *bytes;
+
+          /* The table holds on to its slot, so the next writes go to the others */
+          bytes = dconf_shm_db_read (writer->priv->shm_db, NULL);
+          if (bytes != NULL)
+            {
+              writer->priv->commited_table = gvdb_table_new_from_bytes (bytes, FALSE, NULL);
+              g_bytes_unref (bytes);
+            }
+        }
+
+      if (writer->priv->commited_table == NULL)
+        {
+          if (!dconf_gvdb_utils_open_and_back_up_file (filename, &writer->priv->commited_table, error))
+            return FALSE;
+
+          /* A plain file left by a previous run: move it over */
+          if (writer->priv->shm_db && writer->priv->commited_table != NULL)
+            {
+              writer->priv->stale_file = TRUE;
+              writer->priv->need_write = TRUE;
+            }
+        }
+
+      if (writer->priv->shard_config && !dconf_writer_load_shards (writer, error))
+        {
+          g_clear_pointer (&writer->priv->shards, g_ptr_array_unref);
+          g_clear_pointer (&writer->priv->commited_table, gvdb_table_free);
+          return FALSE;
+        }
+
+      writer->priv->loaded = TRUE;
+
+      /* If this is a non-native writer and the file doesn't exist, we
+       * will need to write it on commit so that the client can open it.
+       */
+      if (writer->priv->commited_table == NULL && !writer->priv->native)
+        writer->priv->need_write = TRUE;
+    }
+
+  writer->priv->uncommited_values = dconf_changeset_new ();
+
+  return TRUE;
+}
+
+static void
+dconf_writer_real_change (DConfWriter    *writer,
+                          DConfChangeset *changeset,
+                          const gchar    *tag)
+{
+  DConfChangeset *effective_changeset;
+
+  g_return_if_fail (writer->priv->uncommited_values != NULL);
+
+  effective_changeset = dconf_writer_filter_changes (writer, changeset);
+
+  if (effective_changeset)
+    {
+      dconf_changeset_change (writer->priv->uncommited_values, effective_changeset);
+      if (tag)
+        {
+          TaggedChange *change;
+
+          change = g_slice_new (TaggedChange);
+          change->changeset = dconf_changeset_ref (effective_changeset);
+          change->tag = g_strdup (tag);
+
+          g_queue_push_tail (&writer->priv->uncommited_changes, change);
+        }
+
+      writer->priv->need_write = TRUE;
+      dconf_changeset_unref (effective_changeset);
+    }
+}
+
+static void
+dconf_writer_sync (DConfWriter *writer)
+{
+  GError *error = NULL;
+
+  switch (writer->priv->durability)
+    {
+    case DCONF_WRITER_DURABILITY_STRICT:
+      break;
+
+    case DCONF_WRITER_DURABILITY_BATCHED:
+      dconf_gvdb_utils_sync_file (writer->priv->filename);
+
+      if (writer->priv->shards != NULL)
+        {
+          guint i;
+
+          for (i = 0; i < writer->priv->shards->len; i++)
+            {
+              DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+              dconf_gvdb_utils_sync_file (shard->filename);
+            }
+        }
+      break;
+
+    case DCONF_WRITER_DURABILITY_WRITE_BACK:
+      /* The live copy stays where it is: clients are reading it */
+      if (writer->priv->commited_content &&
+          !dconf_gvdb_utils_write_contents (writer->priv->filename, writer->priv->commited_content, TRUE, &error))
+        {
+          g_warning ("Failed to write back dconf database '%s': %s", writer->priv->filename, error->message);
+          g_error_free (error);
+        }
+      break;
+    }
+}
+
+static void
+dconf_writer_drop_shards_to_mapping (DConfWriter *writer)
+{
+  guint i;
+
+  for (i = 0; i < writer->priv->shards->len; i++)
+    {
+      DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+      GvdbTable *table;
+
+      if (shard->content == NULL)
+        continue;
+
+      table = gvdb_table_new (shard->filename, FALSE, NULL);
+      if (table != NULL)
+        {
+          gvdb_table_free (shard->table);
+          shard->table = table;
+          g_clear_pointer (&shard->content, g_bytes_unref);
+        }
+    }
+}
+
+static void
+dconf_writer_drop_to_mapping (DConfWriter *writer)
+{
+  const gchar *filename;
+  GvdbTable *table;
+
+  if (writer->priv->shards != NULL)
+    dconf_writer_drop_shards_to_mapping (writer);
+
+  if (writer->priv->commited_content == NULL)
+    return;
+
+  if (writer->priv->have_live_copy)
+    filename = writer->priv->live_filename;
+  else
+    filename = writer->priv->filename;
+
+  /* Swap the copy that we built for a mapping of the same contents,
+   * which the kernel can share with the clients and drop at will.
+   * With a buffered file, that is the slot that we just published.
+   */
+  if (writer->priv->shm_db)
+    {
+      GBytes *bytes;
+
+      table = NULL;
+      bytes = dconf_shm_db_read (writer->priv->shm_db, NULL);
+      if (bytes != NULL)
+        {
+          table = gvdb_table_new_from_bytes (bytes, FALSE, NULL);
+          g_bytes_unref (bytes);
+        }
+    }
+  else
+    table = gvdb_table_new (filename, FALSE, NULL);
+
+  if (table != NULL)
+    {
+      gvdb_table_free (writer->priv->commited_table);
+      writer->priv->commited_table = table;
+      g_clear_pointer (&writer->priv->commited_content, g_bytes_unref);
+    }
+}
+
+static void dconf_writer_kick (DConfWriter *writer);
+
+static gboolean
+dconf_writer_sync_cb (gpointer user_data)
+{
+  DConfWriter *writer = user_data;
+
+  writer->priv->sync_source = 0;
+  writer->priv->sync_requested = TRUE;
+  dconf_writer_kick (writer);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The timers don't hold a reference: finalize takes care of them */
+static void
+dconf_writer_schedule_sync (DConfWriter *writer)
+{
+  guint interval;
+
+  if (writer->priv->durability == DCONF_WRITER_DURABILITY_WRITE_BACK)
+    interval = DCONF_WRITER_WRITE_BACK_SYNC_INTERVAL;
+  else
+    interval = DCONF_WRITER_BATCHED_SYNC_INTERVAL;
+
+  if (!writer->priv->sync_source)
+    writer->priv->sync_source = g_timeout_add_seconds (interval, dconf_writer_sync_cb, writer);
+}
+
+static gboolean
+dconf_writer_idle_cb (gpointer user_data)
+{
+  DConfWriter *writer = user_data;
+
+  /* Wait until the latest contents are also in the config dir */
+  if (writer->priv->sync_source || writer->priv->sync_requested)
+    return G_SOURCE_CONTINUE;
+
+  writer->priv->idle_source = 0;
+  writer->priv->idle_requested = TRUE;
+  dconf_writer_kick (writer);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+dconf_writer_schedule_idle (DConfWriter *writer)
+{
+  if (writer->priv->idle_source)
+    g_source_remove (writer->priv->idle_source);
+
+  writer->priv->idle_source = g_timeout_add_seconds_full (G_PRIORITY_LOW, DCONF_WRITER_IDLE_TIMEOUT,
+                                                          dconf_writer_idle_cb, writer, NULL);
+}
+
+/* What is left to do once the new contents are out */
+static void
+dconf_writer_commit_done (DConfWriter *writer)
+{
+  GQueue empty_queue = G_QUEUE_INIT;
+
+  if (writer->priv->durability != DCONF_WRITER_DURABILITY_STRICT)
+    dconf_writer_schedule_sync (writer);
+
+  writer->priv->need_write = FALSE;
+  g_clear_pointer (&writer->priv->uncommited_values, dconf_changeset_unref);
+
+  dconf_writer_schedule_idle (writer);
+
+  g_assert (g_queue_is_empty (&writer->priv->commited_changes));
+  writer->priv->commited_changes = writer->priv->uncommited_changes;
+  writer->priv->uncommited_changes = empty_queue;
+}
+
+typedef struct
+{
+  DConfWriter    *writer;
+  DConfChangeset *main_changes;
+} DConfWriterSplit;
+
+/* Sends each change to the table (or tables, for a dir reset) that it
+ * applies to.
+ */
+static gboolean
+dconf_writer_split_change (const gchar *path,
+                           GVariant    *value,
+                           gpointer     user_data)
+{
+  DConfWriterSplit *split = user_data;
+  DConfWriterShard *shard;
+  guint i;
+
+  if (!g_str_has_suffix (path, "/"))
+    {
+      shard = dconf_writer_find_shard (split->writer, path);
+      dconf_changeset_set (shard ? shard->changes : split->main_changes, path, value);
+
+      return TRUE;
+    }
+
+  shard = dconf_writer_find_shard (split->writer, path);
+  if (shard == NULL)
+    dconf_changeset_set (split->main_changes, path, value);
+
+  for (i = 0; i < split->writer->priv->shards->len; i++)
+    {
+      DConfWriterShard *other = g_ptr_array_index (split->writer->priv->shards, i);
+
+      if (other == shard || g_str_has_prefix (other->dir, path))
+        dconf_changeset_set (other->changes, path, value);
+    }
+
+  return TRUE;
+}
+
+/* Writes out the shards that @changes touch, and the main table if it
+ * is touched too.  If @resplit is set then everything is written.
+ */
+static gboolean
+dconf_writer_write_shards (DConfWriter     *writer,
+                           DConfChangeset  *changes,
+                           gboolean         resplit,
+                           GError         **error)
+{
+  gboolean durable = writer->priv->durability == DCONF_WRITER_DURABILITY_STRICT;
+  DConfWriterSplit split = { writer, NULL };
+  gboolean success = FALSE;
+  gchar **tmpnames;
+  GBytes **contents;
+  guint n_shards;
+  guint i;
+
+  split.main_changes = dconf_changeset_new ();
+  for (i = 0; i < writer->priv->shards->len; i++)
+    {
+      DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+      g_clear_pointer (&shard->changes, dconf_changeset_unref);
+      shard->changes = dconf_changeset_new ();
+    }
+
+  dconf_changeset_all (changes, dconf_writer_split_change, &split);
+
+  /* One for each shard, and the main table last */
+  n_shards = writer->priv->shards->len;
+  contents = g_new0 (GBytes *, n_shards + 1);
+  tmpnames = g_new0 (gchar *, n_shards + 1);
+
+  for (i = 0; i < n_shards; i++)
+    {
+      DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+      if (!resplit && dconf_changeset_is_empty (shard->changes))
+        continue;
+
+      contents[i] = dconf_gvdb_utils_serialise (resplit ? NULL : shard->table, shard->changes, NULL, error);
+      if (contents[i] == NULL)
+        goto out;
+    }
+
+  if (resplit || !dconf_changeset_is_empty (split.main_changes))
+    {
+      GHashTable *index;
+
+      index = g_hash_table_new (g_str_hash, g_str_equal);
+      for (i = 0; i < n_shards; i++)
+        {
+          DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+          g_hash_table_insert (index, shard->dir, shard->name);
+        }
+
+      contents[n_shards] = dconf_gvdb_utils_serialise (resplit ? NULL : writer->priv->commited_table,
+                                                       split.main_changes, index, error);
+      g_hash_table_unref (index);
+
+      if (contents[n_shards] == NULL)
+        goto out;
+    }
+
+  /* All of the files are written out before any of them is renamed
+   * into place, so that running out of space (say) part of the way
+   * through leaves the old set of files rather than a mix.
+   */
+  for (i = 0; i <= n_shards; i++)
+    {
+      const gchar *filename;
+
+      if (contents[i] == NULL)
+        continue;
+
+      if (i < n_shards)
+        filename = ((DConfWriterShard *) g_ptr_array_index (writer->priv->shards, i))->filename;
+      else
+        filename = writer->priv->filename;
+
+      tmpnames[i] = dconf_gvdb_utils_write_temp (filename, contents[i], durable, error);
+      if (tmpnames[i] == NULL)
+        goto out;
+    }
+
+  /* The shards go first, so that clients that see the new main table
+   * find the shards that it lists.
+   */
+  for (i = 0; i < n_shards; i++)
+    {
+      DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+      if (tmpnames[i] == NULL)
+        continue;
+
+      if (!dconf_gvdb_utils_rename_temp (g_steal_pointer (&tmpnames[i]), shard->filename, error))
+        goto out;
+
+      g_clear_pointer (&shard->table, gvdb_table_free);
+      g_clear_pointer (&shard->content, g_bytes_unref);
+      shard->content = g_steal_pointer (&contents[i]);
+      shard->table = gvdb_table_new_from_bytes (shard->content, TRUE, NULL);
+
+      dconf_shm_flag (shard->name);
+    }
+
+  if (tmpnames[n_shards] != NULL)
+    {
+      if (!dconf_gvdb_utils_rename_temp (g_steal_pointer (&tmpnames[n_shards]), writer->priv->filename, error))
+        goto out;
+
+      /* Don't let clients keep reading a stale live copy */
+      if (writer->priv->have_live_copy)
+        {
+          g_unlink (writer->priv->live_filename);
+          writer->priv->have_live_copy = FALSE;
+        }
+
+      writer->priv->generation = dconf_shm_flag (writer->priv->name);
+
+      g_clear_pointer (&writer->priv->commited_table, gvdb_table_free);
+      g_clear_pointer (&writer->priv->commited_content, g_bytes_unref);
+      writer->priv->commited_content = g_steal_pointer (&contents[n_shards]);
+      writer->priv->commited_table = gvdb_table_new_from_bytes (writer->priv->commited_content, TRUE, NULL);
+    }
+
+  success = TRUE;
+
+ out:
+  for (i = 0; i <= n_shards; i++)
+    {
+      if (tmpnames[i] != NULL)
+        {
+          g_unlink (tmpnames[i]);
+          g_free (tmpnames[i]);
+        }
+
+      if (contents[i] != NULL)
+        g_bytes_unref (contents[i]);
+    }
+
+  g_free (tmpnames);
+  g_free (contents);
+
+  dconf_changeset_unref (split.main_changes);
+  for (i = 0; i < writer->priv->shards->len; i++)
+    {
+      DConfWriterShard *shard = g_ptr_array_index (writer->priv->shards, i);
+
+      g_clear_pointer (&shard->changes, dconf_changeset_unref);
+    }
+
+  return success;
+}
+
+/* Writes a sharded database.  Only the tables that the changes touch
+ * are written, unless the shards are being rearranged: then all of the
+ * values are written out again in the new layout.
+ */
+static gboolean
+dconf_writer_write_sharded (DConfWriter  *writer,
+                            GError      **error)
+{
+  GPtrArray *old_shards;
+  DConfChangeset *values;
+  GHashTableIter iter;
+  gpointer dir, name;
+  guint i;
+
+  if (!writer->priv->resplit)
+    return dconf_writer_write_shards (writer, writer->priv->uncommited_values, FALSE, error);
+
+  values = dconf_writer_get_values (writer);
+
+  old_shards = writer->priv->shards;
+  writer->priv->shards = g_ptr_array_new_with_free_func (dconf_writer_shard_free);
+  g_hash_table_iter_init (&iter, writer->priv->shard_config);
+  while (g_hash_table_iter_next (&iter, &dir, &name))
+    g_ptr_array_add (writer->priv->shards, dconf_writer_shard_new (writer, dir, name));
+
+  if (!dconf_writer_write_shards (writer, values, TRUE, error))
+    {
+      g_ptr_array_unref (writer->priv->shards);
+      writer->priv->shards = old_shards;
+      dconf_changeset_unref (values);
+
+      return FALSE;
+    }
+
+  /* Remove the files of the shards that are gone */
+  for (i = 0; i < old_shards->len; i++)
+    {
+      DConfWriterShard *shard = g_ptr_array_index (old_shards, i);
+
+      if (g_strcmp0 (g_hash_table_lookup (writer->priv->shard_config, shard->dir), shard->name) != 0)
+        g_unlink (shard->filename);
+    }
+
+  g_ptr_array_unref (old_shards);
+  dconf_changeset_unref (values);
+  writer->priv->resplit = FALSE;
+
+  return TRUE;
+}
+
+/* Writes the uncommited values out.  This is the part of the commit
+ * that is done in the thread pool, so it must not touch anything that
+ * belongs to the main context.
+ */
+static gboolean
+dconf_writer_write (DConfWriter  *writer,
+                    GError      **error)
+{
+  gint invalidate_fd = -1;
+  GBytes *content;
+
+  if (writer->priv->shards != NULL && (writer->priv->shards->len > 0 || writer->priv->resplit))
+    return dconf_writer_write_sharded (writer, error);
+
+  /* Only the values that changed need to be serialised again */
+  content = dconf_gvdb_utils_serialise (writer->priv->commited_table,
+                                        writer->priv->uncommited_values,
+                                        NULL, error);
+  if (content == NULL)
+    return FALSE;
+
+  /* Clients may still be reading the plain file that we are about to
+   * move into the buffered one, so invalidate that too.
+   */
+  if (!writer->priv->native && (!writer->priv->shm_db || writer->priv->stale_file))
+    /* If it fails, it doesn't matter... */
+    invalidate_fd = open (writer->priv->filename, O_WRONLY);
+
+  if (writer->priv->shm_db)
+    {
+      if (!dconf_shm_db_write (writer->priv->shm_db, content, error))
+        {
+          g_bytes_unref (content);
+          return FALSE;
+        }
+
+      if (writer->priv->stale_file)
+        {
+          g_unlink (writer->priv->filename);
+          writer->priv->stale_file = FALSE;
+        }
+    }
+  else if (writer->priv->durability == DCONF_WRITER_DURABILITY_WRITE_BACK)
+    {
+      if (!dconf_gvdb_utils_write_contents (writer->priv->live_filename, content, FALSE, error))
+        {
+          g_bytes_unref (content);
+          return FALSE;
+        }
+
+      writer->priv->have_live_copy = TRUE;
+    }
+  else
+    {
+      gboolean durable = writer->priv->durability == DCONF_WRITER_DURABILITY_STRICT;
+
+      if (!dconf_gvdb_utils_write_contents (writer->priv->filename, content, durable, error))
+        {
+          g_bytes_unref (content);
+          return FALSE;
+        }
+
+      /* Don't let clients keep reading a stale live copy */
+      if (writer->priv->have_live_copy)
+        {
+          g_unlink (writer->priv->live_filename);
+          writer->priv->have_live_copy = FALSE;
+        }
+    }
+
+  if (writer->priv->native)
+    writer->priv->generation = dconf_shm_flag (writer->priv->name);
+
+  if (invalidate_fd != -1)
+    {
+      write (invalidate_fd, "\0\0\0\0\0\0\0\0", 8);
+      close (invalidate_fd);
+    }
+
+  /* We just built this, so there is no need to validate it */
+  g_clear_pointer (&writer->priv->commited_table, gvdb_table_free);
+  g_clear_pointer (&writer->priv->commited_content, g_bytes_unref);
+  writer->priv->commited_content = content;
+  writer->priv->commited_table = gvdb_table_new_from_bytes (content, TRUE, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+dconf_writer_real_commit (DConfWriter  *writer,
+                          GError      **error)
+{
+  if (!writer->priv->need_write)
+    {
+      g_assert (g_queue_is_empty (&writer->priv->uncommited_changes));
+      g_assert (g_queue_is_empty (&writer->priv->commited_changes));
+      dconf_changeset_unref (writer->priv->uncommited_values);
+      writer->priv->uncommited_values = NULL;
+
+      return TRUE;
+    }
+
+  if (!dconf_writer_write (writer, error))
+    return FALSE;
+
+  dconf_writer_commit_done (writer);
+
+  return TRUE;
+}
+
+static void
+dconf_writer_real_end (DConfWriter *writer)
+{
+  while (!g_queue_is_empty (&writer->priv->uncommited_changes))
+    {
+      TaggedChange *change = g_queue_pop_head (&writer->priv->uncommited_changes);
+      dconf_changeset_unref (change->changeset);
+      g_free (change->tag);
+      g_slice_free (TaggedChange, change);
+    }
+
+  while (!g_queue_is_empty (&writer->priv->commited_changes))
+    {
+      TaggedChange *change = g_queue_pop_head (&writer->priv->commited_changes);
+      const gchar *prefix;
+      const gchar * const *paths;
+      guint n;
+
+      n = dconf_changeset_describe (change->changeset, &prefix, &paths, NULL);
+      g_assert (n != 0);
+      dconf_dbus_writer_emit_notify_signal (DCONF_DBUS_WRITER (writer), prefix, paths, change->tag);
+      if (writer->priv->journal)
+        dconf_journal_append (writer->priv->journal, writer->priv->generation, prefix, paths, change->tag);
+      dconf_changeset_unref (change->changeset);
+      g_free (change->tag);
+      g_slice_free (TaggedChange, change);
+    }
+
+  g_clear_pointer (&writer->priv->uncommited_values, dconf_changeset_unref);
+}
+
+static gboolean
+dconf_writer_begin (DConfWriter  *writer,
+                    GError      **error)
+{
+  return DCONF_WRITER_GET_CLASS (writer)->begin (writer, error);
+}
+
+static void
+dconf_writer_change (DConfWriter    *writer,
+                     DConfChangeset *changeset,
+                     const gchar    *tag)
+{
+  DCONF_WRITER_GET_CLASS (writer)->change (writer, changeset, tag);
+}
+
+static gboolean
+dconf_writer_commit (DConfWriter  *writer,
+                     GError      **error)
+{
+  return DCONF_WRITER_GET_CLASS (writer)->commit (writer, error);
+}
+
+static void
+dconf_writer_end (DConfWriter *writer)
+{
+  return DCONF_WRITER_GET_CLASS (writer)->end (writer);
+}
+
+static void
+dconf_writer_complete_invocation (DConfDBusWriter       *dbus_writer,
+                                  GDBusMethodInvocation *invocation,
+                                  GVariant              *result,
+                                  GError                *error)
+{
+  if (error)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      g_error_free (error);
+    }
+  else
+    g_dbus_method_invocation_return_value (invocation, result);
+}
+
+/* Whether the caller of @change needs to hear about a failure to begin
+ * or to commit the transaction.  Empty changesets never touched the
+ * database, and neither did changes that were redundant, so they get
+ * their tag back regardless.
+ */
+static gboolean
+dconf_writer_change_failed (PendingChange *change,
+                            gboolean       begun)
+{
+  /* Init (and anything else without a changeset) is about the database
+   * itself, so it always needs to know.
+   */
+  if (change->changeset == NULL)
+    return TRUE;
+
+  if (!begun)
+    return dconf_changeset_describe (change->changeset, NULL, NULL, NULL) != 0;
+
+  return change->written;
+}
+
+static void
+dconf_writer_pending_change_free (PendingChange *change)
+{
+  g_clear_object (&change->invocation);
+  if (change->changeset)
+    dconf_changeset_unref (change->changeset);
+  g_free (change->tag);
+  g_slice_free (PendingChange, change);
+}
+
+/* Starts the transaction for the batch of the job and applies all of
+ * its changes.  The commit is left to the caller.
+ */
+static void
+dconf_writer_apply_batch (DConfWriter    *writer,
+                          DConfWriterJob *job)
+{
+  const gchar *written_tag = NULL;
+  gboolean need_commit = FALSE;
+  GList *node;
+
+  for (node = job->batch.head; node; node = node->next)
+    {
+      PendingChange *change = node->data;
+
+      /* Don't bother with empty changesets, but do run a transaction for
+       * Init (and other requests without any changeset).
+       */
+      if (!change->changeset || dconf_changeset_describe (change->changeset, NULL, NULL, NULL))
+        need_commit = TRUE;
+    }
+
+  /* All of the queued changes go into a single transaction, so we only
+   * write the file (and flag the shm) once for the entire batch.
+   */
+  if (!need_commit || !dconf_writer_begin (writer, &job->error))
+    return;
+
+  job->begun = TRUE;
+
+  for (node = job->batch.head; node; node = node->next)
+    {
+      PendingChange *change = node->data;
+
+      if (change->changeset && dconf_changeset_describe (change->changeset, NULL, NULL, NULL))
+        {
+          guint n_changes;
+
+          /* Only the changes that had an effect get queued for the
+           * Notify signal, and only those depend on the write.
+           */
+          n_changes = g_queue_get_length (&writer->priv->uncommited_changes);
+          dconf_writer_change (writer, change->changeset, change->tag);
+          change->written = g_queue_get_length (&writer->priv->uncommited_changes) != n_changes;
+        }
+
+      /* The pieces of a transaction share a tag, and only the last
+       * one has the invocation to reply to.
+       */
+      if (change->invocation == NULL && change->written)
+        written_tag = change->tag;
+      else if (change->invocation != NULL && written_tag != NULL && g_strcmp0 (change->tag, written_tag) == 0)
+        change->written = TRUE;
+    }
+}
+
+/* Replies to the callers in the batch of the job, and then lets the
+ * others know about the changes.
+ */
+static void
+dconf_writer_complete_batch (DConfWriter    *writer,
+                             DConfWriterJob *job)
+{
+  DConfDBusWriter *dbus_writer = DCONF_DBUS_WRITER (writer);
+
+  while (!g_queue_is_empty (&job->batch))
+    {
+      PendingChange *change = g_queue_pop_head (&job->batch);
+
+      if (change->invocation)
+        {
+          GVariant *result = NULL;
+          GError *change_error = NULL;
+
+          if (job->error && dconf_writer_change_failed (change, job->begun))
+            change_error = g_error_copy (job->error);
+          else if (change->tag)
+            result = g_variant_new ("(s)", change->tag);
+
+          dconf_writer_complete_invocation (dbus_writer, change->invocation, result, change_error);
+        }
+
+      dconf_writer_pending_change_free (change);
+    }
+
+  /* Only emit the Notify signals after all of the callers have their
+   * replies, just as in the unbatched case.
+   */
+  dconf_writer_end (writer);
+}
+
+/* The part of the job that is done in the thread pool */
+static void
+dconf_writer_run (DConfWriter    *writer,
+                  DConfWriterJob *job)
+{
+  if (job->write)
+    dconf_writer_write (writer, &job->error);
+
+  if (job->sync)
+    dconf_writer_sync (writer);
+
+  g_mutex_lock (&writer->priv->lock);
+  job->done = TRUE;
+  g_cond_broadcast (&writer->priv->cond);
+  g_mutex_unlock (&writer->priv->lock);
+}
+
+/* Back in the main context, once the job is done */
+static void
+dconf_writer_finish (DConfWriter *writer)
+{
+  DConfWriterJob *job = writer->priv->job;
+
+  if (job->write && job->error == NULL)
+    dconf_writer_commit_done (writer);
+
+  if (!g_queue_is_empty (&job->batch))
+    dconf_writer_complete_batch (writer, job);
+
+  if (job->idle)
+    dconf_writer_drop_to_mapping (writer);
+
+  g_clear_error (&job->error);
+  g_slice_free (DConfWriterJob, job);
+  writer->priv->job = NULL;
+
+  /* Anything that arrived in the meantime */
+  dconf_writer_kick (writer);
+}
+
+static gboolean
+dconf_writer_finish_cb (gpointer user_data)
+{
+  DConfWriter *writer = user_data;
+  gboolean done;
+
+  /* dconf_writer_flush() may have got to it first */
+  g_mutex_lock (&writer->priv->lock);
+  done = writer->priv->job != NULL && writer->priv->job->done;
+  g_mutex_unlock (&writer->priv->lock);
+
+  if (done)
+    dconf_writer_finish (writer);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+dconf_writer_worker (gpointer data,
+                     gpointer user_data)
+{
+  DConfWriter *writer = data;
+  GSource *source;
+
+  dconf_writer_run (writer, writer->priv->job);
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source, dconf_writer_finish_cb, g_object_ref (writer), g_object_unref);
+  g_source_attach (source, writer->priv->context);
+  g_source_unref (source);
+
+  g_object_unref (writer);
+}
+
+/* Starts a job for all of the outstanding work, unless one is running
+ * already: anything left over is picked up when that one finishes.
+ */
+static void
+dconf_writer_kick (DConfWriter *writer)
+{
+  DConfWriterJob *job;
+
+  if (writer->priv->job != NULL)
+    return;
+
+  if (g_queue_is_empty (&writer->priv->pending_changes) &&
+      !writer->priv->sync_requested && !writer->priv->idle_requested)
+    return;
+
+  job = g_slice_new0 (DConfWriterJob);
+  job->batch = writer->priv->pending_changes;
+  job->sync = writer->priv->sync_requested;
+  job->idle = writer->priv->idle_requested;
+  writer->priv->pending_changes = (GQueue) G_QUEUE_INIT;
+  writer->priv->sync_requested = FALSE;
+  writer->priv->idle_requested = FALSE;
+  writer->priv->job = job;
+
+  dconf_writer_apply_batch (writer, job);
+
+  /* Only the writing of our own database format can be done in the
+   * pool.  Subclasses commit in the main context, like they begin.
+   */
+  if (job->begun)
+    {
+      if (DCONF_WRITER_GET_CLASS (writer)->commit == dconf_writer_real_commit && writer->priv->need_write)
+        job->write = TRUE;
+      else
+        dconf_writer_commit (writer, &job->error);
+    }
+
+  if (!job->write && !job->sync)
+    {
+      job->done = TRUE;
+      dconf_writer_finish (writer);
+    }
+  else if (writer->priv->flushing)
+    {
+      dconf_writer_run (writer, job);
+      dconf_writer_finish (writer);
+    }
+  else
+    g_thread_pool_push (dconf_writer_pool, g_object_ref (writer), NULL);
+}
+
+static gboolean
+dconf_writer_flush_cb (gpointer user_data)
+{
+  DConfWriter *writer = user_data;
+
+  writer->priv->flush_source = 0;
+  dconf_writer_kick (writer);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+dconf_writer_push (DConfWriter           *writer,
+                   GDBusMethodInvocation *invocation,
+                   DConfChangeset        *changeset,
+                   gchar                 *tag)
+{
+  PendingChange *change;
+
+  change = g_slice_new (PendingChange);
+  change->invocation = invocation ? g_object_ref (invocation) : NULL;
+  change->changeset = changeset;
+  change->tag = tag;
+  change->written = FALSE;
+
+  g_queue_push_tail (&writer->priv->pending_changes, change);
+}
+
+static void
+dconf_writer_schedule (DConfWriter *writer,
+                       gboolean     now)
+{
+  /* Changes wait a little while for others to join them, unless a job
+   * is already running, in which case they get picked up when it
+   * finishes.  Anything else runs right away.
+   */
+  if (now)
+    {
+      if (writer->priv->flush_source)
+        {
+          g_source_remove (writer->priv->flush_source);
+          writer->priv->flush_source = 0;
+        }
+
+      dconf_writer_kick (writer);
+    }
+  else if (writer->priv->job == NULL && !writer->priv->flush_source)
+    {
+      if (dconf_writer_commit_delay)
+        writer->priv->flush_source = g_timeout_add_full (G_PRIORITY_DEFAULT, dconf_writer_commit_delay,
+                                                         dconf_writer_flush_cb,
+                                                         g_object_ref (writer), g_object_unref);
+      else
+        writer->priv->flush_source = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                                                      dconf_writer_flush_cb,
+                                                      g_object_ref (writer), g_object_unref);
+    }
+}
+
+static void
+dconf_writer_queue (DConfWriter           *writer,
+                    GDBusMethodInvocation *invocation,
+                    DConfChangeset        *changeset,
+                    gchar                 *tag)
+{
+  dconf_writer_push (writer, invocation, changeset, tag);
+  dconf_writer_schedule (writer, changeset == NULL);
+}
+
+void
+dconf_writer_refresh (DConfWriter *writer)
+{
+  g_return_if_fail (DCONF_IS_WRITER (writer));
+
+  dconf_writer_queue (writer, NULL, NULL, NULL);
+}
+
+void
+dconf_writer_flush (DConfWriter *writer)
+{
+  g_return_if_fail (DCONF_IS_WRITER (writer));
+
+  if (writer->priv->flush_source)
+    {
+      g_source_remove (writer->priv->flush_source);
+      writer->priv->flush_source = 0;
+    }
+
+  if (writer->priv->sync_source)
+    {
+      g_source_remove (writer->priv->sync_source);
+      writer->priv->sync_source = 0;
+      writer->priv->sync_requested = TRUE;
+    }
+
+  /* Wait for the job in the pool, then do the rest ourselves */
+  writer->priv->flushing = TRUE;
+
+  if (writer->priv->job != NULL)
+    {
+      g_mutex_lock (&writer->priv->lock);
+      while (!writer->priv->job->done)
+        g_cond_wait (&writer->priv->cond, &writer->priv->lock);
+      g_mutex_unlock (&writer->priv->lock);
+
+      dconf_writer_finish (writer);
+    }
+  else
+    dconf_writer_kick (writer);
+
+  writer->priv->flushing = FALSE;
+}
+
+static gboolean
+dconf_writer_handle_init (DConfDBusWriter       *dbus_writer,
+                          GDBusMethodInvocation *invocation)
+{
+  DConfWriter *writer = DCONF_WRITER (dbus_writer);
+
+  dconf_blame_record (invocation);
+
+  /* This goes through the same queue as Change, so that it is ordered
+   * after any changes that came before it.
+   */
+  dconf_writer_queue (writer, invocation, NULL, NULL);
+
+  return TRUE;
+}
+
+static DConfChangeset *
+dconf_writer_deserialise_blob (GVariant *blob)
+{
+  DConfChangeset *changeset;
+  GVariant *tmp, *args;
+
+  tmp = g_variant_new_from_data (G_VARIANT_TYPE ("a{smv}"),
+                                 g_variant_get_data (blob), g_variant_get_size (blob), FALSE,
+                                 (GDestroyNotify) g_variant_unref, g_variant_ref (blob));
+  g_variant_ref_sink (tmp);
+  args = g_variant_get_normal_form (tmp);
+  g_variant_unref (tmp);
+
+  changeset = dconf_changeset_deserialise (args);
+  g_variant_unref (args);
+
+  return changeset;
+}
+
+static gboolean
+dconf_writer_handle_change (DConfDBusWriter       *dbus_writer,
+                            GDBusMethodInvocation *invocation,
+                            GVariant              *blob)
+{
+  DConfWriter *writer = DCONF_WRITER (dbus_writer);
+
+  dconf_blame_record (invocation);
+
+  dconf_writer_queue (writer, invocation, dconf_writer_deserialise_blob (blob), dconf_writer_get_tag (writer));
+
+  return TRUE;
+}
+
+/* Transactions let a client send a change that is too big for a single
+ * message as a series of Append calls.  Nothing is queued until Commit,
+ * at which point all of the pieces are queued together so that they end
+ * up in the same commit.
+ */
+static void
+dconf_writer_transaction_free (gpointer data)
+{
+  Transaction *transaction = data;
+
+  while (!g_queue_is_empty (&transaction->changesets))
+    dconf_changeset_unref (g_queue_pop_head (&transaction->changesets));
+
+  if (transaction->watch_id)
+    g_bus_unwatch_name (transaction->watch_id);
+  if (transaction->closed_id)
+    g_signal_handler_disconnect (transaction->connection, transaction->closed_id);
+
+  g_object_unref (transaction->connection);
+  g_free (transaction->sender);
+  g_slice_free (Transaction, transaction);
+}
+
+static void
+dconf_writer_transaction_vanished (GDBusConnection *connection,
+                                   const gchar     *name,
+                                   gpointer         user_data)
+{
+  Transaction *transaction = user_data;
+
+  g_hash_table_remove (transaction->writer->priv->transactions, GUINT_TO_POINTER (transaction->id));
+}
+
+static void
+dconf_writer_transaction_closed (GDBusConnection *connection,
+                                 gboolean         remote_peer_vanished,
+                                 GError          *error,
+                                 gpointer         user_data)
+{
+  dconf_writer_transaction_vanished (connection, NULL, user_data);
+}
+
+/* Returns NULL (and returns an error to the caller) unless the caller
+ * is the one that started the transaction.
+ */
+static Transaction *
+dconf_writer_lookup_transaction (DConfWriter           *writer,
+                                 GDBusMethodInvocation *invocation,
+                                 guint                  id)
+{
+  Transaction *transaction;
+
+  transaction = g_hash_table_lookup (writer->priv->transactions, GUINT_TO_POINTER (id));
+
+  if (transaction == NULL ||
+      transaction->connection != g_dbus_method_invocation_get_connection (invocation) ||
+      g_strcmp0 (transaction->sender, g_dbus_method_invocation_get_sender (invocation)) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "No such transaction: %u", id);
+      return NULL;
+    }
+
+  return transaction;
+}
+
+static gboolean
+dconf_writer_handle_begin_transaction (DConfDBusWriter       *dbus_writer,
+                                       GDBusMethodInvocation *invocation)
+{
+  DConfWriter *writer = DCONF_WRITER (dbus_writer);
+  Transaction *transaction;
+
+  dconf_blame_record (invocation);
+
+  transaction = g_slice_new0 (Transaction);
+  transaction->writer = writer;
+  transaction->id = ++writer->priv->next_transaction;
+  transaction->connection = g_object_ref (g_dbus_method_invocation_get_connection (invocation));
+  transaction->sender = g_strdup (g_dbus_method_invocation_get_sender (invocation));
+
+  /* Drop the transaction if the client goes away without finishing it */
+  if (transaction->sender)
+    transaction->watch_id = g_bus_watch_name_on_connection (transaction->connection, transaction->sender,
+                                                            G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
+                                                            dconf_writer_transaction_vanished,
+                                                            transaction, NULL);
+  else
+    transaction->closed_id = g_signal_connect (transaction->connection, "closed",
+                                               G_CALLBACK (dconf_writer_transaction_closed), transaction);
+
+  g_hash_table_insert (writer->priv->transactions, GUINT_TO_POINTER (transaction->id), transaction);
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", transaction->id));
+
+  return TRUE;
+}
+
+static gboolean
+dconf_writer_handle_append (DConfDBusWriter       *dbus_writer,
+                            GDBusMethodInvocation *invocation,
+                            guint                  id,
+                            GVariant              *blob)
+{
+  DConfWriter *writer = DCONF_WRITER (dbus_writer);
+  Transaction *transaction;
+  DConfChangeset *changeset;
+
+  transaction = dconf_writer_lookup_transaction (writer, invocation, id);
+  if (transaction == NULL)
+    return TRUE;
+
+  transaction->n_pieces++;
+  transaction->size += g_variant_get_size (blob);
+
+  /* The whole transaction fails: the caller has no way to carry on */
+  if (transaction->n_pieces > DCONF_WRITER_MAX_TRANSACTION_PIECES ||
+      transaction->size > DCONF_WRITER_MAX_TRANSACTION_SIZE)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+                                             "Transaction %u is too big", id);
+      g_hash_table_remove (writer->priv->transactions, GUINT_TO_POINTER (id));
+      return TRUE;
+    }
+
+  changeset = dconf_writer_deserialise_blob (blob);
+
+  if (dconf_changeset_is_empty (changeset))
+    dconf_changeset_unref (changeset);
+  else
+    g_queue_push_tail (&transaction->changesets, changeset);
+
+  g_dbus_method_invocation_return_value (invocation, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+dconf_writer_handle_commit (DConfDBusWriter       *dbus_writer,
+                            GDBusMethodInvocation *invocation,
+                            guint                  id)
+{
+  DConfWriter *writer = DCONF_WRITER (dbus_writer);
+  Transaction *transaction;
+  gchar *tag;
+
+  transaction = dconf_writer_lookup_transaction (writer, invocation, id);
+  if (transaction == NULL)
+    return TRUE;
+
+  dconf_blame_record (invocation);
+
+  tag = dconf_writer_get_tag (writer);
+
+  /* The pieces are applied in order, each with the same tag.  Only the
+   * last one gets the reply, so the caller hears about the result once
+   * everything is on disk.
+   */
+  if (g_queue_is_empty (&transaction->changesets))
+    dconf_writer_push (writer, invocation, dconf_changeset_new (), tag);
+
+  while (!g_queue_is_empty (&transaction->changesets))
+    {
+      DConfChangeset *changeset = g_queue_pop_head (&transaction->changesets);
+
+      if (g_queue_is_empty (&transaction->changesets))
+        dconf_writer_push (writer, invocation, changeset, tag);
+      else
+        dconf_writer_push (writer, NULL, changeset, g_strdup (tag));
+    }
+
+  dconf_writer_schedule (writer, FALSE);
+
+  g_hash_table_remove (writer->priv->transactions, GUINT_TO_POINTER (id));
+
+  return TRUE;
+}
+
+static gboolean
+dconf_writer_handle_abort (DConfDBusWriter       *dbus_writer,
+                           GDBusMethodInvocation *invocation,
+                           guint                  id)
+{
+  DConfWriter *writer = DCONF_WRITER (dbus_writer);
+
+  if (dconf_writer_lookup_transaction (writer, invocation, id) == NULL)
+    return TRUE;
+
+  g_hash_table_remove (writer->priv->transactions, GUINT_TO_POINTER (id));
+
+  g_dbus_method_invocation_return_value (invocation, NULL);
+
+  return TRUE;
+}
+
+static void
+dconf_writer_iface_init (DConfDBusWriterIface *iface)
+{
+  iface->handle_init = dconf_writer_handle_init;
+  iface->handle_change = dconf_writer_handle_change;
+  iface->handle_begin_transaction = dconf_writer_handle_begin_transaction;
+  iface->handle_append = dconf_writer_handle_append;
+  iface->handle_commit = dconf_writer_handle_commit;
+  iface->handle_abort = dconf_writer_handle_abort;
+}
+
+static void
+dconf_writer_init (DConfWriter *writer)
+{
+  writer->priv = dconf_writer_get_instance_private (writer);
+  writer->priv->context = g_main_context_ref_thread_default ();
+  g_mutex_init (&writer->priv->lock);
+  g_cond_init (&writer->priv->cond);
+  writer->priv->basepath = g_build_filename (g_get_user_config_dir (), "dconf", NULL);
+  writer->priv->native = TRUE;
+  writer->priv->transactions = g_hash_table_new_full (NULL, NULL, NULL, dconf_writer_transaction_free);
+}
+
+/* Writes the contents of the buffered file back to the plain
+ * file and removes it.  If that fails, it's better to leave it there.
+ */
+static void
+dconf_writer_close_shm_db (const gchar *filename,
+                           DConfShmDb  *shm_db)
+{
+  GError *error = NULL;
+  GBytes *bytes;
+
+  bytes = dconf_shm_db_read (shm_db, NULL);
+
+  if (bytes == NULL || dconf_gvdb_utils_write_contents (filename, bytes, FALSE, &error))
+    dconf_shm_db_remove (shm_db);
+  else
+    {
+      g_warning ("Unable to write '%s': %s", filename, error->message);
+      dconf_shm_db_close (shm_db);
+      g_error_free (error);
+    }
+
+  if (bytes)
+    g_bytes_unref (bytes);
+}
+
+static void
+dconf_writer_free_tagged_changes (GQueue *queue)
+{
+  while (!g_queue_is_empty (queue))
+    {
+      TaggedChange *change = g_queue_pop_head (queue);
+
+      dconf_changeset_unref (change->changeset);
+      g_free (change->tag);
+      g_slice_free (TaggedChange, change);
+    }
+}
+
+static void
+dconf_writer_finalize (GObject *object)
+{
+  DConfWriter *writer = DCONF_WRITER (object);
+
+  /* The pool thread and the flush timer hold references */
+  g_assert (writer->priv->job == NULL);
+  g_assert (writer->priv->flush_source == 0);
+
+  /* Don't lose a sync that was still to come */
+  if (writer->priv->sync_source)
+    {
+      g_source_remove (writer->priv->sync_source);
+      dconf_writer_sync (writer);
+    }
+
+  if (writer->priv->idle_source)
+    g_source_remove (writer->priv->idle_source);
+
+  while (!g_queue_is_empty (&writer->priv->pending_changes))
+    dconf_writer_pending_change_free (g_queue_pop_head (&writer->priv->pending_changes));
+  dconf_writer_free_tagged_changes (&writer->priv->uncommited_changes);
+  dconf_writer_free_tagged_changes (&writer->priv->commited_changes);
+  g_hash_table_unref (writer->priv->transactions);
+
+  g_clear_pointer (&writer->priv->journal, dconf_journal_close);
+  if (writer->priv->shm_db)
+    dconf_writer_close_shm_db (writer->priv->filename, g_steal_pointer (&writer->priv->shm_db));
+  g_clear_pointer (&writer->priv->shards, g_ptr_array_unref);
+  g_clear_pointer (&writer->priv->shard_config, g_hash_table_unref);
+  g_clear_pointer (&writer->priv->commited_table, gvdb_table_free);
+  g_clear_pointer (&writer->priv->commited_content, g_bytes_unref);
+  g_clear_pointer (&writer->priv->uncommited_values, dconf_changeset_unref);
+
+  g_free (writer->priv->live_filename);
+  g_free (writer->priv->filename);
+  g_free (writer->priv->basepath);
+  g_free (writer->priv->name);
+
+  g_mutex_clear (&writer->priv->lock);
+  g_cond_clear (&writer->priv->cond);
+  g_main_context_unref (writer->priv->context);
+
+  G_OBJECT_CLASS (dconf_writer_parent_class)->finalize (object);
+}
+
+/* DCONF_DURABILITY is a comma-separated list of modes ("strict",
+ * "batched" or "write-back"), each optionally prefixed with "name=" to
+ * apply only to the named database.  A mode for a specific database
+ * overrides the one without a name.
+ */
+static DConfWriterDurability
+dconf_writer_get_durability (const gchar *name)
+{
+  DConfWriterDurability durability = DCONF_WRITER_DURABILITY_STRICT;
+  gboolean have_specific = FALSE;
+  const gchar *spec;
+  gchar **items;
+  gint i;
+
+  spec = g_getenv ("DCONF_DURABILITY");
+  if (spec == NULL)
+    return durability;
+
+  items = g_strsplit (spec, ",", 0);
+  for (i = 0; items[i]; i++)
+    {
+      const gchar *mode = items[i];
+      const gchar *eq;
+      gboolean specific = FALSE;
+
+      eq = strchr (items[i], '=');
+      if (eq != NULL)
+        {
+          gsize len = eq - items[i];
+
+          if (strncmp (items[i], name, len) != 0 || name[len] != '\0')
+            continue;
+
+          mode = eq + 1;
+          specific = TRUE;
+        }
+      else if (have_specific)
+        continue;
+
+      if (g_str_equal (mode, "strict"))
+        durability = DCONF_WRITER_DURABILITY_STRICT;
+      else if (g_str_equal (mode, "batched"))
+        durability = DCONF_WRITER_DURABILITY_BATCHED;
+      else if (g_str_equal (mode, "write-back"))
+        durability = DCONF_WRITER_DURABILITY_WRITE_BACK;
+      else
+        {
+          g_warning ("Ignoring unknown durability mode '%s' in DCONF_DURABILITY", mode);
+          continue;
+        }
+
+      have_specific |= specific;
+    }
+  g_strfreev (items);
+
+  return durability;
+}
+
+/* The name of the file (and shm flag) of the shard of @name for @dir.
+ * It has a '.' in it, so it is never taken for a database of its own.
+ */
+static gchar *
+dconf_writer_get_shard_name (const gchar *name,
+                             const gchar *dir)
+{
+  gchar *checksum;
+  gchar *result;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, dir, -1);
+  result = g_strdup_printf ("%s.shard-%.16s", name, checksum);
+  g_free (checksum);
+
+  return result;
+}
+
+/* DCONF_SHARDS is a comma-separated list of dirs, each optionally
+ * prefixed with "name=" like in DCONF_DURABILITY.  Each of the dirs that
+ * apply to the database named @name gets a shard of its own.
+ */
+static GHashTable *
+dconf_writer_get_shard_config (const gchar *name)
+{
+  GHashTable *config;
+  const gchar *spec;
+  gchar **items;
+  gint i;
+
+  config = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  spec = g_getenv ("DCONF_SHARDS");
+  if (spec == NULL)
+    return config;
+
+  items = g_strsplit (spec, ",", 0);
+  for (i = 0; items[i]; i++)
+    {
+      const gchar *dir = items[i];
+      const gchar *eq;
+
+      eq = strchr (items[i], '=');
+      if (eq != NULL)
+        {
+          gsize len = eq - items[i];
+
+          if (strncmp (items[i], name, len) != 0 || name[len] != '\0')
+            continue;
+
+          dir = eq + 1;
+        }
+
+      if (!dconf_is_dir (dir, NULL) || g_str_equal (dir, "/"))
+        {
+          g_warning ("Ignoring invalid dir '%s' in DCONF_SHARDS", dir);
+          continue;
+        }
+
+      g_hash_table_insert (config, g_strdup (dir), dconf_writer_get_shard_name (name, dir));
+    }
+  g_strfreev (items);
+
+  return config;
+}
+
+static void
+dconf_writer_set_property (GObject *object, guint prop_id,
+                           const GValue *value, GParamSpec *pspec)
+{
+  DConfWriter *writer = DCONF_WRITER (object);
+
+  g_assert_cmpint (prop_id, ==, 1);
+
+  g_assert (!writer->priv->name);
+  writer->priv->name = g_value_dup_string (value);
+
+  writer->priv->filename = g_build_filename (writer->priv->basepath, writer->priv->name, NULL);
+
+  /* Non-native databases already live in the runtime dir */
+  if (writer->priv->native)
+    {
+      gchar *live_name;
+
+      writer->priv->durability = dconf_writer_get_durability (writer->priv->name);
+
+      live_name = g_strconcat (writer->priv->name, ".gvdb", NULL);
+      writer->priv->live_filename = g_build_filename (g_get_user_runtime_dir (), "dconf", live_name, NULL);
+      g_free (live_name);
+
+      if (g_getenv ("DCONF_JOURNAL"))
+        writer->priv->journal = dconf_journal_open (writer->priv->name, TRUE);
+
+      /* The live copy in the runtime dir is only ever one file, so in
+       * write-back mode any shards get merged back into it.
+       */
+      if (writer->priv->durability != DCONF_WRITER_DURABILITY_WRITE_BACK)
+        writer->priv->shard_config = dconf_writer_get_shard_config (writer->priv->name);
+      else
+        {
+          if (g_getenv ("DCONF_SHARDS"))
+            g_warning ("Not sharding '%s': it is in write-back mode", writer->priv->name);
+
+          writer->priv->shard_config = g_hash_table_new (g_str_hash, g_str_equal);
+        }
+    }
+  else
+    {
+      gchar *shm_db_filename;
+
+      shm_db_filename = g_strconcat (writer->priv->filename, ".shared", NULL);
+
+      if (g_getenv ("DCONF_RUNTIME_BUFFERS"))
+        {
+          writer->priv->shm_db = dconf_shm_db_open (shm_db_filename, TRUE);
+
+          if (writer->priv->shm_db == NULL)
+            g_warning ("Unable to create '%s'; falling back to a plain file", shm_db_filename);
+        }
+
+      /* Left behind by an earlier run that used it (and didn't get to
+       * clean up): take the contents and make the clients stop using it.
+       */
+      else if (g_file_test (shm_db_filename, G_FILE_TEST_EXISTS))
+        {
+          DConfShmDb *shm_db;
+
+          shm_db = dconf_shm_db_open (shm_db_filename, TRUE);
+
+          if (shm_db != NULL)
+            dconf_writer_close_shm_db (writer->priv->filename, shm_db);
+          else
+            g_unlink (shm_db_filename);
+        }
+
+      g_free (shm_db_filename);
+    }
+}
+
+static void
+dconf_writer_class_init (DConfWriterClass *class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+  const gchar *delay;
+
+  object_class->set_property = dconf_writer_set_property;
+  object_class->finalize = dconf_writer_finalize;
+
+  delay = g_getenv ("DCONF_COMMIT_DELAY");
+  if (delay)
+    dconf_writer_commit_delay = MIN (g_ascii_strtoull (delay, NULL, 10), 1000);
+
+  dconf_writer_pool = g_thread_pool_new (dconf_writer_worker, NULL, DCONF_WRITER_MAX_THREADS, FALSE, NULL);
 
   class->begin = dconf_writer_real_begin;
   class->change = dconf_writer_real_change;
@@ -402,7 +2260,14 @@ DConfChangeset *
 dconf_writer_diff (DConfWriter    *writer,
                    DConfChangeset *changeset)
 {
-  return dconf_changeset_diff (writer->priv->uncommited_values, changeset);
+  DConfChangeset *values;
+  DConfChangeset *diff;
+
+  values = dconf_writer_get_values (writer);
+  diff = dconf_changeset_diff (values, changeset);
+  dconf_changeset_unref (values);
+
+  return diff;
 }
 
 const gchar *
@@ -76,6 +76,8 @@ void                    dconf_writer_set_basepath                       (DConfWr
 DConfChangeset *        dconf_writer_diff                               (DConfWriter *writer,
                                                                          DConfChangeset *changeset);
 const gchar *           dconf_writer_get_name                           (DConfWriter *writer);
+void                    dconf_writer_flush                              (DConfWriter *writer);
+void                    dconf_writer_refresh                            (DConfWriter *writer);
 
 void                    dconf_writer_list                               (GType        type,
                                                                          GHashTable  *set);
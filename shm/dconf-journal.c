@@ -0,0 +1,443 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "dconf-journal.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/* The file is a header followed by the ring itself.
+ *
+ * Positions are byte offsets into an imaginary infinite stream; the
+ * record at position p is stored at p % DCONF_JOURNAL_RING_SIZE.  The
+ * writer first bumps 'reserved' to cover the space that it is about to
+ * overwrite, then writes the record, then bumps 'end' and 'wakeups'.
+ * A reader copies a record out and then checks 'reserved' to make sure
+ * that the writer didn't start overwriting it in the meantime.
+ *
+ * Records never wrap around the end of the ring: if a record doesn't
+ * fit then the rest of the ring is filled with a padding record.
+ */
+#define DCONF_JOURNAL_MAGIC             0x6c6e726a /* 'jrnl' */
+#define DCONF_JOURNAL_HEADER_SIZE       64
+#define DCONF_JOURNAL_RING_SIZE         (64 * 1024)
+#define DCONF_JOURNAL_MAX_RECORD        (DCONF_JOURNAL_RING_SIZE / 8)
+
+typedef struct
+{
+  guint32 magic;
+  guint32 wakeups;
+  guint64 reserved;
+  guint64 end;
+} DConfJournalHeader;
+
+/* 'length' is the size of the serialised value, or zero for padding */
+typedef struct
+{
+  guint32 size;
+  guint32 length;
+} DConfJournalRecord;
+
+struct _DConfJournal
+{
+  DConfJournalHeader *header;
+  guint8             *ring;
+  gchar              *filename;
+  gboolean            writable;
+  gboolean            cancelled;
+  gint                fd;
+};
+
+G_STATIC_ASSERT (sizeof (DConfJournalHeader) <= DCONF_JOURNAL_HEADER_SIZE);
+
+#ifdef __linux__
+/* The writer holds an exclusive lock on the file for as long as it is
+ * writing it.  The kernel drops the lock if the service dies, so a
+ * reader that can take a shared lock knows that nobody is writing.
+ *
+ * Readers don't poll that: a service that exits normally clears the
+ * magic and wakes them, and the engine finds out that one that crashed
+ * is gone from the NameOwnerChanged signal, and calls
+ * dconf_journal_check() then.
+ */
+static gboolean
+dconf_journal_has_writer (gint fd)
+{
+  if (flock (fd, LOCK_SH | LOCK_NB) == 0)
+    {
+      flock (fd, LOCK_UN);
+      return FALSE;
+    }
+
+  return errno == EWOULDBLOCK;
+}
+
+DConfJournal *
+dconf_journal_open (const gchar *name,
+                    gboolean     writable)
+{
+  DConfJournal *journal = NULL;
+  gchar *journal_name;
+  gchar *filename;
+  gchar *dirname;
+  struct stat buf;
+  gsize size;
+  void *memory;
+  gint fd;
+
+  size = DCONF_JOURNAL_HEADER_SIZE + DCONF_JOURNAL_RING_SIZE;
+
+  dirname = g_build_filename (g_get_user_runtime_dir (), "dconf", NULL);
+  journal_name = g_strconcat (name, ".journal", NULL);
+  filename = g_build_filename (dirname, journal_name, NULL);
+  g_free (journal_name);
+
+  if (writable)
+    {
+      if (g_mkdir_with_parents (dirname, 0700) != 0)
+        goto out;
+
+      /* Always start with a fresh file: clients may still have the old
+       * one mapped, and they need to see it go invalid, not reused.
+       */
+      unlink (filename);
+
+      fd = open (filename, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+      if (fd == -1)
+        goto out;
+
+      if (flock (fd, LOCK_EX | LOCK_NB) != 0 || posix_fallocate (fd, 0, size) != 0)
+        {
+          unlink (filename);
+          close (fd);
+          goto out;
+        }
+    }
+  else
+    {
+      /* If the file doesn't exist then the service isn't writing it,
+       * and the client should use D-Bus instead.
+       *
+       * Readers only ever write to 'wakeups', in dconf_journal_cancel().
+       */
+      fd = open (filename, O_RDWR | O_CLOEXEC);
+      if (fd == -1)
+        goto out;
+
+      /* The same goes for a file left behind by a service that died */
+      if (fstat (fd, &buf) != 0 || buf.st_size < size || !dconf_journal_has_writer (fd))
+        {
+          close (fd);
+          goto out;
+        }
+    }
+
+  memory = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (memory == MAP_FAILED)
+    {
+      if (writable)
+        unlink (filename);
+      close (fd);
+      goto out;
+    }
+
+  journal = g_slice_new (DConfJournal);
+  journal->header = memory;
+  journal->ring = (guint8 *) memory + DCONF_JOURNAL_HEADER_SIZE;
+  journal->filename = filename;
+  journal->writable = writable;
+  journal->cancelled = FALSE;
+  journal->fd = fd;
+  filename = NULL;
+
+  if (writable)
+    __atomic_store_n (&journal->header->magic, DCONF_JOURNAL_MAGIC, __ATOMIC_RELEASE);
+
+  else if (__atomic_load_n (&journal->header->magic, __ATOMIC_ACQUIRE) != DCONF_JOURNAL_MAGIC)
+    {
+      dconf_journal_close (journal);
+      journal = NULL;
+    }
+
+ out:
+  g_free (filename);
+  g_free (dirname);
+
+  return journal;
+}
+
+static gboolean
+dconf_journal_is_valid (DConfJournal *journal)
+{
+  return __atomic_load_n (&journal->header->magic, __ATOMIC_ACQUIRE) == DCONF_JOURNAL_MAGIC &&
+         !__atomic_load_n (&journal->cancelled, __ATOMIC_ACQUIRE);
+}
+
+gboolean
+dconf_journal_wait (DConfJournal *journal,
+                    guint64       position)
+{
+  guint32 wakeups;
+
+  wakeups = __atomic_load_n (&journal->header->wakeups, __ATOMIC_ACQUIRE);
+
+  if (!dconf_journal_is_valid (journal))
+    return FALSE;
+
+  /* If the writer adds a record (or somebody cancels) after this check
+   * then they will also bump 'wakeups', and the futex call will return
+   * immediately.
+   */
+  if (__atomic_load_n (&journal->header->end, __ATOMIC_ACQUIRE) != position)
+    return TRUE;
+
+  syscall (SYS_futex, &journal->header->wakeups, FUTEX_WAIT, wakeups, NULL, NULL, 0);
+
+  return dconf_journal_is_valid (journal);
+}
+
+static void
+dconf_journal_wake (DConfJournal *journal)
+{
+  __atomic_add_fetch (&journal->header->wakeups, 1, __ATOMIC_RELEASE);
+  syscall (SYS_futex, &journal->header->wakeups, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+gboolean
+dconf_journal_check (DConfJournal *journal)
+{
+  return dconf_journal_is_valid (journal) && dconf_journal_has_writer (journal->fd);
+}
+
+/* The readers in other processes wake up too, but they just find that
+ * there is nothing new and go back to sleep.
+ */
+void
+dconf_journal_cancel (DConfJournal *journal)
+{
+  g_return_if_fail (!journal->writable);
+
+  __atomic_store_n (&journal->cancelled, TRUE, __ATOMIC_RELEASE);
+  dconf_journal_wake (journal);
+}
+#else
+/* We need futexes to wake up the readers */
+DConfJournal *
+dconf_journal_open (const gchar *name,
+                    gboolean     writable)
+{
+  return NULL;
+}
+
+gboolean
+dconf_journal_wait (DConfJournal *journal,
+                    guint64       position)
+{
+  g_assert_not_reached ();
+}
+
+static void
+dconf_journal_wake (DConfJournal *journal)
+{
+  g_assert_not_reached ();
+}
+
+gboolean
+dconf_journal_check (DConfJournal *journal)
+{
+  g_assert_not_reached ();
+}
+
+void
+dconf_journal_cancel (DConfJournal *journal)
+{
+  g_assert_not_reached ();
+}
+#endif
+
+void
+dconf_journal_close (DConfJournal *journal)
+{
+  if (journal->writable)
+    {
+      struct stat file_buf, fd_buf;
+
+      /* Tell the readers to go back to D-Bus */
+      __atomic_store_n (&journal->header->magic, 0, __ATOMIC_RELEASE);
+      dconf_journal_wake (journal);
+
+      /* ...and make sure that no new ones start using the file, unless
+       * another writer already replaced it with its own.
+       */
+      if (stat (journal->filename, &file_buf) == 0 && fstat (journal->fd, &fd_buf) == 0 &&
+          file_buf.st_dev == fd_buf.st_dev && file_buf.st_ino == fd_buf.st_ino)
+        unlink (journal->filename);
+    }
+
+  munmap (journal->header, DCONF_JOURNAL_HEADER_SIZE + DCONF_JOURNAL_RING_SIZE);
+  close (journal->fd);
+  g_free (journal->filename);
+  g_slice_free (DConfJournal, journal);
+}
+
+guint64
+dconf_journal_get_position (DConfJournal *journal)
+{
+  return __atomic_load_n (&journal->header->end, __ATOMIC_ACQUIRE);
+}
+
+void
+dconf_journal_append (DConfJournal        *journal,
+                      guint64              generation,
+                      const gchar         *prefix,
+                      const gchar * const *changes,
+                      const gchar         *tag)
+{
+  const gchar * const everything[] = { "", NULL };
+  DConfJournalRecord record;
+  GVariant *value;
+  guint64 position;
+  gsize offset;
+  gsize size;
+
+  g_return_if_fail (journal->writable);
+
+  value = g_variant_new ("(ts^ass)", generation, prefix, changes, tag ? tag : "");
+  g_variant_ref_sink (value);
+
+  /* Readers treat a change to the prefix itself as a change to
+   * everything below it, so huge change lists can be collapsed.
+   */
+  if (g_variant_get_size (value) + sizeof record > DCONF_JOURNAL_MAX_RECORD)
+    {
+      g_variant_unref (value);
+      value = g_variant_new ("(ts^ass)", generation, prefix, everything, tag ? tag : "");
+      g_variant_ref_sink (value);
+    }
+
+  size = (sizeof record + g_variant_get_size (value) + 7) & ~7;
+  if (size > DCONF_JOURNAL_MAX_RECORD)
+    {
+      /* A huge prefix or tag.  Nothing sensible to do. */
+      g_variant_unref (value);
+      return;
+    }
+
+  /* We are the only writer */
+  position = __atomic_load_n (&journal->header->end, __ATOMIC_RELAXED);
+  offset = position % DCONF_JOURNAL_RING_SIZE;
+
+  if (offset + size > DCONF_JOURNAL_RING_SIZE)
+    {
+      __atomic_store_n (&journal->header->reserved, position + (DCONF_JOURNAL_RING_SIZE - offset) + size,
+                        __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_RELEASE);
+
+      record.size = DCONF_JOURNAL_RING_SIZE - offset;
+      record.length = 0;
+      memcpy (journal->ring + offset, &record, sizeof record);
+
+      position += DCONF_JOURNAL_RING_SIZE - offset;
+      offset = 0;
+    }
+  else
+    {
+      __atomic_store_n (&journal->header->reserved, position + size, __ATOMIC_RELAXED);
+      __atomic_thread_fence (__ATOMIC_RELEASE);
+    }
+
+  record.size = size;
+  record.length = g_variant_get_size (value);
+  memcpy (journal->ring + offset, &record, sizeof record);
+  g_variant_store (value, journal->ring + offset + sizeof record);
+  g_variant_unref (value);
+
+  __atomic_store_n (&journal->header->end, position + size, __ATOMIC_RELEASE);
+  dconf_journal_wake (journal);
+}
+
+GVariant *
+dconf_journal_read (DConfJournal *journal,
+                    guint64      *position,
+                    gboolean     *lagged)
+{
+  while (TRUE)
+    {
+      DConfJournalRecord record;
+      GVariant *value;
+      GBytes *bytes;
+      guint64 end;
+      gsize offset;
+
+      end = __atomic_load_n (&journal->header->end, __ATOMIC_ACQUIRE);
+
+      if (*position == end)
+        return NULL;
+
+      if (end - *position > DCONF_JOURNAL_RING_SIZE)
+        break;
+
+      offset = *position % DCONF_JOURNAL_RING_SIZE;
+      memcpy (&record, journal->ring + offset, sizeof record);
+
+      if (record.size < sizeof record || record.size % 8 || offset + record.size > DCONF_JOURNAL_RING_SIZE ||
+          record.length > record.size - sizeof record)
+        break;
+
+      bytes = g_bytes_new (journal->ring + offset + sizeof record, record.length);
+
+      /* Make sure the record wasn't overwritten while we copied it */
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&journal->header->reserved, __ATOMIC_RELAXED) - *position > DCONF_JOURNAL_RING_SIZE)
+        {
+          g_bytes_unref (bytes);
+          break;
+        }
+
+      *position += record.size;
+
+      if (record.length == 0)
+        {
+          g_bytes_unref (bytes);
+          continue;
+        }
+
+      /* The contents are untrusted, but GVariant deals with that */
+      value = g_variant_new_from_bytes (G_VARIANT_TYPE ("(tsass)"), bytes, FALSE);
+      g_bytes_unref (bytes);
+
+      return g_variant_ref_sink (value);
+    }
+
+  /* We fell behind (or the ring is corrupt).  Skip to the end. */
+  *position = __atomic_load_n (&journal->header->end, __ATOMIC_ACQUIRE);
+  *lagged = TRUE;
+
+  return NULL;
+}
@@ -0,0 +1,62 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __dconf_journal_h__
+#define __dconf_journal_h__
+
+#include <glib.h>
+
+/* The journal is a ring buffer of change records for one database,
+ * written by the service and read directly by clients.  Each record is
+ * a GVariant of type (tsass): the generation of the database after the
+ * change, followed by the same prefix, changes and tag as in the Notify
+ * signal.
+ *
+ * The journal is only valid while the service is running: closing the
+ * writable side invalidates it and removes the file, and
+ * dconf_journal_wait() returns %FALSE once that has happened, after
+ * which the client must use D-Bus.  dconf_journal_wait() doesn't notice
+ * a service that died without closing it: dconf_journal_check() says
+ * if the service is still there, and dconf_journal_cancel() makes
+ * dconf_journal_wait() return %FALSE from another thread.
+ */
+typedef struct _DConfJournal DConfJournal;
+
+G_GNUC_INTERNAL
+DConfJournal *          dconf_journal_open                              (const gchar         *name,
+                                                                         gboolean             writable);
+G_GNUC_INTERNAL
+void                    dconf_journal_close                             (DConfJournal        *journal);
+G_GNUC_INTERNAL
+void                    dconf_journal_append                            (DConfJournal        *journal,
+                                                                         guint64              generation,
+                                                                         const gchar         *prefix,
+                                                                         const gchar * const *changes,
+                                                                         const gchar         *tag);
+G_GNUC_INTERNAL
+guint64                 dconf_journal_get_position                      (DConfJournal        *journal);
+G_GNUC_INTERNAL
+GVariant *              dconf_journal_read                              (DConfJournal        *journal,
+                                                                         guint64             *position,
+                                                                         gboolean            *lagged);
+G_GNUC_INTERNAL
+gboolean                dconf_journal_wait                              (DConfJournal        *journal,
+                                                                         guint64              position);
+G_GNUC_INTERNAL
+gboolean                dconf_journal_check                             (DConfJournal        *journal);
+G_GNUC_INTERNAL
+void                    dconf_journal_cancel                            (DConfJournal        *journal);
+
+#endif /* __dconf_journal_h__ */
@@ -0,0 +1,445 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "dconf-shm-db.h"
+
+#include <glib/gstdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* The file is a header followed by three slots of 'slot_size' bytes.
+ *
+ * 'published' holds the current generation shifted left by two, with
+ * the slot that it is in in the low bits.  'generations' says which
+ * generation each slot holds, and 'readers' how many readers are
+ * holding on to it.
+ *
+ * Readers use the slot in place.  A reader bumps the count of the
+ * published slot and then checks that the slot still holds that
+ * generation; the service sets the generation of a slot to zero and
+ * then checks that no one is holding it before writing into it.  Both
+ * sides use sequentially consistent operations, so at least one of
+ * them notices the other.  The count is dropped when the last ref to
+ * the bytes goes away.
+ *
+ * To write a new generation, the service picks a slot other than the
+ * published one that no one is holding.  If there is none (or the new
+ * version doesn't fit) then it writes a bigger file, renames it over
+ * the old one and sets 'replaced' in the old header to tell readers to
+ * map the new one.  Readers that are still holding slots in the old
+ * file keep it mapped until they let go.  That is also how the counts
+ * of readers that exited without letting go get cleared.
+ */
+#define DCONF_SHM_DB_MAGIC              0x62646d73 /* 'smdb' */
+#define DCONF_SHM_DB_HEADER_SIZE        128
+#define DCONF_SHM_DB_MIN_SLOT_SIZE      (16 * 1024)
+#define DCONF_SHM_DB_N_SLOTS            3
+
+typedef struct
+{
+  guint32 magic;
+  guint32 replaced;
+  guint64 slot_size;
+  guint64 published;
+  guint64 generations[DCONF_SHM_DB_N_SLOTS];
+  guint64 sizes[DCONF_SHM_DB_N_SLOTS];
+  gint32  readers[DCONF_SHM_DB_N_SLOTS];
+} DConfShmDbHeader;
+
+/* Stays mapped for as long as the db or any bytes from it use it */
+typedef struct
+{
+  DConfShmDbHeader *header;
+  gsize             size;
+  gint              ref_count;
+} DConfShmDbMapping;
+
+/* The user data of the bytes returned by dconf_shm_db_read() */
+typedef struct
+{
+  DConfShmDbMapping *mapping;
+  guint              slot;
+} DConfShmDbHold;
+
+struct _DConfShmDb
+{
+  gchar             *filename;
+  DConfShmDbMapping *mapping;
+  DConfShmDbHeader  *header;
+  gboolean           writable;
+};
+
+G_STATIC_ASSERT (sizeof (DConfShmDbHeader) <= DCONF_SHM_DB_HEADER_SIZE);
+
+static guint8 *
+dconf_shm_db_get_slot (DConfShmDbHeader *header,
+                       guint             slot)
+{
+  return (guint8 *) header + DCONF_SHM_DB_HEADER_SIZE + slot * header->slot_size;
+}
+
+static DConfShmDbMapping *
+dconf_shm_db_mapping_new (void  *memory,
+                          gsize  size)
+{
+  DConfShmDbMapping *mapping;
+
+  mapping = g_slice_new (DConfShmDbMapping);
+  mapping->header = memory;
+  mapping->size = size;
+  mapping->ref_count = 1;
+
+  return mapping;
+}
+
+static void
+dconf_shm_db_mapping_unref (DConfShmDbMapping *mapping)
+{
+  if (!g_atomic_int_dec_and_test (&mapping->ref_count))
+    return;
+
+  munmap (mapping->header, mapping->size);
+  g_slice_free (DConfShmDbMapping, mapping);
+}
+
+static void
+dconf_shm_db_release (gpointer user_data)
+{
+  DConfShmDbHold *hold = user_data;
+
+  __atomic_fetch_sub (&hold->mapping->header->readers[hold->slot], 1, __ATOMIC_RELEASE);
+  dconf_shm_db_mapping_unref (hold->mapping);
+  g_slice_free (DConfShmDbHold, hold);
+}
+
+/* Readers map the file writable too, for the counts in the header */
+static gboolean
+dconf_shm_db_map (DConfShmDb *db)
+{
+  DConfShmDbHeader *header;
+  struct stat buf;
+  void *memory;
+  gint fd;
+
+  fd = open (db->filename, O_RDWR);
+  if (fd == -1)
+    return FALSE;
+
+  if (fstat (fd, &buf) != 0 || buf.st_size < DCONF_SHM_DB_HEADER_SIZE)
+    {
+      close (fd);
+      return FALSE;
+    }
+
+  memory = mmap (NULL, buf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (memory == MAP_FAILED)
+    return FALSE;
+
+  /* The service only renames the file into place once the header is
+   * filled in, so there is no need for atomics here.
+   */
+  header = memory;
+  if (header->magic != DCONF_SHM_DB_MAGIC ||
+      header->slot_size > G_MAXSIZE / DCONF_SHM_DB_N_SLOTS ||
+      buf.st_size != DCONF_SHM_DB_HEADER_SIZE + DCONF_SHM_DB_N_SLOTS * header->slot_size)
+    {
+      munmap (memory, buf.st_size);
+      return FALSE;
+    }
+
+  db->mapping = dconf_shm_db_mapping_new (memory, buf.st_size);
+  db->header = header;
+
+  return TRUE;
+}
+
+static void
+dconf_shm_db_unmap (DConfShmDb *db)
+{
+  if (db->mapping != NULL)
+    dconf_shm_db_mapping_unref (db->mapping);
+
+  db->mapping = NULL;
+  db->header = NULL;
+}
+
+/* Writes a new file with the given contents as generation 'generation'
+ * (or no contents at all if 'contents' is NULL) and puts it in place.
+ */
+static gboolean
+dconf_shm_db_create (DConfShmDb  *db,
+                     GBytes      *contents,
+                     guint64      generation,
+                     GError     **error)
+{
+  DConfShmDbHeader *header;
+  gsize slot_size;
+  gchar *tmpname;
+  void *memory;
+  gsize size;
+  gint fd;
+
+  slot_size = DCONF_SHM_DB_MIN_SLOT_SIZE;
+  if (contents)
+    while (slot_size < g_bytes_get_size (contents) * 2)
+      slot_size *= 2;
+
+  size = DCONF_SHM_DB_HEADER_SIZE + DCONF_SHM_DB_N_SLOTS * slot_size;
+
+  tmpname = g_strconcat (db->filename, ".XXXXXX", NULL);
+  fd = g_mkstemp_full (tmpname, O_RDWR, 0600);
+  if (fd == -1)
+    goto fail;
+
+  if (ftruncate (fd, size) != 0)
+    {
+      close (fd);
+      goto fail;
+    }
+
+  memory = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (memory == MAP_FAILED)
+    goto fail;
+
+  header = memory;
+  header->magic = DCONF_SHM_DB_MAGIC;
+  header->slot_size = slot_size;
+
+  if (contents)
+    {
+      memcpy (dconf_shm_db_get_slot (header, 0), g_bytes_get_data (contents, NULL), g_bytes_get_size (contents));
+      header->sizes[0] = g_bytes_get_size (contents);
+      header->generations[0] = generation;
+      header->published = generation << 2;
+    }
+
+  if (g_rename (tmpname, db->filename) != 0)
+    {
+      munmap (memory, size);
+      goto fail;
+    }
+
+  /* Tell anyone still reading the old file to move over */
+  if (db->header != NULL)
+    __atomic_store_n (&db->header->replaced, TRUE, __ATOMIC_RELEASE);
+
+  dconf_shm_db_unmap (db);
+  db->mapping = dconf_shm_db_mapping_new (memory, size);
+  db->header = header;
+
+  g_free (tmpname);
+
+  return TRUE;
+
+ fail:
+  {
+    gint saved_errno = errno;
+
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                 "Failed to create file '%s': %s", db->filename, g_strerror (saved_errno));
+    g_unlink (tmpname);
+    g_free (tmpname);
+  }
+
+  return FALSE;
+}
+
+DConfShmDb *
+dconf_shm_db_open (const gchar *filename,
+                   gboolean     writable)
+{
+  DConfShmDb *db;
+
+  db = g_slice_new0 (DConfShmDb);
+  db->filename = g_strdup (filename);
+  db->writable = writable;
+
+  if (dconf_shm_db_map (db))
+    return db;
+
+  /* The service starts from scratch if the file is missing or invalid.
+   * Clients don't see the file until the service has put it in place.
+   */
+  if (writable)
+    {
+      gchar *dirname;
+
+      dirname = g_path_get_dirname (filename);
+      g_mkdir_with_parents (dirname, 0700);
+      g_free (dirname);
+
+      if (dconf_shm_db_create (db, NULL, 0, NULL))
+        return db;
+    }
+
+  dconf_shm_db_close (db);
+
+  return NULL;
+}
+
+/* Bytes returned by dconf_shm_db_read() stay valid after this */
+void
+dconf_shm_db_close (DConfShmDb *db)
+{
+  dconf_shm_db_unmap (db);
+  g_free (db->filename);
+  g_slice_free (DConfShmDb, db);
+}
+
+/* Like dconf_shm_db_close(), but also removes the file.  Clients that
+ * are reading it find that it was replaced, fail to map a new one and
+ * go back to the plain file.
+ */
+void
+dconf_shm_db_remove (DConfShmDb *db)
+{
+  g_return_if_fail (db->writable);
+
+  g_unlink (db->filename);
+
+  if (db->header != NULL)
+    __atomic_store_n (&db->header->replaced, TRUE, __ATOMIC_RELEASE);
+
+  dconf_shm_db_close (db);
+}
+
+guint64
+dconf_shm_db_get_generation (DConfShmDb *db)
+{
+  if (db->header == NULL || __atomic_load_n (&db->header->replaced, __ATOMIC_ACQUIRE))
+    return G_MAXUINT64;
+
+  return __atomic_load_n (&db->header->published, __ATOMIC_ACQUIRE) >> 2;
+}
+
+/* Returns the current contents, or NULL if the service hasn't written
+ * any yet (or the file went away).  The bytes point into the file: the
+ * service leaves their slot alone until they are freed, so don't hold
+ * on to them for longer than needed.
+ */
+GBytes *
+dconf_shm_db_read (DConfShmDb *db,
+                   guint64    *generation)
+{
+  while (TRUE)
+    {
+      DConfShmDbHold *hold;
+      guint64 published;
+      guint64 current;
+      guint64 size;
+      guint slot;
+
+      if (db->header == NULL || __atomic_load_n (&db->header->replaced, __ATOMIC_ACQUIRE))
+        {
+          dconf_shm_db_unmap (db);
+
+          if (!dconf_shm_db_map (db))
+            return NULL;
+        }
+
+      published = __atomic_load_n (&db->header->published, __ATOMIC_ACQUIRE);
+      current = published >> 2;
+      slot = published & 3;
+      if (current == 0 || slot >= DCONF_SHM_DB_N_SLOTS)
+        return NULL;
+
+      __atomic_fetch_add (&db->header->readers[slot], 1, __ATOMIC_SEQ_CST);
+
+      /* The service moved on and took the slot before we got it */
+      if (__atomic_load_n (&db->header->generations[slot], __ATOMIC_SEQ_CST) != current)
+        {
+          __atomic_fetch_sub (&db->header->readers[slot], 1, __ATOMIC_RELEASE);
+          continue;
+        }
+
+      if (generation)
+        *generation = current;
+
+      hold = g_slice_new (DConfShmDbHold);
+      hold->mapping = db->mapping;
+      hold->slot = slot;
+      g_atomic_int_inc (&db->mapping->ref_count);
+
+      size = MIN (__atomic_load_n (&db->header->sizes[slot], __ATOMIC_RELAXED), db->header->slot_size);
+
+      return g_bytes_new_with_free_func (dconf_shm_db_get_slot (db->header, slot), size,
+                                         dconf_shm_db_release, hold);
+    }
+}
+
+/* Finds a slot that isn't published and that no one is holding, and
+ * takes it.  Returns DCONF_SHM_DB_N_SLOTS if there is none.
+ */
+static guint
+dconf_shm_db_take_slot (DConfShmDbHeader *header)
+{
+  guint current;
+  guint slot;
+
+  current = header->published & 3;
+
+  for (slot = 0; slot < DCONF_SHM_DB_N_SLOTS; slot++)
+    {
+      if (slot == current)
+        continue;
+
+      __atomic_store_n (&header->generations[slot], 0, __ATOMIC_SEQ_CST);
+
+      if (__atomic_load_n (&header->readers[slot], __ATOMIC_SEQ_CST) == 0)
+        break;
+    }
+
+  return slot;
+}
+
+gboolean
+dconf_shm_db_write (DConfShmDb  *db,
+                    GBytes      *contents,
+                    GError     **error)
+{
+  guint64 generation;
+  gsize size;
+  guint slot;
+
+  g_return_val_if_fail (db->writable, FALSE);
+
+  generation = (db->header->published >> 2) + 1;
+  size = g_bytes_get_size (contents);
+
+  if (size > db->header->slot_size)
+    return dconf_shm_db_create (db, contents, generation, error);
+
+  slot = dconf_shm_db_take_slot (db->header);
+  if (slot == DCONF_SHM_DB_N_SLOTS)
+    return dconf_shm_db_create (db, contents, generation, error);
+
+  memcpy (dconf_shm_db_get_slot (db->header, slot), g_bytes_get_data (contents, NULL), size);
+  __atomic_store_n (&db->header->sizes[slot], size, __ATOMIC_RELAXED);
+  __atomic_store_n (&db->header->generations[slot], generation, __ATOMIC_RELAXED);
+
+  __atomic_store_n (&db->header->published, (generation << 2) | slot, __ATOMIC_RELEASE);
+
+  return TRUE;
+}
@@ -0,0 +1,49 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the licence, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __dconf_shm_db_h__
+#define __dconf_shm_db_h__
+
+#include <glib.h>
+
+/* A buffered database file in the runtime dir.  The service writes
+ * each new version of the database into a slot that clients are not
+ * using and then publishes it by bumping the generation in the header,
+ * so clients map the file only once and read the slots in place.
+ *
+ * The file only lives as long as the service uses it: when the service
+ * is done with it, dconf_shm_db_remove() sends the clients back to the
+ * plain database file.
+ */
+typedef struct _DConfShmDb DConfShmDb;
+
+G_GNUC_INTERNAL
+DConfShmDb *            dconf_shm_db_open                               (const gchar   *filename,
+                                                                         gboolean       writable);
+G_GNUC_INTERNAL
+void                    dconf_shm_db_close                              (DConfShmDb    *db);
+G_GNUC_INTERNAL
+void                    dconf_shm_db_remove                             (DConfShmDb    *db);
+G_GNUC_INTERNAL
+guint64                 dconf_shm_db_get_generation                     (DConfShmDb    *db);
+G_GNUC_INTERNAL
+GBytes *                dconf_shm_db_read                               (DConfShmDb    *db,
+                                                                         guint64       *generation);
+G_GNUC_INTERNAL
+gboolean                dconf_shm_db_write                              (DConfShmDb    *db,
+                                                                         GBytes        *contents,
+                                                                         GError       **error);
+
+#endif /* __dconf_shm_db_h__ */
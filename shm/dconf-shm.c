@@ -24,6 +24,7 @@
 #include "dconf-shm-mockable.h"
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -40,13 +41,46 @@ dconf_shm_get_shmdir (void)
 }
 
 void
-dconf_shm_close (guint8 *shm)
+dconf_shm_close (const guint64 *shm)
 {
   if (shm)
-    munmap (shm, 1);
+    munmap ((gpointer) shm, sizeof (guint64));
 }
 
-guint8 *
+static gboolean
+dconf_shm_allocate (gint fd)
+{
+  /* ftruncate(fd, 8) is not sufficient because it does not actually
+   * ensure that the space is available (which could give a SIGBUS
+   * later).
+   *
+   * posix_fallocate() is also problematic because it is implemented in
+   * a racy way in the libc if unavailable for a particular filesystem
+   * (as is the case for tmpfs, which is where we probably are).
+   *
+   * By writing to the byte after the counter we ensure we don't
+   * overwrite the counter itself.
+   */
+  return dconf_shm_pwrite (fd, "", 1, sizeof (guint64)) == 1;
+}
+
+/* The counter has a file of its own.  The file with the plain name of
+ * the database is the one-byte flag that older clients map.
+ */
+static gchar *
+dconf_shm_get_counter_filename (const gchar *name)
+{
+  gchar *basename;
+  gchar *filename;
+
+  basename = g_strconcat (name, ".generation", NULL);
+  filename = g_build_filename (dconf_shm_get_shmdir (), basename, NULL);
+  g_free (basename);
+
+  return filename;
+}
+
+const guint64 *
 dconf_shm_open (const gchar *name)
 {
   const gchar *shmdir;
@@ -55,7 +89,7 @@ dconf_shm_open (const gchar *name)
   gint fd;
 
   shmdir = dconf_shm_get_shmdir ();
-  filename = g_build_filename (shmdir, name, NULL);
+  filename = dconf_shm_get_counter_filename (name);
   memory = NULL;
   fd = -1;
 
@@ -72,24 +106,13 @@ dconf_shm_open (const gchar *name)
       goto out;
     }
 
-  /* ftruncate(fd, 1) is not sufficient because it does not actually
-   * ensure that the space is available (which could give a SIGBUS
-   * later).
-   *
-   * posix_fallocate() is also problematic because it is implemented in
-   * a racy way in the libc if unavailable for a particular filesystem
-   * (as is the case for tmpfs, which is where we probably are).
-   *
-   * By writing to the second byte in the file we ensure we don't
-   * overwrite the first byte (which is the one we care about).
-   */
-  if (dconf_shm_pwrite (fd, "", 1, 1) != 1)
+  if (!dconf_shm_allocate (fd))
     {
       g_critical ("failed to allocate file '%s': %s.  dconf will not work properly.", filename, g_strerror (errno));
       goto out;
     }
 
-  memory = mmap (NULL, 1, PROT_READ, MAP_SHARED, fd, 0);
+  memory = mmap (NULL, sizeof (guint64), PROT_READ, MAP_SHARED, fd, 0);
   g_assert (memory != MAP_FAILED);
   g_assert (memory != NULL);
 
@@ -100,20 +123,65 @@ dconf_shm_open (const gchar *name)
   return memory;
 }
 
-void
-dconf_shm_flag (const gchar *name)
+/* The service keeps a writable mapping of the counter for each database
+ * that it has flagged, so that flagging is just an atomic increment.
+ *
+ * The file can be removed behind our back (eg: by someone cleaning out
+ * the runtime dir), and then clients create a new one that we would
+ * never bump.  So we keep the file open and check that it is still
+ * linked before each increment.  A new file carries on from the last
+ * generation that we gave out, so generations never go backwards.
+ *
+ * The one-byte flag of older clients is only set for databases that had
+ * one when we first flagged them: everyone else would pay for an extra
+ * open() per change for nothing.
+ */
+typedef struct
+{
+  guint64  *counter;
+  gint      fd;
+  guint64   last;
+  gboolean  legacy;
+} DConfShmCounter;
+
+static GHashTable *dconf_shm_counters;
+static GMutex dconf_shm_counters_lock;
+
+static gchar *
+dconf_shm_get_legacy_filename (const gchar *name)
+{
+  return g_build_filename (dconf_shm_get_shmdir (), name, NULL);
+}
+
+static void
+dconf_shm_counter_close (DConfShmCounter *counter)
+{
+  if (counter->counter != NULL)
+    {
+      munmap (counter->counter, sizeof (guint64));
+      close (counter->fd);
+    }
+
+  counter->counter = NULL;
+  counter->fd = -1;
+}
+
+static void
+dconf_shm_counter_open (DConfShmCounter *counter,
+                        const gchar     *name)
 {
-  const gchar *shmdir;
   gchar *filename;
   gint fd;
 
-  shmdir = dconf_shm_get_shmdir ();
-  filename = g_build_filename (shmdir, name, NULL);
+  filename = dconf_shm_get_counter_filename (name);
 
   /* We need O_RDWR for PROT_WRITE.
    *
    * This is probably due to the fact that some architectures can't make
    * write-only mappings (so they end up being readable as well).
+   *
+   * If the file doesn't exist then no client is watching yet, and
+   * there is nothing to do.  We will try again next time.
    */
   fd = open (filename, O_RDWR);
   if (fd >= 0)
@@ -125,11 +193,9 @@ dconf_shm_flag (const gchar *name)
        * If this fails then it will probably fail for the client too.
        * If it doesn't then there's not really much we can do...
        */
-      if (dconf_shm_pwrite (fd, "", 1, 1) == 1)
+      if (dconf_shm_allocate (fd))
         {
-          guint8 *shm;
-
-          /* It would have been easier for us to do write(fd, "\1", 1);
+          /* It would have been easier for us to pwrite() the counter,
            * but this causes problems on kernels (ie: OpenBSD) that
            * don't sync up their filesystem cache with mmap()ed regions.
            *
@@ -138,6 +204,72 @@ dconf_shm_flag (const gchar *name)
            * See https://bugzilla.gnome.org/show_bug.cgi?id=687334 about
            * why we need to have PROT_READ even though we only write.
            */
+          counter->counter = mmap (NULL, sizeof (guint64), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+          g_assert (counter->counter != MAP_FAILED);
+          counter->fd = fd;
+
+          if (__atomic_load_n (counter->counter, __ATOMIC_RELAXED) < counter->last)
+            __atomic_store_n (counter->counter, counter->last, __ATOMIC_RELAXED);
+        }
+      else
+        close (fd);
+    }
+
+  g_free (filename);
+}
+
+static DConfShmCounter *
+dconf_shm_get_counter (const gchar *name)
+{
+  DConfShmCounter *counter;
+  struct stat buf;
+
+  if (dconf_shm_counters == NULL)
+    dconf_shm_counters = g_hash_table_new (g_str_hash, g_str_equal);
+
+  counter = g_hash_table_lookup (dconf_shm_counters, name);
+  if (counter == NULL)
+    {
+      gchar *filename;
+
+      filename = dconf_shm_get_legacy_filename (name);
+      counter = g_slice_new0 (DConfShmCounter);
+      counter->fd = -1;
+      counter->legacy = g_file_test (filename, G_FILE_TEST_EXISTS);
+      g_hash_table_insert (dconf_shm_counters, g_strdup (name), counter);
+      g_free (filename);
+    }
+
+  /* Unlinked (or replaced) since we opened it */
+  if (counter->counter != NULL && (fstat (counter->fd, &buf) != 0 || buf.st_nlink == 0))
+    dconf_shm_counter_close (counter);
+
+  if (counter->counter == NULL)
+    dconf_shm_counter_open (counter, name);
+
+  return counter;
+}
+
+/* Sets the flag of clients from before the generation counter, if any
+ * of them have the database open, and removes it so that the next ones
+ * get a fresh one.
+ */
+static void
+dconf_shm_flag_legacy (const gchar *name)
+{
+  gchar *filename;
+  gint fd;
+
+  filename = dconf_shm_get_legacy_filename (name);
+
+  fd = open (filename, O_RDWR);
+  if (fd >= 0)
+    {
+      /* As above: make sure that the byte is there before mapping it */
+      if (dconf_shm_pwrite (fd, "", 1, 1) == 1)
+        {
+          guint8 *shm;
+
           shm = mmap (NULL, 1, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
           g_assert (shm != MAP_FAILED);
 
@@ -153,3 +285,33 @@ dconf_shm_flag (const gchar *name)
 
   g_free (filename);
 }
+
+/* Returns the new generation, or 0 if nobody is watching yet */
+guint64
+dconf_shm_flag (const gchar *name)
+{
+  DConfShmCounter *counter;
+  guint64 generation = 0;
+  gboolean legacy;
+
+  g_mutex_lock (&dconf_shm_counters_lock);
+
+  counter = dconf_shm_get_counter (name);
+  legacy = counter->legacy;
+
+  /* Pairs with the acquire in dconf_shm_get_generation(): a client that
+   * sees the new generation also sees the database that we just wrote.
+   */
+  if (counter->counter != NULL)
+    {
+      generation = __atomic_add_fetch (counter->counter, 1, __ATOMIC_RELEASE);
+      counter->last = generation;
+    }
+
+  g_mutex_unlock (&dconf_shm_counters_lock);
+
+  if (legacy)
+    dconf_shm_flag_legacy (name);
+
+  return generation;
+}
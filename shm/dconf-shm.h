@@ -22,17 +22,31 @@
 
 #include <glib.h>
 
+/* Each database has a page holding a 64-bit generation counter (in
+ * "NAME.generation"), which the service increments after each change.
+ * Clients map it once and compare it against the generation that they
+ * last read.  The service also sets the one-byte flag in "NAME" that
+ * older clients use, for the databases that had one when it first
+ * flagged them.
+ */
 G_GNUC_INTERNAL
-guint8 *                dconf_shm_open                                  (const gchar *name);
+const guint64 *         dconf_shm_open                                  (const gchar   *name);
 G_GNUC_INTERNAL
-void                    dconf_shm_close                                 (guint8      *shm);
+void                    dconf_shm_close                                 (const guint64 *shm);
 G_GNUC_INTERNAL
-void                    dconf_shm_flag                                  (const gchar *name);
+guint64                 dconf_shm_flag                                  (const gchar   *name);
+
+static inline guint64
+dconf_shm_get_generation (const guint64 *shm)
+{
+  return __atomic_load_n (shm, __ATOMIC_ACQUIRE);
+}
 
 static inline gboolean
-dconf_shm_is_flagged (const guint8 *shm)
+dconf_shm_is_flagged (const guint64 *shm,
+                      guint64        generation)
 {
-  return shm == NULL || *shm != 0;
+  return shm == NULL || dconf_shm_get_generation (shm) != generation;
 }
 
 #endif /* __dconf_shm_h__ */
@@ -229,6 +229,86 @@ test_coalesce (void)
   g_signal_handlers_disconnect_by_func (client, changed, NULL);
 }
 
+static void
+log_changed (DConfClient         *client,
+             const gchar         *prefix,
+             const gchar * const *changes,
+             const gchar         *tag,
+             gpointer             user_data)
+{
+  GString *log = user_data;
+  gchar *joined;
+
+  joined = g_strjoinv (",", (gchar **) changes);
+  g_string_append_printf (log, "%s:%s;", prefix, joined);
+  g_free (joined);
+}
+
+static void
+test_coalesce_signals (void)
+{
+  GMainContext *context;
+  DConfClient *client;
+  GString *log;
+  gint i;
+
+  /* Use a context that isn't running, so that the changes pile up */
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+  client = dconf_client_new ();
+  g_main_context_pop_thread_default (context);
+
+  dconf_client_set_coalesce_changes (client, TRUE);
+
+  log = g_string_new (NULL);
+  g_signal_connect (client, "changed", G_CALLBACK (log_changed), log);
+
+  for (i = 0; i < 100; i++)
+    dconf_client_write_fast (client, "/test/a", g_variant_new_int32 (i), NULL);
+  dconf_client_write_fast (client, "/test/b", g_variant_new_int32 (0), NULL);
+  dconf_client_write_fast (client, "/test/a", g_variant_new_int32 (100), NULL);
+
+  g_assert_cmpstr (log->str, ==, "");
+
+  /* One signal for each key */
+  while (g_main_context_iteration (context, FALSE));
+  g_assert_cmpstr (log->str, ==, "/test/a:;/test/b:;");
+  g_string_truncate (log, 0);
+
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "1"), NULL);
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "2"), NULL);
+  dconf_mock_dbus_assert_no_async ();
+
+  while (g_main_context_iteration (context, FALSE));
+  g_string_truncate (log, 0);
+
+  /* Changes under the same prefix: each path is listed once */
+  for (i = 0; i < 2; i++)
+    {
+      DConfChangeset *changeset;
+
+      changeset = dconf_changeset_new ();
+      dconf_changeset_set (changeset, i ? "/test/b" : "/test/a", g_variant_new_int32 (i));
+      dconf_changeset_set (changeset, "/test/c", g_variant_new_int32 (i));
+      g_assert_true (dconf_client_change_fast (client, changeset, NULL));
+      dconf_changeset_unref (changeset);
+    }
+
+  while (g_main_context_iteration (context, FALSE));
+  g_assert_cmpstr (log->str, ==, "/test/:a,b,c;");
+
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "3"), NULL);
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "4"), NULL);
+  dconf_mock_dbus_assert_no_async ();
+
+  while (g_main_context_iteration (context, FALSE));
+
+  g_signal_handlers_disconnect_by_func (client, log_changed, log);
+  g_string_free (log, TRUE);
+  g_object_unref (client);
+  g_main_context_unref (context);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -241,6 +321,7 @@ main (int argc, char **argv)
   g_test_add_func ("/client/lifecycle", test_lifecycle);
   g_test_add_func ("/client/basic-fast", test_fast);
   g_test_add_func ("/client/coalesce", test_coalesce);
+  g_test_add_func ("/client/coalesce-signals", test_coalesce_signals);
 
   return g_test_run ();
 }
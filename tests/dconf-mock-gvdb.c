@@ -172,10 +172,21 @@ gchar **
 gvdb_table_get_names (GvdbTable *table,
                       gsize     *length)
 {
+  GHashTableIter iter;
+  gpointer key;
+  gchar **names;
+  gsize n = 0;
+
+  names = g_new0 (gchar *, g_hash_table_size (table->table) + 1);
+
+  g_hash_table_iter_init (&iter, table->table);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    names[n++] = g_strdup (key);
+
   if (length)
-    *length = 0;
+    *length = n;
 
-  return g_new0 (gchar *, 0 + 1);
+  return names;
 }
 
 GvdbTable *
@@ -198,6 +209,17 @@ gvdb_table_new (const gchar  *filename,
   return table;
 }
 
+/* Only used for buffered service databases, which the mock
+ * dconf_shm_db_open() never returns.
+ */
+GvdbTable *
+gvdb_table_new_from_bytes (GBytes    *bytes,
+                           gboolean   trusted,
+                           GError   **error)
+{
+  g_assert_not_reached ();
+}
+
 gboolean
 gvdb_table_is_valid (GvdbTable *table)
 {
@@ -1,11 +1,13 @@
 #include "../shm/dconf-shm.h"
+#include "../shm/dconf-journal.h"
+#include "../shm/dconf-shm-db.h"
 
 #include "dconf-mock.h"
 
 typedef struct
 {
-  guint8 flagged;
-  gint   ref_count;
+  guint64 generation;
+  gint    ref_count;
 } DConfMockShm;
 
 static GHashTable *dconf_mock_shm_table;
@@ -29,7 +31,7 @@ dconf_mock_shm_ref (DConfMockShm *shm)
   return shm;
 }
 
-guint8 *
+const guint64 *
 dconf_shm_open (const gchar *name)
 {
   DConfMockShm *shm;
@@ -56,11 +58,11 @@ dconf_shm_open (const gchar *name)
 
   g_mutex_unlock (&dconf_mock_shm_lock);
 
-  return &shm->flagged;
+  return &shm->generation;
 }
 
 void
-dconf_shm_close (guint8 *shm)
+dconf_shm_close (const guint64 *shm)
 {
   if (shm)
     {
@@ -68,7 +70,7 @@ dconf_shm_close (guint8 *shm)
       g_string_append (dconf_mock_shm_log, "close;");
       g_mutex_unlock (&dconf_mock_shm_lock);
 
-      dconf_mock_shm_unref (shm);
+      dconf_mock_shm_unref ((gpointer) shm);
     }
 }
 
@@ -82,9 +84,8 @@ dconf_mock_shm_flag (const gchar *name)
   shm = g_hash_table_lookup (dconf_mock_shm_table, name);
   if (shm)
     {
-      shm->flagged = 1;
-      count = shm->ref_count;
-      g_hash_table_remove (dconf_mock_shm_table, name);
+      __atomic_add_fetch (&shm->generation, 1, __ATOMIC_RELEASE);
+      count = shm->ref_count - 1;
     }
   g_mutex_unlock (&dconf_mock_shm_lock);
 
@@ -122,3 +123,102 @@ dconf_mock_shm_assert_log (const gchar *expected_log)
   g_string_truncate (dconf_mock_shm_log, 0);
   g_mutex_unlock (&dconf_mock_shm_lock);
 }
+
+/* The engine uses D-Bus for change notifies in the tests, except for
+ * the "journal" database.  Its journal never has anything in it, and
+ * the reader never stops, even when cancelled: the tests feed records
+ * to the engine with dconf_engine_handle_journal_record() directly, and
+ * say when it is closed with dconf_engine_handle_journal_closed().
+ */
+static gint dconf_mock_journal;
+static gint dconf_mock_journal_cancelled;
+
+DConfJournal *
+dconf_journal_open (const gchar *name,
+                    gboolean     writable)
+{
+  g_assert (!writable);
+
+  if (g_str_equal (name, "journal"))
+    return (DConfJournal *) &dconf_mock_journal;
+
+  return NULL;
+}
+
+void
+dconf_journal_close (DConfJournal *journal)
+{
+  g_assert_not_reached ();
+}
+
+guint64
+dconf_journal_get_position (DConfJournal *journal)
+{
+  return 0;
+}
+
+GVariant *
+dconf_journal_read (DConfJournal *journal,
+                    guint64      *position,
+                    gboolean     *lagged)
+{
+  return NULL;
+}
+
+gboolean
+dconf_journal_wait (DConfJournal *journal,
+                    guint64       position)
+{
+  static GMutex lock;
+  static GCond cond;
+
+  g_mutex_lock (&lock);
+  while (TRUE)
+    g_cond_wait (&cond, &lock);
+}
+
+gboolean
+dconf_journal_check (DConfJournal *journal)
+{
+  return TRUE;
+}
+
+void
+dconf_journal_cancel (DConfJournal *journal)
+{
+  g_atomic_int_set (&dconf_mock_journal_cancelled, TRUE);
+}
+
+void
+dconf_mock_journal_assert_cancelled (gboolean cancelled)
+{
+  g_assert_cmpint (g_atomic_int_get (&dconf_mock_journal_cancelled), ==, cancelled);
+  g_atomic_int_set (&dconf_mock_journal_cancelled, FALSE);
+}
+
+/* Service databases are always plain gvdb files in the tests */
+DConfShmDb *
+dconf_shm_db_open (const gchar *filename,
+                   gboolean     writable)
+{
+  return NULL;
+}
+
+void
+dconf_shm_db_close (DConfShmDb *db)
+{
+  g_assert_not_reached ();
+}
+
+guint64
+dconf_shm_db_get_generation (DConfShmDb *db)
+{
+  g_assert_not_reached ();
+}
+
+GBytes *
+dconf_shm_db_read (DConfShmDb *db,
+                   guint64    *generation)
+{
+  g_assert_not_reached ();
+}
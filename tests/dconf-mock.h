@@ -23,6 +23,7 @@ void                    dconf_mock_dbus_assert_no_async                 (void);
 void                    dconf_mock_shm_reset                            (void);
 gint                    dconf_mock_shm_flag                             (const gchar *name);
 void                    dconf_mock_shm_assert_log                       (const gchar *expected_log);
+void                    dconf_mock_journal_assert_cancelled             (gboolean     cancelled);
 
 GvdbTable *             dconf_mock_gvdb_table_new                       (void);
 void                    dconf_mock_gvdb_table_insert                    (GvdbTable   *table,
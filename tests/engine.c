@@ -294,22 +294,26 @@ test_user_source (void)
   g_assert (source->locks == NULL);
   dconf_mock_shm_assert_log ("");
 
-  /* Now flag it and reopen. */
+  /* Now flag it and reopen.  The shm stays open. */
   dconf_mock_shm_flag ("user");
   reopened = dconf_engine_source_refresh (source);
   g_assert (reopened);
   g_assert (source->values != NULL);
   g_assert (source->locks == NULL);
   g_assert (gvdb_table_has_value (source->values, "/values/int32"));
-  dconf_mock_shm_assert_log ("close;open user;");
+  dconf_mock_shm_assert_log ("");
 
-  /* Do it again -- should get the same result, after some IO */
+  /* No more flags, so no more reopening */
+  reopened = dconf_engine_source_refresh (source);
+  g_assert (!reopened);
+
+  /* Do it again -- should get the same result */
   dconf_mock_shm_flag ("user");
   reopened = dconf_engine_source_refresh (source);
   g_assert (reopened);
   g_assert (source->values != NULL);
   g_assert (source->locks == NULL);
-  dconf_mock_shm_assert_log ("close;open user;");
+  dconf_mock_shm_assert_log ("");
 
   /* "Delete" the gvdb and make sure dconf notices after a flag */
   dconf_mock_gvdb_install ("/HOME/.config/dconf/user", NULL);
@@ -318,7 +322,7 @@ test_user_source (void)
   g_assert (reopened);
   g_assert (source->values == NULL);
   g_assert (source->locks == NULL);
-  dconf_mock_shm_assert_log ("close;open user;");
+  dconf_mock_shm_assert_log ("");
 
   /* Add a gvdb with a lock */
   table = dconf_mock_gvdb_table_new ();
@@ -336,7 +340,7 @@ test_user_source (void)
   g_assert (source->locks != NULL);
   g_assert (gvdb_table_has_value (source->values, "/values/int32"));
   g_assert (gvdb_table_has_value (source->locks, "/values/int32"));
-  dconf_mock_shm_assert_log ("close;open user;");
+  dconf_mock_shm_assert_log ("");
 
   /* Reopen one last time */
   dconf_mock_shm_flag ("user");
@@ -344,7 +348,7 @@ test_user_source (void)
   g_assert (reopened);
   g_assert (source->values != NULL);
   g_assert (source->locks != NULL);
-  dconf_mock_shm_assert_log ("close;open user;");
+  dconf_mock_shm_assert_log ("");
 
   dconf_engine_source_free (source);
   dconf_mock_shm_assert_log ("close;");
@@ -452,6 +456,8 @@ static void
 test_service_source (void)
 {
   DConfEngineSource *source;
+  GVariant *parameters;
+  GVariant *reply;
   gboolean reopened;
 
   /* Make sure we deal with errors from the service sensibly */
@@ -460,11 +466,19 @@ test_service_source (void)
       g_log_set_always_fatal (G_LOG_LEVEL_ERROR);
 
       source = dconf_engine_source_new ("service-db:unknown/nil");
-      dconf_mock_dbus_sync_call_handler = handle_service_request;
       g_assert (source != NULL);
       g_assert (source->values == NULL);
       g_assert (source->locks == NULL);
       reopened = dconf_engine_source_refresh (source);
+      g_assert (!reopened);
+      g_assert (source->needs_init);
+
+      /* Do what the engine does when the Init call comes back */
+      source->needs_init = FALSE;
+      dconf_engine_source_retry (source);
+      reopened = dconf_engine_source_refresh (source);
+      g_assert (!reopened);
+      g_assert (!source->needs_init);
 
       return;
     }
@@ -481,15 +495,28 @@ test_service_source (void)
 
   /* Refresh it the first time.
    *
-   * This should cause the service to be asked to create it.
-   *
-   * This should return TRUE because we just opened it.
+   * This should ask for the service to be asked to create it.  That
+   * happens asynchronously, so we don't have it yet.
    */
-  dconf_mock_dbus_sync_call_handler = handle_service_request;
   reopened = dconf_engine_source_refresh (source);
-  dconf_mock_dbus_sync_call_handler = NULL;
+  g_assert (!reopened);
+  g_assert (source->needs_init);
+
+  /* Pretend to be the engine sending the Init call.
+   *
+   * Refreshing again should return TRUE because we just opened it.
+   */
+  source->needs_init = FALSE;
+  parameters = g_variant_ref_sink (g_variant_new ("()"));
+  reply = handle_service_request (G_BUS_TYPE_SESSION, source->bus_name, source->object_path,
+                                  "ca.desrt.dconf.Writer", "Init", parameters, NULL, NULL);
+  g_variant_unref (g_variant_ref_sink (reply));
+  g_variant_unref (parameters);
   g_assert (service_db_created);
+  dconf_engine_source_retry (source);
+  reopened = dconf_engine_source_refresh (source);
   g_assert (reopened);
+  g_assert (!source->needs_init);
 
   /* After that, a refresh should be a no-op. */
   reopened = dconf_engine_source_refresh (source);
@@ -497,15 +524,13 @@ test_service_source (void)
 
   /* Close it and reopen it, ensuring that we don't hit the service
    * again (because the file already exists).
-   *
-   * Note: dconf_mock_dbus_sync_call_handler = NULL, so D-Bus calls will
-   * assert.
    */
   dconf_engine_source_free (source);
   source = dconf_engine_source_new ("service-db:shm/nil");
   g_assert (source != NULL);
   reopened = dconf_engine_source_refresh (source);
   g_assert (reopened);
+  g_assert (!source->needs_init);
 
   /* Make sure it has the content we expect to see */
   g_assert (gvdb_table_has_value (source->values, "/values/int32"));
@@ -532,6 +557,131 @@ test_service_source (void)
   service_db_table = NULL;
 }
 
+/* Each key is read from the shard with the longest dir that it is in,
+ * and never from the main table if a shard has its dir.
+ */
+static void
+test_read_shards (void)
+{
+  gchar *profile_filename;
+  GError *error = NULL;
+  DConfEngine *engine;
+  GvdbTable *table;
+  GvdbTable *index;
+  GvdbTable *shard;
+  GVariant *value;
+
+  close (g_file_open_tmp ("dconf-testcase.XXXXXX", &profile_filename, &error));
+  g_assert_no_error (error);
+  g_file_set_contents (profile_filename, "user-db:user\n", -1, &error);
+  g_assert_no_error (error);
+
+  index = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_table_insert (index, "/org/", g_variant_new_string ("user.org"), NULL);
+  dconf_mock_gvdb_table_insert (index, "/org/gnome/", g_variant_new_string ("user.gnome"), NULL);
+
+  table = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_table_insert (table, "/value", g_variant_new_string ("main"), NULL);
+  dconf_mock_gvdb_table_insert (table, "/org/value", g_variant_new_string ("main"), NULL);
+  dconf_mock_gvdb_table_insert (table, ".shards", NULL, index);
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user", table);
+
+  shard = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_table_insert (shard, "/org/value", g_variant_new_string ("org"), NULL);
+  dconf_mock_gvdb_table_insert (shard, "/org/gnome/value", g_variant_new_string ("org"), NULL);
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user.org", shard);
+
+  shard = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_table_insert (shard, "/org/gnome/value", g_variant_new_string ("gnome"), NULL);
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user.gnome", shard);
+
+  engine = dconf_engine_new (profile_filename, NULL, NULL);
+
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/value");
+  g_assert_cmpstr (g_variant_get_string (value, NULL), ==, "main");
+  g_variant_unref (value);
+
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/org/value");
+  g_assert_cmpstr (g_variant_get_string (value, NULL), ==, "org");
+  g_variant_unref (value);
+
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/org/gnome/value");
+  g_assert_cmpstr (g_variant_get_string (value, NULL), ==, "gnome");
+  g_variant_unref (value);
+
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/org/other");
+  g_assert (value == NULL);
+
+  /* A missing shard has no values, rather than the main table's */
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user.org", NULL);
+  dconf_mock_shm_flag ("user.org");
+
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/org/value");
+  g_assert (value == NULL);
+
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/org/gnome/value");
+  g_assert_cmpstr (g_variant_get_string (value, NULL), ==, "gnome");
+  g_variant_unref (value);
+
+  dconf_engine_unref (engine);
+
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user", NULL);
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user.gnome", NULL);
+  dconf_mock_shm_reset ();
+  g_unlink (profile_filename);
+  g_free (profile_filename);
+}
+
+static void
+test_service_init (void)
+{
+  gchar *profile_filename;
+  GError *error = NULL;
+  DConfEngine *engine;
+  GVariant *value;
+
+  close (g_file_open_tmp ("dconf-testcase.XXXXXX", &profile_filename, &error));
+  g_assert_no_error (error);
+  g_file_set_contents (profile_filename, "service-db:shm/nil\n", -1, &error);
+  g_assert_no_error (error);
+
+  engine = dconf_engine_new (profile_filename, NULL, NULL);
+
+  /* The first read doesn't wait for the service to create the file */
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/values/int32");
+  g_assert (value == NULL);
+  g_assert_cmpint (g_queue_get_length (&dconf_mock_dbus_outstanding_call_handles), ==, 1);
+
+  /* ...and the next one doesn't ask again */
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/values/int32");
+  g_assert (value == NULL);
+  g_assert_cmpint (g_queue_get_length (&dconf_mock_dbus_outstanding_call_handles), ==, 1);
+
+  /* Once the service replies, we get told that everything changed */
+  service_db_table = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_table_insert (service_db_table, "/values/int32", g_variant_new_int32 (123456), NULL);
+  dconf_mock_gvdb_install ("/RUNTIME/dconf-service/shm/nil", service_db_table);
+
+  change_log = g_string_new (NULL);
+  dconf_mock_dbus_async_reply (g_variant_new ("()"), NULL);
+  g_assert_cmpstr (change_log->str, ==, "/:1::nil;");
+  g_string_free (change_log, TRUE);
+  change_log = NULL;
+
+  value = dconf_engine_read (engine, DCONF_READ_FLAGS_NONE, NULL, "/values/int32");
+  g_assert (value != NULL);
+  g_assert_cmpint (g_variant_get_int32 (value), ==, 123456);
+  g_variant_unref (value);
+
+  dconf_mock_dbus_assert_no_async ();
+  dconf_engine_unref (engine);
+
+  dconf_mock_gvdb_install ("/RUNTIME/dconf-service/shm/nil", NULL);
+  service_db_table = NULL;
+  g_unlink (profile_filename);
+  g_free (profile_filename);
+}
+
 static void
 test_system_source (void)
 {
@@ -556,13 +706,22 @@ test_system_source (void)
       /* Attempt the reopen to make sure we don't get two warnings.
        * We should see FALSE again since we go from NULL to NULL.
        */
+      dconf_engine_source_retry (source);
       reopened = dconf_engine_source_refresh (source);
       g_assert (!reopened);
 
-      /* Create the file after the fact and make sure it opens properly */
+      /* Create the file after the fact.  We don't look for it again
+       * until the backoff is over (or we get a signal about it)...
+       */
       first_table = dconf_mock_gvdb_table_new ();
       dconf_mock_gvdb_install (SYSCONFDIR "/dconf/db/site", first_table);
 
+      reopened = dconf_engine_source_refresh (source);
+      g_assert (!reopened);
+      g_assert (source->values == NULL);
+
+      /* ...and then make sure it opens properly */
+      dconf_engine_source_retry (source);
       reopened = dconf_engine_source_refresh (source);
       g_assert (reopened);
       g_assert (source->values != NULL);
@@ -628,11 +787,23 @@ invalidate_state (guint     n_sources,
   for (i = 0; i < n_sources; i++)
     if (source_types & (1u << i))
       {
+        GVariant *parameters;
+        gchar *object_path;
+
         if (state[i])
           {
             dconf_mock_gvdb_table_invalidate (state[i]);
             gvdb_table_free (state[i]);
           }
+
+        /* Like "dconf update" does, so that a missing database gets
+         * looked for again.
+         */
+        object_path = g_strdup_printf ("/ca/desrt/dconf/Writer/db%d", i);
+        parameters = g_variant_ref_sink (g_variant_new ("(s)", "/"));
+        dconf_engine_handle_dbus_signal (G_BUS_TYPE_SYSTEM, ":1.123", object_path, "WritabilityNotify", parameters);
+        g_variant_unref (parameters);
+        g_free (object_path);
       }
     else
       {
@@ -1118,6 +1289,91 @@ test_read (void)
   assert_no_messages ();
 }
 
+static void
+test_read_scalar (void)
+{
+  DConfChangeset *changeset;
+  DConfEngine *engine;
+  GvdbTable *table;
+  gboolean success;
+  GError *error = NULL;
+  gboolean b = FALSE;
+  gdouble d = 0;
+  gint32 i = 0;
+  gchar *s = NULL;
+  guint32 u = 0;
+
+  table = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_table_insert (table, "/int32", g_variant_new_int32 (123456), NULL);
+  dconf_mock_gvdb_table_insert (table, "/string", g_variant_new_string ("user"), NULL);
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user", table);
+  table = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_table_insert (table, "/int32", g_variant_new_int32 (654321), NULL);
+  dconf_mock_gvdb_table_insert (table, "/boolean", g_variant_new_boolean (TRUE), NULL);
+  dconf_mock_gvdb_table_insert (table, "/double", g_variant_new_double (1.5), NULL);
+  dconf_mock_gvdb_install (SYSCONFDIR "/dconf/db/site", table);
+
+  engine = dconf_engine_new (SRCDIR "/profile/dos", NULL, NULL);
+
+  /* The user value wins over the system one */
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/int32", "i", &i);
+  g_assert (success);
+  g_assert_cmpint (i, ==, 123456);
+
+  success = dconf_engine_read_scalar (engine, DCONF_READ_DEFAULT_VALUE, "/int32", "i", &i);
+  g_assert (success);
+  g_assert_cmpint (i, ==, 654321);
+
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/boolean", "b", &b);
+  g_assert (success);
+  g_assert (b);
+
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/double", "d", &d);
+  g_assert (success);
+  g_assert_cmpfloat (d, ==, 1.5);
+
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/string", "s", &s);
+  g_assert (success);
+  g_assert_cmpstr (s, ==, "user");
+  g_free (s);
+
+  /* Wrong type and missing keys leave the result alone */
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/int32", "u", &u);
+  g_assert (!success);
+  g_assert_cmpuint (u, ==, 0);
+
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/missing", "i", &i);
+  g_assert (!success);
+  g_assert_cmpint (i, ==, 654321);
+
+  /* Queued changes are seen, including resets */
+  changeset = dconf_changeset_new_write ("/int32", g_variant_new_int32 (7));
+  dconf_changeset_set (changeset, "/string", NULL);
+  success = dconf_engine_change_fast (engine, changeset, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (success);
+  dconf_changeset_unref (changeset);
+
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/int32", "i", &i);
+  g_assert (success);
+  g_assert_cmpint (i, ==, 7);
+
+  s = NULL;
+  success = dconf_engine_read_scalar (engine, DCONF_READ_FLAGS_NONE, "/string", "s", &s);
+  g_assert (!success);
+  g_assert (s == NULL);
+
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "tag"), NULL);
+  dconf_mock_dbus_assert_no_async ();
+
+  dconf_engine_unref (engine);
+  dconf_mock_gvdb_install ("/HOME/.config/dconf/user", NULL);
+  dconf_mock_gvdb_install (SYSCONFDIR "/dconf/db/site", NULL);
+  dconf_mock_shm_reset ();
+
+  assert_no_messages ();
+}
+
 static void
 test_watch_fast (void)
 {
@@ -1733,6 +1989,224 @@ send_signal (GBusType     type,
   g_variant_unref (value);
 }
 
+static void
+test_journal (void)
+{
+  const gchar * const everything[] = { "", NULL };
+  DConfChangeset *change;
+  DConfEngine *engine;
+  GError *error = NULL;
+  gboolean success;
+  GVariant *triv;
+
+  change_log = g_string_new (NULL);
+  triv = g_variant_ref_sink (g_variant_new ("()"));
+  change = dconf_changeset_new_write ("/value", g_variant_new_string ("value"));
+
+  g_setenv ("DCONF_JOURNAL", "1", TRUE);
+  engine = dconf_engine_new (SRCDIR "/profile/journal", NULL, NULL);
+
+  /* No match rules for the paths while we have the journal, only one to
+   * see the service go away.  It is still there once that is in place.
+   */
+  dconf_engine_watch_fast (engine, "/");
+  dconf_mock_dbus_async_reply (triv, NULL);
+  dconf_mock_dbus_assert_no_async ();
+  dconf_mock_journal_assert_cancelled (FALSE);
+
+  success = dconf_engine_change_fast (engine, change, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (success);
+  g_assert_cmpstr (change_log->str, ==, "/value:1::nil;");
+  g_string_set_size (change_log, 0);
+
+  /* The records for our change and for somebody else's both beat the
+   * reply.  Only the other one gets through, once we know our tag.
+   */
+  dconf_engine_handle_journal_record ("journal", "/value", everything, "tag1");
+  dconf_engine_handle_journal_record ("journal", "/other", everything, "tag2");
+  g_assert_cmpstr (change_log->str, ==, "");
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "tag1"), NULL);
+  dconf_mock_dbus_assert_no_async ();
+  g_assert_cmpstr (change_log->str, ==, "/other:1::tag2;");
+  g_string_set_size (change_log, 0);
+
+  /* This time the reply comes first */
+  success = dconf_engine_change_fast (engine, change, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (success);
+  g_assert_cmpstr (change_log->str, ==, "/value:1::nil;");
+  g_string_set_size (change_log, 0);
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "tag3"), NULL);
+  dconf_engine_handle_journal_record ("journal", "/value", everything, "tag3");
+  g_assert_cmpstr (change_log->str, ==, "");
+  dconf_engine_handle_journal_record ("journal", "/other", everything, "tag4");
+  g_assert_cmpstr (change_log->str, ==, "/other:1::tag4;");
+  g_string_set_size (change_log, 0);
+
+  /* Not knowing what changed (no tag) is never held back */
+  success = dconf_engine_change_fast (engine, change, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (success);
+  g_string_set_size (change_log, 0);
+  dconf_engine_handle_journal_record ("journal", "/", everything, NULL);
+  g_assert_cmpstr (change_log->str, ==, "/:1::nil;");
+  g_string_set_size (change_log, 0);
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "tag5"), NULL);
+  g_assert_cmpstr (change_log->str, ==, "");
+
+  /* Only the bus saying that the service lost its name (and didn't just
+   * get it) stops the journal.
+   */
+  send_signal (G_BUS_TYPE_SESSION, ":1.123", "/org/freedesktop/DBus", "NameOwnerChanged", "('ca.desrt.dconf', ':1.1', '')");
+  send_signal (G_BUS_TYPE_SESSION, "org.freedesktop.DBus", "/org/freedesktop/DBus", "NameOwnerChanged", "('ca.desrt.dconf', '', ':1.1')");
+  dconf_mock_journal_assert_cancelled (FALSE);
+  send_signal (G_BUS_TYPE_SESSION, "org.freedesktop.DBus", "/org/freedesktop/DBus", "NameOwnerChanged", "('ca.desrt.dconf', ':1.1', '')");
+  dconf_mock_journal_assert_cancelled (TRUE);
+
+  /* The service went away.  The engine adds the match rules that it
+   * skipped, and then says that anything could have changed.
+   */
+  dconf_engine_handle_journal_closed ("journal");
+  g_assert_cmpstr (change_log->str, ==, "");
+  dconf_mock_dbus_async_reply (triv, NULL);
+  dconf_mock_dbus_assert_no_async ();
+  g_assert_cmpstr (change_log->str, ==, "/:1::nil;");
+  g_string_set_size (change_log, 0);
+
+  /* From now on the changes come from the Notify signal */
+  dconf_engine_handle_journal_record ("journal", "/other", everything, "tag6");
+  g_assert_cmpstr (change_log->str, ==, "");
+  send_signal (G_BUS_TYPE_SESSION, ":1.123", "/ca/desrt/dconf/Writer/journal", "Notify", "('/other', [''], 'tag7')");
+  g_assert_cmpstr (change_log->str, ==, "/other:1::tag7;");
+  g_string_set_size (change_log, 0);
+
+  dconf_engine_unwatch_fast (engine, "/");
+  dconf_mock_dbus_async_reply (triv, NULL);
+  dconf_mock_dbus_assert_no_async ();
+
+  /* The rule for the name goes with the engine */
+  dconf_engine_unref (engine);
+  dconf_mock_dbus_async_reply (triv, NULL);
+  dconf_mock_dbus_assert_no_async ();
+
+  dconf_changeset_unref (change);
+  g_string_free (change_log, TRUE);
+  change_log = NULL;
+  g_variant_unref (triv);
+  g_unsetenv ("DCONF_JOURNAL");
+
+  dconf_mock_shm_reset ();
+}
+
+static GString *transaction_log;
+
+static GVariant *
+handle_transaction_request (GBusType             bus_type,
+                            const gchar         *bus_name,
+                            const gchar         *object_path,
+                            const gchar         *interface_name,
+                            const gchar         *method_name,
+                            GVariant            *parameters,
+                            const GVariantType  *expected_type,
+                            GError             **error)
+{
+  g_assert_cmpstr (bus_name, ==, "ca.desrt.dconf");
+  g_assert_cmpstr (interface_name, ==, "ca.desrt.dconf.Writer");
+
+  g_string_append_printf (transaction_log, "%s;", method_name);
+
+  if (g_str_equal (method_name, "BeginTransaction"))
+    return g_variant_new ("(u)", 42);
+
+  if (g_str_equal (method_name, "Append"))
+    {
+      DConfChangeset *chunk;
+      GVariant *blob, *args;
+      guint transaction;
+
+      g_variant_get (parameters, "(u@ay)", &transaction, &blob);
+      g_assert_cmpuint (transaction, ==, 42);
+      args = g_variant_new_from_data (G_VARIANT_TYPE ("a{smv}"),
+                                      g_variant_get_data (blob), g_variant_get_size (blob), FALSE,
+                                      (GDestroyNotify) g_variant_unref, blob);
+      chunk = dconf_changeset_deserialise (g_variant_ref_sink (args));
+      g_assert_cmpuint (dconf_changeset_describe (chunk, NULL, NULL, NULL), <=, 1024);
+      dconf_changeset_unref (chunk);
+      g_variant_unref (args);
+
+      if (change_sync_error)
+        {
+          *error = change_sync_error;
+          return NULL;
+        }
+
+      return g_variant_new ("()");
+    }
+
+  if (g_str_equal (method_name, "Abort"))
+    return g_variant_new ("()");
+
+  g_assert_cmpstr (method_name, ==, "Commit");
+
+  return g_variant_new ("(s)", "bigtag");
+}
+
+static void
+test_change_sync_chunked (void)
+{
+  DConfChangeset *big_write;
+  DConfEngine *engine;
+  GvdbTable *table;
+  gboolean success;
+  GError *error = NULL;
+  gchar *tag;
+  gint i;
+
+  table = dconf_mock_gvdb_table_new ();
+  dconf_mock_gvdb_install (SYSCONFDIR "/dconf/db/site", table);
+
+  big_write = dconf_changeset_new ();
+  dconf_changeset_set (big_write, "/dir/", NULL);
+  for (i = 0; i < 2500; i++)
+    {
+      gchar *path = g_strdup_printf ("/dir/key%d", i);
+      dconf_changeset_set (big_write, path, g_variant_new_int32 (i));
+      g_free (path);
+    }
+
+  engine = dconf_engine_new (SRCDIR "/profile/dos", NULL, NULL);
+
+  dconf_mock_dbus_sync_call_handler = handle_transaction_request;
+  transaction_log = g_string_new (NULL);
+
+  /* 2501 paths go in three pieces */
+  success = dconf_engine_change_sync (engine, big_write, &tag, &error);
+  g_assert_no_error (error);
+  g_assert (success);
+  g_assert_cmpstr (tag, ==, "bigtag");
+  g_assert_cmpstr (transaction_log->str, ==, "BeginTransaction;Append;Append;Append;Commit;");
+  g_free (tag);
+
+  /* A failure part way through aborts the transaction */
+  g_string_set_size (transaction_log, 0);
+  change_sync_error = g_error_new_literal (G_FILE_ERROR, G_FILE_ERROR_NOENT, "something failed");
+  success = dconf_engine_change_sync (engine, big_write, &tag, &error);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+  g_assert (!success);
+  g_assert_cmpstr (transaction_log->str, ==, "BeginTransaction;Append;Abort;");
+  g_clear_error (&error);
+  change_sync_error = NULL;
+
+  g_string_free (transaction_log, TRUE);
+  transaction_log = NULL;
+  dconf_mock_dbus_sync_call_handler = NULL;
+
+  dconf_changeset_unref (big_write);
+  dconf_engine_unref (engine);
+  dconf_mock_gvdb_install (SYSCONFDIR "/dconf/db/site", NULL);
+}
+
 static void
 test_signals (void)
 {
@@ -1827,6 +2301,61 @@ test_signals (void)
   dconf_engine_unref (engine);
 }
 
+static void
+test_signals_before_reply (void)
+{
+  DConfChangeset *change;
+  DConfEngine *engine;
+  GError *error = NULL;
+  gboolean success;
+
+  change_log = g_string_new (NULL);
+  change = dconf_changeset_new_write ("/value", g_variant_new_string ("value"));
+
+  engine = dconf_engine_new (SRCDIR "/profile/dos", NULL, NULL);
+
+  success = dconf_engine_change_fast (engine, change, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (success);
+  g_assert_cmpstr (change_log->str, ==, "/value:1::nil;");
+  g_string_set_size (change_log, 0);
+
+  /* The reply comes over the peer socket, and loses the race against
+   * the signals for our own change and for somebody else's.
+   */
+  send_signal (G_BUS_TYPE_SESSION, ":1.123", "/ca/desrt/dconf/Writer/user", "Notify", "('/value', [''], 'tag1')");
+  send_signal (G_BUS_TYPE_SESSION, ":1.123", "/ca/desrt/dconf/Writer/user", "Notify", "('/other', [''], 'tag2')");
+  g_assert_cmpstr (change_log->str, ==, "");
+
+  /* Signals from other databases don't need to wait */
+  send_signal (G_BUS_TYPE_SYSTEM, ":1.123", "/ca/desrt/dconf/Writer/site", "Notify", "('/site', [''], 'tag1')");
+  g_assert_cmpstr (change_log->str, ==, "/site:1::tag1;");
+  g_string_set_size (change_log, 0);
+
+  dconf_mock_dbus_async_reply (g_variant_new ("(s)", "tag1"), NULL);
+  dconf_mock_dbus_assert_no_async ();
+  g_assert_cmpstr (change_log->str, ==, "/other:1::tag2;");
+  g_string_set_size (change_log, 0);
+
+  /* A failed write gets no signal, so the others are let through */
+  success = dconf_engine_change_fast (engine, change, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (success);
+  g_string_set_size (change_log, 0);
+  send_signal (G_BUS_TYPE_SESSION, ":1.123", "/ca/desrt/dconf/Writer/user", "Notify", "('/other', [''], 'tag3')");
+  g_assert_cmpstr (change_log->str, ==, "");
+  error = g_error_new_literal (G_FILE_ERROR, G_FILE_ERROR_NOENT, "something failed");
+  dconf_mock_dbus_async_reply (NULL, error);
+  g_clear_error (&error);
+  assert_pop_message ("dconf", G_LOG_LEVEL_WARNING, "failed to commit changes to dconf: something failed");
+  g_assert_cmpstr (change_log->str, ==, "/other:1::tag3;/value:1::nil;");
+
+  dconf_engine_unref (engine);
+  dconf_changeset_unref (change);
+  g_string_free (change_log, TRUE);
+  change_log = NULL;
+}
+
 static gboolean it_is_good_to_be_done;
 
 static gpointer
@@ -2080,7 +2609,10 @@ main (int argc, char **argv)
   g_test_add_func ("/engine/sources/system", test_system_source);
   g_test_add_func ("/engine/sources/file", test_file_source);
   g_test_add_func ("/engine/sources/service", test_service_source);
+  g_test_add_func ("/engine/sources/service/init", test_service_init);
   g_test_add_func ("/engine/read", test_read);
+  g_test_add_func ("/engine/read/scalar", test_read_scalar);
+  g_test_add_func ("/engine/read/shards", test_read_shards);
   g_test_add_func ("/engine/watch/fast", test_watch_fast);
   g_test_add_func ("/engine/watch/fast/simultaneous", test_watch_fast_simultaneous_subscriptions);
   g_test_add_func ("/engine/watch/fast/successive", test_watch_fast_successive_subscriptions);
@@ -2088,7 +2620,10 @@ main (int argc, char **argv)
   g_test_add_func ("/engine/watch/sync", test_watch_sync);
   g_test_add_func ("/engine/change/fast", test_change_fast);
   g_test_add_func ("/engine/change/sync", test_change_sync);
+  g_test_add_func ("/engine/change/sync/chunked", test_change_sync_chunked);
   g_test_add_func ("/engine/signals", test_signals);
+  g_test_add_func ("/engine/signals/before-reply", test_signals_before_reply);
+  g_test_add_func ("/engine/journal", test_journal);
   g_test_add_func ("/engine/sync", test_sync);
 
   retval = g_test_run ();
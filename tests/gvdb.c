@@ -1,5 +1,10 @@
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "../gvdb/gvdb-reader.h"
+#include "../service/dconf-gvdb-builder.h"
+#include "../common/dconf-access-log.h"
 
 static void
 test_reader_open_error (void)
@@ -415,6 +420,485 @@ test_corrupted (gconstpointer user_data)
   g_mapped_file_unref (mapped);
 }
 
+static void
+test_sorted_builder (void)
+{
+  const gchar *keys[] = { "/a", "/a-b/c", "/a/b", "/a/c/d", "/b", "/b/x" };
+  const gchar *root_children[] = { "a", "a-b/", "a/", "b", "b/", "big", NULL };
+  const gchar *a_children[] = { "b", "c/", NULL };
+  DConfGvdbBuilder *builder;
+  GHashTable *locks;
+  GvdbTable *table;
+  GvdbTable *sub;
+  GError *error = NULL;
+  GVariant *value;
+  gchar *filename;
+  gchar **names;
+  gchar *big;
+  gsize n_names;
+  gsize i;
+  gint fd;
+
+  fd = g_file_open_tmp ("gvdb-sorted-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+
+  builder = dconf_gvdb_builder_new (fd, FALSE, NULL);
+
+  locks = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (locks, "/a", "");
+  dconf_gvdb_builder_add_string_table (builder, ".locks", locks);
+  g_hash_table_unref (locks);
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    dconf_gvdb_builder_add_value (builder, keys[i], g_variant_new_string (keys[i]));
+
+  /* Bigger than the write buffer */
+  big = g_malloc0 (200000);
+  memset (big, 'x', 200000 - 1);
+  dconf_gvdb_builder_add_value (builder, "/big", g_variant_new_take_string (big));
+
+  g_assert_true (dconf_gvdb_builder_finish (builder, &error));
+  g_assert_no_error (error);
+  close (fd);
+
+  table = gvdb_table_new (filename, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (table);
+
+  /* The keys, the dirs that they are in, and the locks table */
+  names = gvdb_table_get_names (table, &n_names);
+  g_assert_cmpuint (n_names, ==, 13);
+  g_strfreev (names);
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+      value = gvdb_table_get_value (table, keys[i]);
+      g_assert_nonnull (value);
+      g_assert_cmpstr (g_variant_get_string (value, NULL), ==, keys[i]);
+      g_variant_unref (value);
+    }
+
+  value = gvdb_table_get_value (table, "/big");
+  g_assert_nonnull (value);
+  g_assert_cmpuint (strlen (g_variant_get_string (value, NULL)), ==, 200000 - 1);
+  g_variant_unref (value);
+
+  /* Children are listed in order */
+  names = gvdb_table_list (table, "/");
+  g_assert_nonnull (names);
+  for (i = 0; root_children[i]; i++)
+    g_assert_cmpstr (names[i], ==, root_children[i]);
+  g_assert_null (names[i]);
+  g_strfreev (names);
+
+  names = gvdb_table_list (table, "/a/");
+  g_assert_nonnull (names);
+  for (i = 0; a_children[i]; i++)
+    g_assert_cmpstr (names[i], ==, a_children[i]);
+  g_assert_null (names[i]);
+  g_strfreev (names);
+
+  sub = gvdb_table_get_table (table, ".locks");
+  g_assert_nonnull (sub);
+  g_assert_true (gvdb_table_has_value (sub, "/a"));
+  gvdb_table_free (sub);
+
+  gvdb_table_free (table);
+  g_unlink (filename);
+  g_free (filename);
+}
+
+static gsize
+find_string (GBytes      *content,
+             const gchar *string)
+{
+  const gchar *data;
+  gsize length;
+  gsize i;
+
+  data = g_bytes_get_data (content, &length);
+
+  for (i = 0; i + strlen (string) <= length; i++)
+    if (memcmp (data + i, string, strlen (string)) == 0)
+      return i;
+
+  g_assert_not_reached ();
+}
+
+/* Like find_string(), but for any copy of @string in [@start, @end) */
+static gboolean
+string_in_range (GBytes      *content,
+                 const gchar *string,
+                 gsize        start,
+                 gsize        end)
+{
+  const gchar *data;
+  gsize i;
+
+  data = g_bytes_get_data (content, NULL);
+
+  for (i = start; i + strlen (string) <= end; i++)
+    if (memcmp (data + i, string, strlen (string)) == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+static void
+test_clustered_layout (void)
+{
+  DConfGvdbBuilder *builder;
+  GError *error = NULL;
+  GBytes *content;
+  GvdbTable *table;
+  gint i, j;
+
+  builder = dconf_gvdb_builder_new (-1, FALSE, NULL);
+  for (i = 0; i < 50; i++)
+    for (j = 0; j < 3; j++)
+      {
+        gchar *key = g_strdup_printf ("/dir%02d/key%d", i, j);
+
+        dconf_gvdb_builder_add_value (builder, key,
+                                      g_variant_new_take_string (g_strdup_printf ("dir%02d-value%d", i, j)));
+        g_free (key);
+      }
+
+  content = dconf_gvdb_builder_get_content (builder, &error);
+  g_assert_no_error (error);
+
+  table = gvdb_table_new_from_bytes (content, TRUE, NULL);
+  g_assert_nonnull (table);
+
+  for (i = 0; i < 50; i++)
+    {
+      gsize first = 0;
+
+      for (j = 0; j < 3; j++)
+        {
+          gchar *key = g_strdup_printf ("/dir%02d/key%d", i, j);
+          gchar *string = g_strdup_printf ("dir%02d-value%d", i, j);
+          GVariant *value;
+          gsize offset;
+
+          value = gvdb_table_get_value (table, key);
+          g_assert_nonnull (value);
+          g_assert_cmpstr (g_variant_get_string (value, NULL), ==, string);
+          g_variant_unref (value);
+
+          /* The values of a dir follow each other, in order */
+          offset = find_string (content, string);
+          if (j == 0)
+            first = offset;
+          else
+            g_assert_cmpuint (offset - first, <, j * 64);
+
+          g_free (key);
+          g_free (string);
+        }
+    }
+
+  gvdb_table_free (table);
+  g_bytes_unref (content);
+}
+
+/* Checks that @content says where the hot range is, and that the
+ * values of the hot keys and the names of their dirs are in it.
+ */
+static void
+check_hot_range (GBytes *content)
+{
+  GvdbTable *table;
+  GVariant *range;
+  guint64 start, end;
+  gint i;
+
+  table = gvdb_table_new_from_bytes (content, TRUE, NULL);
+  g_assert_nonnull (table);
+
+  range = gvdb_table_get_value (table, DCONF_ACCESS_LOG_HOT_RANGE_KEY);
+  g_assert_nonnull (range);
+  g_assert_true (g_variant_is_of_type (range, G_VARIANT_TYPE ("(tt)")));
+  g_variant_get (range, "(tt)", &start, &end);
+  g_variant_unref (range);
+  g_assert_cmpuint (start, <, end);
+  g_assert_cmpuint (end, <=, g_bytes_get_size (content));
+
+  for (i = 0; i < 100; i++)
+    {
+      gchar *key = g_strdup_printf ("/dir%02d/key", i);
+      gchar *string = g_strdup_printf ("value-%02d", i);
+      GVariant *value;
+      gsize offset;
+
+      value = gvdb_table_get_value (table, key);
+      g_assert_nonnull (value);
+      g_assert_cmpstr (g_variant_get_string (value, NULL), ==, string);
+      g_variant_unref (value);
+
+      offset = find_string (content, string);
+      if (i % 10 == 0)
+        g_assert_true (start <= offset && offset < end);
+      else
+        g_assert_false (start <= offset && offset < end);
+
+      /* A lookup checks the name of the dir too */
+      if (i % 10 == 0)
+        {
+          gchar *dir = g_strdup_printf ("dir%02d/", i);
+
+          g_assert_true (string_in_range (content, dir, start, end));
+          g_free (dir);
+        }
+
+      g_free (key);
+      g_free (string);
+    }
+
+  gvdb_table_free (table);
+}
+
+static void
+add_hot_range_keys (DConfGvdbBuilder *builder)
+{
+  gint i;
+
+  for (i = 0; i < 100; i++)
+    {
+      gchar *key = g_strdup_printf ("/dir%02d/key", i);
+
+      dconf_gvdb_builder_add_value (builder, key, g_variant_new_take_string (g_strdup_printf ("value-%02d", i)));
+      g_free (key);
+    }
+}
+
+static void
+test_hot_range (void)
+{
+  DConfGvdbBuilder *builder;
+  GHashTable *hot_keys;
+  GError *error = NULL;
+  GBytes *content;
+  gchar *contents;
+  gchar *filename;
+  gsize length;
+  gint fd;
+  gint i;
+
+  hot_keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < 100; i += 10)
+    g_hash_table_add (hot_keys, g_strdup_printf ("/dir%02d/key", i));
+
+  builder = dconf_gvdb_builder_new (-1, FALSE, hot_keys);
+  add_hot_range_keys (builder);
+  content = dconf_gvdb_builder_get_content (builder, &error);
+  g_assert_no_error (error);
+  check_hot_range (content);
+  g_bytes_unref (content);
+
+  fd = g_file_open_tmp ("gvdb-hot-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+
+  builder = dconf_gvdb_builder_new (fd, FALSE, hot_keys);
+  add_hot_range_keys (builder);
+  g_assert_true (dconf_gvdb_builder_finish (builder, &error));
+  g_assert_no_error (error);
+  close (fd);
+
+  g_file_get_contents (filename, &contents, &length, &error);
+  g_assert_no_error (error);
+  content = g_bytes_new_take (contents, length);
+  check_hot_range (content);
+  g_bytes_unref (content);
+
+  g_unlink (filename);
+  g_free (filename);
+  g_hash_table_unref (hot_keys);
+}
+
+/* Key names that don't fit in the format are an error, not a crash */
+static void
+test_sorted_long_key (void)
+{
+  DConfGvdbBuilder *builder;
+  GError *error = NULL;
+  gchar *filename;
+  gchar *name;
+  gchar *key;
+  gint fd;
+
+  name = g_malloc (100000 + 1);
+  memset (name, 'n', 100000);
+  name[100000] = '\0';
+  key = g_strconcat ("/", name, "/leaf", NULL);
+
+  fd = g_file_open_tmp ("gvdb-sorted-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+
+  builder = dconf_gvdb_builder_new (fd, FALSE, NULL);
+  dconf_gvdb_builder_add_value (builder, "/a", g_variant_new_boolean (TRUE));
+  dconf_gvdb_builder_add_value (builder, key, g_variant_new_string ("value"));
+  dconf_gvdb_builder_add_value (builder, "/z", g_variant_new_boolean (TRUE));
+  g_assert_false (dconf_gvdb_builder_finish (builder, &error));
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+  g_clear_error (&error);
+  close (fd);
+
+  /* Same in memory */
+  builder = dconf_gvdb_builder_new (-1, FALSE, NULL);
+  dconf_gvdb_builder_add_value (builder, key, g_variant_new_string ("value"));
+  g_assert_null (dconf_gvdb_builder_get_content (builder, &error));
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+  g_clear_error (&error);
+
+  g_unlink (filename);
+  g_free (filename);
+  g_free (key);
+  g_free (name);
+}
+
+static guint
+count_string (GBytes      *content,
+              const gchar *string)
+{
+  const gchar *data;
+  gsize length;
+  guint count = 0;
+  gsize i;
+
+  data = g_bytes_get_data (content, &length);
+
+  for (i = 0; i + strlen (string) <= length; i++)
+    if (memcmp (data + i, string, strlen (string)) == 0)
+      count++;
+
+  return count;
+}
+
+/* Checks that the 50 dirs written by test_dedup() read back correctly
+ * and that their shared key names and values were only written once.
+ */
+static void
+check_dedup (GBytes *content)
+{
+  GvdbTable *table;
+  gint i;
+
+  table = gvdb_table_new_from_bytes (content, TRUE, NULL);
+  g_assert_nonnull (table);
+
+  for (i = 0; i < 50; i++)
+    {
+      gchar *enabled = g_strdup_printf ("/dir%02d/enabled", i);
+      gchar *name = g_strdup_printf ("/dir%02d/name", i);
+      GVariant *value;
+
+      value = gvdb_table_get_value (table, enabled);
+      g_assert_nonnull (value);
+      g_assert_true (g_variant_get_boolean (value));
+      g_variant_unref (value);
+
+      value = gvdb_table_get_value (table, name);
+      g_assert_nonnull (value);
+      g_assert_cmpstr (g_variant_get_string (value, NULL), ==, "a value that many keys have");
+      g_variant_unref (value);
+
+      g_free (enabled);
+      g_free (name);
+    }
+
+  g_assert_cmpuint (count_string (content, "enabled"), ==, 1);
+  g_assert_cmpuint (count_string (content, "a value that many keys have"), ==, 1);
+
+  gvdb_table_free (table);
+}
+
+static void
+add_dedup_keys (DConfGvdbBuilder *builder)
+{
+  gint i;
+
+  for (i = 0; i < 50; i++)
+    {
+      gchar *enabled = g_strdup_printf ("/dir%02d/enabled", i);
+      gchar *name = g_strdup_printf ("/dir%02d/name", i);
+
+      dconf_gvdb_builder_add_value (builder, enabled, g_variant_new_boolean (TRUE));
+      dconf_gvdb_builder_add_value (builder, name, g_variant_new_string ("a value that many keys have"));
+
+      g_free (enabled);
+      g_free (name);
+    }
+}
+
+static void
+test_dedup (void)
+{
+  DConfGvdbBuilder *builder;
+  GError *error = NULL;
+  GBytes *content;
+  gchar *contents;
+  gchar *filename;
+  gsize length;
+  gint fd;
+
+  builder = dconf_gvdb_builder_new (-1, FALSE, NULL);
+  add_dedup_keys (builder);
+  content = dconf_gvdb_builder_get_content (builder, &error);
+  g_assert_no_error (error);
+  check_dedup (content);
+  g_bytes_unref (content);
+
+  fd = g_file_open_tmp ("gvdb-dedup-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+
+  builder = dconf_gvdb_builder_new (fd, FALSE, NULL);
+  add_dedup_keys (builder);
+  g_assert_true (dconf_gvdb_builder_finish (builder, &error));
+  g_assert_no_error (error);
+  close (fd);
+
+  g_file_get_contents (filename, &contents, &length, &error);
+  g_assert_no_error (error);
+  content = g_bytes_new_take (contents, length);
+  check_dedup (content);
+  g_bytes_unref (content);
+
+  g_unlink (filename);
+  g_free (filename);
+}
+
+/* Only so many values are remembered: the ones from before the limit
+ * is reached are still shared, but new ones after it aren't.
+ */
+static void
+test_dedup_limit (void)
+{
+  DConfGvdbBuilder *builder;
+  GError *error = NULL;
+  GBytes *content;
+  gint i;
+
+  builder = dconf_gvdb_builder_new (-1, FALSE, NULL);
+  dconf_gvdb_builder_add_value (builder, "/a", g_variant_new_string ("an early value"));
+  for (i = 0; i < 20000; i++)
+    {
+      gchar *key = g_strdup_printf ("/b/%05d", i);
+
+      dconf_gvdb_builder_add_value (builder, key, g_variant_new_take_string (g_strdup_printf ("unique-%05d", i)));
+      g_free (key);
+    }
+  dconf_gvdb_builder_add_value (builder, "/c/x", g_variant_new_string ("an early value"));
+  dconf_gvdb_builder_add_value (builder, "/c/y", g_variant_new_string ("a late value"));
+  dconf_gvdb_builder_add_value (builder, "/c/z", g_variant_new_string ("a late value"));
+
+  content = dconf_gvdb_builder_get_content (builder, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (count_string (content, "an early value"), ==, 1);
+  g_assert_cmpuint (count_string (content, "a late value"), ==, 2);
+  g_bytes_unref (content);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -427,6 +911,12 @@ main (int argc, char **argv)
   g_test_add_func ("/gvdb/reader/values", test_reader_values);
   g_test_add_func ("/gvdb/reader/values/big-endian", test_reader_values_bigendian);
   g_test_add_func ("/gvdb/reader/nested", test_nested);
+  g_test_add_func ("/gvdb/dconf-builder/sorted", test_sorted_builder);
+  g_test_add_func ("/gvdb/dconf-builder/long-key", test_sorted_long_key);
+  g_test_add_func ("/gvdb/dconf-builder/clustered", test_clustered_layout);
+  g_test_add_func ("/gvdb/dconf-builder/hot-range", test_hot_range);
+  g_test_add_func ("/gvdb/dconf-builder/dedup", test_dedup);
+  g_test_add_func ("/gvdb/dconf-builder/dedup/limit", test_dedup_limit);
   for (i = 0; i < 20; i++)
     {
       gchar test_name[80];
@@ -0,0 +1,116 @@
+#include "../common/dconf-keyfile.h"
+
+static gboolean
+append_key (const gchar  *group,
+            const gchar  *key,
+            const gchar  *value,
+            gpointer      user_data,
+            GError      **error)
+{
+  g_string_append_printf (user_data, "[%s] %s=%s;", group, key, value);
+
+  return TRUE;
+}
+
+static void
+test_parse (void)
+{
+  struct {
+    const gchar *contents;
+    const gchar *expected;
+    GKeyFileError error;
+  } cases[] = {
+    { "",                                       "" },
+    { "# comment\n\n[a]\nb=1\n",               "[a] b=1;" },
+    { "  [a/b]  \r\n  key  =   'x y'  \r\n",   "[a/b] key='x y';" },
+    { "[/]\nx=true\n[a]\nx=false",              "[/] x=true;[a] x=false;" },
+    { "[a]\nk=1\nk=2\n",                        "[a] k=1;[a] k=2;" },
+    { "[a]\nk[de_DE]=1\n",                      "[a] k[de_DE]=1;" },
+    { "[a]\nk=\n",                              "[a] k=;" },
+    { "[a]\nk=a=b\n",                           "[a] k=a=b;" },
+    { "k=1\n",                                  NULL, G_KEY_FILE_ERROR_GROUP_NOT_FOUND },
+    { "[a]\nnonsense\n",                        NULL, G_KEY_FILE_ERROR_PARSE },
+    { "[a]\n=1\n",                              NULL, G_KEY_FILE_ERROR_PARSE },
+    { "[a[b]\nk=1\n",                           NULL, G_KEY_FILE_ERROR_PARSE },
+    { "[]\nk=1\n",                              NULL, G_KEY_FILE_ERROR_PARSE },
+    { "[a]\nk]=1\n",                            NULL, G_KEY_FILE_ERROR_PARSE },
+    { "[a]\nk[de=1\n",                          NULL, G_KEY_FILE_ERROR_PARSE },
+    { "[a]\nk=\xff\n",                          NULL, G_KEY_FILE_ERROR_UNKNOWN_ENCODING },
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+      GString *keys = g_string_new (NULL);
+      GError *error = NULL;
+      gboolean success;
+
+      success = dconf_keyfile_parse (cases[i].contents, -1, append_key, keys, &error);
+
+      if (cases[i].expected)
+        {
+          g_assert_no_error (error);
+          g_assert_true (success);
+          g_assert_cmpstr (keys->str, ==, cases[i].expected);
+        }
+      else
+        {
+          g_assert_error (error, G_KEY_FILE_ERROR, cases[i].error);
+          g_assert_false (success);
+          g_clear_error (&error);
+        }
+
+      g_string_free (keys, TRUE);
+    }
+}
+
+static void
+test_parse_value (void)
+{
+  const gchar *cases[] = {
+    "true", "false", "True", "truex",
+    "0", "42", "-7", "-0", "2147483647", "-2147483648",
+    "2147483648", "-2147483649", "12345678901", "010", "0x10", "1.5", "1e3", "-",
+    "'hello'", "\"hello\"", "'say \"hi\"'", "\"it's\"", "''", "'it\\'s'", "'\\u00e9'",
+    "'unterminated", "'a' 'b'",
+    "['a']", "['a', 'b']", "[ 'a' ,\"b\" ]  ", "['a\\n']", "[]", "['a', 1]", "['a'", "['a'] x",
+    "@as []", "('a', 1)", "{'a': <1>}", "uint32 5", "<'v'>",
+  };
+  guint i;
+
+  /* Whatever the fast paths do, the result must be the same as if the
+   * value had gone through g_variant_parse().
+   */
+  for (i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+      GVariant *expected;
+      GVariant *value;
+
+      expected = g_variant_parse (NULL, cases[i], NULL, NULL, NULL);
+      value = dconf_keyfile_parse_value (cases[i], NULL);
+
+      if (expected == NULL)
+        {
+          g_assert_null (value);
+          continue;
+        }
+
+      g_assert_nonnull (value);
+      g_assert_false (g_variant_is_floating (value));
+      g_assert_true (g_variant_equal (value, expected));
+
+      g_variant_unref (expected);
+      g_variant_unref (value);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/keyfile/parse", test_parse);
+  g_test_add_func ("/keyfile/parse-value", test_parse_value);
+
+  return g_test_run ();
+}
@@ -2,21 +2,25 @@
 
 #include "../common/dconf-paths.h"
 #include <glib/gstdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <dlfcn.h>
 
 #include "../shm/dconf-shm.h"
+#include "../shm/dconf-journal.h"
+#include "../shm/dconf-shm-db.h"
 #include "../shm/dconf-shm-mockable.h"
 #include "tmpdir.h"
 
 static void
 test_mkdir_fail (void)
 {
-  guint8 *shm;
+  const guint64 *shm;
 
   if (g_test_subprocess ())
     {
@@ -52,28 +56,144 @@ test_close_null (void)
 static void
 test_open_and_flag (void)
 {
-  guint8 *shm;
+  const guint64 *shm;
 
   shm = dconf_shm_open ("foo");
   g_assert (shm != NULL);
-  g_assert (!dconf_shm_is_flagged (shm));
+  g_assert_cmpuint (dconf_shm_get_generation (shm), ==, 0);
+  g_assert (!dconf_shm_is_flagged (shm, 0));
   dconf_shm_flag ("foo");
-  g_assert (dconf_shm_is_flagged (shm));
+  g_assert (dconf_shm_is_flagged (shm, 0));
+  g_assert (!dconf_shm_is_flagged (shm, 1));
   dconf_shm_close (shm);
 }
 
+static void
+test_generation (void)
+{
+  const guint64 *shm;
+  const guint64 *other;
+  guint64 generation;
+
+  shm = dconf_shm_open ("gen");
+  generation = dconf_shm_get_generation (shm);
+
+  /* The same page is bumped each time, and new clients see the count */
+  dconf_shm_flag ("gen");
+  dconf_shm_flag ("gen");
+  g_assert_cmpuint (dconf_shm_get_generation (shm), ==, generation + 2);
+
+  other = dconf_shm_open ("gen");
+  g_assert_cmpuint (dconf_shm_get_generation (other), ==, generation + 2);
+  g_assert (!dconf_shm_is_flagged (other, generation + 2));
+
+  dconf_shm_flag ("gen");
+  g_assert (dconf_shm_is_flagged (other, generation + 2));
+  g_assert_cmpuint (dconf_shm_get_generation (shm), ==, generation + 3);
+
+  dconf_shm_close (other);
+  dconf_shm_close (shm);
+}
+
+static void
+test_legacy_flag (void)
+{
+  const guint64 *shm;
+  gchar *filename;
+  guint8 *flag;
+  gint fd;
+
+  shm = dconf_shm_open ("legacy");
+  g_assert (shm != NULL);
+
+  /* This is what clients did before there was a generation counter */
+  filename = g_build_filename (g_get_user_runtime_dir (), "dconf", "legacy", NULL);
+  fd = open (filename, O_RDWR | O_CREAT, 0600);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (pwrite (fd, "", 1, 1), ==, 1);
+  flag = mmap (NULL, 1, PROT_READ, MAP_SHARED, fd, 0);
+  g_assert (flag != MAP_FAILED);
+  close (fd);
+
+  /* The counter is in a file of its own, so it doesn't touch the flag */
+  g_assert_cmpuint (*flag, ==, 0);
+
+  /* A change sets both, and removes the old flag for the next client */
+  dconf_shm_flag ("legacy");
+  g_assert_cmpuint (*flag, ==, 1);
+  g_assert_cmpuint (dconf_shm_get_generation (shm), ==, 1);
+  g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+
+  munmap (flag, 1);
+  dconf_shm_close (shm);
+  g_free (filename);
+}
+
+/* No flag file when the service first got to it: none is made later */
+static void
+test_legacy_flag_absent (void)
+{
+  gchar *filename;
+  guint8 *flag;
+  gint fd;
+
+  dconf_shm_flag ("new");
+
+  filename = g_build_filename (g_get_user_runtime_dir (), "dconf", "new", NULL);
+  fd = open (filename, O_RDWR | O_CREAT, 0600);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (pwrite (fd, "", 1, 1), ==, 1);
+  flag = mmap (NULL, 1, PROT_READ, MAP_SHARED, fd, 0);
+  g_assert (flag != MAP_FAILED);
+  close (fd);
+
+  dconf_shm_flag ("new");
+  g_assert_cmpuint (*flag, ==, 0);
+  g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+  munmap (flag, 1);
+  g_unlink (filename);
+  g_free (filename);
+}
+
+/* If the counter file goes away, the service finds the new one */
+static void
+test_counter_removed (void)
+{
+  const guint64 *shm;
+  const guint64 *other;
+  gchar *filename;
+
+  shm = dconf_shm_open ("removed");
+  g_assert_cmpuint (dconf_shm_flag ("removed"), ==, 1);
+
+  filename = g_build_filename (g_get_user_runtime_dir (), "dconf", "removed.generation", NULL);
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+  other = dconf_shm_open ("removed");
+  g_assert_cmpuint (dconf_shm_get_generation (other), ==, 0);
+
+  /* ...and carries on from where it was */
+  g_assert_cmpuint (dconf_shm_flag ("removed"), ==, 2);
+  g_assert_cmpuint (dconf_shm_get_generation (other), ==, 2);
+  g_assert (dconf_shm_is_flagged (other, 0));
+
+  dconf_shm_close (other);
+  dconf_shm_close (shm);
+  g_free (filename);
+}
+
 static void
 test_invalid_name (void)
 {
   if (g_test_subprocess ())
     {
-      guint8 *shm;
+      const guint64 *shm;
 
       g_log_set_always_fatal (G_LOG_LEVEL_ERROR);
 
       shm = dconf_shm_open ("foo/bar");
       g_assert (shm == NULL);
-      g_assert (dconf_shm_is_flagged (shm));
+      g_assert (dconf_shm_is_flagged (shm, 0));
       return;
     }
 
@@ -107,14 +227,14 @@ test_out_of_space_open (void)
 {
   if (g_test_subprocess ())
     {
-      guint8 *shm;
+      const guint64 *shm;
 
       g_log_set_always_fatal (G_LOG_LEVEL_ERROR);
       should_fail_pwrite = TRUE;
 
       shm = dconf_shm_open ("foo");
       g_assert (shm == NULL);
-      g_assert (dconf_shm_is_flagged (shm));
+      g_assert (dconf_shm_is_flagged (shm, 0));
       return;
     }
 
@@ -139,6 +259,249 @@ test_out_of_space_flag (void)
   g_test_trap_assert_passed ();
 }
 
+static void
+test_journal (void)
+{
+  const gchar * const changes[] = { "a", "b/c", NULL };
+  DConfJournal *writer;
+  DConfJournal *reader;
+  gboolean lagged = FALSE;
+  const gchar **paths;
+  const gchar *prefix;
+  const gchar *tag;
+  guint64 generation;
+  guint64 position;
+  GVariant *record;
+  gchar *filename;
+  gchar *contents;
+  gsize length;
+  gint i;
+
+  /* Nothing there until the service creates it */
+  g_assert (dconf_journal_open ("journal", FALSE) == NULL);
+
+  writer = dconf_journal_open ("journal", TRUE);
+  g_assert (writer != NULL);
+  reader = dconf_journal_open ("journal", FALSE);
+  g_assert (reader != NULL);
+
+  position = dconf_journal_get_position (reader);
+  g_assert (dconf_journal_read (reader, &position, &lagged) == NULL);
+
+  dconf_journal_append (writer, 7, "/x/", changes, "tag1");
+  dconf_journal_append (writer, 8, "/y", (const gchar * const[]) { "", NULL }, "tag2");
+
+  record = dconf_journal_read (reader, &position, &lagged);
+  g_assert (record != NULL);
+  g_variant_get (record, "(t&s^a&s&s)", &generation, &prefix, &paths, &tag);
+  g_assert_cmpuint (generation, ==, 7);
+  g_assert_cmpstr (prefix, ==, "/x/");
+  g_assert_cmpstr (paths[0], ==, "a");
+  g_assert_cmpstr (paths[1], ==, "b/c");
+  g_assert (paths[2] == NULL);
+  g_assert_cmpstr (tag, ==, "tag1");
+  g_variant_unref (record);
+  g_free (paths);
+
+  record = dconf_journal_read (reader, &position, &lagged);
+  g_assert (record != NULL);
+  g_variant_get (record, "(t&s^a&s&s)", &generation, &prefix, NULL, &tag);
+  g_assert_cmpuint (generation, ==, 8);
+  g_assert_cmpstr (prefix, ==, "/y");
+  g_assert_cmpstr (tag, ==, "tag2");
+  g_variant_unref (record);
+
+  g_assert (dconf_journal_read (reader, &position, &lagged) == NULL);
+  g_assert (!lagged);
+
+  /* Waiting must return straight away if there is something new */
+  dconf_journal_append (writer, 9, "/z", (const gchar * const[]) { "", NULL }, "tag3");
+  g_assert (dconf_journal_wait (reader, position));
+
+  /* Overflow the ring: the reader finds out that it missed changes and
+   * carries on from the end.
+   */
+  for (i = 0; i < 10000; i++)
+    dconf_journal_append (writer, 10 + i, "/x/", changes, "tag");
+
+  g_assert (dconf_journal_read (reader, &position, &lagged) == NULL);
+  g_assert (lagged);
+  g_assert_cmpuint (position, ==, dconf_journal_get_position (writer));
+
+  lagged = FALSE;
+  dconf_journal_append (writer, 1, "/x/", changes, "last");
+  record = dconf_journal_read (reader, &position, &lagged);
+  g_assert (record != NULL);
+  g_assert (!lagged);
+  g_variant_unref (record);
+
+  /* Once the writer is gone, the readers know to stop using it */
+  dconf_journal_close (writer);
+  g_assert (!dconf_journal_wait (reader, position));
+  dconf_journal_close (reader);
+
+  filename = g_build_filename (g_get_user_runtime_dir (), "dconf", "journal.journal", NULL);
+  g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+  g_assert (dconf_journal_open ("journal", FALSE) == NULL);
+
+  /* A journal left behind by a service that died is ignored too: the
+   * copy of the file still has the magic, but nobody holds the lock.
+   */
+  writer = dconf_journal_open ("journal", TRUE);
+  g_assert (writer != NULL);
+  g_assert (g_file_get_contents (filename, &contents, &length, NULL));
+  dconf_journal_close (writer);
+  g_assert (g_file_set_contents (filename, contents, length, NULL));
+  g_assert (dconf_journal_open ("journal", FALSE) == NULL);
+
+  /* ...and replaced by the next service */
+  writer = dconf_journal_open ("journal", TRUE);
+  g_assert (writer != NULL);
+  reader = dconf_journal_open ("journal", FALSE);
+  g_assert (reader != NULL);
+  g_assert (dconf_journal_check (reader));
+
+  /* A reader that is told to stop waits no more, writer or not */
+  dconf_journal_cancel (reader);
+  g_assert (!dconf_journal_check (reader));
+  g_assert (!dconf_journal_wait (reader, dconf_journal_get_position (reader)));
+  dconf_journal_close (reader);
+  dconf_journal_close (writer);
+  g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+
+  g_free (contents);
+  g_free (filename);
+}
+
+static void
+test_db (void)
+{
+  DConfShmDb *writer;
+  DConfShmDb *reader;
+  guint64 generation;
+  guint64 expected;
+  GBytes *contents;
+  GBytes *bytes;
+  GBytes *empty;
+  gchar *filename;
+  gchar *big;
+  gint i;
+
+  filename = g_build_filename (g_get_user_runtime_dir (), "dconf-service", "shm", "db.shared", NULL);
+
+  /* Nothing there until the service creates it */
+  g_assert (dconf_shm_db_open (filename, FALSE) == NULL);
+
+  writer = dconf_shm_db_open (filename, TRUE);
+  g_assert (writer != NULL);
+  reader = dconf_shm_db_open (filename, FALSE);
+  g_assert (reader != NULL);
+
+  /* ...and it's empty until the first write */
+  g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, 0);
+  g_assert (dconf_shm_db_read (reader, &generation) == NULL);
+
+  /* Go round the slots a few times */
+  empty = g_bytes_new_static ("", 1);
+  expected = 0;
+  for (i = 0; i < 5; i++)
+    {
+      gchar *data;
+
+      data = g_strdup_printf ("version %d", i);
+      contents = g_bytes_new (data, strlen (data) + 1);
+      g_assert (dconf_shm_db_write (writer, contents, NULL));
+      expected++;
+
+      g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, expected);
+      bytes = dconf_shm_db_read (reader, &generation);
+      g_assert (bytes != NULL);
+      g_assert_cmpuint (generation, ==, expected);
+      g_assert (g_bytes_equal (bytes, contents));
+
+      /* The service leaves the slot that we are holding alone */
+      g_assert (dconf_shm_db_write (writer, empty, NULL));
+      g_assert (dconf_shm_db_write (writer, empty, NULL));
+      g_assert (dconf_shm_db_write (writer, empty, NULL));
+      expected += 3;
+      g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, expected);
+      g_assert_cmpstr (g_bytes_get_data (bytes, NULL), ==, data);
+
+      g_bytes_unref (contents);
+      g_bytes_unref (bytes);
+      g_free (data);
+    }
+
+  /* If all of the other slots are held, the file gets replaced, and
+   * what the readers hold stays where it is.
+   */
+  contents = g_bytes_new ("held", 5);
+  g_assert (dconf_shm_db_write (writer, contents, NULL));
+  g_bytes_unref (contents);
+  bytes = dconf_shm_db_read (reader, &generation);
+  g_assert (dconf_shm_db_write (writer, empty, NULL));
+  contents = dconf_shm_db_read (reader, &generation);
+  g_assert_cmpuint (generation, ==, expected + 2);
+  g_assert (dconf_shm_db_write (writer, empty, NULL));
+  g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, expected + 3);
+  g_assert (dconf_shm_db_write (writer, empty, NULL));
+  expected += 4;
+  g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, G_MAXUINT64);
+  g_assert_cmpstr (g_bytes_get_data (bytes, NULL), ==, "held");
+
+  /* ...even once the reader has moved over or gone away */
+  g_bytes_unref (contents);
+  contents = dconf_shm_db_read (reader, &generation);
+  g_assert_cmpuint (generation, ==, expected);
+  g_assert (g_bytes_equal (contents, empty));
+  g_bytes_unref (contents);
+  dconf_shm_db_close (reader);
+  g_assert_cmpstr (g_bytes_get_data (bytes, NULL), ==, "held");
+  g_bytes_unref (bytes);
+  reader = dconf_shm_db_open (filename, FALSE);
+  g_assert (reader != NULL);
+  g_bytes_unref (empty);
+
+  /* Something that doesn't fit: the file gets replaced, and the reader
+   * notices and moves over to the new one.
+   */
+  big = g_malloc0 (1024 * 1024);
+  memset (big, 'x', 1024 * 1024 - 1);
+  contents = g_bytes_new_take (big, 1024 * 1024);
+  g_assert (dconf_shm_db_write (writer, contents, NULL));
+
+  g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, G_MAXUINT64);
+  bytes = dconf_shm_db_read (reader, &generation);
+  g_assert (bytes != NULL);
+  g_assert_cmpuint (generation, ==, expected + 1);
+  g_assert (g_bytes_equal (bytes, contents));
+  g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, expected + 1);
+  g_bytes_unref (contents);
+  g_bytes_unref (bytes);
+
+  dconf_shm_db_close (reader);
+  dconf_shm_db_close (writer);
+
+  /* The service carries on from where it was after a restart */
+  writer = dconf_shm_db_open (filename, TRUE);
+  g_assert (writer != NULL);
+  bytes = dconf_shm_db_read (writer, &generation);
+  g_assert (bytes != NULL);
+  g_assert_cmpuint (generation, ==, expected + 1);
+  g_bytes_unref (bytes);
+
+  /* Once the service is done with the file, the readers find out */
+  reader = dconf_shm_db_open (filename, FALSE);
+  g_assert (reader != NULL);
+  dconf_shm_db_remove (writer);
+  g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+  g_assert_cmpuint (dconf_shm_db_get_generation (reader), ==, G_MAXUINT64);
+  g_assert (dconf_shm_db_read (reader, &generation) == NULL);
+  dconf_shm_db_close (reader);
+
+  g_free (filename);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -161,10 +524,18 @@ main (int argc, char **argv)
   g_test_add_func ("/shm/mkdir-fail", test_mkdir_fail);
   g_test_add_func ("/shm/close-null", test_close_null);
   g_test_add_func ("/shm/open-and-flag", test_open_and_flag);
+  g_test_add_func ("/shm/generation", test_generation);
+  g_test_add_func ("/shm/legacy-flag", test_legacy_flag);
+  g_test_add_func ("/shm/legacy-flag/absent", test_legacy_flag_absent);
+  g_test_add_func ("/shm/counter-removed", test_counter_removed);
   g_test_add_func ("/shm/invalid-name", test_invalid_name);
   g_test_add_func ("/shm/flag-nonexistent", test_flag_nonexistent);
   g_test_add_func ("/shm/out-of-space-open", test_out_of_space_open);
   g_test_add_func ("/shm/out-of-space-flag", test_out_of_space_flag);
+  g_test_add_func ("/shm/db", test_db);
+#ifdef __linux__
+  g_test_add_func ("/shm/journal", test_journal);
+#endif
 
   status = g_test_run ();
 
@@ -17,6 +17,7 @@
 
 import mmap
 import os
+import shutil
 import subprocess
 import sys
 import tempfile
@@ -422,6 +423,69 @@ class DBusTest(unittest.TestCase):
         keyfile_com = dconf('dump', '/com/').stdout
         self.assertEqual(keyfile_org, keyfile_com)
 
+    def test_load_chunked(self):
+        """Loads that are too big for a single Change call are sent in pieces
+        and committed together.
+        """
+
+        lines = ['[big]']
+        lines.extend('key{}={}'.format(i, i) for i in sorted(range(3000), key=str))
+        keyfile = '\n'.join(lines) + '\n'
+
+        dconf('load', '/', input=keyfile)
+        self.assertEqual(dconf('dump', '/').stdout, keyfile)
+        self.assertEqual(dconf_read('/big/key2999'), '2999')
+
+    def test_load_offline(self):
+        """Offline load writes the user database directly, and refuses to
+        do so while the service is running.
+        """
+
+        dconf('load', '-o', '/', input=dedent('''\
+        [org/editor]
+        tab-width=8
+        '''))
+        dconf('load', '-o', '/org/', input=dedent('''\
+        [editor]
+        window-fullscreen=true
+        '''))
+
+        self.assertEqual(dconf_read('/org/editor/tab-width'), '8')
+        self.assertEqual(dconf_read('/org/editor/window-fullscreen'), 'true')
+
+        # Starts the service.
+        dconf_write('/org/editor/tab-width', '4')
+
+        result = dconf('load', '-o', '/', input='[a]\nb=1\n', check=False,
+                       stderr=subprocess.PIPE)
+        self.assertNotEqual(result.returncode, 0)
+        self.assertEqual(dconf_read('/a/b'), '')
+        self.assertEqual(dconf_read('/org/editor/tab-width'), '4')
+
+    def test_load_offline_live_copy(self):
+        """Offline load merges with the live copy that the service leaves in
+        the runtime dir in write-back mode, and removes it.
+        """
+
+        dconf('load', '-o', '/', input=dedent('''\
+        [org/editor]
+        tab-width=8
+        '''))
+
+        # As if the service had only written the live copy.
+        db = os.path.join(self.config_home, 'dconf', 'user')
+        live_dir = os.path.join(self.runtime_dir, 'dconf')
+        live = os.path.join(live_dir, 'user.gvdb')
+        os.makedirs(live_dir, exist_ok=True)
+        shutil.copy(db, live)
+        os.remove(db)
+
+        dconf('load', '-o', '/', input='[a]\nb=1\n')
+
+        self.assertFalse(os.path.exists(live))
+        self.assertEqual(dconf_read('/org/editor/tab-width'), '8')
+        self.assertEqual(dconf_read('/a/b'), '1')
+
     def test_complete(self):
         """Tests _complete command used internally to implement bash completion.
 
@@ -610,11 +674,127 @@ class DBusTest(unittest.TestCase):
                 # Sanity check that database is valid.
                 self.assertNotEqual(b'\0'*8, mm[:8])
 
+                with open(os.path.join(local_d, 'local.conf'), 'a') as file:
+                    file.write("picture-options = 'zoom'\n")
+
                 dconf('update', db)
 
                 # Now database should be marked as invalid.
                 self.assertEqual(b'\0'*8, mm[:8])
 
+    def test_update_incremental(self):
+        """Update leaves databases alone unless their keyfiles changed."""
+
+        db = os.path.join(self.temporary_dir.name, 'db')
+        local = os.path.join(db, 'local')
+        local_d = os.path.join(db, 'local.d')
+        local_conf = os.path.join(local_d, 'local.conf')
+
+        os.makedirs(local_d)
+
+        with open(local_conf, 'w') as file:
+            file.write('[org]\na = 1\n')
+
+        def update_and_check_rewritten():
+            atime = os.path.getatime(local)
+            mtime = os.path.getmtime(local) - 60
+            os.utime(local, times=(atime, mtime))
+            dconf('update', db)
+            return os.path.getmtime(local) != mtime
+
+        dconf('update', db)
+
+        # Nothing changed at all.
+        self.assertFalse(update_and_check_rewritten())
+
+        # Touched, and even rewritten, but with the same result.
+        with open(local_conf, 'w') as file:
+            file.write('[org]\na=1\n')
+        self.assertFalse(update_and_check_rewritten())
+
+        # Actually changed.
+        with open(local_conf, 'w') as file:
+            file.write('[org]\na = 2\n')
+        self.assertTrue(update_and_check_rewritten())
+
+    def test_update_manifest(self):
+        """Update skips databases without rebuilding them when nothing about
+        their keyfiles changed, and doesn't go by the mtime and size alone.
+        """
+
+        db = os.path.join(self.temporary_dir.name, 'db')
+        local = os.path.join(db, 'local')
+        local_d = os.path.join(db, 'local.d')
+        local_conf = os.path.join(local_d, 'local.conf')
+        manifest = os.path.join(db, '.local.manifest')
+
+        os.makedirs(local_d)
+
+        with open(local_conf, 'w') as file:
+            file.write('[org]\na = 1\n')
+
+        dconf('update', db)
+        inode = os.stat(manifest).st_ino
+        with open(local, 'rb') as file:
+            contents = file.read()
+
+        # Nothing changed: the manifest is the same, so it isn't rewritten.
+        dconf('update', db)
+        self.assertEqual(os.stat(manifest).st_ino, inode)
+
+        # Same size, and the mtime is put back afterwards.
+        stat = os.stat(local_conf)
+        with open(local_conf, 'w') as file:
+            file.write('[org]\na = 2\n')
+        os.utime(local_conf, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+
+        dconf('update', db)
+        self.assertNotEqual(os.stat(manifest).st_ino, inode)
+        with open(local, 'rb') as file:
+            self.assertNotEqual(file.read(), contents)
+
+    @unittest.skipIf(shutil.which('dbus-monitor') is None,
+                     'dbus-monitor is not available')
+    def test_update_notify(self):
+        """Update only announces the keys and locks that actually changed."""
+
+        db = os.path.join(self.temporary_dir.name, 'db')
+        site_d = os.path.join(db, 'site.d')
+        site_locks = os.path.join(site_d, 'locks')
+
+        os.makedirs(site_locks)
+
+        with open(os.path.join(site_d, 'site.conf'), 'w') as file:
+            file.write('[org]\na = 1\nb = 1\n')
+
+        # Send the "system bus" signals to our bus so that we can see them.
+        address = os.environ['DBUS_SESSION_BUS_ADDRESS']
+        env = dict(os.environ)
+        env['DBUS_SYSTEM_BUS_ADDRESS'] = address
+
+        dconf('update', db, env=env)
+
+        monitor = subprocess.Popen(['dbus-monitor', '--address', address,
+                                    "type='signal',interface='ca.desrt.dconf.Writer'"],
+                                   stdout=subprocess.PIPE,
+                                   universal_newlines=True)
+        time.sleep(0.2)
+
+        with open(os.path.join(site_d, 'site.conf'), 'w') as file:
+            file.write('[org]\na = 2\nb = 1\n')
+        with open(os.path.join(site_locks, 'lock'), 'w') as file:
+            file.write('/org/b\n')
+
+        dconf('update', db, env=env)
+        time.sleep(0.2)
+
+        monitor.terminate()
+        output = monitor.communicate()[0]
+
+        self.assertRegex(output, r'member=Notify\n\s*string "/org/a"')
+        self.assertRegex(output, r'member=WritabilityNotify\n\s*string "/org/b"')
+        self.assertNotIn('string "/"\n', output)
+
     def test_update_failure(self):
         """Update should skip invalid configuration directory and continue with
         others. Failure to update one of databases should be indicated with
@@ -775,6 +955,48 @@ class DBusTest(unittest.TestCase):
         self.assertEqual('true', dconf_read('/system/proxy/http/enabled', env=env))
         self.assertEqual("'Winter.png'", dconf_read('/org/gnome/desktop/background', env=env))
 
+    def test_sharded_database(self):
+        """Keys in a sharded dir go to their own file, and changing them
+        doesn't rewrite the main database file.
+        """
+
+        # The service gets its environment from the bus.
+        subprocess.check_call(['dbus-send', '--session', '--print-reply',
+                               '--dest=org.freedesktop.DBus', '/org/freedesktop/DBus',
+                               'org.freedesktop.DBus.UpdateActivationEnvironment',
+                               'dict:string:string:DCONF_SHARDS,/org/big/'],
+                              stdout=subprocess.DEVNULL)
+
+        config_dir = os.path.join(self.config_home, 'dconf')
+        config = os.path.join(config_dir, 'user')
+
+        dconf_write('/org/big/a', '1')
+        dconf_write('/org/small/b', '2')
+
+        shards = [name for name in os.listdir(config_dir) if name.startswith('user.shard-')]
+        self.assertEqual(len(shards), 1)
+        shard = os.path.join(config_dir, shards[0])
+
+        self.assertEqual(dconf_read('/org/big/a'), '1')
+        self.assertEqual(dconf_read('/org/small/b'), '2')
+        self.assertEqual(dconf_list('/org/'), ['big/', 'small/'])
+        self.assertEqual(dconf_list('/org/big/'), ['a'])
+
+        # Only the shard is written for a change to a key in it.
+        atime = os.path.getatime(config)
+        mtime = os.path.getmtime(config) - 60
+        os.utime(config, times=(atime, mtime))
+
+        dconf_write('/org/big/a', '3')
+        self.assertEqual(dconf_read('/org/big/a'), '3')
+        self.assertEqual(os.path.getmtime(config), mtime)
+
+        # Resetting a dir above the shard reaches into it.
+        dconf('reset', '-f', '/org/')
+        self.assertEqual(dconf_read('/org/big/a'), '')
+        self.assertEqual(dconf_read('/org/small/b'), '')
+        self.assertTrue(os.path.exists(shard))
+
     def test_dconf_blame(self):
         """Blame returns recorded information about write operations.
 
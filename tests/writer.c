@@ -20,7 +20,12 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <locale.h>
+#include <sys/socket.h>
+#include <utime.h>
 
+#include "gvdb/gvdb-builder.h"
+#include "gvdb/gvdb-reader.h"
+#include "shm/dconf-shm-db.h"
 #include "service/dconf-generated.h"
 #include "service/dconf-writer.h"
 
@@ -73,7 +78,143 @@ typedef struct
   gchar *dconf_dir;  /* (owned) */
 } Fixture;
 
+static void
+connection_new_cb (GObject      *source,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  GDBusConnection **connection = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  *connection = g_dbus_connection_new_finish (result, &local_error);
+  g_assert_no_error (local_error);
+}
+
+/* Connects a pair of peer-to-peer connections to each other, so that
+ * writers can be called over D-Bus without a bus. */
+static void
+connect_peers (GDBusConnection **server,
+               GDBusConnection **client)
+{
+  g_autofree gchar *guid = g_dbus_generate_guid ();
+  GIOStream *streams[2];
+  int fds[2];
+  guint i;
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+
+  for (i = 0; i < 2; i++)
+    {
+      g_autoptr(GSocket) socket = NULL;
+      g_autoptr(GError) local_error = NULL;
+
+      socket = g_socket_new_from_fd (fds[i], &local_error);
+      g_assert_no_error (local_error);
+      streams[i] = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+    }
+
+  *server = NULL;
+  *client = NULL;
+  g_dbus_connection_new (streams[0], guid,
+                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER |
+                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_ALLOW_ANONYMOUS,
+                         NULL, NULL, connection_new_cb, server);
+  g_dbus_connection_new (streams[1], NULL,
+                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                         NULL, NULL, connection_new_cb, client);
+
+  while (*server == NULL || *client == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_unref (streams[0]);
+  g_object_unref (streams[1]);
+}
+
+typedef struct
+{
+  gboolean done;
+  gchar *tag;  /* (owned) */
+  GError *error;  /* (owned) */
+} ChangeResult;
+
+static void
+change_done_cb (GObject      *source,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  ChangeResult *change = user_data;
+  GVariant *reply;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &change->error);
+  if (reply != NULL)
+    {
+      g_variant_get (reply, "(s)", &change->tag);
+      g_variant_unref (reply);
+    }
+
+  change->done = TRUE;
+}
+
+/* Sends @changes to the writer at @object_path, the same way as the
+ * engine does. */
+static void
+call_change (GDBusConnection *client,
+             const gchar     *object_path,
+             DConfChangeset  *changes,
+             ChangeResult    *result)
+{
+  GVariant *serialised;
+
+  serialised = g_variant_ref_sink (dconf_changeset_serialise (changes));
+  g_dbus_connection_call (client, NULL, object_path, "ca.desrt.dconf.Writer", "Change",
+                          g_variant_new_from_data (G_VARIANT_TYPE ("(ay)"),
+                                                   g_variant_get_data (serialised),
+                                                   g_variant_get_size (serialised), TRUE,
+                                                   (GDestroyNotify) g_variant_unref, serialised),
+                          G_VARIANT_TYPE ("(s)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          change_done_cb, result);
+}
+
+static void
+count_notify_cb (GDBusConnection *connection,
+                 const gchar     *sender_name,
+                 const gchar     *object_path,
+                 const gchar     *interface_name,
+                 const gchar     *signal_name,
+                 GVariant        *parameters,
+                 gpointer         user_data)
+{
+  guint *n_notifies = user_data;
+
+  (*n_notifies)++;
+}
+
+static void
+wait_for_changes (ChangeResult *results,
+                  guint         n_results)
+{
+  guint i;
+
+  for (i = 0; i < n_results; i++)
+    while (!results[i].done)
+      g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+clear_changes (ChangeResult *results,
+               guint         n_results)
+{
+  guint i;
+
+  for (i = 0; i < n_results; i++)
+    {
+      g_clear_pointer (&results[i].tag, g_free);
+      g_clear_error (&results[i].error);
+    }
+}
+
 gchar *config_dir = NULL;
+gchar *runtime_dir = NULL;
 
 static void
 set_up (Fixture       *fixture,
@@ -378,6 +519,582 @@ static void test_writer_commit_real_changes (Fixture       *fixture,
   g_assert_cmpint (g_unlink (db_filename), ==, 0);
 }
 
+/**
+ * Test that if a commit fails, only the callers whose changes were in it
+ * get the error.  Changes that were redundant or empty didn't need the
+ * write, even though they were in the same batch.
+ */
+static void
+test_writer_commit_error (Fixture       *fixture,
+                          gconstpointer  test_data)
+{
+  const char *db_name = "commit-error";
+  const char *object_path = "/ca/desrt/dconf/Writer/commit_error";
+  g_autoptr(DConfWriter) writer = NULL;
+  g_autoptr(GDBusConnection) server = NULL;
+  g_autoptr(GDBusConnection) client = NULL;
+  DConfWriterClass *writer_class;
+  DConfChangeset *changes;
+  ChangeResult results[3] = { { 0, }, };
+  gboolean retval;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *db_filename = g_build_filename (fixture->dconf_dir, db_name, NULL);
+
+  /* Start with a value in the database. */
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, db_name));
+  writer_class = DCONF_WRITER_GET_CLASS (writer);
+
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  changes = dconf_changeset_new_write ("/a", g_variant_new_int32 (1));
+  writer_class->change (writer, changes, NULL);
+  dconf_changeset_unref (changes);
+
+  retval = writer_class->commit (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  writer_class->end (writer);
+
+  /* Make the next write fail. */
+  g_assert_cmpint (g_unlink (db_filename), ==, 0);
+  g_assert_cmpint (g_mkdir (db_filename, 0700), ==, 0);
+
+  connect_peers (&server, &client);
+  g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (writer), server, object_path, &local_error);
+  g_assert_no_error (local_error);
+
+  /* These arrive within the commit delay, so they are one batch. */
+  changes = dconf_changeset_new_write ("/a", g_variant_new_int32 (1));
+  call_change (client, object_path, changes, &results[0]);
+  dconf_changeset_unref (changes);
+
+  changes = dconf_changeset_new ();
+  call_change (client, object_path, changes, &results[1]);
+  dconf_changeset_unref (changes);
+
+  changes = dconf_changeset_new_write ("/b", g_variant_new_int32 (2));
+  call_change (client, object_path, changes, &results[2]);
+  dconf_changeset_unref (changes);
+
+  wait_for_changes (results, G_N_ELEMENTS (results));
+
+  g_assert_no_error (results[0].error);
+  g_assert_nonnull (results[0].tag);
+  g_assert_no_error (results[1].error);
+  g_assert_nonnull (results[1].tag);
+  g_assert_nonnull (results[2].error);
+  g_assert_null (results[2].tag);
+
+  /* Clean up. */
+  clear_changes (results, G_N_ELEMENTS (results));
+  g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (writer));
+  g_dbus_connection_close_sync (client, NULL, NULL);
+  g_dbus_connection_close_sync (server, NULL, NULL);
+  g_assert_cmpint (g_rmdir (db_filename), ==, 0);
+}
+
+typedef struct
+{
+  gboolean done;
+  GVariant *reply;  /* (owned) */
+  GError *error;  /* (owned) */
+} CallResult;
+
+static void
+call_done_cb (GObject      *source,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  CallResult *call = user_data;
+
+  call->reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &call->error);
+  call->done = TRUE;
+}
+
+/* Test that a transaction that is sent in too many pieces fails as a
+ * whole, instead of the service keeping all of it in memory. */
+static void
+test_writer_transaction_limits (Fixture       *fixture,
+                                gconstpointer  test_data)
+{
+  const gchar *object_path = "/ca/desrt/dconf/Writer/transaction_limits";
+  g_autoptr(DConfWriter) writer = NULL;
+  g_autoptr(GDBusConnection) server = NULL;
+  g_autoptr(GDBusConnection) client = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GVariant) blob = NULL;
+  CallResult begin = { 0, };
+  CallResult commit = { 0, };
+  CallResult *appends;
+  const guint n_appends = 4097;
+  DConfChangeset *changes;
+  guint id;
+  guint i;
+
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, "transaction-limits"));
+  connect_peers (&server, &client);
+  g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (writer), server, object_path, &local_error);
+  g_assert_no_error (local_error);
+
+  g_dbus_connection_call (client, NULL, object_path, "ca.desrt.dconf.Writer", "BeginTransaction",
+                          NULL, G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          call_done_cb, &begin);
+  while (!begin.done)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_no_error (begin.error);
+  g_variant_get (begin.reply, "(u)", &id);
+
+  changes = dconf_changeset_new ();
+  blob = g_variant_ref_sink (dconf_changeset_serialise (changes));
+  dconf_changeset_unref (changes);
+
+  /* One piece more than the service accepts */
+  appends = g_new0 (CallResult, n_appends);
+  for (i = 0; i < n_appends; i++)
+    g_dbus_connection_call (client, NULL, object_path, "ca.desrt.dconf.Writer", "Append",
+                            g_variant_new ("(u@ay)", id,
+                                           g_variant_new_from_data (G_VARIANT_TYPE_BYTESTRING,
+                                                                    g_variant_get_data (blob),
+                                                                    g_variant_get_size (blob), TRUE,
+                                                                    (GDestroyNotify) g_variant_unref,
+                                                                    g_variant_ref (blob))),
+                            NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, call_done_cb, &appends[i]);
+
+  g_dbus_connection_call (client, NULL, object_path, "ca.desrt.dconf.Writer", "Commit",
+                          g_variant_new ("(u)", id), G_VARIANT_TYPE ("(s)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          call_done_cb, &commit);
+
+  while (!commit.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  for (i = 0; i < n_appends - 1; i++)
+    {
+      g_assert_true (appends[i].done);
+      g_assert_no_error (appends[i].error);
+      g_variant_unref (appends[i].reply);
+    }
+
+  g_assert_true (appends[n_appends - 1].done);
+  g_assert_error (appends[n_appends - 1].error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED);
+  g_clear_error (&appends[n_appends - 1].error);
+
+  /* ...and the transaction is gone */
+  g_assert_error (commit.error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_clear_error (&commit.error);
+
+  /* Clean up. */
+  g_free (appends);
+  g_variant_unref (begin.reply);
+  g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (writer));
+  g_dbus_connection_close_sync (client, NULL, NULL);
+  g_dbus_connection_close_sync (server, NULL, NULL);
+}
+
+/**
+ * Test that several writers can commit at the same time (each in its own
+ * thread from the pool), and that all of the callers get their replies
+ * and all of the changes their Notify signals.
+ */
+static void
+test_writer_concurrent (Fixture       *fixture,
+                        gconstpointer  test_data)
+{
+  const gchar *db_names[] = { "concurrent0", "concurrent1", "concurrent2" };
+  const guint n_writers = G_N_ELEMENTS (db_names);
+  const guint n_changes = 4;
+  g_autoptr(GDBusConnection) server = NULL;
+  g_autoptr(GDBusConnection) client = NULL;
+  DConfWriter *writers[G_N_ELEMENTS (db_names)];
+  ChangeResult results[G_N_ELEMENTS (db_names) * 4] = { { 0, }, };
+  g_autoptr(GError) local_error = NULL;
+  guint n_notifies = 0;
+  guint subscription;
+  guint i, j;
+
+  connect_peers (&server, &client);
+  subscription = g_dbus_connection_signal_subscribe (client, NULL, "ca.desrt.dconf.Writer", "Notify",
+                                                     NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+                                                     count_notify_cb, &n_notifies, NULL);
+
+  for (i = 0; i < n_writers; i++)
+    {
+      g_autofree gchar *object_path = g_strconcat ("/ca/desrt/dconf/Writer/", db_names[i], NULL);
+
+      writers[i] = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, db_names[i]));
+      g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (writers[i]), server, object_path, &local_error);
+      g_assert_no_error (local_error);
+    }
+
+  /* Interleave the calls, so that the writers are all busy at once. */
+  for (j = 0; j < n_changes; j++)
+    for (i = 0; i < n_writers; i++)
+      {
+        g_autofree gchar *object_path = g_strconcat ("/ca/desrt/dconf/Writer/", db_names[i], NULL);
+        DConfChangeset *changes;
+
+        changes = dconf_changeset_new_write ("/key", g_variant_new_uint32 (j));
+        call_change (client, object_path, changes, &results[j * n_writers + i]);
+        dconf_changeset_unref (changes);
+      }
+
+  wait_for_changes (results, G_N_ELEMENTS (results));
+
+  for (i = 0; i < G_N_ELEMENTS (results); i++)
+    {
+      g_assert_no_error (results[i].error);
+      g_assert_nonnull (results[i].tag);
+    }
+
+  /* Every change was effective, so each has a signal. */
+  while (n_notifies < G_N_ELEMENTS (results))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (n_notifies, ==, G_N_ELEMENTS (results));
+
+  /* And each database has the last value that was written to it. */
+  for (i = 0; i < n_writers; i++)
+    {
+      g_autofree gchar *db_filename = g_build_filename (fixture->dconf_dir, db_names[i], NULL);
+      GvdbTable *table;
+      GVariant *value;
+
+      g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (writers[i]));
+      g_object_unref (writers[i]);
+
+      table = gvdb_table_new (db_filename, FALSE, &local_error);
+      g_assert_no_error (local_error);
+      value = gvdb_table_get_value (table, "/key");
+      g_assert_nonnull (value);
+      g_assert_cmpuint (g_variant_get_uint32 (value), ==, n_changes - 1);
+      g_variant_unref (value);
+      gvdb_table_free (table);
+
+      g_assert_cmpint (g_unlink (db_filename), ==, 0);
+    }
+
+  /* Clean up. */
+  clear_changes (results, G_N_ELEMENTS (results));
+  g_dbus_connection_signal_unsubscribe (client, subscription);
+  g_dbus_connection_close_sync (client, NULL, NULL);
+  g_dbus_connection_close_sync (server, NULL, NULL);
+}
+
+/**
+ * Test that a writer working from an existing database file (rather than
+ * from one that it wrote itself) filters out redundant changes and applies
+ * directory resets to the keys in the file.
+ */
+static void
+test_writer_reopen (Fixture       *fixture,
+                    gconstpointer  test_data)
+{
+  const char *db_name = "reopen";
+  g_autoptr(DConfWriter) writer = NULL;
+  DConfWriterClass *writer_class;
+  DConfChangeset *changes;
+  GvdbTable *table;
+  GVariant *value;
+  gboolean retval;
+  g_autoptr(GError) local_error = NULL;
+  guint64 db_mtime_us;
+  g_autofree gchar *db_filename = g_build_filename (fixture->dconf_dir, db_name, NULL);
+
+  /* Write some keys with one writer. */
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, db_name));
+  writer_class = DCONF_WRITER_GET_CLASS (writer);
+
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  changes = dconf_changeset_new ();
+  dconf_changeset_set (changes, "/a/x", g_variant_new_int32 (1));
+  dconf_changeset_set (changes, "/a/y", g_variant_new_int32 (2));
+  dconf_changeset_set (changes, "/b", g_variant_new_int32 (3));
+  writer_class->change (writer, changes, NULL);
+  dconf_changeset_unref (changes);
+
+  retval = writer_class->commit (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  writer_class->end (writer);
+
+  g_clear_object (&writer);
+  db_mtime_us = get_file_mtime_us (db_filename);
+
+  /* A new writer sees those keys, so rewriting one of them is a no-op. */
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, db_name));
+
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  changes = dconf_changeset_new_write ("/a/x", g_variant_new_int32 (1));
+  writer_class->change (writer, changes, NULL);
+  dconf_changeset_unref (changes);
+
+  retval = writer_class->commit (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  writer_class->end (writer);
+
+  g_assert_cmpuint (db_mtime_us, ==, get_file_mtime_us (db_filename));
+
+  /* Resetting the directory removes both of the keys below it. */
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  changes = dconf_changeset_new_write ("/a/", NULL);
+  writer_class->change (writer, changes, NULL);
+  dconf_changeset_unref (changes);
+
+  retval = writer_class->commit (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  writer_class->end (writer);
+
+  table = gvdb_table_new (db_filename, FALSE, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_false (gvdb_table_has_value (table, "/a/x"));
+  g_assert_false (gvdb_table_has_value (table, "/a/y"));
+  value = gvdb_table_get_value (table, "/b");
+  g_assert_nonnull (value);
+  g_assert_cmpint (g_variant_get_int32 (value), ==, 3);
+  g_variant_unref (value);
+  gvdb_table_free (table);
+
+  /* Clean up. */
+  g_assert_cmpint (g_unlink (db_filename), ==, 0);
+}
+
+/**
+ * Test that writing over a database in the other byte order keeps the
+ * values that were not changed.  They can't be copied over as they are,
+ * since the new file is always in the native byte order.
+ */
+static void
+test_writer_byteswapped (Fixture       *fixture,
+                         gconstpointer  test_data)
+{
+  const char *db_name = "byteswapped";
+  g_autoptr(DConfWriter) writer = NULL;
+  DConfWriterClass *writer_class;
+  DConfChangeset *changes;
+  GHashTable *builder;
+  GvdbItem *root, *item;
+  GvdbTable *table;
+  GVariant *value;
+  const gchar *string;
+  guint32 number;
+  gboolean retval;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *db_filename = g_build_filename (fixture->dconf_dir, db_name, NULL);
+
+  builder = gvdb_hash_table_new (NULL, NULL);
+  root = gvdb_hash_table_insert (builder, "/");
+  item = gvdb_hash_table_insert (builder, "/a");
+  gvdb_item_set_parent (item, root);
+  gvdb_item_set_value (item, g_variant_new ("(su)", "a string", 1234));
+  item = gvdb_hash_table_insert (builder, "/b");
+  gvdb_item_set_parent (item, root);
+  gvdb_item_set_value (item, g_variant_new_int32 (3));
+  retval = gvdb_table_write_contents (builder, db_filename, TRUE, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  g_hash_table_unref (builder);
+
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, db_name));
+  writer_class = DCONF_WRITER_GET_CLASS (writer);
+
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  changes = dconf_changeset_new_write ("/b", g_variant_new_int32 (4));
+  writer_class->change (writer, changes, NULL);
+  dconf_changeset_unref (changes);
+
+  retval = writer_class->commit (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  writer_class->end (writer);
+
+  table = gvdb_table_new (db_filename, FALSE, &local_error);
+  g_assert_no_error (local_error);
+  value = gvdb_table_get_value (table, "/a");
+  g_assert_nonnull (value);
+  g_assert_true (g_variant_is_of_type (value, G_VARIANT_TYPE ("(su)")));
+  g_variant_get (value, "(&su)", &string, &number);
+  g_assert_cmpstr (string, ==, "a string");
+  g_assert_cmpuint (number, ==, 1234);
+  g_variant_unref (value);
+  value = gvdb_table_get_value (table, "/b");
+  g_assert_nonnull (value);
+  g_assert_cmpint (g_variant_get_int32 (value), ==, 4);
+  g_variant_unref (value);
+  gvdb_table_free (table);
+
+  /* Clean up. */
+  g_assert_cmpint (g_unlink (db_filename), ==, 0);
+}
+
+/**
+ * Test that in the "write-back" durability mode, commits go to a live copy
+ * of the database in the runtime directory, and only reach the config
+ * directory when the writer is flushed.
+ */
+static void
+test_writer_durability_write_back (Fixture       *fixture,
+                                   gconstpointer  test_data)
+{
+  const char *db_name = "write-back";
+  g_autoptr(DConfWriter) writer = NULL;
+  DConfWriterClass *writer_class;
+  DConfChangeset *changes;
+  gboolean retval;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *db_filename = g_build_filename (fixture->dconf_dir, db_name, NULL);
+  g_autofree gchar *live_filename = g_build_filename (runtime_dir, "dconf", "write-back.gvdb", NULL);
+  struct utimbuf old_time = { 0, 0 };
+
+  g_assert_true (g_setenv ("DCONF_DURABILITY", "strict,write-back=write-back", TRUE));
+
+  /* Create a writer. */
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, db_name));
+  g_assert_nonnull (writer);
+  writer_class = DCONF_WRITER_GET_CLASS (writer);
+
+  g_unsetenv ("DCONF_DURABILITY");
+
+  /* Make a real change to the database */
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  changes = dconf_changeset_new ();
+  dconf_changeset_set (changes, "/key", g_variant_new ("(s)", "value"));
+  writer_class->change (writer, changes, NULL);
+  dconf_changeset_unref (changes);
+
+  retval = writer_class->commit (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  writer_class->end (writer);
+
+  /* Only the live copy has been written so far */
+  g_assert_true (g_file_test (live_filename, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (db_filename, G_FILE_TEST_EXISTS));
+
+  /* Flushing writes it back to the config directory */
+  dconf_writer_flush (writer);
+  g_assert_true (g_file_test (db_filename, G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (live_filename, G_FILE_TEST_EXISTS));
+
+  /* A live copy that is older than the database in the config directory
+   * is stale, and the next writer to open the database removes it */
+  g_clear_object (&writer);
+  g_assert_cmpint (g_utime (live_filename, &old_time), ==, 0);
+
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_WRITER, db_name));
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  writer_class->end (writer);
+
+  g_assert_false (g_file_test (live_filename, G_FILE_TEST_EXISTS));
+
+  /* Clean up. */
+  g_assert_cmpint (g_unlink (db_filename), ==, 0);
+}
+
+/* Test that the buffered file only exists while a writer uses it,
+ * and that its contents end up in the plain file. */
+static void
+test_writer_runtime_buffers (Fixture       *fixture,
+                             gconstpointer  test_data)
+{
+  g_autoptr(DConfWriter) writer = NULL;
+  DConfWriterClass *writer_class;
+  DConfChangeset *changes;
+  DConfShmDb *shm_db;
+  GvdbTable *table;
+  GVariant *value;
+  GBytes *contents;
+  gchar *data;
+  gsize length;
+  gboolean retval;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *service_dir = g_build_filename (runtime_dir, "dconf-service", NULL);
+  g_autofree gchar *shm_dir = g_build_filename (service_dir, "shm", NULL);
+  g_autofree gchar *filename = g_build_filename (shm_dir, "buffers", NULL);
+  g_autofree gchar *shared_filename = g_build_filename (shm_dir, "buffers.shared", NULL);
+
+  g_assert_true (g_setenv ("DCONF_RUNTIME_BUFFERS", "1", TRUE));
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_SHM_WRITER, "buffers"));
+  writer_class = DCONF_WRITER_GET_CLASS (writer);
+  g_unsetenv ("DCONF_RUNTIME_BUFFERS");
+
+  retval = writer_class->begin (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+
+  changes = dconf_changeset_new ();
+  dconf_changeset_set (changes, "/key", g_variant_new_int32 (1));
+  writer_class->change (writer, changes, NULL);
+  dconf_changeset_unref (changes);
+
+  retval = writer_class->commit (writer, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (retval);
+  writer_class->end (writer);
+
+  g_assert_true (g_file_test (shared_filename, G_FILE_TEST_EXISTS));
+  g_assert_false (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+  /* When the writer goes away, the contents go back to the plain file */
+  g_clear_object (&writer);
+  g_assert_false (g_file_test (shared_filename, G_FILE_TEST_EXISTS));
+
+  table = gvdb_table_new (filename, FALSE, &local_error);
+  g_assert_no_error (local_error);
+  value = gvdb_table_get_value (table, "/key");
+  g_assert_cmpint (g_variant_get_int32 (value), ==, 1);
+  g_variant_unref (value);
+  gvdb_table_free (table);
+
+  /* A file left behind by a run that didn't get to clean up is written
+   * back and removed, even with the buffers turned off. */
+  g_assert_true (g_file_get_contents (filename, &data, &length, NULL));
+  contents = g_bytes_new_take (data, length);
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+
+  shm_db = dconf_shm_db_open (shared_filename, TRUE);
+  g_assert_nonnull (shm_db);
+  g_assert_true (dconf_shm_db_write (shm_db, contents, NULL));
+  dconf_shm_db_close (shm_db);
+  g_bytes_unref (contents);
+
+  writer = DCONF_WRITER (dconf_writer_new (DCONF_TYPE_SHM_WRITER, "buffers"));
+  g_assert_false (g_file_test (shared_filename, G_FILE_TEST_EXISTS));
+
+  table = gvdb_table_new (filename, FALSE, &local_error);
+  g_assert_no_error (local_error);
+  value = gvdb_table_get_value (table, "/key");
+  g_assert_cmpint (g_variant_get_int32 (value), ==, 1);
+  g_variant_unref (value);
+  gvdb_table_free (table);
+
+  /* Clean up. */
+  g_clear_object (&writer);
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+  g_assert_cmpint (g_rmdir (shm_dir), ==, 0);
+  g_assert_cmpint (g_rmdir (service_dir), ==, 0);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -405,6 +1122,15 @@ main (int argc, char **argv)
   g_assert_true (g_setenv ("XDG_CONFIG_HOME", config_dir, TRUE));
   g_test_message ("Using config directory: %s", config_dir);
 
+  /* Likewise for $XDG_RUNTIME_DIR. */
+  runtime_dir = g_dir_make_tmp ("dconf-test-writer-runtime_XXXXXX", &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (g_setenv ("XDG_RUNTIME_DIR", runtime_dir, TRUE));
+
+  /* Give the changes that the tests send over D-Bus time to be batched
+   * together.  This is read when the first writer is created. */
+  g_assert_true (g_setenv ("DCONF_COMMIT_DELAY", "100", TRUE));
+
   /* Log handling so we don’t abort on the first g_warning(). */
   g_log_set_writer_func (log_writer_cb, NULL, NULL);
 
@@ -426,6 +1152,20 @@ main (int argc, char **argv)
               test_writer_commit_empty_changes, tear_down);
   g_test_add ("/writer/commit/redundant_change/2", Fixture, NULL, set_up,
               test_writer_commit_real_changes, tear_down);
+  g_test_add ("/writer/commit/error", Fixture, NULL, set_up,
+              test_writer_commit_error, tear_down);
+  g_test_add ("/writer/concurrent", Fixture, NULL, set_up,
+              test_writer_concurrent, tear_down);
+  g_test_add ("/writer/reopen", Fixture, NULL, set_up,
+              test_writer_reopen, tear_down);
+  g_test_add ("/writer/byteswapped", Fixture, NULL, set_up,
+              test_writer_byteswapped, tear_down);
+  g_test_add ("/writer/durability/write-back", Fixture, NULL, set_up,
+              test_writer_durability_write_back, tear_down);
+  g_test_add ("/writer/runtime-buffers", Fixture, NULL, set_up,
+              test_writer_runtime_buffers, tear_down);
+  g_test_add ("/writer/transaction/limits", Fixture, NULL, set_up,
+              test_writer_transaction_limits, tear_down);
 
   retval = g_test_run ();
 
@@ -434,5 +1174,29 @@ main (int argc, char **argv)
   g_assert_cmpint (g_rmdir (config_dir), ==, 0);
   g_clear_pointer (&config_dir, g_free);
 
+  /* And the runtime dir, including the shm directory.  The generation
+   * counters stay around for as long as the session does, but the
+   * writers must have removed their journals.
+   */
+  {
+    g_autofree gchar *shm_dir = g_build_filename (runtime_dir, "dconf", NULL);
+    g_autoptr(GDir) dir = g_dir_open (shm_dir, 0, NULL);
+    const gchar *name;
+
+    while (dir != NULL && (name = g_dir_read_name (dir)) != NULL)
+      {
+        g_autofree gchar *filename = g_build_filename (shm_dir, name, NULL);
+
+        g_assert_true (g_str_has_suffix (name, ".generation"));
+        g_assert_cmpint (g_unlink (filename), ==, 0);
+      }
+
+    g_unsetenv ("XDG_RUNTIME_DIR");
+    if (dir != NULL)
+      g_assert_cmpint (g_rmdir (shm_dir), ==, 0);
+    g_assert_cmpint (g_rmdir (runtime_dir), ==, 0);
+    g_clear_pointer (&runtime_dir, g_free);
+  }
+
   return retval;
 }